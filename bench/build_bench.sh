@@ -0,0 +1,14 @@
+#!/bin/bash
+
+# Build the benchmark binaries
+cd "$(dirname "$0")"
+
+g++ -std=c++17 -O2 -pthread -o loadgen loadgen.cpp -lsqlite3 -lssl -lcrypto
+g++ -std=c++17 -O2 -o http_parser_bench http_parser_bench.cpp
+g++ -std=c++17 -O2 -o escape_bench escape_bench.cpp
+g++ -std=c++17 -O2 -o snapshot_bench snapshot_bench.cpp -lsqlite3
+g++ -std=c++17 -O2 -o tag_index_bench tag_index_bench.cpp -lsqlite3
+g++ -std=c++17 -O2 -pthread -o counter_bench counter_bench.cpp -lsqlite3
+g++ -std=c++17 -O2 -o sketch_bench sketch_bench.cpp -lsqlite3
+
+echo "Benchmarks built in $(pwd)"
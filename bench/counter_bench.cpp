@@ -0,0 +1,133 @@
+// Benchmark for common/counters.h.
+//
+// Applies the same stream of sochee likes two ways: one UPDATE transaction
+// per like (what a naive endpoint does), and through CounterService from
+// several threads. Checks the stored totals match and reports likes/s.
+// Run it against a scratch copy of content.db: it writes to sochee.
+//
+// Usage: counter_bench <scratch.db> [likes] [threads]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sqlite3.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../common/counters.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static int64_t total_likes(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int64_t total = -1;
+  sqlite3_prepare_v2(db, "SELECT sum(likes) FROM sochee", -1, &stmt, NULL);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    total = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  return total;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: counter_bench <scratch.db> [likes] [threads]\n");
+    return 2;
+  }
+  size_t likes = argc > 2 ? strtoull(argv[2], nullptr, 10) : 20000;
+  unsigned threads = argc > 3 ? (unsigned)atoi(argv[3]) : 4;
+
+  sqlite3 *db;
+  if (open_db(argv[1], &db) != SQLITE_OK) {
+    fprintf(stderr, "cannot open %s\n", argv[1]);
+    return 1;
+  }
+  sqlite3_busy_timeout(db, COUNTER_BUSY_TIMEOUT_MS);
+  sqlite3_exec(db,
+               "CREATE TABLE IF NOT EXISTS counter_flushes (name TEXT "
+               "PRIMARY KEY, segment INTEGER NOT NULL, flushed_at DATETIME)",
+               NULL, NULL, NULL);
+  std::vector<int64_t> ids;
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db, "SELECT id FROM sochee", -1, &stmt, NULL);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    ids.push_back(sqlite3_column_int64(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+  if (ids.empty()) {
+    fprintf(stderr, "no sochee rows\n");
+    return 1;
+  }
+
+  // Skewed like stream: a few posts get most of them
+  std::mt19937_64 rng(42);
+  std::vector<int64_t> stream(likes);
+  for (int64_t &id : stream) {
+    size_t r = rng() % ids.size();
+    id = ids[(r * r) / ids.size()];
+  }
+
+  int64_t start_total = total_likes(db);
+  sqlite3_prepare_v2(db, "UPDATE sochee SET likes = likes + 1 WHERE id = ?",
+                     -1, &stmt, NULL);
+  Clock::time_point start = Clock::now();
+  for (int64_t id : stream) {
+    sqlite3_bind_int64(stmt, 1, id);
+    sqlite3_step(stmt); // autocommit: one transaction per like
+    sqlite3_reset(stmt);
+  }
+  double direct = std::chrono::duration<double>(Clock::now() - start).count();
+  sqlite3_finalize(stmt);
+
+  std::string journal_dir = std::string(argv[1]) + ".counters";
+  CounterService counters("sochee", {"likes", "comments"});
+  std::string error;
+  if (!counters.start(argv[1], journal_dir, error)) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+  start = Clock::now();
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      for (size_t i = t; i < stream.size(); i += threads) {
+        counters.add(stream[i], 0, 1);
+      }
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  double coalesced =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  // Wait for the flusher to drain what is left
+  while (total_likes(db) != start_total + 2 * (int64_t)likes) {
+    if (std::chrono::duration<double>(Clock::now() - start).count() > 10) {
+      break;
+    }
+    counters.wake();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  double drained = std::chrono::duration<double>(Clock::now() - start).count();
+  CounterStats stats = counters.stats();
+  int64_t end_total = total_likes(db);
+  sqlite3_close(db);
+
+  printf("%zu likes over %zu posts, %u threads, %u shards\n", likes,
+         ids.size(), threads, counters.shards());
+  printf("%-22s %12.0f likes/s  %zu transactions\n", "transaction per like",
+         likes / direct, likes);
+  printf("%-22s %12.0f likes/s  %llu transactions, %llu row updates "
+         "(flushed after %.2f s)\n",
+         "coalesced", likes / coalesced, (unsigned long long)stats.flushes,
+         (unsigned long long)stats.rows, drained);
+  if (end_total != start_total + 2 * (int64_t)likes) {
+    fprintf(stderr, "likes total is %lld, expected %lld\n",
+            (long long)end_total,
+            (long long)(start_total + 2 * (int64_t)likes));
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,176 @@
+// Microbenchmark for common/escape.h.
+//
+// Escapes a synthetic table dump (cells of 4-200 bytes, a small fraction
+// containing characters that need escaping) cell by cell in every mode, with
+// a per-character scalar loop as the baseline and each kernel the CPU
+// supports. Outputs are compared so a kernel that disagrees fails the run.
+//
+// Usage: escape_bench [megabytes] [special-per-mille]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../common/escape.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// What every renderer would do without the library: a branch per character
+static void scalar_reference(std::string &out, EscapeMode mode,
+                             std::string_view text) {
+  bool quote = false;
+  if (mode == EscapeMode::Csv) {
+    for (char c : text) {
+      quote |= c == ',' || c == '"' || c == '\r' || c == '\n';
+    }
+    if (quote) {
+      out += '"';
+    }
+  }
+  for (char c : text) {
+    switch (mode) {
+    case EscapeMode::Html:
+    case EscapeMode::Attr:
+      if (c == '&') {
+        out += "&amp;";
+      } else if (c == '<') {
+        out += "&lt;";
+      } else if (c == '>') {
+        out += "&gt;";
+      } else if (c == '"' && mode == EscapeMode::Attr) {
+        out += "&quot;";
+      } else if (c == '\'' && mode == EscapeMode::Attr) {
+        out += "&#39;";
+      } else {
+        out += c;
+      }
+      break;
+    case EscapeMode::Json:
+      if (c == '"') {
+        out += "\\\"";
+      } else if (c == '\\') {
+        out += "\\\\";
+      } else if (c == '\n') {
+        out += "\\n";
+      } else if (c == '\r') {
+        out += "\\r";
+      } else if (c == '\t') {
+        out += "\\t";
+      } else if (c == '\b') {
+        out += "\\b";
+      } else if (c == '\f') {
+        out += "\\f";
+      } else if ((unsigned char)c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+        out += buf;
+      } else {
+        out += c;
+      }
+      break;
+    case EscapeMode::Csv:
+      if (c == '"') {
+        out += '"';
+      }
+      out += c;
+      break;
+    }
+  }
+  if (quote) {
+    out += '"';
+  }
+}
+
+static std::vector<std::string> make_cells(size_t bytes, int per_mille) {
+  static const char specials[] = "&<>\"',\n\r\t\\\x01";
+  std::mt19937_64 rng(42);
+  std::uniform_int_distribution<int> length(4, 200);
+  std::uniform_int_distribution<int> letter('a', 'z');
+  std::uniform_int_distribution<int> mille(0, 999);
+  std::uniform_int_distribution<int> special(0, sizeof(specials) - 2);
+
+  std::vector<std::string> cells;
+  size_t total = 0;
+  while (total < bytes) {
+    std::string cell(length(rng), ' ');
+    for (char &c : cell) {
+      int r = mille(rng);
+      c = r < per_mille ? specials[special(rng)] : r % 7 ? letter(rng) : ' ';
+    }
+    total += cell.size();
+    cells.push_back(std::move(cell));
+  }
+  return cells;
+}
+
+// Escape every cell into one buffer; returns MB/s of input
+static double run(const std::vector<std::string> &cells, size_t bytes,
+                  EscapeMode mode, bool reference, std::string &out) {
+  double best = 0;
+  for (int round = 0; round < 5; round++) {
+    out.clear();
+    Clock::time_point start = Clock::now();
+    for (const std::string &cell : cells) {
+      if (reference) {
+        scalar_reference(out, mode, cell);
+      } else {
+        escape_append(out, mode, cell);
+      }
+    }
+    double seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    double rate = bytes / seconds / 1e6;
+    best = rate > best ? rate : best;
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  size_t megabytes = argc > 1 ? atol(argv[1]) : 16;
+  int per_mille = argc > 2 ? atoi(argv[2]) : 5;
+
+  std::vector<std::string> cells = make_cells(megabytes << 20, per_mille);
+  size_t bytes = 0;
+  for (const std::string &cell : cells) {
+    bytes += cell.size();
+  }
+  printf("%zu cells, %.1f MB, %d/1000 bytes need escaping\n", cells.size(),
+         bytes / 1e6, per_mille);
+
+  std::vector<EscapeKernel> kernels = {EscapeKernel::Scalar};
+#ifdef ESCAPE_X86
+  kernels.push_back(EscapeKernel::Sse2);
+  if (detect_escape_kernel() == EscapeKernel::Avx2) {
+    kernels.push_back(EscapeKernel::Avx2);
+  }
+#endif
+
+  const EscapeMode modes[] = {EscapeMode::Html, EscapeMode::Attr,
+                              EscapeMode::Json, EscapeMode::Csv};
+  const char *names[] = {"html", "attr", "json", "csv"};
+  bool ok = true;
+  std::string expected, out;
+  out.reserve(bytes * 2);
+  expected.reserve(bytes * 2);
+
+  for (int m = 0; m < 4; m++) {
+    printf("%-5s %-10s %8.0f MB/s\n", names[m], "reference",
+           run(cells, bytes, modes[m], true, expected));
+    for (EscapeKernel kernel : kernels) {
+      escape_kernel() = kernel;
+      double rate = run(cells, bytes, modes[m], false, out);
+      printf("%-5s %-10s %8.0f MB/s\n", names[m], escape_kernel_name(kernel),
+             rate);
+      if (out != expected) {
+        fprintf(stderr, "%s kernel output differs in %s mode\n",
+                escape_kernel_name(kernel), names[m]);
+        ok = false;
+      }
+    }
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+// Microbenchmark for common/http.h.
+//
+// Parses representative requests in a loop and counts heap allocations by
+// replacing the global operator new. The GET cases must report 0 allocations
+// per request; the "legacy" case reproduces the old std::string/substr/
+// istringstream parsing for comparison.
+//
+// Usage: http_parser_bench [iterations]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../common/http.h"
+
+static std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+typedef std::chrono::steady_clock Clock;
+
+static const char *GET_MAIN = "GET / HTTP/1.1\r\n"
+                              "Host: localhost:8888\r\n"
+                              "User-Agent: Mozilla/5.0 (X11; Linux x86_64)\r\n"
+                              "Accept: text/html,application/xhtml+xml\r\n"
+                              "Accept-Encoding: gzip, deflate\r\n"
+                              "Accept-Language: en-US,en;q=0.9\r\n"
+                              "Connection: keep-alive\r\n\r\n";
+
+static const char *GET_TABLE =
+    "GET /table?name=content_blocks&sort=created_at&q=hello%20world+again "
+    "HTTP/1.1\r\n"
+    "Host: localhost:8888\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64)\r\n"
+    "Accept: text/html\r\n"
+    "Referer: http://localhost:8888/\r\n"
+    "Connection: keep-alive\r\n\r\n";
+
+struct Result {
+  double ns_per_request;
+  double allocations_per_request;
+};
+
+// Parse `request` (repeated `pipeline` times back to back) `iterations`
+// times, feeding it `chunk` bytes at a time
+static Result run_parser(const char *request, int pipeline, size_t chunk,
+                         long iterations) {
+  std::string source;
+  for (int i = 0; i < pipeline; i++) {
+    source += request;
+  }
+  std::vector<char> buffer(source.size());
+  HttpParser parser;
+  HttpRequest parsed;
+  size_t checksum = 0;
+
+  uint64_t before = allocations.load();
+  Clock::time_point start = Clock::now();
+  for (long it = 0; it < iterations; it++) {
+    // Decoding happens in place, so start every round from a fresh copy
+    memcpy(buffer.data(), source.data(), source.size());
+    size_t offset = 0;
+    size_t available = 0;
+    while (offset < source.size()) {
+      size_t remaining = source.size() - offset;
+      available =
+          remaining - available <= chunk ? remaining : available + chunk;
+      HttpParser::Status status =
+          parser.parse(buffer.data() + offset, available, parsed);
+      if (status == HttpParser::Incomplete) {
+        continue;
+      }
+      if (status == HttpParser::Error) {
+        fprintf(stderr, "parse error %d\n", parser.error_status());
+        exit(1);
+      }
+      checksum += parsed.path.size() + parsed.param_count +
+                  parsed.header("host").size();
+      size_t used = parser.consumed();
+      offset += used;
+      available -= used;
+      parser.reset();
+    }
+  }
+  double elapsed = std::chrono::duration<double, std::nano>(Clock::now() -
+                                                            start)
+                       .count();
+  uint64_t allocated = allocations.load() - before;
+
+  if (checksum == 0) {
+    fprintf(stderr, "nothing parsed\n");
+  }
+  double requests = (double)iterations * pipeline;
+  return {elapsed / requests, allocated / requests};
+}
+
+// The parsing the servers did before common/http.h
+static Result run_legacy(const char *request, long iterations) {
+  size_t checksum = 0;
+  uint64_t before = allocations.load();
+  Clock::time_point start = Clock::now();
+  for (long it = 0; it < iterations; it++) {
+    std::string req(request);
+    size_t path_start = req.find(" ") + 1;
+    size_t path_end = req.find(" ", path_start);
+    std::string path = req.substr(path_start, path_end - path_start);
+
+    std::map<std::string, std::string> params;
+    size_t query_start = path.find('?');
+    if (query_start != std::string::npos) {
+      std::string query = path.substr(query_start + 1);
+      path = path.substr(0, query_start);
+      std::istringstream iss(query);
+      std::string pair;
+      while (std::getline(iss, pair, '&')) {
+        std::istringstream pair_stream(pair);
+        std::string key, value;
+        if (std::getline(pair_stream, key, '=')) {
+          std::getline(pair_stream, value);
+          params[key] = value;
+        }
+      }
+    }
+    size_t host = req.find("Host:");
+    checksum += path.size() + params.size() + host;
+  }
+  double elapsed = std::chrono::duration<double, std::nano>(Clock::now() -
+                                                            start)
+                       .count();
+  uint64_t allocated = allocations.load() - before;
+
+  if (checksum == 0) {
+    fprintf(stderr, "nothing parsed\n");
+  }
+  return {elapsed / iterations, (double)allocated / iterations};
+}
+
+static void report(const char *name, Result r) {
+  printf("%-32s %10.1f ns/request %8.2f allocations/request\n", name,
+         r.ns_per_request, r.allocations_per_request);
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+
+  Result main_page = run_parser(GET_MAIN, 1, SIZE_MAX, iterations);
+  Result table = run_parser(GET_TABLE, 1, SIZE_MAX, iterations);
+  report("GET / (whole)", main_page);
+  report("GET /table?... (whole)", table);
+  report("GET /table?... (16-byte reads)",
+         run_parser(GET_TABLE, 1, 16, iterations / 4));
+  report("GET pipelined x8",
+         run_parser(GET_TABLE, 8, SIZE_MAX, iterations / 8));
+  report("legacy GET /table?...", run_legacy(GET_TABLE, iterations / 4));
+
+  if (main_page.allocations_per_request != 0 ||
+      table.allocations_per_request != 0) {
+    fprintf(stderr, "GET hot path allocated\n");
+    return 1;
+  }
+  return 0;
+}
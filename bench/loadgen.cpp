@@ -0,0 +1,717 @@
+// HTTP load generator for db_admin and media_manager.
+//
+// Closed loop: --connections workers each issue the next request as soon as
+// the previous one finished (optionally paced with --rate).
+// Open loop: requests are scheduled at a fixed --rate regardless of how fast
+// the server answers, and latency is measured from the scheduled start so
+// queueing behind a slow response is not hidden (coordinated omission).
+//
+// Usage:
+//   loadgen --scenario db-main|db-table|media-upload|handshake [options]
+//   loadgen --seed-db PATH --rows 1000,100000,...
+//
+// Options:
+//   --host 127.0.0.1 --port N     server address (defaults per scenario)
+//   --table NAME                  table for db-table
+//   --size BYTES                  upload size for media-upload (k/m/g suffix)
+//   --mode closed|open            load model (default closed)
+//   --connections N               concurrent connections (default 4)
+//   --rate R                      requests per second (open loop, or pacing)
+//   --duration S                  seconds to run (default 10)
+//   --requests N                  stop after N requests instead
+//   --json                        print one JSON object instead of text
+//   --label TEXT                  label copied into the JSON output
+//   --tls                         connect with TLS (certificate not verified)
+//   --resume                      reuse each worker's TLS session/ticket
+//
+// The handshake scenario only connects (and runs the TLS handshake), which
+// isolates connection setup cost: compare the connect histogram of --tls
+// with and without --resume, or against plain connections through an SSH
+// tunnel. With --resume it also waits for the server's next session ticket
+// (TLS 1.3 tickets are single use), so its req/s understates the server.
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <sqlite3.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../common/histogram.h"
+
+#define ADMIN_PORT 8888
+#define MEDIA_PORT 8889
+#define READ_BUFFER_SIZE 65536
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+  std::string scenario;
+  std::string host = "127.0.0.1";
+  int port = 0;
+  std::string table;
+  size_t upload_size = 1024;
+  bool open_loop = false;
+  int connections = 4;
+  double rate = 0;
+  double duration = 10;
+  long max_requests = 0;
+  bool json = false;
+  std::string label;
+  bool tls = false;
+  bool resume = false;
+  std::string seed_db;
+  std::vector<long> seed_rows;
+};
+
+// One request: a header block plus an optional body that is generated on
+// the fly so gigabyte uploads do not need gigabytes of memory
+struct RequestTemplate {
+  std::string head;
+  std::string body_prefix;
+  size_t body_fill = 0;
+  std::string body_suffix;
+
+  size_t size() const {
+    return head.size() + body_prefix.size() + body_fill + body_suffix.size();
+  }
+};
+
+struct WorkerResult {
+  LatencyHistogram latency;
+  LatencyHistogram corrected;
+  LatencyHistogram handshake;
+  uint64_t resumed = 0;
+  uint64_t requests = 0;
+  uint64_t errors = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t bytes_received = 0;
+  std::vector<int> status_counts = std::vector<int>(6, 0);
+};
+
+// "64k", "1m", "1g"; unit is 1024 for byte sizes and 1000 for row counts
+static size_t parse_size(const char *text, double unit = 1024) {
+  char *end;
+  double value = strtod(text, &end);
+  switch (*end) {
+  case 'k':
+  case 'K':
+    value *= unit;
+    break;
+  case 'm':
+  case 'M':
+    value *= unit * unit;
+    break;
+  case 'g':
+  case 'G':
+    value *= unit * unit * unit;
+    break;
+  }
+  return (size_t)value;
+}
+
+static RequestTemplate build_request(const Options &opt) {
+  RequestTemplate req;
+  std::string host_header = "Host: " + opt.host + "\r\n";
+
+  if (opt.scenario == "db-main") {
+    req.head = "GET / HTTP/1.1\r\n" + host_header + "Connection: close\r\n\r\n";
+  } else if (opt.scenario == "db-table") {
+    req.head = "GET /table?name=" + opt.table + " HTTP/1.1\r\n" + host_header +
+               "Connection: close\r\n\r\n";
+  } else if (opt.scenario == "media-upload") {
+    std::string boundary = "----grabbielbench7MA4YWxkTrZu0gW";
+    req.body_prefix = "--" + boundary +
+                      "\r\nContent-Disposition: form-data; name=\"content_id\""
+                      "\r\n\r\n0\r\n--" +
+                      boundary +
+                      "\r\nContent-Disposition: form-data; name=\"title\""
+                      "\r\n\r\nbench\r\n--" +
+                      boundary +
+                      "\r\nContent-Disposition: form-data; name=\"video\"; "
+                      "filename=\"bench.mp4\"\r\nContent-Type: video/mp4"
+                      "\r\n\r\n";
+    req.body_fill = opt.upload_size;
+    req.body_suffix = "\r\n--" + boundary + "--\r\n";
+    size_t body_size =
+        req.body_prefix.size() + req.body_fill + req.body_suffix.size();
+    req.head = "POST /upload-video HTTP/1.1\r\n" + host_header +
+               "Content-Type: multipart/form-data; boundary=" + boundary +
+               "\r\nContent-Length: " + std::to_string(body_size) +
+               "\r\nConnection: close\r\n\r\n";
+  }
+
+  return req;
+}
+
+static SSL_CTX *tls_ctx = nullptr;
+
+// Client side of one connection, plain or TLS
+struct ClientConnection {
+  int fd = -1;
+  SSL *ssl = nullptr;
+
+  ~ClientConnection() {
+    if (ssl) {
+      SSL_shutdown(ssl);
+      SSL_free(ssl);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  ssize_t send(const char *data, size_t len) {
+    if (ssl) {
+      size_t n = 0;
+      return SSL_write_ex(ssl, data, len, &n) > 0 ? (ssize_t)n : -1;
+    }
+    return ::send(fd, data, len, MSG_NOSIGNAL);
+  }
+
+  ssize_t read(char *buffer, size_t len) {
+    if (ssl) {
+      size_t n = 0;
+      if (SSL_read_ex(ssl, buffer, len, &n) > 0) {
+        return (ssize_t)n;
+      }
+      return SSL_get_error(ssl, 0) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+    return ::read(fd, buffer, len);
+  }
+};
+
+static bool send_all(ClientConnection &conn, const char *data, size_t len,
+                     uint64_t &sent) {
+  while (len > 0) {
+    ssize_t n = conn.send(data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+    sent += n;
+  }
+  return true;
+}
+
+// TCP connect plus, with --tls, the handshake (resuming `session` if set)
+static bool open_connection(const Options &opt, const sockaddr_in &addr,
+                            SSL_SESSION *session, ClientConnection &conn,
+                            WorkerResult &result) {
+  Clock::time_point start = Clock::now();
+  conn.fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (conn.fd < 0) {
+    return false;
+  }
+  int one = 1;
+  setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (connect(conn.fd, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+    return false;
+  }
+
+  if (opt.tls) {
+    conn.ssl = SSL_new(tls_ctx);
+    SSL_set_fd(conn.ssl, conn.fd);
+    if (session) {
+      SSL_set_session(conn.ssl, session);
+    }
+    if (SSL_connect(conn.ssl) <= 0) {
+      return false;
+    }
+    if (SSL_session_reused(conn.ssl)) {
+      result.resumed++;
+    }
+  }
+
+  result.handshake.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              Clock::now() - start)
+                              .count());
+  return true;
+}
+
+// Send the request and drain the response; returns the HTTP status or -1
+static int exchange(ClientConnection &conn, const RequestTemplate &req,
+                    WorkerResult &result) {
+  static const std::string fill(READ_BUFFER_SIZE, 'x');
+  bool ok =
+      send_all(conn, req.head.data(), req.head.size(), result.bytes_sent) &&
+      send_all(conn, req.body_prefix.data(), req.body_prefix.size(),
+               result.bytes_sent);
+  for (size_t left = req.body_fill; ok && left > 0;) {
+    size_t chunk = std::min(left, fill.size());
+    ok = send_all(conn, fill.data(), chunk, result.bytes_sent);
+    left -= chunk;
+  }
+  ok = ok && send_all(conn, req.body_suffix.data(), req.body_suffix.size(),
+                      result.bytes_sent);
+
+  // The servers close the connection after each response
+  char buffer[READ_BUFFER_SIZE];
+  std::string status_line;
+  ssize_t n;
+  while (ok && (n = conn.read(buffer, sizeof(buffer))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (status_line.size() < 12) {
+      status_line.append(buffer, std::min<size_t>(n, 12 - status_line.size()));
+    }
+    result.bytes_received += n;
+  }
+
+  if (!ok || status_line.size() < 12 || status_line.rfind("HTTP/", 0) != 0) {
+    return -1;
+  }
+  return atoi(status_line.c_str() + 9);
+}
+
+// Latest session handed out by the server on this thread (new_session_cb)
+static thread_local SSL_SESSION *received_session = nullptr;
+
+static int on_new_session(SSL *, SSL_SESSION *session) {
+  SSL_SESSION_free(received_session);
+  received_session = session;
+  return 1;
+}
+
+// The handshake scenario never reads, so pull the ticket the server sends
+// right after the handshake explicitly
+static void wait_for_ticket(ClientConnection &conn) {
+  int flags = fcntl(conn.fd, F_GETFL);
+  fcntl(conn.fd, F_SETFL, flags | O_NONBLOCK);
+  for (int i = 0; i < 100 && !received_session; i++) {
+    char c;
+    size_t n;
+    if (SSL_peek_ex(conn.ssl, &c, 1, &n) <= 0 &&
+        SSL_get_error(conn.ssl, 0) != SSL_ERROR_WANT_READ) {
+      break;
+    }
+    struct pollfd pfd = {conn.fd, POLLIN, 0};
+    poll(&pfd, 1, 10);
+  }
+  fcntl(conn.fd, F_SETFL, flags);
+}
+
+// Run one request on a fresh connection; returns the HTTP status or -1.
+// The handshake scenario returns 0 once the connection is established.
+static int run_request(const Options &opt, const sockaddr_in &addr,
+                       const RequestTemplate &req, SSL_SESSION *&session,
+                       WorkerResult &result) {
+  ClientConnection conn;
+  if (!open_connection(opt, addr, opt.resume ? session : nullptr, conn,
+                       result)) {
+    return -1;
+  }
+
+  int status = 0;
+  if (!req.head.empty()) {
+    status = exchange(conn, req, result);
+  }
+
+  if (opt.resume && conn.ssl) {
+    if (req.head.empty()) {
+      wait_for_ticket(conn);
+    }
+    if (received_session) {
+      SSL_SESSION_free(session);
+      session = received_session;
+      received_session = nullptr;
+    }
+  }
+  return status;
+}
+
+static void record(WorkerResult &result, int status, uint64_t latency_ns,
+                   uint64_t corrected_ns, uint64_t expected_interval_ns) {
+  result.requests++;
+  if (status < 0) {
+    result.errors++;
+  } else {
+    result.status_counts[std::min(status / 100, 5)]++;
+  }
+  result.latency.record(latency_ns);
+  result.corrected.record_corrected(corrected_ns, expected_interval_ns);
+}
+
+static void closed_loop_worker(const Options &opt, const sockaddr_in &addr,
+                               const RequestTemplate &req, Clock::time_point end,
+                               std::atomic<long> &remaining,
+                               WorkerResult &result) {
+  // With --rate each connection is paced at rate/connections and the
+  // corrected histogram back-fills requests a stall would have delayed
+  uint64_t interval_ns =
+      opt.rate > 0 ? (uint64_t)(1e9 * opt.connections / opt.rate) : 0;
+  Clock::time_point next = Clock::now();
+  SSL_SESSION *session = nullptr;
+
+  while (Clock::now() < end) {
+    if (opt.max_requests && remaining.fetch_sub(1) <= 0) {
+      break;
+    }
+    if (interval_ns) {
+      std::this_thread::sleep_until(next);
+    }
+
+    Clock::time_point start = Clock::now();
+    int status = run_request(opt, addr, req, session, result);
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      Clock::now() - start)
+                      .count();
+    record(result, status, ns, ns, interval_ns);
+
+    if (interval_ns) {
+      next += std::chrono::nanoseconds(interval_ns);
+    }
+  }
+  SSL_SESSION_free(session);
+}
+
+static void open_loop_worker(const Options &opt, const sockaddr_in &addr,
+                             const RequestTemplate &req,
+                             Clock::time_point start, Clock::time_point end,
+                             std::atomic<long> &next_slot,
+                             WorkerResult &result) {
+  double interval_ns = 1e9 / opt.rate;
+  SSL_SESSION *session = nullptr;
+
+  while (true) {
+    long slot = next_slot.fetch_add(1);
+    if (opt.max_requests && slot >= opt.max_requests) {
+      break;
+    }
+    Clock::time_point intended =
+        start + std::chrono::nanoseconds((long long)(slot * interval_ns));
+    if (intended >= end) {
+      break;
+    }
+    std::this_thread::sleep_until(intended);
+
+    Clock::time_point sent = Clock::now();
+    int status = run_request(opt, addr, req, session, result);
+    Clock::time_point done = Clock::now();
+
+    uint64_t service_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(done - sent)
+            .count();
+    uint64_t response_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(done - intended)
+            .count();
+    record(result, status, service_ns, response_ns, 0);
+  }
+  SSL_SESSION_free(session);
+}
+
+static void print_latency_json(const char *name, const LatencyHistogram &h,
+                               bool last) {
+  printf("\"%s\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,"
+         "\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}%s",
+         name, (unsigned long long)h.count, h.mean_ns() / 1e3,
+         h.percentile_ns(0.50) / 1e3, h.percentile_ns(0.90) / 1e3,
+         h.percentile_ns(0.99) / 1e3, h.percentile_ns(0.999) / 1e3,
+         h.max_ns / 1e3, last ? "" : ",");
+}
+
+static void print_latency_text(const char *name, const LatencyHistogram &h) {
+  printf("%-22s mean %10.1f  p50 %10.1f  p90 %10.1f  p99 %10.1f  "
+         "p99.9 %10.1f  max %10.1f  (us)\n",
+         name, h.mean_ns() / 1e3, h.percentile_ns(0.50) / 1e3,
+         h.percentile_ns(0.90) / 1e3, h.percentile_ns(0.99) / 1e3,
+         h.percentile_ns(0.999) / 1e3, h.max_ns / 1e3);
+}
+
+static std::string json_escape(const std::string &s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+    }
+    if ((unsigned char)c >= 0x20) {
+      out += c;
+    }
+  }
+  return out;
+}
+
+static int run_load(const Options &opt) {
+  RequestTemplate req = build_request(opt);
+  if (req.head.empty() && opt.scenario != "handshake") {
+    fprintf(stderr, "Unknown scenario '%s'\n", opt.scenario.c_str());
+    return 1;
+  }
+  if (opt.open_loop && opt.rate <= 0) {
+    fprintf(stderr, "Open loop mode needs --rate\n");
+    return 1;
+  }
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(opt.port);
+  if (inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr) != 1) {
+    fprintf(stderr, "Invalid host '%s'\n", opt.host.c_str());
+    return 1;
+  }
+
+  if (opt.tls) {
+    // Benchmark client: self-signed server certificates are fine
+    tls_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+    if (opt.resume) {
+      SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT |
+                                                  SSL_SESS_CACHE_NO_INTERNAL);
+      SSL_CTX_sess_set_new_cb(tls_ctx, on_new_session);
+    }
+  }
+
+  std::vector<WorkerResult> results(opt.connections);
+  std::vector<std::thread> workers;
+  std::atomic<long> counter(opt.open_loop ? 0 : opt.max_requests);
+  Clock::time_point start = Clock::now();
+  Clock::time_point end =
+      opt.max_requests ? Clock::time_point::max()
+                       : start + std::chrono::milliseconds(
+                                     (long long)(opt.duration * 1000));
+
+  for (int i = 0; i < opt.connections; i++) {
+    if (opt.open_loop) {
+      workers.emplace_back(open_loop_worker, std::cref(opt), std::cref(addr),
+                           std::cref(req), start, end, std::ref(counter),
+                           std::ref(results[i]));
+    } else {
+      workers.emplace_back(closed_loop_worker, std::cref(opt), std::cref(addr),
+                           std::cref(req), end, std::ref(counter),
+                           std::ref(results[i]));
+    }
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  double elapsed =
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  WorkerResult total;
+  for (const auto &r : results) {
+    total.latency.merge(r.latency);
+    total.corrected.merge(r.corrected);
+    total.handshake.merge(r.handshake);
+    total.resumed += r.resumed;
+    total.requests += r.requests;
+    total.errors += r.errors;
+    total.bytes_sent += r.bytes_sent;
+    total.bytes_received += r.bytes_received;
+    for (int i = 0; i < 6; i++) {
+      total.status_counts[i] += r.status_counts[i];
+    }
+  }
+
+  if (opt.json) {
+    printf("{\"label\":\"%s\",\"scenario\":\"%s\",\"mode\":\"%s\","
+           "\"connections\":%d,\"rate\":%.1f,\"upload_bytes\":%zu,"
+           "\"table\":\"%s\",\"elapsed_s\":%.3f,\"requests\":%llu,"
+           "\"errors\":%llu,\"status_2xx\":%d,\"status_3xx\":%d,"
+           "\"status_4xx\":%d,\"status_5xx\":%d,\"throughput_rps\":%.2f,"
+           "\"sent_mb_s\":%.2f,\"received_mb_s\":%.2f,\"tls\":%s,"
+           "\"resume\":%s,\"resumed\":%llu,\"latency_us\":{",
+           json_escape(opt.label).c_str(), opt.scenario.c_str(),
+           opt.open_loop ? "open" : "closed", opt.connections, opt.rate,
+           opt.scenario == "media-upload" ? opt.upload_size : 0,
+           json_escape(opt.table).c_str(), elapsed,
+           (unsigned long long)total.requests,
+           (unsigned long long)total.errors, total.status_counts[2],
+           total.status_counts[3], total.status_counts[4],
+           total.status_counts[5], total.requests / elapsed,
+           total.bytes_sent / elapsed / 1e6,
+           total.bytes_received / elapsed / 1e6, opt.tls ? "true" : "false",
+           opt.resume ? "true" : "false", (unsigned long long)total.resumed);
+    print_latency_json("service", total.latency, false);
+    print_latency_json("connect", total.handshake, false);
+    print_latency_json("corrected", total.corrected, true);
+    printf("}}\n");
+  } else {
+    printf("%s %s loop, %d connections, %.1f s\n", opt.scenario.c_str(),
+           opt.open_loop ? "open" : "closed", opt.connections, elapsed);
+    printf("requests %llu (errors %llu, 2xx %d, 3xx %d, 4xx %d, 5xx %d)\n",
+           (unsigned long long)total.requests,
+           (unsigned long long)total.errors, total.status_counts[2],
+           total.status_counts[3], total.status_counts[4],
+           total.status_counts[5]);
+    printf("throughput %.2f req/s, sent %.2f MB/s, received %.2f MB/s\n",
+           total.requests / elapsed, total.bytes_sent / elapsed / 1e6,
+           total.bytes_received / elapsed / 1e6);
+    if (opt.tls) {
+      printf("tls sessions resumed %llu of %llu\n",
+             (unsigned long long)total.resumed,
+             (unsigned long long)total.handshake.count);
+    }
+    print_latency_text("connect/handshake", total.handshake);
+    print_latency_text("service time", total.latency);
+    print_latency_text("corrected response", total.corrected);
+  }
+
+  return total.errors ? 2 : 0;
+}
+
+// Create bench_rows_<n> tables shaped like content_blocks for db-table runs
+static int seed_database(const Options &opt) {
+  sqlite3 *db;
+  if (sqlite3_open(opt.seed_db.c_str(), &db) != SQLITE_OK) {
+    fprintf(stderr, "Failed to open %s: %s\n", opt.seed_db.c_str(),
+            sqlite3_errmsg(db));
+    return 1;
+  }
+  sqlite3_exec(db, "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF;", NULL,
+               NULL, NULL);
+
+  static const char *statuses[] = {"draft", "published", "archived"};
+  for (long rows : opt.seed_rows) {
+    std::string table = "bench_rows_" + std::to_string(rows);
+    std::string sql = "DROP TABLE IF EXISTS " + table + "; CREATE TABLE " +
+                      table +
+                      " (id INTEGER PRIMARY KEY, title TEXT NOT NULL, "
+                      "url_slug TEXT NOT NULL, status TEXT, language TEXT, "
+                      "created_at DATETIME, body TEXT);";
+    if (sqlite3_exec(db, sql.c_str(), NULL, NULL, NULL) != SQLITE_OK) {
+      fprintf(stderr, "Failed to create %s: %s\n", table.c_str(),
+              sqlite3_errmsg(db));
+      sqlite3_close(db);
+      return 1;
+    }
+
+    sql = "INSERT INTO " + table +
+          " (id, title, url_slug, status, language, created_at, body) "
+          "VALUES (?, ?, ?, ?, 'en', datetime(1700000000 + ?, 'unixepoch'), ?)";
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ (uint64_t)rows;
+    for (long i = 1; i <= rows; i++) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      std::string title = "Benchmark row " + std::to_string(i);
+      std::string slug = "bench-" + std::to_string(i);
+      std::string body(40 + state % 160, 'a' + (char)(state % 26));
+
+      sqlite3_bind_int64(stmt, 1, i);
+      sqlite3_bind_text(stmt, 2, title.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_text(stmt, 3, slug.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_text(stmt, 4, statuses[state % 3], -1, SQLITE_STATIC);
+      sqlite3_bind_int64(stmt, 5, i * 60);
+      sqlite3_bind_text(stmt, 6, body.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
+    }
+
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    sqlite3_finalize(stmt);
+    printf("Seeded %s with %ld rows\n", table.c_str(), rows);
+  }
+
+  sqlite3_close(db);
+  return 0;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: loadgen --scenario db-main|db-table|media-upload|handshake "
+          "[--table NAME] [--size BYTES]\n"
+          "               [--mode closed|open] [--connections N] [--rate R]\n"
+          "               [--duration S] [--requests N] [--host H] "
+          "[--port P] [--json] [--label L]\n"
+          "               [--tls] [--resume]\n"
+          "       loadgen --seed-db PATH --rows 1000,100000,...\n");
+}
+
+int main(int argc, char **argv) {
+  Options opt;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--json") {
+      opt.json = true;
+      continue;
+    }
+    if (arg == "--tls") {
+      opt.tls = true;
+      continue;
+    }
+    if (arg == "--resume") {
+      opt.resume = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    const char *value = argv[++i];
+    if (arg == "--scenario") {
+      opt.scenario = value;
+    } else if (arg == "--host") {
+      opt.host = value;
+    } else if (arg == "--port") {
+      opt.port = atoi(value);
+    } else if (arg == "--table") {
+      opt.table = value;
+    } else if (arg == "--size") {
+      opt.upload_size = parse_size(value);
+    } else if (arg == "--mode") {
+      opt.open_loop = std::string(value) == "open";
+    } else if (arg == "--connections") {
+      opt.connections = std::max(1, atoi(value));
+    } else if (arg == "--rate") {
+      opt.rate = atof(value);
+    } else if (arg == "--duration") {
+      opt.duration = atof(value);
+    } else if (arg == "--requests") {
+      opt.max_requests = atol(value);
+    } else if (arg == "--label") {
+      opt.label = value;
+    } else if (arg == "--seed-db") {
+      opt.seed_db = value;
+    } else if (arg == "--rows") {
+      for (char *tok = strtok((char *)value, ","); tok;
+           tok = strtok(NULL, ",")) {
+        opt.seed_rows.push_back((long)parse_size(tok, 1000));
+      }
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  if (!opt.seed_db.empty()) {
+    return seed_database(opt);
+  }
+  if (opt.scenario.empty()) {
+    usage();
+    return 1;
+  }
+  if (opt.port == 0) {
+    opt.port = opt.scenario.rfind("media", 0) == 0 ? MEDIA_PORT : ADMIN_PORT;
+  }
+
+  return run_load(opt);
+}
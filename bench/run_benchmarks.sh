@@ -0,0 +1,94 @@
+#!/bin/bash
+
+# Benchmark suite for db_admin and media_manager.
+#
+# Builds both servers and the load generator, points the servers at a
+# scratch database and a local storage directory, and appends one JSON
+# line per run to $RESULTS (default bench/results.jsonl) so runs can be
+# compared across commits.
+#
+#   ./run_benchmarks.sh                # 1k..1M row tables, uploads to 64 MB
+#   LARGE=1 ./run_benchmarks.sh        # also 10M rows and 1 GB uploads
+#   DURATION=30 CONNECTIONS=8 ./run_benchmarks.sh
+#
+# A second pair of servers with TLS enabled listens on 127.0.0.2 (self-signed
+# certificate) for the handshake/resumption and TLS upload runs.
+
+set -e
+cd "$(dirname "$0")"
+
+WORK_DIR=${WORK_DIR:-/tmp/grabbiel-bench}
+RESULTS=${RESULTS:-$(pwd)/results.jsonl}
+DURATION=${DURATION:-10}
+CONNECTIONS=${CONNECTIONS:-4}
+RATE=${RATE:-200}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+ROWS="1000 100000 1000000"
+UPLOADS="1k 64k 1m 16m 64m"
+if [ -n "$LARGE" ]; then
+  ROWS="$ROWS 10000000"
+  UPLOADS="$UPLOADS 256m 1g"
+fi
+
+./build_bench.sh
+mkdir -p "$WORK_DIR/storage"
+# The servers as they ship (common/build_flags.sh), plus optimization
+source ../common/build_flags.sh
+(cd ../db-admin && g++ $DB_ADMIN_FLAGS -O2 -o "$WORK_DIR/db_admin" db_admin.cpp $SERVER_LIBS)
+(cd ../media && g++ $MEDIA_MANAGER_FLAGS -O2 -o "$WORK_DIR/media_manager" media_manager.cpp $SERVER_LIBS)
+
+DB="$WORK_DIR/content.db"
+if [ ! -f "$DB" ]; then
+  sqlite3 "$DB" <../schema/init_db.sql
+  for migration in ../migrations/*.sql; do
+    sqlite3 "$DB" <"$migration" 2>/dev/null || true
+  done
+fi
+./loadgen --seed-db "$DB" --rows "$(echo $ROWS | tr ' ' ',')"
+
+if [ ! -f "$WORK_DIR/tls-cert.pem" ]; then
+  openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes \
+    -keyout "$WORK_DIR/tls-key.pem" -out "$WORK_DIR/tls-cert.pem" \
+    -days 365 -subj /CN=localhost 2>/dev/null
+fi
+
+export GRABBIEL_DB_PATH="$DB"
+export GRABBIEL_STORAGE_DIR="$WORK_DIR/storage"
+
+"$WORK_DIR/db_admin" >/dev/null 2>&1 &
+ADMIN_PID=$!
+"$WORK_DIR/media_manager" >/dev/null 2>&1 &
+MEDIA_PID=$!
+TLS_ENV="GRABBIEL_BIND_ADDRESS=127.0.0.2 GRABBIEL_TLS_CERT=$WORK_DIR/tls-cert.pem GRABBIEL_TLS_KEY=$WORK_DIR/tls-key.pem"
+env $TLS_ENV "$WORK_DIR/db_admin" >/dev/null 2>&1 &
+TLS_ADMIN_PID=$!
+env $TLS_ENV "$WORK_DIR/media_manager" >/dev/null 2>&1 &
+TLS_MEDIA_PID=$!
+trap 'kill $ADMIN_PID $MEDIA_PID $TLS_ADMIN_PID $TLS_MEDIA_PID 2>/dev/null' EXIT
+sleep 1
+
+run() {
+  ./loadgen --json --label "$COMMIT" --duration "$DURATION" "$@" | tee -a "$RESULTS"
+}
+
+run --scenario db-main --connections "$CONNECTIONS"
+run --scenario db-main --mode open --rate "$RATE" --connections "$CONNECTIONS"
+
+for rows in $ROWS; do
+  # Whole-table pages get slow quickly, so the big ones run a fixed count
+  run --scenario db-table --table "bench_rows_$rows" --connections 1 --requests 5
+done
+
+for size in $UPLOADS; do
+  run --scenario media-upload --size "$size" --connections 1 --requests 3
+done
+
+run --scenario handshake --host 127.0.0.2 --tls --connections 1 --requests 500
+run --scenario handshake --host 127.0.0.2 --tls --resume --connections 1 --requests 500
+run --scenario db-main --host 127.0.0.2 --tls --resume --connections "$CONNECTIONS"
+for size in $UPLOADS; do
+  run --scenario media-upload --host 127.0.0.2 --tls --size "$size" --connections 1 --requests 3
+done
+
+echo "Results appended to $RESULTS"
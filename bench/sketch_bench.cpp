@@ -0,0 +1,160 @@
+// Benchmark for common/sketch.h.
+//
+// Streams a skewed (Zipf-like) sequence of hashtag events over two hours
+// into a one-hour SlidingTopK and into an in-memory SQLite event table,
+// then compares "top 10 over the last hour" answered by the sketch and by
+// GROUP BY over the events: latency, recall of the exact top 10 and the
+// overestimate of the reported counts.
+//
+// Usage: sketch_bench [events] [distinct-keys]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/sketch.h"
+
+typedef std::chrono::steady_clock Clock;
+
+#define BENCH_SECONDS (2 * 60 * 60)
+#define BENCH_TOP 10
+
+static double micros(Clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - start)
+      .count();
+}
+
+int main(int argc, char **argv) {
+  size_t events = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2000000;
+  size_t keys = argc > 2 ? strtoull(argv[2], nullptr, 10) : 100000;
+  if (!events || !keys) {
+    fprintf(stderr, "usage: sketch_bench [events] [distinct-keys]\n");
+    return 2;
+  }
+
+  // Event i happens at start + i * BENCH_SECONDS / events
+  std::mt19937_64 rng(42);
+  std::vector<uint32_t> stream(events);
+  std::vector<std::string> names(keys);
+  for (size_t k = 0; k < keys; k++) {
+    names[k] = "#tag" + std::to_string(k);
+  }
+  for (uint32_t &key : stream) {
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    key = (uint32_t)(keys * u * u * u); // heavy head, long tail
+  }
+  time_t start = 1700000000;
+  auto when = [&](size_t i) {
+    return start + (time_t)(i * (uint64_t)BENCH_SECONDS / events);
+  };
+  time_t now = when(events - 1);
+
+  SlidingTopK sketch({60, 60});
+  Clock::time_point t = Clock::now();
+  for (size_t i = 0; i < events; i++) {
+    sketch.add(stream[i], when(i), 1, names[stream[i]]);
+  }
+  double ingest = micros(t);
+
+  int repeats = 1000;
+  std::vector<TopEntry> top;
+  t = Clock::now();
+  for (int r = 0; r < repeats; r++) {
+    top = sketch.top(BENCH_TOP, now);
+  }
+  double sketch_us = micros(t) / repeats;
+
+  // Exact answer over the same live buckets
+  int64_t first = sketch.first_live(now);
+  std::unordered_map<uint32_t, uint32_t> exact;
+  size_t live = 0;
+  for (size_t i = 0; i < events; i++) {
+    if (when(i) / 60 >= first) {
+      exact[stream[i]]++;
+      live++;
+    }
+  }
+  std::vector<std::pair<uint32_t, uint32_t>> ranked;
+  for (const auto &entry : exact) {
+    ranked.push_back({entry.second, entry.first});
+  }
+  std::sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) {
+    return a.first != b.first ? a.first > b.first : a.second < b.second;
+  });
+  ranked.resize(std::min(ranked.size(), (size_t)BENCH_TOP));
+
+  // What the site would run without the sketch
+  sqlite3 *db;
+  sqlite3_open(":memory:", &db);
+  sqlite3_exec(db,
+               "CREATE TABLE events (at INTEGER, hashtag TEXT); "
+               "CREATE INDEX idx_events_at ON events(at)",
+               NULL, NULL, NULL);
+  sqlite3_stmt *stmt;
+  sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+  sqlite3_prepare_v2(db, "INSERT INTO events VALUES (?, ?)", -1, &stmt, NULL);
+  for (size_t i = 0; i < events; i++) {
+    sqlite3_bind_int64(stmt, 1, when(i));
+    sqlite3_bind_text(stmt, 2, names[stream[i]].c_str(), -1, SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  sqlite3_prepare_v2(db,
+                     "SELECT hashtag, count(*) AS n FROM events WHERE at >= ? "
+                     "GROUP BY hashtag ORDER BY n DESC LIMIT ?",
+                     -1, &stmt, NULL);
+  int sql_repeats = 3;
+  std::vector<std::string> sql_top;
+  t = Clock::now();
+  for (int r = 0; r < sql_repeats; r++) {
+    sql_top.clear();
+    sqlite3_bind_int64(stmt, 1, first * 60);
+    sqlite3_bind_int(stmt, 2, BENCH_TOP);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      sql_top.emplace_back((const char *)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_reset(stmt);
+  }
+  double sql_us = micros(t) / sql_repeats;
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+
+  size_t found = 0;
+  double worst = 0;
+  for (const auto &entry : ranked) {
+    for (const TopEntry &got : top) {
+      found += got.key == entry.second;
+    }
+  }
+  for (const TopEntry &got : top) {
+    uint32_t truth = exact[(uint32_t)got.key];
+    if (got.count < truth) {
+      fprintf(stderr, "%s: estimate %u below true count %u\n",
+              std::string(got.label).c_str(), got.count, truth);
+      return 1;
+    }
+    worst = std::max(worst, (got.count - truth) / (double)truth);
+  }
+
+  printf("%zu events over %zu keys, %zu in the last hour, %zu candidates\n",
+         events, keys, live, sketch.candidates());
+  printf("%-22s %10.0f events/s\n", "sketch ingest", events / ingest * 1e6);
+  printf("%-22s %10.1f us\n", "sketch top 10", sketch_us);
+  printf("%-22s %10.1f us\n", "GROUP BY top 10", sql_us);
+  printf("recall of exact top 10: %zu/%zu, worst overestimate %.1f%%\n",
+         found, ranked.size(), worst * 100);
+  printf("top: ");
+  for (const TopEntry &got : top) {
+    printf("%s=%u ", std::string(got.label).c_str(), got.count);
+  }
+  printf("\n");
+  return 0;
+}
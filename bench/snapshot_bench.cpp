@@ -0,0 +1,227 @@
+// Microbenchmark for common/snapshot.h.
+//
+// Resolves random published slugs the way a page render does (block, tags,
+// metadata) through prepared SQLite statements and through the snapshot
+// written by tools/snapshot_export, checks both agree, and fails if a
+// snapshot lookup allocates.
+//
+// Usage: snapshot_bench <content.db> <content.snapshot> [lookups]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+
+#include "../common/snapshot.h"
+
+static std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+typedef std::chrono::steady_clock Clock;
+
+struct Lookup {
+  std::string title;
+  size_t tags = 0;
+  size_t metadata = 0;
+  size_t bytes = 0; // of every string read, so nothing is optimized out
+};
+
+class SqliteLookup {
+public:
+  explicit SqliteLookup(sqlite3 *db) {
+    sqlite3_prepare_v2(db,
+                       "SELECT cb.id, cb.title, ct.type FROM content_blocks cb "
+                       "LEFT JOIN content_types ct ON ct.id = cb.type_id "
+                       "WHERE cb.url_slug = ? AND cb.status = 'published'",
+                       -1, &block_, nullptr);
+    sqlite3_prepare_v2(db,
+                       "SELECT t.name FROM content_tags ct "
+                       "JOIN tags t ON t.id = ct.tag_id "
+                       "WHERE ct.content_id = ?",
+                       -1, &tags_, nullptr);
+    sqlite3_prepare_v2(db,
+                       "SELECT key, value FROM content_metadata "
+                       "WHERE content_id = ?",
+                       -1, &meta_, nullptr);
+  }
+
+  ~SqliteLookup() {
+    sqlite3_finalize(block_);
+    sqlite3_finalize(tags_);
+    sqlite3_finalize(meta_);
+  }
+
+  bool ok() const { return block_ && tags_ && meta_; }
+
+  bool find(const std::string &slug, Lookup &out) {
+    sqlite3_reset(block_);
+    sqlite3_bind_text(block_, 1, slug.data(), (int)slug.size(),
+                      SQLITE_STATIC);
+    if (sqlite3_step(block_) != SQLITE_ROW) {
+      return false;
+    }
+    sqlite3_int64 id = sqlite3_column_int64(block_, 0);
+    const char *title = (const char *)sqlite3_column_text(block_, 1);
+    out.title = title ? title : "";
+    out.bytes += out.title.size() + sqlite3_column_bytes(block_, 2);
+
+    sqlite3_reset(tags_);
+    sqlite3_bind_int64(tags_, 1, id);
+    for (out.tags = 0; sqlite3_step(tags_) == SQLITE_ROW; out.tags++) {
+      out.bytes += sqlite3_column_bytes(tags_, 0);
+    }
+    sqlite3_reset(meta_);
+    sqlite3_bind_int64(meta_, 1, id);
+    for (out.metadata = 0; sqlite3_step(meta_) == SQLITE_ROW; out.metadata++) {
+      out.bytes +=
+          sqlite3_column_bytes(meta_, 0) + sqlite3_column_bytes(meta_, 1);
+    }
+    return true;
+  }
+
+private:
+  sqlite3_stmt *block_ = nullptr;
+  sqlite3_stmt *tags_ = nullptr;
+  sqlite3_stmt *meta_ = nullptr;
+};
+
+// The snapshot side reads the same fields without copying any of them
+static bool snapshot_find(const ContentSnapshot &snapshot,
+                          const std::string &slug, size_t &tags,
+                          size_t &metadata, size_t &bytes) {
+  const SnapshotRecord *record = snapshot.find(slug);
+  if (!record) {
+    return false;
+  }
+  bytes += snapshot.str(record->title).size() +
+           snapshot.str(record->type).size();
+  const SnapshotString *names = snapshot.tags(*record);
+  for (tags = 0; tags < record->tags_count; tags++) {
+    bytes += snapshot.str(names[tags]).size();
+  }
+  const SnapshotPair *pairs = snapshot.metadata(*record);
+  for (metadata = 0; metadata < record->meta_count; metadata++) {
+    bytes += snapshot.str(pairs[metadata].key).size() +
+             snapshot.str(pairs[metadata].value).size();
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr,
+            "usage: snapshot_bench <content.db> <content.snapshot> "
+            "[lookups]\n");
+    return 2;
+  }
+  size_t lookups = argc > 3 ? strtoull(argv[3], nullptr, 10) : 200000;
+
+  std::string error;
+  std::shared_ptr<const ContentSnapshot> snapshot =
+      ContentSnapshot::open(argv[2], error);
+  if (!snapshot) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+  sqlite3 *db = nullptr;
+  if (sqlite3_open_v2(argv[1], &db, SQLITE_OPEN_READONLY, nullptr) !=
+      SQLITE_OK) {
+    fprintf(stderr, "cannot open %s\n", argv[1]);
+    return 1;
+  }
+  bool ok = true;
+  {
+    SqliteLookup sqlite(db);
+    if (!sqlite.ok()) {
+      fprintf(stderr, "prepare failed: %s\n", sqlite3_errmsg(db));
+      sqlite3_close(db);
+      return 1;
+    }
+
+    // Mostly hits, with one miss in sixteen
+    std::vector<std::string> slugs;
+    for (const SnapshotRecord &record : *snapshot) {
+      slugs.emplace_back(snapshot->str(record.slug));
+    }
+    std::mt19937_64 rng(42);
+    std::vector<std::string> keys;
+    keys.reserve(lookups);
+    for (size_t i = 0; i < lookups; i++) {
+      if (slugs.empty() || i % 16 == 15) {
+        keys.push_back("missing-" + std::to_string(i));
+      } else {
+        keys.push_back(slugs[rng() % slugs.size()]);
+      }
+    }
+
+    size_t mismatches = 0;
+    Lookup expected;
+    for (size_t i = 0; i < keys.size() && i < 10000; i++) {
+      size_t tags = 0, metadata = 0, bytes = 0;
+      bool hit = sqlite.find(keys[i], expected);
+      if (hit != snapshot_find(*snapshot, keys[i], tags, metadata, bytes) ||
+          (hit && (tags != expected.tags || metadata != expected.metadata ||
+                   snapshot->str(snapshot->find(keys[i])->title) !=
+                       expected.title))) {
+        mismatches++;
+      }
+    }
+    if (mismatches) {
+      fprintf(stderr, "%zu lookups differ between SQLite and the snapshot\n",
+              mismatches);
+      ok = false;
+    }
+
+    Lookup row;
+    Clock::time_point start = Clock::now();
+    for (const std::string &key : keys) {
+      sqlite.find(key, row);
+    }
+    double sqlite_seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+
+    size_t bytes = 0;
+    uint64_t before = allocations.load();
+    start = Clock::now();
+    for (const std::string &key : keys) {
+      size_t tags, metadata;
+      snapshot_find(*snapshot, key, tags, metadata, bytes);
+    }
+    double snapshot_seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    uint64_t allocated = allocations.load() - before;
+
+    printf("%zu blocks, %zu lookups, snapshot %.1f MB\n", snapshot->size(),
+           keys.size(), snapshot->bytes() / 1e6);
+    printf("%-9s %10.0f ns/lookup\n", "sqlite",
+           sqlite_seconds * 1e9 / keys.size());
+    printf("%-9s %10.0f ns/lookup  %.2f allocs/lookup\n", "snapshot",
+           snapshot_seconds * 1e9 / keys.size(),
+           (double)allocated / keys.size());
+    if (allocated) {
+      fprintf(stderr, "snapshot lookups allocated %llu times\n",
+              (unsigned long long)allocated);
+      ok = false;
+    }
+    if (bytes == 0 && row.bytes == 0) {
+      printf("(no strings read)\n");
+    }
+  }
+  sqlite3_close(db);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,221 @@
+// Benchmark for common/tag_index.h.
+//
+// Builds the tag index from a content.db, then runs multi-tag queries
+// (AND, OR, AND NOT, with status and site filters) against the index and
+// as the equivalent SQL joins over content_tags, checks both return the
+// same ids, and reports per-query latency for every bitmap kernel.
+// Generate a large database with tools/datagen (scale 10 is about 3M
+// content_tags rows).
+//
+// Usage: tag_index_bench <content.db> [repeats]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+
+#include "../common/tag_index.h"
+
+typedef std::chrono::steady_clock Clock;
+
+struct BenchQuery {
+  const char *name;
+  TagQuery query;
+  std::string sql;
+};
+
+static std::vector<std::string> tag_names(sqlite3 *db) {
+  std::vector<std::string> names;
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db,
+                     "SELECT t.name FROM content_tags ct "
+                     "JOIN tags t ON t.id = ct.tag_id "
+                     "GROUP BY ct.tag_id ORDER BY count(*) DESC",
+                     -1, &stmt, NULL);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    names.emplace_back((const char *)sqlite3_column_text(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+  return names;
+}
+
+static std::string quoted(const std::string &text) {
+  std::string out = "'";
+  for (char c : text) {
+    out += c;
+    if (c == '\'') {
+      out += '\'';
+    }
+  }
+  return out + "'";
+}
+
+// One join per required tag, the way the site filters today
+static std::string tag_sql(const TagQuery &q) {
+  std::string sql = "SELECT DISTINCT cb.id FROM content_blocks cb";
+  for (size_t i = 0; i < q.all.size(); i++) {
+    std::string t = "t" + std::to_string(i);
+    sql += " JOIN content_tags " + t + " ON " + t + ".content_id = cb.id AND " +
+           t + ".tag_id = (SELECT id FROM tags WHERE name = " +
+           quoted(q.all[i]) + ")";
+  }
+  if (!q.any.empty()) {
+    sql += " JOIN content_tags ta ON ta.content_id = cb.id AND ta.tag_id IN "
+           "(SELECT id FROM tags WHERE name IN (";
+    for (size_t i = 0; i < q.any.size(); i++) {
+      sql += (i ? ", " : "") + quoted(q.any[i]);
+    }
+    sql += "))";
+  }
+  sql += " WHERE 1";
+  if (!q.status.empty()) {
+    sql += " AND cb.status = " + quoted(q.status);
+  }
+  if (!q.site.empty()) {
+    sql += " AND cb.site_id = (SELECT id FROM sites WHERE slug = " +
+           quoted(q.site) + ")";
+  }
+  for (const std::string &name : q.none) {
+    sql += " AND NOT EXISTS (SELECT 1 FROM content_tags tn "
+           "WHERE tn.content_id = cb.id AND tn.tag_id = "
+           "(SELECT id FROM tags WHERE name = " +
+           quoted(name) + "))";
+  }
+  return sql + " ORDER BY cb.id";
+}
+
+static bool run_sql(sqlite3 *db, const std::string &sql,
+                    std::vector<uint32_t> &ids) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "%s\n%s\n", sqlite3_errmsg(db), sql.c_str());
+    return false;
+  }
+  ids.clear();
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    ids.push_back((uint32_t)sqlite3_column_int64(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+  return true;
+}
+
+static double millis(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: tag_index_bench <content.db> [repeats]\n");
+    return 2;
+  }
+  int repeats = argc > 2 ? atoi(argv[2]) : 20;
+
+  TagIndex index;
+  std::string error;
+  if (!index.open(argv[1], error)) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+  TagIndexStats stats = index.stats();
+  sqlite3 *db;
+  open_db(argv[1], &db, SQLITE_OPEN_READONLY);
+  std::vector<std::string> tags = tag_names(db);
+  printf("index: %zu tags, %zu hashtags, %zu blocks, %.1f MB, built in "
+         "%.0f ms\n",
+         stats.tags, stats.hashtags, stats.blocks, stats.bytes / 1e6,
+         stats.build_ms);
+  if (tags.size() < 40) {
+    fprintf(stderr, "need at least 40 tags in content_tags\n");
+    return 1;
+  }
+  std::string site;
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db,
+                     "SELECT s.slug FROM content_blocks cb "
+                     "JOIN sites s ON s.id = cb.site_id "
+                     "GROUP BY cb.site_id ORDER BY count(*) DESC LIMIT 1",
+                     -1, &stmt, NULL);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    site = (const char *)sqlite3_column_text(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+
+  // Popular tags are the expensive case for the joins
+  std::vector<BenchQuery> queries(6);
+  queries[0].name = "2 popular AND";
+  queries[0].query.all = {tags[0], tags[1]};
+  queries[1].name = "3 popular AND, published";
+  queries[1].query.all = {tags[0], tags[1], tags[2]};
+  queries[1].query.status = "published";
+  queries[2].name = "popular AND rare";
+  queries[2].query.all = {tags[0], tags[tags.size() - 1]};
+  queries[3].name = "5 mid OR, published";
+  queries[3].query.any = {tags[10], tags[11], tags[12], tags[13], tags[14]};
+  queries[3].query.status = "published";
+  queries[4].name = "AND NOT, site";
+  queries[4].query.all = {tags[0]};
+  queries[4].query.none = {tags[1], tags[2]};
+  queries[4].query.site = site;
+  queries[5].name = "OR + AND + NOT, all filters";
+  queries[5].query.all = {tags[3]};
+  queries[5].query.any = {tags[0], tags[1], tags[20]};
+  queries[5].query.none = {tags[30]};
+  queries[5].query.status = "published";
+  queries[5].query.site = site;
+
+  std::vector<RoaringKernel> kernels = {RoaringKernel::Scalar};
+  if (detect_roaring_kernel() != RoaringKernel::Scalar) {
+    kernels.push_back(RoaringKernel::Sse42);
+  }
+  if (detect_roaring_kernel() == RoaringKernel::Avx2) {
+    kernels.push_back(RoaringKernel::Avx2);
+  }
+
+  bool ok = true;
+  printf("%-28s %8s %10s", "query", "rows", "sql ms");
+  for (RoaringKernel kernel : kernels) {
+    printf(" %9s", roaring_kernel_name(kernel));
+  }
+  printf("  (ms)\n");
+  for (BenchQuery &q : queries) {
+    q.sql = tag_sql(q.query);
+    std::vector<uint32_t> expected, got;
+    Clock::time_point start = Clock::now();
+    for (int r = 0; r < std::max(1, repeats / 10); r++) {
+      if (!run_sql(db, q.sql, expected)) {
+        return 1;
+      }
+    }
+    double sql_ms = millis(start) / std::max(1, repeats / 10);
+    printf("%-28s %8zu %10.2f", q.name, expected.size(), sql_ms);
+
+    for (RoaringKernel kernel : kernels) {
+      roaring_kernel() = kernel;
+      RoaringBitmap result;
+      start = Clock::now();
+      for (int r = 0; r < repeats; r++) {
+        if (!index.query(TagFamily::Content, q.query, result, error)) {
+          fprintf(stderr, "%s\n", error.c_str());
+          return 1;
+        }
+      }
+      printf(" %9.3f", millis(start) / repeats);
+      got.clear();
+      result.for_each([&](uint32_t id) {
+        got.push_back(id);
+        return true;
+      });
+      if (got != expected) {
+        fprintf(stderr, "\n%s: %s kernel returned %zu ids, SQL %zu\n", q.name,
+                roaring_kernel_name(kernel), got.size(), expected.size());
+        ok = false;
+      }
+    }
+    printf("\n");
+  }
+  sqlite3_close(db);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# Compare reaching the VM through the SSH tunnel against connecting to the
+# servers' own TLS listener. Start the tunnel first (connect/connect.sh or
+# connect/media-manager-connect.sh), and run the servers on the VM with
+# GRABBIEL_TLS_CERT, GRABBIEL_TLS_KEY and GRABBIEL_BIND_ADDRESS set.
+#
+#   VM_IP=203.0.113.7 ./tls_vs_tunnel.sh
+#   VM_IP=203.0.113.7 UPLOADS="1m 256m" ./tls_vs_tunnel.sh
+#
+# Local tunnel ports default to 8888 (db_admin) and 8889 (media_manager);
+# the TLS listeners are expected on the same ports on $VM_IP.
+#
+# Appends JSON lines labelled tunnel / tls / tls-resume to $RESULTS.
+
+set -e
+cd "$(dirname "$0")"
+
+if [ -z "$VM_IP" ]; then
+  echo "Set VM_IP to the address of the TLS listener" >&2
+  exit 1
+fi
+
+RESULTS=${RESULTS:-$(pwd)/results.jsonl}
+ADMIN_PORT=${ADMIN_PORT:-8888}
+MEDIA_PORT=${MEDIA_PORT:-8889}
+REQUESTS=${REQUESTS:-200}
+UPLOADS=${UPLOADS:-"1m 16m 64m"}
+
+./build_bench.sh >/dev/null
+
+run() {
+  ./loadgen --json --connections 1 "$@" | tee -a "$RESULTS"
+}
+
+# Connection setup: tunnel connects are local, TLS pays the network RTT
+run --label tunnel --scenario handshake --port "$ADMIN_PORT" --requests "$REQUESTS"
+run --label tls --scenario handshake --host "$VM_IP" --port "$ADMIN_PORT" --tls --requests "$REQUESTS"
+run --label tls-resume --scenario handshake --host "$VM_IP" --port "$ADMIN_PORT" --tls --resume --requests "$REQUESTS"
+
+# Small request latency
+run --label tunnel --scenario db-main --port "$ADMIN_PORT" --requests "$REQUESTS"
+run --label tls-resume --scenario db-main --host "$VM_IP" --port "$ADMIN_PORT" --tls --resume --requests "$REQUESTS"
+
+# Bulk throughput
+for size in $UPLOADS; do
+  run --label tunnel --scenario media-upload --size "$size" --port "$MEDIA_PORT" --requests 3
+  run --label tls-resume --scenario media-upload --size "$size" --host "$VM_IP" --port "$MEDIA_PORT" --tls --resume --requests 3
+done
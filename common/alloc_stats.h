@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+#include "arena.h"
+
+// Heap allocations per route.
+//
+// A binary that expands COUNT_HEAP_ALLOCATIONS() once at file scope
+// replaces the global operator new with one that counts per thread; the
+// servers take a snapshot around each request and add the difference to
+// the route's totals, next to what the request arena (common/arena.h)
+// handed out. /admin/allocations shows the table.
+//
+// On a coroutine loop many requests share the thread, so a snapshot would
+// also count whatever other tasks allocated meanwhile. There the request
+// installs its own counters with TaskHeapCounters instead; common/coro.h
+// carries them across suspensions, so they only see the request's task.
+// Allocations on pool threads are not attributed.
+
+struct HeapCounters {
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;
+};
+
+inline HeapCounters &thread_heap_counters() {
+  static thread_local HeapCounters counters;
+  return counters;
+}
+
+// Counters of the task running on this thread, if it installed any
+inline HeapCounters *&task_heap_counters() {
+  static thread_local HeapCounters *counters = nullptr;
+  return counters;
+}
+
+// Installs `counters` for the task that creates it, until it is destroyed
+class TaskHeapCounters {
+public:
+  explicit TaskHeapCounters(HeapCounters &counters) {
+    task_heap_counters() = &counters;
+  }
+  ~TaskHeapCounters() { task_heap_counters() = nullptr; }
+
+  TaskHeapCounters(const TaskHeapCounters &) = delete;
+  TaskHeapCounters &operator=(const TaskHeapCounters &) = delete;
+};
+
+// The array and nothrow forms default to these. delete stays out of line
+// so GCC does not pair the inlined free() with operator new and warn.
+#define COUNT_HEAP_ALLOCATIONS()                                               \
+  void *operator new(size_t size) {                                            \
+    HeapCounters &counters = thread_heap_counters();                           \
+    counters.allocations++;                                                    \
+    counters.bytes += size;                                                    \
+    if (HeapCounters *task = task_heap_counters()) {                           \
+      task->allocations++;                                                     \
+      task->bytes += size;                                                     \
+    }                                                                          \
+    if (void *p = malloc(size ? size : 1)) {                                   \
+      return p;                                                                \
+    }                                                                          \
+    throw std::bad_alloc();                                                    \
+  }                                                                            \
+  __attribute__((noinline)) void operator delete(void *p) noexcept {          \
+    free(p);                                                                   \
+  }                                                                            \
+  __attribute__((noinline)) void operator delete(void *p, size_t) noexcept {  \
+    free(p);                                                                   \
+  }
+
+struct RouteAllocations {
+  uint64_t requests = 0;
+  uint64_t heap_allocations = 0;
+  uint64_t heap_bytes = 0;
+  uint64_t arena_allocations = 0;
+  uint64_t arena_bytes = 0;
+};
+
+#define ALLOC_STATS_MAX_ROUTES 64
+
+class AllocationProfiler {
+public:
+  static AllocationProfiler &instance() {
+    static AllocationProfiler profiler;
+    return profiler;
+  }
+
+  // Paths beyond ALLOC_STATS_MAX_ROUTES distinct ones are pooled
+  void record(std::string_view route, const RouteAllocations &request) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = routes_.find(route);
+    if (it == routes_.end()) {
+      it = routes_.size() < ALLOC_STATS_MAX_ROUTES
+               ? routes_.emplace(std::string(route), RouteAllocations()).first
+               : routes_.emplace("(other)", RouteAllocations()).first;
+    }
+    RouteAllocations &total = it->second;
+    total.requests++;
+    total.heap_allocations += request.heap_allocations;
+    total.heap_bytes += request.heap_bytes;
+    total.arena_allocations += request.arena_allocations;
+    total.arena_bytes += request.arena_bytes;
+  }
+
+  // Per-request averages by route
+  std::string report() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ostringstream out;
+    out << "route requests heap_allocs/req heap_bytes/req arena_allocs/req "
+           "arena_bytes/req\n";
+    for (const auto &entry : routes_) {
+      const RouteAllocations &r = entry.second;
+      out << entry.first << " " << r.requests << " "
+          << r.heap_allocations / r.requests << " "
+          << r.heap_bytes / r.requests << " "
+          << r.arena_allocations / r.requests << " "
+          << r.arena_bytes / r.requests << "\n";
+    }
+    return out.str();
+  }
+
+private:
+  std::mutex mutex_;
+  std::map<std::string, RouteAllocations, std::less<>> routes_;
+};
+
+// Add one request's allocations to `route`; `heap` is what it allocated
+inline void record_task_allocations(std::string_view route,
+                                    const HeapCounters &heap,
+                                    const RequestArena &arena) {
+  RouteAllocations request;
+  request.heap_allocations = heap.allocations;
+  request.heap_bytes = heap.bytes;
+  request.arena_allocations = arena.allocations();
+  request.arena_bytes = arena.bytes();
+  AllocationProfiler::instance().record(route, request);
+}
+
+// Add one request's allocations, counted from `before`, to `route`
+inline void record_request_allocations(std::string_view route,
+                                       const HeapCounters &before,
+                                       const RequestArena &arena) {
+  const HeapCounters &now = thread_heap_counters();
+  HeapCounters heap;
+  heap.allocations = now.allocations - before.allocations;
+  heap.bytes = now.bytes - before.bytes;
+  record_task_allocations(route, heap, arena);
+}
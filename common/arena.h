@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+
+// Per-request bump allocator. Request handlers take a
+// std::pmr::memory_resource * and build their scratch containers
+// (std::pmr::vector, std::pmr::string, ...) on it; the server resets the
+// arena after the response has been sent, which frees everything at once.
+//
+// Allocation is a pointer bump inside one preallocated buffer; a request
+// that outgrows it continues in heap blocks from upstream, and the next
+// reset() grows the buffer so steady traffic stays off the heap.
+
+#define REQUEST_ARENA_SIZE (64 * 1024)
+#define REQUEST_ARENA_MAX_SIZE (16 * 1024 * 1024)
+
+class RequestArena : public std::pmr::memory_resource {
+public:
+  RequestArena() { allocate_buffer(REQUEST_ARENA_SIZE); }
+
+  RequestArena(const RequestArena &) = delete;
+  RequestArena &operator=(const RequestArena &) = delete;
+
+  // Since the last reset()
+  size_t allocations() const { return allocations_; }
+  size_t bytes() const { return bytes_; }
+  size_t capacity() const { return size_; }
+
+  void reset() {
+    size_t needed = bytes_;
+    monotonic_->release();
+    if (needed > size_ && size_ < REQUEST_ARENA_MAX_SIZE) {
+      size_t size = size_;
+      while (size < needed && size < REQUEST_ARENA_MAX_SIZE) {
+        size *= 2;
+      }
+      allocate_buffer(size);
+    }
+    allocations_ = bytes_ = 0;
+  }
+
+private:
+  void allocate_buffer(size_t size) {
+    monotonic_.reset();
+    buffer_.reset(new char[size]);
+    size_ = size;
+    monotonic_.reset(new std::pmr::monotonic_buffer_resource(
+        buffer_.get(), size, std::pmr::new_delete_resource()));
+  }
+
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    allocations_++;
+    bytes_ += bytes;
+    return monotonic_->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void *, size_t, size_t) override {}
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+
+  std::unique_ptr<char[]> buffer_;
+  size_t size_ = 0;
+  std::unique_ptr<std::pmr::monotonic_buffer_resource> monotonic_;
+  size_t allocations_ = 0;
+  size_t bytes_ = 0;
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <csignal>
+#include <functional>
+#include <memory>
+#include <sys/signalfd.h>
+
+#include "coro.h"
+#include "server.h"
+
+// run_server for coroutine handlers (common/coro.h). Every connection is a
+// task on one EventLoop, so a client that sends its request slowly, or
+// reads its response slowly, holds only its own task: reads wait for
+// readiness, the TLS handshake is stepped as the socket allows, and
+// response writes that would block are queued on the Connection and
+// flushed once the handler returns.
+//
+// SIGTERM and SIGINT arrive through a signalfd. Accepting stops at once;
+// connections in progress are finished (a stalled client gives up after
+// REQUEST_TIMEOUT_MS or SEND_TIMEOUT_MS) before run_async_server returns.
+
+#define ACCEPT_BATCH 64
+#define ACCEPT_RETRY_MS 100 // out of descriptors
+
+// Read one request; Error also when the client stays silent for
+// REQUEST_TIMEOUT_MS
+inline Task<HttpParser::Status> read_request(EventLoop &loop,
+                                             Connection &conn,
+                                             RequestReader &reader,
+                                             HttpRequest &request) {
+  while (true) {
+    HttpParser::Status status = reader.read(conn, request);
+    if (status != HttpParser::Incomplete) {
+      co_return status;
+    }
+    // poll and epoll share the bit values of IN and OUT
+    if (!co_await loop.ready(conn.fd(), conn.wants(), REQUEST_TIMEOUT_MS)) {
+      co_return HttpParser::Error;
+    }
+  }
+}
+
+// Send what the connection queued; false if the client failed or read
+// nothing for SEND_TIMEOUT_MS
+inline Task<bool> flush_output(EventLoop &loop, Connection &conn) {
+  while (true) {
+    int sent = conn.flush();
+    if (sent != 0) {
+      co_return sent > 0;
+    }
+    if (!co_await loop.ready(conn.fd(), conn.wants(), SEND_TIMEOUT_MS)) {
+      co_return false;
+    }
+  }
+}
+
+// Server side of the handshake on a non-blocking socket; nullptr on
+// failure
+inline Task<SSL *> tls_handshake(EventLoop &loop, TlsContext &tls, int fd) {
+  SSL *ssl = tls.create(fd);
+  while (ssl) {
+    int rc = SSL_accept(ssl);
+    if (rc == 1) {
+      break;
+    }
+    int err = SSL_get_error(ssl, rc);
+    uint32_t events = 0;
+    if (err == SSL_ERROR_WANT_READ) {
+      events = EPOLLIN;
+    } else if (err == SSL_ERROR_WANT_WRITE) {
+      events = EPOLLOUT;
+    }
+    bool ready = false;
+    if (events) {
+      ready = co_await loop.ready(fd, events, REQUEST_TIMEOUT_MS);
+    }
+    if (!ready) {
+      ERR_clear_error();
+      SSL_free(ssl);
+      ssl = nullptr;
+    }
+  }
+  co_return ssl;
+}
+
+struct AsyncServer {
+  EventLoop &loop;
+  TlsContext *tls;
+  const std::function<Task<void>(Connection &)> &handler;
+  size_t active = 0; // connections
+  bool stopping = false;
+};
+
+inline Task<void> serve_connection(AsyncServer &server, int fd) {
+  SSL *ssl = nullptr;
+  if (server.tls) {
+    ssl = co_await tls_handshake(server.loop, *server.tls, fd);
+  }
+  if (server.tls && !ssl) {
+    close(fd);
+  } else {
+    Connection conn(fd, ssl);
+    conn.set_queue_writes(true);
+    try {
+      co_await server.handler(conn);
+    } catch (const std::exception &e) {
+      fprintf(stderr, "Request failed: %s\n", e.what());
+    }
+    co_await flush_output(server.loop, conn);
+  }
+
+  if (--server.active == 0 && server.stopping) {
+    server.loop.stop();
+  }
+}
+
+inline Task<void> accept_connections(AsyncServer &server, int server_fd,
+                                     int signal_fd) {
+  // Readable while a connection or a stop signal is waiting
+  int watch = epoll_create1(EPOLL_CLOEXEC);
+  for (int fd : {server_fd, signal_fd}) {
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (watch < 0 || epoll_ctl(watch, EPOLL_CTL_ADD, fd, &event) != 0) {
+      perror("Cannot watch the listener");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (int accepted = 0;;) {
+    signalfd_siginfo signal;
+    if (read(signal_fd, &signal, sizeof(signal)) == sizeof(signal)) {
+      break;
+    }
+    // Let the connections already accepted run now and then
+    if (accepted == ACCEPT_BATCH) {
+      accepted = 0;
+      co_await server.loop.ready(watch, EPOLLIN);
+    }
+
+    struct sockaddr_in client;
+    socklen_t addrlen = sizeof(client);
+    int fd = accept4(server_fd, (struct sockaddr *)&client, &addrlen,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        accepted = 0;
+        co_await server.loop.ready(watch, EPOLLIN);
+      } else if (errno == EMFILE || errno == ENFILE) {
+        perror("Accept failed");
+        co_await server.loop.sleep(ACCEPT_RETRY_MS);
+      } else if (errno != EINTR && errno != ECONNABORTED) {
+        perror("Accept failed");
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+    accepted++;
+
+    // The TLS handshake and ticket flights are several small writes
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    server.active++;
+    spawn(serve_connection(server, fd));
+  }
+
+  // As in run_server: connections still queued go to the slot's next worker
+  close(watch);
+  close(server_fd);
+  server.stopping = true;
+  if (server.active == 0) {
+    server.loop.stop();
+  }
+}
+
+// Accept connections on `loop` until SIGTERM or SIGINT, running `handler`
+// as a task per connection; returns once the last one has finished
+inline int run_async_server(
+    const char *name, int port, EventLoop &loop,
+    const std::function<Task<void>(Connection &)> &handler) {
+  signal(SIGPIPE, SIG_IGN);
+  block_stop_signals();
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGTERM);
+  sigaddset(&stop, SIGINT);
+  int signal_fd = signalfd(-1, &stop, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd < 0) {
+    perror("signalfd failed");
+    exit(EXIT_FAILURE);
+  }
+
+  std::unique_ptr<TlsContext> tls = TlsContext::from_env();
+  int server_fd = start_listening(name, port, tls != nullptr);
+
+  AsyncServer server{loop, tls.get(), handler};
+  spawn(accept_connections(server, server_fd, signal_fd));
+  loop.run();
+
+  close(signal_fd);
+  return 0;
+}
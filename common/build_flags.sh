@@ -0,0 +1,8 @@
+# Compiler flags for the two servers, sourced by their build scripts, the
+# deploy workflows and bench/run_benchmarks.sh so every build of a server
+# matches the one that ships. Both start background threads (-pthread);
+# media_manager's request pipeline is C++20 coroutines.
+
+DB_ADMIN_FLAGS="-std=c++17 -pthread"
+MEDIA_MANAGER_FLAGS="-std=c++20 -pthread"
+SERVER_LIBS="-lsqlite3 -lssl -lcrypto"
@@ -0,0 +1,451 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sqlite3.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "alloc_stats.h"
+#include "db.h"
+
+// C++20 coroutine runtime: many connections on one thread.
+//
+// A Task<T> is a lazily started coroutine; co_await runs it and hands back
+// its value (or rethrows its exception). An EventLoop resumes coroutines
+// when a descriptor is ready (epoll, one-shot) or a timeout passes, and a
+// ThreadPool runs what would stall the loop -- disk writes, subprocesses,
+// sqlite3_step -- on its own threads and resumes the caller on the loop
+// afterwards. A pool given a database path opens one connection per
+// thread and passes it to jobs that take a sqlite3 *:
+//
+//   Task<void> handle(Connection &conn) {
+//     if (!co_await loop.ready(conn.fd(), EPOLLIN, 30000)) co_return;
+//     int n = co_await db_pool.run([&](sqlite3 *db) { return count(db); });
+//     std::string path = co_await io_pool.run([&] { return save(data); });
+//   }
+//
+// Everything but pool jobs runs on the loop thread, so coroutines share
+// state without locks; a job must only touch what its caller lends it.
+// A task's heap counters (common/alloc_stats.h) are put aside while it is
+// suspended and put back when it resumes.
+
+#define EVENT_LOOP_BATCH 256
+
+template <typename T = void> class Task;
+
+template <typename T> struct TaskPromiseBase {
+  std::coroutine_handle<> continuation = std::noop_coroutine();
+  std::exception_ptr exception;
+
+  // Resume whoever awaited the task (symmetric transfer, so long chains
+  // of finished tasks do not grow the stack)
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      return handle.promise().continuation;
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T> struct TaskPromise : TaskPromiseBase<T> {
+  std::optional<T> value;
+
+  template <typename U> void return_value(U &&result) {
+    value.emplace(std::forward<U>(result));
+  }
+  T result() {
+    if (this->exception) {
+      std::rethrow_exception(this->exception);
+    }
+    return std::move(*value);
+  }
+};
+
+template <> struct TaskPromise<void> : TaskPromiseBase<void> {
+  void return_void() {}
+  void result() {
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+  }
+};
+
+template <typename T> class Task {
+public:
+  struct promise_type : TaskPromise<T> {
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+  };
+
+  Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  ~Task() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<> caller) noexcept {
+    handle_.promise().continuation = caller;
+    return handle_;
+  }
+  T await_resume() { return handle_.promise().result(); }
+
+private:
+  explicit Task(std::coroutine_handle<promise_type> handle)
+      : handle_(handle) {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+// Frame of spawn(): starts at once and frees itself when done
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+// Run `task` on its own, e.g. one per accepted connection. It runs on the
+// current thread up to its first suspension; an exception is reported and
+// dropped.
+inline DetachedTask spawn(Task<void> task) {
+  try {
+    co_await std::move(task);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "Task failed: %s\n", e.what());
+  } catch (...) {
+    fprintf(stderr, "Task failed\n");
+  }
+}
+
+class EventLoop {
+public:
+  // Awaitable: resumes with true once `fd` is ready for `events`
+  // (EPOLLIN/EPOLLOUT; errors and hangups count as ready), false when
+  // `timeout_ms` (-1: none) passes first. fd -1 is a plain sleep.
+  class Wait {
+  public:
+    Wait(EventLoop &loop, int fd, uint32_t events, int timeout_ms)
+        : loop_(loop), fd_(fd), events_(events), timeout_ms_(timeout_ms) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+      handle_ = handle;
+      if (fd_ >= 0) {
+        epoll_event event;
+        event.events = events_ | EPOLLONESHOT;
+        event.data.ptr = this;
+        if (epoll_ctl(loop_.epoll_fd_, EPOLL_CTL_ADD, fd_, &event) != 0) {
+          ready_ = errno == EPERM; // regular files are always ready
+          return false;
+        }
+      }
+      if (timeout_ms_ >= 0) {
+        timer_ = loop_.timers_.emplace(
+            std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(timeout_ms_),
+            this);
+      }
+      heap_ = std::exchange(task_heap_counters(), nullptr);
+      return true;
+    }
+
+    bool await_resume() const noexcept {
+      if (heap_) {
+        task_heap_counters() = heap_;
+      }
+      return ready_;
+    }
+
+  private:
+    friend class EventLoop;
+
+    void finish(bool ready) {
+      ready_ = ready;
+      if (fd_ >= 0) {
+        epoll_ctl(loop_.epoll_fd_, EPOLL_CTL_DEL, fd_, nullptr);
+      }
+      if (timeout_ms_ >= 0) {
+        loop_.timers_.erase(timer_);
+      }
+      loop_.ready_.push_back(handle_);
+    }
+
+    EventLoop &loop_;
+    int fd_;
+    uint32_t events_;
+    int timeout_ms_;
+    bool ready_ = false;
+    std::coroutine_handle<> handle_;
+    HeapCounters *heap_ = nullptr;
+    std::multimap<std::chrono::steady_clock::time_point, Wait *>::iterator
+        timer_;
+  };
+
+  EventLoop()
+      : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+        wake_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_fd_ < 0 || wake_fd_ < 0 ||
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event) != 0) {
+      perror("Cannot create event loop");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  ~EventLoop() {
+    close(wake_fd_);
+    close(epoll_fd_);
+  }
+
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+
+  Wait ready(int fd, uint32_t events, int timeout_ms = -1) {
+    return Wait(*this, fd, events, timeout_ms);
+  }
+
+  Wait sleep(int timeout_ms) { return Wait(*this, -1, 0, timeout_ms); }
+
+  // Resume `handle` on the loop thread; safe from any thread
+  void post(std::coroutine_handle<> handle) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      posted_.push_back(handle);
+    }
+    uint64_t one = 1;
+    ssize_t written = write(wake_fd_, &one, sizeof(one));
+    (void)written; // a full counter still wakes the loop
+  }
+
+  // Resume coroutines until stop(). Readiness is collected for the whole
+  // batch before anything is resumed, so a coroutine that finishes cannot
+  // leave a dangling Wait behind in the batch.
+  void run() {
+    epoll_event events[EVENT_LOOP_BATCH];
+    while (!stopped_) {
+      int n = epoll_wait(epoll_fd_, events, EVENT_LOOP_BATCH, next_timeout());
+      if (n < 0 && errno != EINTR) {
+        perror("epoll_wait failed");
+        exit(EXIT_FAILURE);
+      }
+      for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr) {
+          ((Wait *)events[i].data.ptr)->finish(true);
+          continue;
+        }
+        uint64_t count;
+        ssize_t got = read(wake_fd_, &count, sizeof(count));
+        (void)got;
+        std::lock_guard<std::mutex> lock(mutex_);
+        ready_.insert(ready_.end(), posted_.begin(), posted_.end());
+        posted_.clear();
+      }
+      std::chrono::steady_clock::time_point now =
+          std::chrono::steady_clock::now();
+      while (!timers_.empty() && timers_.begin()->first <= now) {
+        timers_.begin()->second->finish(false);
+      }
+
+      std::vector<std::coroutine_handle<>> resume;
+      resume.swap(ready_);
+      for (std::coroutine_handle<> handle : resume) {
+        handle.resume();
+      }
+    }
+  }
+
+  // From the loop thread: run() returns after the current batch
+  void stop() { stopped_ = true; }
+
+private:
+  int next_timeout() const {
+    if (!ready_.empty()) {
+      return 0;
+    }
+    if (timers_.empty()) {
+      return -1;
+    }
+    auto wait = timers_.begin()->first - std::chrono::steady_clock::now();
+    // Round up, or the loop spins through the last millisecond
+    return (int)std::max<int64_t>(
+        0, std::chrono::ceil<std::chrono::milliseconds>(wait).count());
+  }
+
+  int epoll_fd_;
+  int wake_fd_;
+  bool stopped_ = false;
+  std::multimap<std::chrono::steady_clock::time_point, Wait *> timers_;
+  std::vector<std::coroutine_handle<>> ready_;
+
+  std::mutex mutex_; // guards posted_
+  std::vector<std::coroutine_handle<>> posted_;
+};
+
+// Result type of a pool job: fn(db) when fn takes the connection
+template <typename F, bool = std::is_invocable_v<F &, sqlite3 *>>
+struct PoolJobResult {
+  using type = std::invoke_result_t<F &, sqlite3 *>;
+};
+template <typename F> struct PoolJobResult<F, false> {
+  using type = std::invoke_result_t<F &>;
+};
+
+class ThreadPool {
+public:
+  // `threads` workers; with `db_path` each one owns a connection, opened
+  // on its first job and retried on the next if that failed (jobs then
+  // get nullptr)
+  ThreadPool(EventLoop &loop, size_t threads, const char *db_path = nullptr)
+      : loop_(loop), db_path_(db_path ? db_path : "") {
+    for (size_t i = 0; i < threads; i++) {
+      std::thread([this] { work(); }).detach();
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  struct Job {
+    virtual void execute(sqlite3 *db) = 0;
+
+  protected:
+    ~Job() = default;
+  };
+
+  // Awaitable running `fn` on a pool thread; lives in the awaiting frame
+  template <typename F> class Run : Job {
+  public:
+    using Result = typename PoolJobResult<F>::type;
+
+    Run(ThreadPool &pool, F fn) : pool_(pool), fn_(std::move(fn)) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+      handle_ = handle;
+      pool_.submit(this);
+      heap_ = std::exchange(task_heap_counters(), nullptr);
+    }
+    Result await_resume() {
+      task_heap_counters() = heap_;
+      if (exception_) {
+        std::rethrow_exception(exception_);
+      }
+      if constexpr (!std::is_void_v<Result>) {
+        return std::move(*result_);
+      }
+    }
+
+  private:
+    void execute(sqlite3 *db) override {
+      try {
+        if constexpr (std::is_void_v<Result>) {
+          call(db);
+        } else {
+          result_.emplace(call(db));
+        }
+      } catch (...) {
+        exception_ = std::current_exception();
+      }
+      // The frame may resume (and free this) as soon as it is posted
+      pool_.loop_.post(handle_);
+    }
+
+    Result call(sqlite3 *db) {
+      if constexpr (std::is_invocable_v<F &, sqlite3 *>) {
+        return fn_(db);
+      } else {
+        (void)db;
+        return fn_();
+      }
+    }
+
+    using Stored = std::conditional_t<std::is_void_v<Result>, bool, Result>;
+
+    ThreadPool &pool_;
+    F fn_;
+    std::coroutine_handle<> handle_;
+    HeapCounters *heap_ = nullptr;
+    std::optional<Stored> result_;
+    std::exception_ptr exception_;
+  };
+
+  template <typename F> Run<F> run(F fn) { return Run<F>(*this, std::move(fn)); }
+
+  // Jobs waiting for a thread
+  size_t queued() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return jobs_.size();
+  }
+
+private:
+  void submit(Job *job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(job);
+    }
+    cv_.notify_one();
+  }
+
+  void work() {
+    sqlite3 *db = nullptr;
+    while (true) {
+      Job *job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return !jobs_.empty(); });
+        job = jobs_.front();
+        jobs_.pop_front();
+      }
+      if (!db_path_.empty() && !db &&
+          open_db(db_path_.c_str(), &db) != SQLITE_OK) {
+        sqlite3_close(db);
+        db = nullptr;
+      }
+      job->execute(db);
+    }
+  }
+
+  EventLoop &loop_;
+  std::string db_path_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Job *> jobs_;
+};
@@ -0,0 +1,582 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <sched.h>
+#include <sqlite3.h>
+#include <string>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "db.h"
+
+// Write-coalescing counters for integer columns that change on every user
+// action (sochee.likes, sochee.comments). add() costs one append to a
+// journal file and a map update; a background thread folds the pending
+// deltas into one SQLite transaction every COUNTER_FLUSH_MS, or sooner once
+// COUNTER_FLUSH_DELTAS have piled up.
+//
+// Deltas go to one shard per CPU (sched_getcpu), each with its own lock,
+// map and journal file, so concurrent writers do not share a cache line.
+// Journals are numbered by flush segment: a flush swaps every shard to the
+// next segment, commits the old one's deltas together with its number in
+// counter_flushes (migration 010), and only then deletes its files. At
+// start, segments above the recorded number are replayed and the rest are
+// deleted, so a crash neither loses nor double-applies a delta. Journal
+// writes survive a process crash; a power loss can drop the last interval.
+//
+// read() returns the stored values plus every delta not yet committed, so
+// a writer sees its own increments immediately.
+//
+// A journal directory belongs to one process at a time (flock on its
+// .lock file). When it is taken, by another worker or by the next
+// generation during a reload, start() claims numbered subdirectories 1, 2,
+// ... instead, each with its own counter_flushes row ("sochee.1"); a crashed
+// owner's journals there are replayed by the next process to claim it.
+// stop() commits what is pending so a graceful exit leaves nothing behind.
+
+#define COUNTER_FLUSH_MS 250
+#define COUNTER_FLUSH_DELTAS 4096
+#define COUNTER_BUSY_TIMEOUT_MS 5000
+#define COUNTER_MAX_SHARDS 64
+#define COUNTER_MAX_CLAIMS 64
+
+struct CounterStats {
+  uint64_t recorded = 0;  // deltas accepted by add()
+  uint64_t flushes = 0;   // transactions committed
+  uint64_t rows = 0;      // counter updates written
+  uint64_t replayed = 0;  // deltas recovered from journals at start
+  uint64_t failures = 0;  // flushes that could not commit
+  uint64_t segment = 0;   // journal segment being written
+  double last_flush_ms = 0;
+  std::string last_error;
+};
+
+class CounterService {
+public:
+  // Counters in `columns` of `table`, whose rows are keyed by `id`
+  CounterService(std::string table, std::vector<std::string> columns)
+      : table_(std::move(table)), columns_(std::move(columns)) {
+    unsigned cpus = std::thread::hardware_concurrency();
+    shard_count_ = std::max(1u, std::min(cpus, (unsigned)COUNTER_MAX_SHARDS));
+    shards_.reset(new Shard[shard_count_]);
+  }
+
+  CounterService(const CounterService &) = delete;
+  CounterService &operator=(const CounterService &) = delete;
+
+  bool ready() const { return ready_.load(std::memory_order_acquire); }
+
+  // Replay journals left by a previous run, then start flushing
+  bool start(const std::string &db_path, const std::string &journal_dir,
+             std::string &error) {
+    db_path_ = db_path;
+    if (!claim(journal_dir, error)) {
+      return false;
+    }
+    if (open_db(db_path_.c_str(), &db_) != SQLITE_OK) {
+      error = "cannot open " + db_path_;
+      return false;
+    }
+    sqlite3_busy_timeout(db_, COUNTER_BUSY_TIMEOUT_MS);
+    if (!recover(error)) {
+      return false;
+    }
+    for (unsigned i = 0; i < shard_count_; i++) {
+      shards_[i].fd = open_journal(segment_, i);
+      if (shards_[i].fd < 0) {
+        error = "cannot open journal: " + std::string(strerror(errno));
+        return false;
+      }
+    }
+    ready_.store(true, std::memory_order_release);
+    std::thread([this] { run(); }).detach();
+    return true;
+  }
+
+  // Commit the pending deltas and stop flushing; add() fails from now on
+  void stop() {
+    if (!ready_.exchange(false)) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+    cv_.notify_all();
+    cv_.wait(lock, [this] { return stopped_; });
+  }
+
+  // Record `delta` for column `column` of row `id`; false if the journal
+  // write failed, in which case nothing was recorded
+  bool add(int64_t id, unsigned column, int32_t delta) {
+    if (!ready() || id < 0 || id > INT64_MAX >> 8 ||
+        column >= columns_.size() || delta == 0) {
+      return false;
+    }
+    int cpu = sched_getcpu();
+    Shard &shard = shards_[(cpu < 0 ? 0 : cpu) % shard_count_];
+    JournalRecord record = make_record(id, column, delta);
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      if (shard.fd < 0 ||
+          write(shard.fd, &record, sizeof(record)) != sizeof(record)) {
+        return false;
+      }
+      shard.deltas[key(id, column)] += delta;
+    }
+    recorded_.fetch_add(1, std::memory_order_relaxed);
+    if (pending_.fetch_add(1, std::memory_order_relaxed) + 1 ==
+        COUNTER_FLUSH_DELTAS) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      woken_ = true;
+      cv_.notify_all();
+    }
+    return true;
+  }
+
+  // Current value of every column for row `id` through `db`, including
+  // deltas not yet flushed; false if the row does not exist
+  bool read(sqlite3 *db, int64_t id, std::vector<int64_t> &values) {
+    std::string sql = "SELECT ";
+    for (size_t c = 0; c < columns_.size(); c++) {
+      sql += (c ? ", " : "") + columns_[c];
+    }
+    sql += " FROM " + table_ + " WHERE id = ?";
+    sqlite3_stmt *stmt = nullptr;
+
+    // Retry if a flush moved deltas or committed while we were looking
+    bool found = false;
+    for (int busy = 0; busy < COUNTER_BUSY_TIMEOUT_MS;) {
+      uint64_t before = sequence_.load(std::memory_order_acquire);
+      if (before & 1) {
+        std::this_thread::yield();
+        continue;
+      }
+      int rc = stmt ? SQLITE_OK
+                    : sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
+      if (rc == SQLITE_OK) {
+        values.assign(columns_.size(), 0);
+        pending(id, values);
+        sqlite3_reset(stmt);
+        sqlite3_bind_int64(stmt, 1, id);
+        rc = sqlite3_step(stmt);
+      }
+      if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+        // The flusher is committing (a fresh connection already needs the
+        // lock to load the schema); wait for it like a busy timeout
+        usleep(1000);
+        busy++;
+        continue;
+      }
+      if (!stmt) {
+        return false;
+      }
+      found = rc == SQLITE_ROW;
+      if (found) {
+        for (size_t c = 0; c < columns_.size(); c++) {
+          values[c] += sqlite3_column_int64(stmt, (int)c);
+        }
+      }
+      if (sequence_.load(std::memory_order_acquire) == before) {
+        break;
+      }
+    }
+    sqlite3_finalize(stmt);
+    return found;
+  }
+
+  // Flush now rather than at the next interval
+  void wake() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    woken_ = true;
+    cv_.notify_all();
+  }
+
+  CounterStats stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CounterStats s = stats_;
+    s.recorded = recorded_.load(std::memory_order_relaxed);
+    return s;
+  }
+
+  unsigned shards() const { return shard_count_; }
+
+  // The directory claimed by start()
+  const std::string &journal_dir() const { return journal_dir_; }
+
+private:
+  struct JournalRecord {
+    int64_t id;
+    uint32_t column;
+    int32_t delta;
+    uint64_t check; // detects a torn record at the end of a journal
+  };
+
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, int64_t> deltas; // key() -> sum
+    int fd = -1;
+  };
+
+  static uint64_t key(int64_t id, unsigned column) {
+    return (uint64_t)id << 8 | column;
+  }
+
+  static uint64_t record_check(const JournalRecord &r) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)r.id;
+    h = (h ^ ((uint64_t)r.column << 32 | (uint32_t)r.delta)) *
+        0xff51afd7ed558ccdULL;
+    return h ^ (h >> 33);
+  }
+
+  static JournalRecord make_record(int64_t id, unsigned column,
+                                   int32_t delta) {
+    JournalRecord r = {id, column, delta, 0};
+    r.check = record_check(r);
+    return r;
+  }
+
+  // Lock the first free directory of `base`, base/1, base/2, ...
+  bool claim(const std::string &base, std::string &error) {
+    for (int i = 0; i < COUNTER_MAX_CLAIMS; i++) {
+      std::string dir = i ? base + "/" + std::to_string(i) : base;
+      if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        error = "cannot create " + dir + ": " + strerror(errno);
+        return false;
+      }
+      int fd = ::open((dir + "/.lock").c_str(),
+                      O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (fd < 0) {
+        error = "cannot lock " + dir + ": " + strerror(errno);
+        return false;
+      }
+      if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        lock_fd_ = fd;
+        journal_dir_ = dir;
+        name_ = i ? table_ + "." + std::to_string(i) : table_;
+        return true;
+      }
+      close(fd);
+    }
+    error = "every journal directory under " + base + " is in use";
+    return false;
+  }
+
+  std::string journal_path(uint64_t segment, unsigned shard) const {
+    return journal_dir_ + "/" + table_ + "." + std::to_string(segment) + "." +
+           std::to_string(shard) + ".journal";
+  }
+
+  int open_journal(uint64_t segment, unsigned shard) const {
+    return ::open(journal_path(segment, shard).c_str(),
+                  O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  }
+
+  // Journal files of this table as (segment, path)
+  std::vector<std::pair<uint64_t, std::string>> journals() const {
+    std::vector<std::pair<uint64_t, std::string>> out;
+    DIR *dir = opendir(journal_dir_.c_str());
+    if (!dir) {
+      return out;
+    }
+    std::string prefix = table_ + ".";
+    while (struct dirent *entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name.compare(0, prefix.size(), prefix) != 0 ||
+          name.size() < 8 || name.substr(name.size() - 8) != ".journal") {
+        continue;
+      }
+      char *end;
+      uint64_t segment = strtoull(name.c_str() + prefix.size(), &end, 10);
+      if (*end == '.') {
+        out.emplace_back(segment, journal_dir_ + "/" + name);
+      }
+    }
+    closedir(dir);
+    return out;
+  }
+
+  void remove_journals(uint64_t through) {
+    for (const auto &journal : journals()) {
+      if (journal.first <= through) {
+        unlink(journal.second.c_str());
+      }
+    }
+  }
+
+  int64_t flushed_segment() {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db_,
+                           "SELECT segment FROM counter_flushes "
+                           "WHERE name = ?",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+      return -1;
+    }
+    sqlite3_bind_text(stmt, 1, name_.c_str(), -1, SQLITE_TRANSIENT);
+    int rc = sqlite3_step(stmt);
+    int64_t segment = rc == SQLITE_ROW    ? sqlite3_column_int64(stmt, 0)
+                      : rc == SQLITE_DONE ? 0
+                                          : -1;
+    sqlite3_finalize(stmt);
+    return segment;
+  }
+
+  bool recover(std::string &error) {
+    int64_t flushed = flushed_segment();
+    if (flushed < 0) {
+      error = "cannot read counter_flushes (migration 010): " +
+              std::string(sqlite3_errmsg(db_));
+      return false;
+    }
+    uint64_t last = (uint64_t)flushed;
+    for (const auto &journal : journals()) {
+      if (journal.first <= (uint64_t)flushed) {
+        unlink(journal.second.c_str());
+        continue;
+      }
+      last = std::max(last, journal.first);
+      int fd = ::open(journal.second.c_str(), O_RDONLY | O_CLOEXEC);
+      JournalRecord r;
+      while (fd >= 0 && read_full(fd, &r, sizeof(r)) &&
+             r.check == record_check(r)) {
+        if (r.column < columns_.size()) {
+          inflight_[key(r.id, r.column)] += r.delta;
+          stats_.replayed++;
+        }
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    segment_ = last;
+    if (!inflight_.empty() && !commit(segment_, error)) {
+      return false;
+    }
+    remove_journals(segment_);
+    segment_++;
+    stats_.segment = segment_;
+    return true;
+  }
+
+  static bool read_full(int fd, void *data, size_t length) {
+    char *p = (char *)data;
+    while (length) {
+      ssize_t n = ::read(fd, p, length);
+      if (n <= 0) {
+        return false;
+      }
+      p += n;
+      length -= n;
+    }
+    return true;
+  }
+
+  // Deltas for `id` not yet committed, added to `values`
+  void pending(int64_t id, std::vector<int64_t> &values) {
+    for (unsigned i = 0; i < shard_count_; i++) {
+      std::lock_guard<std::mutex> lock(shards_[i].mutex);
+      for (size_t c = 0; c < columns_.size(); c++) {
+        auto it = shards_[i].deltas.find(key(id, (unsigned)c));
+        if (it != shards_[i].deltas.end()) {
+          values[c] += it->second;
+        }
+      }
+    }
+    std::lock_guard<std::mutex> lock(inflight_mutex_);
+    for (size_t c = 0; c < columns_.size(); c++) {
+      auto it = inflight_.find(key(id, (unsigned)c));
+      if (it != inflight_.end()) {
+        values[c] += it->second;
+      }
+    }
+  }
+
+  // Write inflight_ and the segment number in one transaction, then clear
+  // inflight_; readers retry around the switch
+  bool commit(uint64_t segment, std::string &error) {
+    std::vector<sqlite3_stmt *> updates(columns_.size(), nullptr);
+    sqlite3_stmt *mark = nullptr;
+    bool ok = sqlite3_exec(db_, "BEGIN IMMEDIATE", NULL, NULL, NULL) ==
+              SQLITE_OK;
+    for (size_t c = 0; ok && c < columns_.size(); c++) {
+      std::string sql = "UPDATE " + table_ + " SET " + columns_[c] + " = " +
+                        columns_[c] + " + ? WHERE id = ?";
+      ok = sqlite3_prepare_v2(db_, sql.c_str(), -1, &updates[c], NULL) ==
+           SQLITE_OK;
+    }
+    ok = ok && sqlite3_prepare_v2(db_,
+                                  "INSERT OR REPLACE INTO counter_flushes "
+                                  "(name, segment, flushed_at) "
+                                  "VALUES (?, ?, CURRENT_TIMESTAMP)",
+                                  -1, &mark, NULL) == SQLITE_OK;
+    uint64_t rows = 0;
+    {
+      std::lock_guard<std::mutex> lock(inflight_mutex_);
+      for (const auto &entry : inflight_) {
+        if (!ok) {
+          break;
+        }
+        if (entry.second == 0) {
+          continue;
+        }
+        sqlite3_stmt *update = updates[entry.first & 0xff];
+        sqlite3_bind_int64(update, 1, entry.second);
+        sqlite3_bind_int64(update, 2, (int64_t)(entry.first >> 8));
+        ok = sqlite3_step(update) == SQLITE_DONE;
+        sqlite3_reset(update);
+        rows++;
+      }
+    }
+    if (ok) {
+      sqlite3_bind_text(mark, 1, name_.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_int64(mark, 2, (int64_t)segment);
+      ok = sqlite3_step(mark) == SQLITE_DONE;
+    }
+    for (sqlite3_stmt *stmt : updates) {
+      sqlite3_finalize(stmt);
+    }
+    sqlite3_finalize(mark);
+    if (!ok) {
+      error = sqlite3_errmsg(db_);
+      sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL);
+      return false;
+    }
+
+    sequence_.fetch_add(1, std::memory_order_acq_rel);
+    ok = sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL) == SQLITE_OK;
+    if (ok) {
+      std::lock_guard<std::mutex> lock(inflight_mutex_);
+      inflight_.clear();
+    }
+    sequence_.fetch_add(1, std::memory_order_acq_rel);
+    if (!ok) {
+      error = sqlite3_errmsg(db_);
+      sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL);
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.flushes++;
+    stats_.rows += rows;
+    return true;
+  }
+
+  void flush() {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    uint64_t old_segment = segment_;
+    uint64_t next_segment = segment_ + 1;
+
+    // Move every shard to the next segment together with its deltas
+    bool moved = false;
+    sequence_.fetch_add(1, std::memory_order_acq_rel);
+    for (unsigned i = 0; i < shard_count_; i++) {
+      Shard &shard = shards_[i];
+      std::unordered_map<uint64_t, int64_t> deltas;
+      {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        int fd = open_journal(next_segment, i);
+        if (shard.fd >= 0) {
+          close(shard.fd);
+        }
+        shard.fd = fd; // add() fails while the journal cannot be opened
+        deltas.swap(shard.deltas);
+      }
+      std::lock_guard<std::mutex> lock(inflight_mutex_);
+      for (const auto &entry : deltas) {
+        inflight_[entry.first] += entry.second;
+        moved = true;
+      }
+    }
+    pending_.store(0, std::memory_order_relaxed);
+    segment_ = next_segment;
+    sequence_.fetch_add(1, std::memory_order_acq_rel);
+
+    bool empty;
+    {
+      std::lock_guard<std::mutex> lock(inflight_mutex_);
+      empty = inflight_.empty();
+    }
+    std::string error;
+    if (!empty && !commit(old_segment, error)) {
+      // Kept in inflight_ and committed with the next segment
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats_.failures++;
+      stats_.last_error = error;
+      stats_.segment = segment_;
+      return;
+    }
+    remove_journals(old_segment);
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.segment = segment_;
+    if (moved) {
+      stats_.last_flush_ms = std::chrono::duration<double, std::milli>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+    }
+  }
+
+  void run() {
+    while (true) {
+      bool last;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait_for(lock, std::chrono::milliseconds(COUNTER_FLUSH_MS),
+                     [this] { return woken_ || stopping_; });
+        woken_ = false;
+        last = stopping_;
+      }
+      flush();
+      if (last) {
+        // Nothing can be added any more, so the new segment is empty
+        for (unsigned i = 0; i < shard_count_; i++) {
+          close(shards_[i].fd);
+          shards_[i].fd = -1;
+          unlink(journal_path(segment_, i).c_str());
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+        cv_.notify_all();
+        return;
+      }
+    }
+  }
+
+  std::string table_;
+  std::vector<std::string> columns_;
+  std::string db_path_;
+  std::string journal_dir_;
+  std::string name_; // counter_flushes row of journal_dir_
+  int lock_fd_ = -1; // holds the flock on journal_dir_
+  sqlite3 *db_ = nullptr; // the flusher's connection
+
+  unsigned shard_count_ = 1;
+  std::unique_ptr<Shard[]> shards_;
+  std::atomic<bool> ready_{false};
+  std::atomic<uint64_t> recorded_{0};
+  std::atomic<uint64_t> pending_{0};
+  // Odd while deltas move between shards, inflight_ and the database
+  std::atomic<uint64_t> sequence_{0};
+  uint64_t segment_ = 0; // flusher thread only, after start()
+
+  // Deltas taken from the shards but not yet committed
+  std::mutex inflight_mutex_;
+  std::unordered_map<uint64_t, int64_t> inflight_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool woken_ = false;
+  bool stopping_ = false;
+  bool stopped_ = false;
+  CounterStats stats_;
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdlib>
+#include <sqlite3.h>
+
+#include "sql_trace.h"
+
+// GRABBIEL_DB_PATH overrides the compiled-in database location so the
+// servers can be pointed at a scratch database (benchmarks, local testing)
+inline const char *resolve_db_path(const char *default_path) {
+  const char *path = getenv("GRABBIEL_DB_PATH");
+  return path && *path ? path : default_path;
+}
+
+// Open a connection the way every grabbiel binary should: same flags as
+// sqlite3_open() plus the shared tracing hooks.
+inline int open_db(const char *path, sqlite3 **db,
+                   int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE) {
+  int rc = sqlite3_open_v2(path, db, flags, NULL);
+  if (rc == SQLITE_OK) {
+    install_sql_trace(*db);
+  }
+  return rc;
+}
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ESCAPE_X86 1
+#endif
+
+// Escaping for HTML, attribute, JSON and CSV output.
+//
+// Almost every value rendered is clean, so the work is finding the next byte
+// that needs escaping: on x86 that is done 32 (AVX2) or 16 (SSE2) bytes at a
+// time and clean runs are copied with memcpy. The kernel is chosen once at
+// startup from CPUID; other architectures use the scalar loop.
+//
+//   Html  & < >          element content
+//   Attr  & < > " '      quoted attribute values
+//   Json  " \ and < 0x20 string contents (without the surrounding quotes)
+//   Csv   , " CR LF      a field is quoted, with "" for ", only if needed
+
+enum class EscapeMode { Html, Attr, Json, Csv };
+enum class EscapeKernel { Scalar, Sse2, Avx2 };
+
+inline EscapeKernel detect_escape_kernel() {
+#ifdef ESCAPE_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return EscapeKernel::Avx2;
+  }
+  return EscapeKernel::Sse2;
+#else
+  return EscapeKernel::Scalar;
+#endif
+}
+
+// The kernel in use; benchmarks overwrite it to compare
+inline EscapeKernel &escape_kernel() {
+  static EscapeKernel kernel = detect_escape_kernel();
+  return kernel;
+}
+
+inline const char *escape_kernel_name(EscapeKernel kernel) {
+  switch (kernel) {
+  case EscapeKernel::Avx2:
+    return "avx2";
+  case EscapeKernel::Sse2:
+    return "sse2";
+  default:
+    return "scalar";
+  }
+}
+
+template <EscapeMode M> inline bool needs_escape(char c) {
+  switch (M) {
+  case EscapeMode::Html:
+    return c == '&' || c == '<' || c == '>';
+  case EscapeMode::Attr:
+    return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'';
+  case EscapeMode::Json:
+    return c == '"' || c == '\\' || (unsigned char)c < 0x20;
+  case EscapeMode::Csv:
+    return c == ',' || c == '"' || c == '\r' || c == '\n';
+  }
+  return false;
+}
+
+template <EscapeMode M>
+inline size_t escape_find_scalar(const char *data, size_t i, size_t length) {
+  for (; i < length; i++) {
+    if (needs_escape<M>(data[i])) {
+      return i;
+    }
+  }
+  return length;
+}
+
+#ifdef ESCAPE_X86
+// 0xff in every lane holding a byte that needs escaping
+template <EscapeMode M> inline __m128i escape_mask_sse2(__m128i v) {
+  __m128i m;
+  switch (M) {
+  case EscapeMode::Html:
+  case EscapeMode::Attr:
+    m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+    if (M == EscapeMode::Attr) {
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+    }
+    return m;
+  case EscapeMode::Json:
+    // min(v, 0x1f) == v exactly for the control characters
+    m = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+  case EscapeMode::Csv:
+    m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(',')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+  }
+  return _mm_setzero_si128();
+}
+
+template <EscapeMode M>
+inline size_t escape_find_sse2(const char *data, size_t length) {
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+    int bits = _mm_movemask_epi8(escape_mask_sse2<M>(v));
+    if (bits) {
+      return i + __builtin_ctz(bits);
+    }
+  }
+  return escape_find_scalar<M>(data, i, length);
+}
+
+template <EscapeMode M>
+__attribute__((target("avx2"))) inline __m256i escape_mask_avx2(__m256i v) {
+  __m256i m;
+  switch (M) {
+  case EscapeMode::Html:
+  case EscapeMode::Attr:
+    m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+    if (M == EscapeMode::Attr) {
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+    }
+    return m;
+  case EscapeMode::Json:
+    m = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+  case EscapeMode::Csv:
+    m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+    return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+  }
+  return _mm256_setzero_si256();
+}
+
+template <EscapeMode M>
+__attribute__((target("avx2"))) inline size_t
+escape_find_avx2(const char *data, size_t length) {
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+    unsigned bits = (unsigned)_mm256_movemask_epi8(escape_mask_avx2<M>(v));
+    if (bits) {
+      return i + __builtin_ctz(bits);
+    }
+  }
+  return i + escape_find_sse2<M>(data + i, length - i);
+}
+#endif
+
+// Offset of the first byte in `data` that needs escaping, or `length`
+template <EscapeMode M>
+inline size_t escape_find(const char *data, size_t length) {
+#ifdef ESCAPE_X86
+  switch (escape_kernel()) {
+  case EscapeKernel::Avx2:
+    return escape_find_avx2<M>(data, length);
+  case EscapeKernel::Sse2:
+    return escape_find_sse2<M>(data, length);
+  default:
+    break;
+  }
+#endif
+  return escape_find_scalar<M>(data, 0, length);
+}
+
+template <EscapeMode M> inline size_t escape_char_length(char c) {
+  switch (M) {
+  case EscapeMode::Html:
+  case EscapeMode::Attr:
+    return c == '&' ? 5 : c == '<' || c == '>' ? 4 : c == '"' ? 6 : 5;
+  case EscapeMode::Json:
+    return c == '"' || c == '\\' || c == '\n' || c == '\r' || c == '\t' ||
+                   c == '\b' || c == '\f'
+               ? 2
+               : 6;
+  case EscapeMode::Csv:
+    return c == '"' ? 2 : 1;
+  }
+  return 1;
+}
+
+template <EscapeMode M> inline char *escape_char(char *dst, char c) {
+  static const char hex[] = "0123456789abcdef";
+  const char *text = nullptr;
+  switch (M) {
+  case EscapeMode::Html:
+  case EscapeMode::Attr:
+    text = c == '&'   ? "&amp;"
+           : c == '<' ? "&lt;"
+           : c == '>' ? "&gt;"
+           : c == '"' ? "&quot;"
+                      : "&#39;";
+    break;
+  case EscapeMode::Json:
+    switch (c) {
+    case '"':
+      text = "\\\"";
+      break;
+    case '\\':
+      text = "\\\\";
+      break;
+    case '\n':
+      text = "\\n";
+      break;
+    case '\r':
+      text = "\\r";
+      break;
+    case '\t':
+      text = "\\t";
+      break;
+    case '\b':
+      text = "\\b";
+      break;
+    case '\f':
+      text = "\\f";
+      break;
+    default:
+      memcpy(dst, "\\u00", 4);
+      dst[4] = hex[(unsigned char)c >> 4];
+      dst[5] = hex[c & 15];
+      return dst + 6;
+    }
+    break;
+  case EscapeMode::Csv:
+    if (c == '"') {
+      *dst++ = '"';
+    }
+    *dst++ = c;
+    return dst;
+  }
+  size_t length = escape_char_length<M>(c);
+  memcpy(dst, text, length);
+  return dst + length;
+}
+
+template <EscapeMode M> inline size_t escaped_length(std::string_view text) {
+  const char *data = text.data();
+  size_t length = text.size();
+  size_t i = escape_find<M>(data, length);
+  if (i == length) {
+    return length;
+  }
+  size_t total = M == EscapeMode::Csv ? length + 2 : length;
+  while (i < length) {
+    total += escape_char_length<M>(data[i]) - 1;
+    i++;
+    i += escape_find<M>(data + i, length - i);
+  }
+  return total;
+}
+
+// Write the escaped text to `dst`, which must have escaped_length() bytes;
+// returns the end
+template <EscapeMode M>
+inline char *escape_to(char *dst, std::string_view text) {
+  const char *data = text.data();
+  size_t length = text.size();
+  size_t i = escape_find<M>(data, length);
+  bool quote = M == EscapeMode::Csv && i < length;
+  if (quote) {
+    *dst++ = '"';
+  }
+  memcpy(dst, data, i);
+  dst += i;
+  while (i < length) {
+    dst = escape_char<M>(dst, data[i]);
+    i++;
+    size_t run = escape_find<M>(data + i, length - i);
+    memcpy(dst, data + i, run);
+    dst += run;
+    i += run;
+  }
+  if (quote) {
+    *dst++ = '"';
+  }
+  return dst;
+}
+
+inline size_t escaped_length(EscapeMode mode, std::string_view text) {
+  switch (mode) {
+  case EscapeMode::Html:
+    return escaped_length<EscapeMode::Html>(text);
+  case EscapeMode::Attr:
+    return escaped_length<EscapeMode::Attr>(text);
+  case EscapeMode::Json:
+    return escaped_length<EscapeMode::Json>(text);
+  case EscapeMode::Csv:
+    return escaped_length<EscapeMode::Csv>(text);
+  }
+  return text.size();
+}
+
+inline char *escape_to(EscapeMode mode, char *dst, std::string_view text) {
+  switch (mode) {
+  case EscapeMode::Html:
+    return escape_to<EscapeMode::Html>(dst, text);
+  case EscapeMode::Attr:
+    return escape_to<EscapeMode::Attr>(dst, text);
+  case EscapeMode::Json:
+    return escape_to<EscapeMode::Json>(dst, text);
+  case EscapeMode::Csv:
+    return escape_to<EscapeMode::Csv>(dst, text);
+  }
+  return dst;
+}
+
+inline void escape_append(std::string &out, EscapeMode mode,
+                          std::string_view text) {
+  size_t length = escaped_length(mode, text);
+  size_t offset = out.size();
+  if (length == text.size()) {
+    out.append(text.data(), text.size());
+    return;
+  }
+  out.resize(offset + length);
+  escape_to(mode, &out[offset], text);
+}
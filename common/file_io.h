@@ -0,0 +1,422 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <deque>
+#include <fcntl.h>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io_ring.h"
+
+// File I/O for the upload path.
+//
+// Writes and copies go through io_uring when the kernel allows it: a file
+// is written as several chunk writes in one submission, copies run through
+// registered (pinned) buffers with READ_FIXED/WRITE_FIXED, and fsync,
+// close and unlink are queued without waiting and submitted together by
+// submit(). Without io_uring (old kernel, seccomp) the same calls fall back
+// to plain syscalls, with the "async" operations done inline.
+
+#define FILE_IO_RING_ENTRIES 64
+#define FILE_IO_CHUNK (1 << 20)
+#define FILE_IO_BATCH 16
+#define FILE_IO_BUFFERS 4
+#define FILE_IO_BUFFER_SIZE (256 << 10)
+
+// Create a directory and any missing parents
+inline bool make_dirs(const std::string &path) {
+  for (size_t pos = path.find('/', 1);; pos = path.find('/', pos + 1)) {
+    std::string dir = path.substr(0, pos);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+    if (pos == std::string::npos) {
+      return true;
+    }
+  }
+}
+
+inline bool pwrite_all(int fd, const char *data, size_t length, off_t offset) {
+  while (length > 0) {
+    ssize_t n = pwrite(fd, data, length, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    length -= (size_t)n;
+    offset += n;
+  }
+  return true;
+}
+
+class FileIo {
+public:
+  // One instance per thread, since a ring is single-threaded
+  static FileIo &instance() {
+    static thread_local FileIo io;
+    return io;
+  }
+
+  FileIo(const FileIo &) = delete;
+  FileIo &operator=(const FileIo &) = delete;
+
+  ~FileIo() {
+    submit();
+    drain(true);
+    free(buffers_);
+  }
+
+  bool uses_io_uring() const { return ring_.ok(); }
+  bool uses_fixed_buffers() const { return fixed_buffers_; }
+  // Failed fsync/close/unlink operations queued since startup
+  size_t async_errors() const { return async_errors_; }
+
+  // Write all of `data` to `fd` starting at `offset`; waits for it
+  bool write_all(int fd, std::string_view data, off_t offset = 0) {
+    if (!ring_.supports(IORING_OP_WRITE)) {
+      return pwrite_all(fd, data.data(), data.size(), offset);
+    }
+
+    size_t done = 0;
+    while (done < data.size()) {
+      reserve(FILE_IO_BATCH);
+      Pending batch[FILE_IO_BATCH];
+      unsigned count = 0;
+      for (; count < FILE_IO_BATCH && done < data.size(); count++) {
+        size_t length = std::min<size_t>(FILE_IO_CHUNK, data.size() - done);
+        io_uring_sqe *sqe = next_sqe();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)(data.data() + done);
+        sqe->len = (unsigned)length;
+        sqe->off = offset + done;
+        sqe->user_data = count;
+        batch[count] = {(char *)data.data() + done, length,
+                        (off_t)(offset + done)};
+        done += length;
+      }
+      if (!finish(fd, batch, count, false)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Copy `length` bytes from `in_fd` at `in_offset` to `out_fd` at
+  // `out_offset`
+  bool copy(int in_fd, int out_fd, size_t length, off_t in_offset = 0,
+            off_t out_offset = 0) {
+    if (!buffers_) {
+      return false;
+    }
+    bool ring = ring_.supports(IORING_OP_READ) &&
+                ring_.supports(IORING_OP_WRITE);
+
+    for (size_t done = 0; done < length;) {
+      Pending batch[FILE_IO_BUFFERS];
+      unsigned count = 0;
+      for (; count < FILE_IO_BUFFERS && done < length; count++) {
+        size_t chunk = std::min<size_t>(FILE_IO_BUFFER_SIZE, length - done);
+        char *buffer = buffers_ + count * FILE_IO_BUFFER_SIZE;
+        batch[count] = {buffer, chunk, (off_t)(in_offset + done)};
+        done += chunk;
+      }
+
+      if (!ring) {
+        for (unsigned i = 0; i < count; i++) {
+          if (pread(in_fd, batch[i].data, batch[i].length, batch[i].offset) !=
+                  (ssize_t)batch[i].length ||
+              !pwrite_all(out_fd, batch[i].data, batch[i].length,
+                          batch[i].offset - in_offset + out_offset)) {
+            return false;
+          }
+        }
+        continue;
+      }
+
+      reserve(count);
+      for (unsigned i = 0; i < count; i++) {
+        prep_buffer_op(next_sqe(), fixed_buffers_ ? IORING_OP_READ_FIXED
+                                                  : IORING_OP_READ,
+                       in_fd, batch[i], i);
+      }
+      if (!finish(in_fd, batch, count, true)) {
+        return false;
+      }
+      for (unsigned i = 0; i < count; i++) {
+        batch[i].offset += out_offset - in_offset;
+      }
+      reserve(count);
+      for (unsigned i = 0; i < count; i++) {
+        prep_buffer_op(next_sqe(), fixed_buffers_ ? IORING_OP_WRITE_FIXED
+                                                  : IORING_OP_WRITE,
+                       out_fd, batch[i], i);
+      }
+      if (!finish(out_fd, batch, count, false)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // fsync then close, queued
+  void sync_and_close_async(int fd) {
+    if (!ring_.supports(IORING_OP_FSYNC) || !ring_.supports(IORING_OP_CLOSE)) {
+      count_error(fsync(fd));
+      count_error(::close(fd));
+      return;
+    }
+    // Both entries must go in the same submission to stay linked
+    reserve(2);
+    io_uring_sqe *sqe = next_sqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    // A hard link closes the file even if the fsync fails
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->user_data = ASYNC_TAG;
+    outstanding_++;
+    queue_close(fd);
+  }
+
+  void close_async(int fd) {
+    if (!ring_.supports(IORING_OP_CLOSE)) {
+      count_error(::close(fd));
+      return;
+    }
+    queue_close(fd);
+  }
+
+  void unlink_async(const std::string &path) {
+    if (!ring_.supports(IORING_OP_UNLINKAT)) {
+      count_error(unlink(path.c_str()));
+      return;
+    }
+    // The kernel reads the path at submission, so it has to live until
+    // then. next_sqe() may submit (and clear paths_) first.
+    io_uring_sqe *sqe = next_sqe();
+    paths_.push_back(path);
+    sqe->opcode = IORING_OP_UNLINKAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)paths_.back().c_str();
+    sqe->user_data = ASYNC_TAG;
+    outstanding_++;
+  }
+
+  // Send every queued operation to the kernel in one call
+  void submit() {
+    if (!ring_.ok()) {
+      return;
+    }
+    ring_.submit();
+    paths_.clear();
+    drain(false);
+  }
+
+private:
+  static constexpr uint64_t ASYNC_TAG = ~0ULL;
+
+  struct Pending {
+    char *data;
+    size_t length;
+    off_t offset;
+  };
+
+  FileIo() : ring_(FILE_IO_RING_ENTRIES) {
+    if (posix_memalign((void **)&buffers_, 4096,
+                       FILE_IO_BUFFERS * FILE_IO_BUFFER_SIZE) != 0) {
+      buffers_ = nullptr;
+      return;
+    }
+    iovec iov[FILE_IO_BUFFERS];
+    for (unsigned i = 0; i < FILE_IO_BUFFERS; i++) {
+      iov[i] = {buffers_ + i * FILE_IO_BUFFER_SIZE, FILE_IO_BUFFER_SIZE};
+    }
+    fixed_buffers_ = ring_.register_buffers(iov, FILE_IO_BUFFERS);
+  }
+
+  // Make room for `count` entries up front, so a batch is never split
+  // across submissions (and no submission happens while transfers are in
+  // flight, whose completions drain() must not see)
+  void reserve(unsigned count) {
+    if (ring_.space() < count) {
+      submit();
+    }
+  }
+
+  // A submission slot, flushing the queue to the kernel if it is full
+  io_uring_sqe *next_sqe() {
+    io_uring_sqe *sqe = ring_.get_sqe();
+    while (!sqe) {
+      submit();
+      sqe = ring_.get_sqe();
+    }
+    return sqe;
+  }
+
+  void prep_buffer_op(io_uring_sqe *sqe, unsigned char opcode, int fd,
+                      const Pending &p, unsigned index) {
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)p.data;
+    sqe->len = (unsigned)p.length;
+    sqe->off = p.offset;
+    sqe->buf_index = (uint16_t)index;
+    sqe->user_data = index;
+  }
+
+  void queue_close(int fd) {
+    io_uring_sqe *sqe = next_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = ASYNC_TAG;
+    outstanding_++;
+  }
+
+  // Submit, then wait for the `count` queued transfers of `batch` (tagged
+  // with their index). Short transfers are completed with plain syscalls.
+  bool finish(int fd, Pending *batch, unsigned count, bool reading) {
+    ring_.submit();
+    paths_.clear();
+
+    bool ok = true;
+    for (unsigned seen = 0; seen < count;) {
+      io_uring_cqe cqe;
+      if (!ring_.wait(cqe)) {
+        return false;
+      }
+      if (cqe.user_data == ASYNC_TAG) {
+        reap(cqe);
+        continue;
+      }
+      seen++;
+      const Pending &p = batch[cqe.user_data];
+      size_t got = cqe.res < 0 ? 0 : (size_t)cqe.res;
+      if (cqe.res < 0) {
+        errno = -cqe.res;
+        ok = false;
+      } else if (got < p.length) {
+        ok = ok && (reading
+                        ? pread(fd, p.data + got, p.length - got,
+                                p.offset + got) == (ssize_t)(p.length - got)
+                        : pwrite_all(fd, p.data + got, p.length - got,
+                                     p.offset + got));
+      }
+    }
+    return ok;
+  }
+
+  void reap(const io_uring_cqe &cqe) {
+    outstanding_--;
+    async_errors_ += cqe.res < 0;
+  }
+
+  // Reap finished async operations; `block` waits for all outstanding ones
+  void drain(bool block) {
+    io_uring_cqe cqe;
+    while (ring_.ok() && outstanding_ > 0) {
+      if (block ? !ring_.wait(cqe) : !ring_.peek(cqe)) {
+        return;
+      }
+      reap(cqe);
+    }
+  }
+
+  void count_error(int rc) { async_errors_ += rc != 0; }
+
+  IoRing ring_;
+  char *buffers_ = nullptr;
+  bool fixed_buffers_ = false;
+  std::deque<std::string> paths_; // stable addresses for queued unlinks
+  size_t outstanding_ = 0;
+  size_t async_errors_ = 0;
+};
+
+// Copy the file at `from` to `to` (created or truncated); the destination
+// is synced and closed in the background
+inline bool copy_file(const std::string &from, const std::string &to) {
+  int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return false;
+  }
+  struct stat st;
+  int out = -1;
+  if (fstat(in, &st) == 0) {
+    out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  }
+  FileIo &io = FileIo::instance();
+  bool ok = out >= 0 && io.copy(in, out, st.st_size);
+  io.close_async(in);
+  if (out >= 0) {
+    io.sync_and_close_async(out);
+  }
+  return ok;
+}
+
+// Directory where uploads wait for the storage backend. A file is written
+// unnamed (O_TMPFILE) and linked in under its name only once complete, so
+// a half-written upload never shows up in the directory. The directory is
+// created once, when the spool is constructed.
+class UploadSpool {
+public:
+  explicit UploadSpool(const std::string &dir)
+      : dir_(dir), ready_(make_dirs(dir)) {}
+
+  bool ready() const { return ready_; }
+
+  // Write `data` to dir/name; returns the path, or "" on failure
+  std::string store(const std::string &name, std::string_view data) {
+    FileIo &io = FileIo::instance();
+    std::string path = dir_ + "/" + name;
+
+    int fd = open(dir_.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    bool anonymous = fd >= 0;
+    if (!anonymous) {
+      // Filesystem without O_TMPFILE support
+      fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    }
+    if (fd < 0) {
+      return "";
+    }
+
+    bool ok = io.write_all(fd, data);
+    if (ok && anonymous) {
+      std::string proc = "/proc/self/fd/" + std::to_string(fd);
+      ok = linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, path.c_str(),
+                  AT_SYMLINK_FOLLOW) == 0;
+      if (!ok && errno == EEXIST) {
+        // Left over from an earlier upload of the same name
+        unlink(path.c_str());
+        ok = linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, path.c_str(),
+                    AT_SYMLINK_FOLLOW) == 0;
+      }
+    }
+    if (!ok && !anonymous) {
+      unlink(path.c_str());
+    }
+    // Submitted now: waiting for release() would hold the descriptor
+    // open for as long as storing the upload takes, or for good if it
+    // never comes
+    io.close_async(fd);
+    io.submit();
+    return ok ? path : "";
+  }
+
+  // Drop a spooled file once storage has it; queued with any pending
+  // fsyncs and submitted in one call
+  void release(const std::string &path) {
+    FileIo &io = FileIo::instance();
+    io.unlink_async(path);
+    io.submit();
+  }
+
+private:
+  std::string dir_;
+  bool ready_;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+#define LATENCY_BUCKETS 368
+
+// Log-linear latency histogram bucket (8 buckets per power of two, so any
+// recorded value is reported within 12.5%)
+inline int latency_bucket(uint64_t ns) {
+  if (ns < 8) {
+    return (int)ns;
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  int index = (msb - 2) * 8 + (int)((ns >> (msb - 3)) & 7);
+  return std::min(index, LATENCY_BUCKETS - 1);
+}
+
+// Largest value that falls into a bucket
+inline uint64_t latency_bucket_upper(int index) {
+  if (index < 8) {
+    return (uint64_t)index;
+  }
+  int msb = index / 8 + 2;
+  uint64_t lower = (uint64_t)(8 + index % 8) << (msb - 3);
+  return lower + ((uint64_t)1 << (msb - 3)) - 1;
+}
+
+struct LatencyHistogram {
+  uint64_t counts[LATENCY_BUCKETS] = {};
+  uint64_t count = 0;
+  uint64_t total_ns = 0;
+  uint64_t max_ns = 0;
+
+  void record(uint64_t ns) {
+    counts[latency_bucket(ns)]++;
+    count++;
+    total_ns += ns;
+    max_ns = std::max(max_ns, ns);
+  }
+
+  // Coordinated omission correction for a load generator that intended to
+  // issue a request every expected_interval_ns: a stall of N intervals hid
+  // N-1 requests that would have waited too, so record them as well.
+  void record_corrected(uint64_t ns, uint64_t expected_interval_ns) {
+    record(ns);
+    if (expected_interval_ns == 0) {
+      return;
+    }
+    for (uint64_t missing = ns > expected_interval_ns
+                                ? ns - expected_interval_ns
+                                : 0;
+         missing >= expected_interval_ns; missing -= expected_interval_ns) {
+      record(missing);
+    }
+  }
+
+  void merge(const LatencyHistogram &other) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      counts[i] += other.counts[i];
+    }
+    count += other.count;
+    total_ns += other.total_ns;
+    max_ns = std::max(max_ns, other.max_ns);
+  }
+
+  uint64_t percentile_ns(double p) const {
+    uint64_t target = (uint64_t)(p * count);
+    if (target >= count) {
+      target = count ? count - 1 : 0;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      seen += counts[i];
+      if (seen > target) {
+        return std::min(latency_bucket_upper(i), max_ns);
+      }
+    }
+    return max_ns;
+  }
+
+  double mean_ns() const { return count ? (double)total_ns / count : 0; }
+};
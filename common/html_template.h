@@ -0,0 +1,335 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "escape.h"
+
+// Compile-time HTML templates.
+//
+// A template is a string literal with holes: {{name}} (HTML-escaped),
+// {{name:attr}} (escaped for a quoted attribute), {{name:url}} (percent-
+// encoded query value) and {{name:raw}} (trusted text, or a callable that
+// renders into the output); escaping is in escape.h. HTML_TEMPLATE splits
+// the literal at compile time into constant fragments; a malformed template
+// fails to compile.
+//
+//   HTML_TEMPLATE(LINK, "<a href='/table?name={{name:url}}'>{{name}}</a>");
+//   render<LINK>(out, table_name);
+//
+// Arguments bind to distinct hole names in order of first appearance, so a
+// name used twice takes one argument. Numbers are formatted directly.
+//
+// HtmlOutput collects the response as iovecs: larger template fragments
+// (styles, scripts, page chrome) point at the literal in .rodata, while
+// dynamic values and short fragments are packed into an arena, so a page
+// goes out with writev without being concatenated.
+
+enum class HoleKind { Html, Attr, Url, Raw };
+
+#define HTML_OUTPUT_BLOCK_SIZE 16384
+#define HTML_OUTPUT_MIN_STATIC 256
+#define HTML_OUTPUT_POOL_BLOCKS 64
+
+class HtmlOutput {
+public:
+  HtmlOutput() = default;
+  ~HtmlOutput() {
+    std::vector<std::unique_ptr<char[]>> &pool = block_pool();
+    for (auto &block : blocks_) {
+      if (pool.size() < HTML_OUTPUT_POOL_BLOCKS) {
+        pool.push_back(std::move(block));
+      }
+    }
+  }
+  HtmlOutput(const HtmlOutput &) = delete;
+  HtmlOutput &operator=(const HtmlOutput &) = delete;
+
+  // Text that outlives the output (literals, template fragments). Short
+  // pieces are copied anyway: a separate iovec per "<td>" costs more in
+  // writev than the copy does.
+  void append_static(std::string_view text) {
+    if (text.size() < HTML_OUTPUT_MIN_STATIC) {
+      append_copy(text);
+    } else {
+      add_segment(text.data(), text.size());
+    }
+  }
+
+  void append_copy(std::string_view text) {
+    char *dst = reserve(text.size());
+    memcpy(dst, text.data(), text.size());
+    commit(dst, text.size());
+  }
+
+  void append(HoleKind kind, std::string_view text) {
+    switch (kind) {
+    case HoleKind::Html:
+      append_escaped(EscapeMode::Html, text);
+      break;
+    case HoleKind::Attr:
+      append_escaped(EscapeMode::Attr, text);
+      break;
+    case HoleKind::Url:
+      append_url(text);
+      break;
+    case HoleKind::Raw:
+      append_copy(text);
+      break;
+    }
+  }
+
+  void append_html(std::string_view text) {
+    append_escaped(EscapeMode::Html, text);
+  }
+
+  void append_escaped(EscapeMode mode, std::string_view text) {
+    size_t length = escaped_length(mode, text);
+    if (length == text.size()) {
+      append_copy(text);
+      return;
+    }
+    char *dst = reserve(length);
+    escape_to(mode, dst, text);
+    commit(dst, length);
+  }
+
+  // Percent-encode everything but unreserved characters
+  void append_url(std::string_view text) {
+    static const char hex[] = "0123456789ABCDEF";
+    char *dst = reserve(text.size() * 3);
+    char *p = dst;
+    for (char c : text) {
+      unsigned char u = (unsigned char)c;
+      if ((u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z') ||
+          (u >= '0' && u <= '9') || u == '-' || u == '_' || u == '.' ||
+          u == '~') {
+        *p++ = c;
+      } else {
+        *p++ = '%';
+        *p++ = hex[u >> 4];
+        *p++ = hex[u & 15];
+      }
+    }
+    commit(dst, p - dst);
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value>::type
+  append_number(T value) {
+    char *dst = reserve(24);
+    char *end = std::to_chars(dst, dst + 24, value).ptr;
+    commit(dst, end - dst);
+  }
+
+  // Same format as the default std::ostream << double
+  void append_number(double value) {
+    char *dst = reserve(32);
+    int n = snprintf(dst, 32, "%g", value);
+    commit(dst, n > 0 ? (size_t)n : 0);
+  }
+
+  // Drop what has been written, e.g. after a streamed chunk went out.
+  // Blocks go back to the pool for the next chunk.
+  void clear() {
+    std::vector<std::unique_ptr<char[]>> &pool = block_pool();
+    for (auto &block : blocks_) {
+      if (pool.size() < HTML_OUTPUT_POOL_BLOCKS) {
+        pool.push_back(std::move(block));
+      }
+    }
+    blocks_.clear();
+    large_blocks_.clear();
+    segments_.clear();
+    block_size_ = block_used_ = size_ = 0;
+  }
+
+  const std::vector<iovec> &segments() const { return segments_; }
+  size_t size() const { return size_; }
+
+  std::string str() const {
+    std::string out;
+    out.reserve(size_);
+    for (const iovec &v : segments_) {
+      out.append((const char *)v.iov_base, v.iov_len);
+    }
+    return out;
+  }
+
+private:
+  // Arena space for `length` bytes; blocks never move, so segments can
+  // point into them. Standard blocks come from a per-thread pool, so a
+  // steady stream of responses stops allocating once it has warmed up.
+  char *reserve(size_t length) {
+    if (block_used_ + length > block_size_) {
+      if (length > HTML_OUTPUT_BLOCK_SIZE) {
+        large_blocks_.emplace_back(new char[length]);
+        block_size_ = length;
+        block_used_ = 0;
+        return large_blocks_.back().get();
+      }
+      std::vector<std::unique_ptr<char[]>> &pool = block_pool();
+      if (pool.empty()) {
+        blocks_.emplace_back(new char[HTML_OUTPUT_BLOCK_SIZE]);
+      } else {
+        blocks_.push_back(std::move(pool.back()));
+        pool.pop_back();
+      }
+      block_size_ = HTML_OUTPUT_BLOCK_SIZE;
+      block_used_ = 0;
+    }
+    char *block = block_size_ > HTML_OUTPUT_BLOCK_SIZE
+                      ? large_blocks_.back().get()
+                      : blocks_.back().get();
+    return block + block_used_;
+  }
+
+  static std::vector<std::unique_ptr<char[]>> &block_pool() {
+    static thread_local std::vector<std::unique_ptr<char[]>> pool;
+    return pool;
+  }
+
+  void commit(char *data, size_t length) {
+    block_used_ += length;
+    add_segment(data, length);
+  }
+
+  void add_segment(const char *data, size_t length) {
+    if (length == 0) {
+      return;
+    }
+    size_ += length;
+    if (!segments_.empty()) {
+      iovec &last = segments_.back();
+      if ((const char *)last.iov_base + last.iov_len == data) {
+        last.iov_len += length;
+        return;
+      }
+    }
+    segments_.push_back({(void *)data, length});
+  }
+
+  std::vector<iovec> segments_;
+  std::vector<std::unique_ptr<char[]>> blocks_;       // pooled, standard size
+  std::vector<std::unique_ptr<char[]>> large_blocks_; // one oversized value
+  size_t block_size_ = 0;
+  size_t block_used_ = 0;
+  size_t size_ = 0;
+};
+
+template <size_t Holes> struct HtmlTemplate {
+  static constexpr size_t hole_count = Holes;
+  // text[i] precedes hole i; text[Holes] is the tail
+  std::string_view text[Holes + 1];
+  std::string_view names[Holes + 1];
+  HoleKind kinds[Holes + 1];
+  size_t arg_index[Holes + 1];
+  size_t arg_count;
+};
+
+constexpr size_t count_template_holes(std::string_view source) {
+  size_t count = 0;
+  for (size_t pos = source.find("{{"); pos != std::string_view::npos;
+       pos = source.find("{{", pos + 2)) {
+    count++;
+  }
+  return count;
+}
+
+template <size_t Holes>
+constexpr HtmlTemplate<Holes> compile_template(std::string_view source) {
+  HtmlTemplate<Holes> tpl{};
+  size_t pos = 0;
+  for (size_t i = 0; i < Holes; i++) {
+    size_t open = source.find("{{", pos);
+    size_t close = source.find("}}", open);
+    if (close == std::string_view::npos) {
+      throw "unterminated {{ in template";
+    }
+    tpl.text[i] = source.substr(pos, open - pos);
+
+    std::string_view hole = source.substr(open + 2, close - open - 2);
+    std::string_view name = hole.substr(0, hole.find(':'));
+    std::string_view kind = hole.size() > name.size()
+                                ? hole.substr(name.size() + 1)
+                                : std::string_view("html");
+    if (name.empty()) {
+      throw "empty hole name in template";
+    }
+    if (kind == "html") {
+      tpl.kinds[i] = HoleKind::Html;
+    } else if (kind == "attr") {
+      tpl.kinds[i] = HoleKind::Attr;
+    } else if (kind == "url") {
+      tpl.kinds[i] = HoleKind::Url;
+    } else if (kind == "raw") {
+      tpl.kinds[i] = HoleKind::Raw;
+    } else {
+      throw "unknown hole kind in template";
+    }
+
+    tpl.names[i] = name;
+    tpl.arg_index[i] = tpl.arg_count;
+    for (size_t j = 0; j < i; j++) {
+      if (tpl.names[j] == name) {
+        tpl.arg_index[i] = tpl.arg_index[j];
+        break;
+      }
+    }
+    if (tpl.arg_index[i] == tpl.arg_count) {
+      tpl.arg_count++;
+    }
+    pos = close + 2;
+  }
+  if (source.find("}}", pos) != std::string_view::npos) {
+    throw "stray }} in template";
+  }
+  tpl.text[Holes] = source.substr(pos);
+  return tpl;
+}
+
+#define HTML_TEMPLATE(name, source)                                            \
+  static constexpr std::string_view name##_SOURCE = source;                    \
+  static constexpr auto name =                                                 \
+      compile_template<count_template_holes(name##_SOURCE)>(name##_SOURCE)
+
+template <const auto &Tpl, size_t I, typename T>
+void render_hole(HtmlOutput &out, const T &value) {
+  constexpr HoleKind kind = Tpl.kinds[I];
+  out.append_static(Tpl.text[I]);
+  if constexpr (std::is_invocable<const T &, HtmlOutput &>::value) {
+    static_assert(kind == HoleKind::Raw, "only raw holes take a renderer");
+    value(out);
+  } else if constexpr (std::is_arithmetic<T>::value) {
+    out.append_number(value);
+  } else {
+    out.append(kind, std::string_view(value));
+  }
+}
+
+template <const auto &Tpl, typename Args, size_t... I>
+void render_holes(HtmlOutput &out, const Args &args,
+                  std::index_sequence<I...>) {
+  (render_hole<Tpl, I>(out, std::get<Tpl.arg_index[I]>(args)), ...);
+}
+
+// Render template `Tpl` with one argument per distinct hole name
+template <const auto &Tpl, typename... Args>
+void render(HtmlOutput &out, const Args &...args) {
+  constexpr size_t holes = std::decay_t<decltype(Tpl)>::hole_count;
+  static_assert(sizeof...(Args) == Tpl.arg_count,
+                "wrong number of template arguments");
+  render_holes<Tpl>(out, std::forward_as_tuple(args...),
+                    std::make_index_sequence<holes>());
+  out.append_static(Tpl.text[holes]);
+}
@@ -0,0 +1,508 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Incremental HTTP/1.1 request parser.
+//
+// Feed it the receive buffer each time more bytes arrive. It remembers how
+// far it has scanned, so a request that trickles in is not rescanned from
+// the start, and it reports Complete once the head and Content-Length bytes
+// of body are present. Everything in HttpRequest is a std::string_view into
+// that buffer: no copies and no heap allocation. The path and query
+// parameters are percent-decoded in place, which is why the buffer is
+// mutable and why views stay valid only while the buffer is untouched.
+//
+// Pipelining: consumed() is the size of the parsed request; whatever follows
+// it in the buffer is the start of the next one (call reset() first).
+//
+// Bodies are capped at HTTP_MAX_FORM_BODY_SIZE unless set_body_limit()
+// lets a route (e.g. an upload endpoint) take up to HTTP_MAX_BODY_SIZE.
+
+#define HTTP_MAX_HEAD_SIZE 65536
+#define HTTP_MAX_BODY_SIZE (4ULL << 30)
+#define HTTP_MAX_FORM_BODY_SIZE (1 << 20) // routes that take no uploads
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_PARAMS 32
+
+struct HttpHeader {
+  std::string_view name;
+  std::string_view value;
+};
+
+struct HttpParam {
+  std::string_view key;
+  std::string_view value;
+};
+
+inline bool iequals(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    char x = a[i], y = b[i];
+    if (x >= 'A' && x <= 'Z') {
+      x += 'a' - 'A';
+    }
+    if (y >= 'A' && y <= 'Z') {
+      y += 'a' - 'A';
+    }
+    if (x != y) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// Decode %XX (and '+' as space when `plus_is_space`) in place; returns the
+// decoded view, which never extends past the input. Malformed escapes are
+// kept literally.
+inline std::string_view percent_decode_in_place(char *data, size_t length,
+                                                bool plus_is_space) {
+  size_t out = 0;
+  for (size_t i = 0; i < length; i++) {
+    char c = data[i];
+    if (c == '%' && i + 2 < length) {
+      int hi = hex_value(data[i + 1]);
+      int lo = hex_value(data[i + 2]);
+      if (hi >= 0 && lo >= 0) {
+        data[out++] = (char)(hi * 16 + lo);
+        i += 2;
+        continue;
+      }
+    } else if (c == '+' && plus_is_space) {
+      c = ' ';
+    }
+    data[out++] = c;
+  }
+  return std::string_view(data, out);
+}
+
+// Split an application/x-www-form-urlencoded string into decoded key/value
+// pairs; returns the number stored (extra pairs are dropped)
+inline size_t parse_query_in_place(char *data, size_t length, HttpParam *out,
+                                   size_t max) {
+  size_t count = 0;
+  size_t start = 0;
+  while (start < length && count < max) {
+    size_t end = start;
+    while (end < length && data[end] != '&') {
+      end++;
+    }
+    size_t eq = start;
+    while (eq < end && data[eq] != '=') {
+      eq++;
+    }
+    if (end > start) {
+      HttpParam &param = out[count++];
+      param.key = percent_decode_in_place(data + start, eq - start, true);
+      param.value = eq < end ? percent_decode_in_place(data + eq + 1,
+                                                       end - eq - 1, true)
+                             : std::string_view();
+    }
+    start = end + 1;
+  }
+  return count;
+}
+
+// Decimal value of `text`, or `fallback` if it is empty or not a number
+inline size_t parse_unsigned(std::string_view text, size_t fallback) {
+  if (text.empty()) {
+    return fallback;
+  }
+  size_t value = 0;
+  for (char c : text) {
+    if (c < '0' || c > '9' || value > (SIZE_MAX - 9) / 10) {
+      return fallback;
+    }
+    value = value * 10 + (c - '0');
+  }
+  return value;
+}
+
+// Standard base64 (padding optional) into `out`; false if malformed
+inline bool base64_decode(std::string_view text, std::string &out) {
+  out.clear();
+  unsigned bits = 0;
+  int count = 0;
+  for (char c : text) {
+    int value;
+    if (c >= 'A' && c <= 'Z') {
+      value = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      value = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      value = c - '0' + 52;
+    } else if (c == '+') {
+      value = 62;
+    } else if (c == '/') {
+      value = 63;
+    } else if (c == '=') {
+      break;
+    } else {
+      return false;
+    }
+    bits = (bits << 6) | (unsigned)value;
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      out += (char)((bits >> count) & 0xff);
+    }
+  }
+  return true;
+}
+
+enum class ByteRange { Whole, Partial, Unsatisfiable };
+
+// Interpret a Range header against a body of `size` bytes. Only a single
+// "bytes=" range is honoured; anything else is answered with the whole body,
+// which RFC 9110 allows.
+inline ByteRange parse_byte_range(std::string_view header, uint64_t size,
+                                  uint64_t &start, uint64_t &length) {
+  start = 0;
+  length = size;
+  if (header.substr(0, 6) != "bytes=" ||
+      header.find(',') != std::string_view::npos) {
+    return ByteRange::Whole;
+  }
+  std::string_view spec = header.substr(6);
+  size_t dash = spec.find('-');
+  if (dash == std::string_view::npos) {
+    return ByteRange::Whole;
+  }
+  std::string_view first = spec.substr(0, dash);
+  std::string_view last = spec.substr(dash + 1);
+
+  if (first.empty()) {
+    // Suffix range: the last N bytes
+    uint64_t suffix = parse_unsigned(last, SIZE_MAX);
+    if (suffix == SIZE_MAX) {
+      return ByteRange::Whole;
+    }
+    if (suffix == 0 || size == 0) {
+      return ByteRange::Unsatisfiable;
+    }
+    length = suffix < size ? suffix : size;
+    start = size - length;
+    return ByteRange::Partial;
+  }
+
+  uint64_t from = parse_unsigned(first, SIZE_MAX);
+  uint64_t to = last.empty() ? from : parse_unsigned(last, SIZE_MAX);
+  if (from == SIZE_MAX || to == SIZE_MAX || to < from) {
+    return ByteRange::Whole;
+  }
+  if (from >= size) {
+    return ByteRange::Unsatisfiable;
+  }
+  if (last.empty()) {
+    to = size - 1;
+  }
+  start = from;
+  length = (to < size ? to : size - 1) - from + 1;
+  return ByteRange::Partial;
+}
+
+inline const char *http_reason(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 201:
+    return "Created";
+  case 204:
+    return "No Content";
+  case 206:
+    return "Partial Content";
+  case 303:
+    return "See Other";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 409:
+    return "Conflict";
+  case 413:
+    return "Payload Too Large";
+  case 415:
+    return "Unsupported Media Type";
+  case 416:
+    return "Range Not Satisfiable";
+  case 431:
+    return "Request Header Fields Too Large";
+  case 500:
+    return "Internal Server Error";
+  case 501:
+    return "Not Implemented";
+  case 507:
+    return "Insufficient Storage";
+  default:
+    return "Error";
+  }
+}
+
+struct HttpRequest {
+  std::string_view method;
+  std::string_view path; // decoded, without the query string
+  std::string_view version;
+  HttpHeader headers[HTTP_MAX_HEADERS];
+  size_t header_count = 0;
+  HttpParam params[HTTP_MAX_PARAMS];
+  size_t param_count = 0;
+  std::string_view body;
+  size_t content_length = 0;
+  bool keep_alive = true;
+
+  // Case-insensitive header lookup; empty view when absent
+  std::string_view header(std::string_view name) const {
+    for (size_t i = 0; i < header_count; i++) {
+      if (iequals(headers[i].name, name)) {
+        return headers[i].value;
+      }
+    }
+    return std::string_view();
+  }
+
+  bool has_param(std::string_view key) const {
+    for (size_t i = 0; i < param_count; i++) {
+      if (params[i].key == key) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // First value for `key`; empty view when absent
+  std::string_view param(std::string_view key) const {
+    for (size_t i = 0; i < param_count; i++) {
+      if (params[i].key == key) {
+        return params[i].value;
+      }
+    }
+    return std::string_view();
+  }
+};
+
+class HttpParser {
+public:
+  enum Status { Incomplete, Complete, Error };
+
+  // Largest body accepted for a request line's method and target (still
+  // percent-encoded, query included)
+  using BodyLimit = size_t (*)(std::string_view method,
+                               std::string_view target);
+
+  // Parse what has arrived so far. `data` must start at the request and may
+  // move between calls (e.g. a growing std::string) as long as the bytes
+  // already passed in are unchanged.
+  Status parse(char *data, size_t length, HttpRequest &request) {
+    if (head_size_ == 0) {
+      size_t end = find_head_end(data, length);
+      if (end == 0) {
+        if (length > HTTP_MAX_HEAD_SIZE) {
+          fail(431);
+          return Error;
+        }
+        return Incomplete;
+      }
+      head_size_ = end;
+      if (!scan_framing(data)) {
+        return Error;
+      }
+    }
+
+    if (length < head_size_ + content_length_) {
+      return Incomplete;
+    }
+    return parse_head(data, request) ? Complete : Error;
+  }
+
+  // Total bytes the request will occupy, once the head has been seen
+  size_t expected_size() const {
+    return head_size_ ? head_size_ + content_length_ : 0;
+  }
+  size_t consumed() const { return head_size_ + content_length_; }
+  size_t head_size() const { return head_size_; }
+  // HTTP status to answer with after Error
+  int error_status() const { return error_status_; }
+
+  // Kept across reset(); HTTP_MAX_FORM_BODY_SIZE for every route if unset
+  void set_body_limit(BodyLimit limit) { body_limit_ = limit; }
+
+  void reset() {
+    scanned_ = 0;
+    head_size_ = 0;
+    content_length_ = 0;
+    error_status_ = 0;
+  }
+
+private:
+  // Offset just past "\r\n\r\n", or 0 if it has not arrived yet
+  size_t find_head_end(const char *data, size_t length) {
+    size_t i = scanned_ >= 3 ? scanned_ - 3 : 0;
+    for (; i + 3 < length; i++) {
+      const char *p = (const char *)memchr(data + i, '\r', length - 3 - i);
+      if (!p) {
+        break;
+      }
+      i = p - data;
+      if (p[1] == '\n' && p[2] == '\r' && p[3] == '\n') {
+        return i + 4;
+      }
+    }
+    scanned_ = length;
+    return 0;
+  }
+
+  // First pass over the head: just the framing headers, so the caller can
+  // size its buffer before the body arrives
+  bool scan_framing(const char *data) {
+    std::string_view head(data, head_size_ - 2);
+    size_t pos = head.find("\r\n") + 2;
+    content_length_ = 0;
+    bool has_length = false;
+    size_t limit = body_limit(head.substr(0, head.find("\r\n")));
+
+    while (pos < head.size()) {
+      size_t eol = head.find("\r\n", pos);
+      std::string_view line = head.substr(pos, eol - pos);
+      pos = eol == std::string_view::npos ? head.size() : eol + 2;
+
+      size_t colon = line.find(':');
+      if (colon == std::string_view::npos) {
+        continue; // reported by parse_head
+      }
+      std::string_view name = line.substr(0, colon);
+      std::string_view value = trim(line.substr(colon + 1));
+      if (iequals(name, "Content-Length")) {
+        size_t length = parse_unsigned(value, SIZE_MAX);
+        // Lengths that disagree could frame the body differently behind a
+        // proxy (request smuggling)
+        if (length == SIZE_MAX || (has_length && length != content_length_)) {
+          return fail(400);
+        }
+        content_length_ = length;
+        has_length = true;
+        if (content_length_ > limit) {
+          return fail(413);
+        }
+      } else if (iequals(name, "Transfer-Encoding")) {
+        // Chunked bodies are not used by any client of these servers
+        return fail(501);
+      }
+    }
+    return true;
+  }
+
+  bool parse_head(char *data, HttpRequest &request) {
+    std::string_view head(data, head_size_ - 2);
+
+    size_t line_end = head.find("\r\n");
+    std::string_view request_line = head.substr(0, line_end);
+    size_t sp1 = request_line.find(' ');
+    size_t sp2 = request_line.rfind(' ');
+    if (sp1 == std::string_view::npos || sp2 == sp1) {
+      return fail(400);
+    }
+    request.method = request_line.substr(0, sp1);
+    request.version = request_line.substr(sp2 + 1);
+    if (request.version.substr(0, 5) != "HTTP/") {
+      return fail(400);
+    }
+
+    char *target = data + sp1 + 1;
+    size_t target_length = sp2 - sp1 - 1;
+    char *query = (char *)memchr(target, '?', target_length);
+    size_t path_length = query ? (size_t)(query - target) : target_length;
+    request.path = percent_decode_in_place(target, path_length, false);
+    request.param_count =
+        query ? parse_query_in_place(query + 1,
+                                     target_length - path_length - 1,
+                                     request.params, HTTP_MAX_PARAMS)
+              : 0;
+
+    request.header_count = 0;
+    size_t pos = line_end + 2;
+    while (pos < head.size()) {
+      size_t eol = head.find("\r\n", pos);
+      if (eol == std::string_view::npos) {
+        eol = head.size();
+      }
+      std::string_view line = head.substr(pos, eol - pos);
+      pos = eol + 2;
+
+      size_t colon = line.find(':');
+      if (colon == std::string_view::npos || colon == 0) {
+        return fail(400);
+      }
+      if (request.header_count == HTTP_MAX_HEADERS) {
+        return fail(431);
+      }
+      HttpHeader &header = request.headers[request.header_count++];
+      header.name = line.substr(0, colon);
+      header.value = trim(line.substr(colon + 1));
+    }
+
+    std::string_view connection = request.header("Connection");
+    request.keep_alive = request.version == "HTTP/1.1"
+                             ? !iequals(connection, "close")
+                             : iequals(connection, "keep-alive");
+    request.content_length = content_length_;
+    request.body = std::string_view(data + head_size_, content_length_);
+    return true;
+  }
+
+  static std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+      s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+      s.remove_suffix(1);
+    }
+    return s;
+  }
+
+  size_t body_limit(std::string_view request_line) const {
+    if (!body_limit_) {
+      return HTTP_MAX_FORM_BODY_SIZE;
+    }
+    size_t sp1 = request_line.find(' ');
+    size_t sp2 = request_line.rfind(' ');
+    if (sp1 == std::string_view::npos || sp2 == sp1) {
+      return HTTP_MAX_FORM_BODY_SIZE; // rejected by parse_head
+    }
+    return std::min<size_t>(
+        body_limit_(request_line.substr(0, sp1),
+                    request_line.substr(sp1 + 1, sp2 - sp1 - 1)),
+        HTTP_MAX_BODY_SIZE);
+  }
+
+  bool fail(int status) {
+    error_status_ = status;
+    return false;
+  }
+
+  BodyLimit body_limit_ = nullptr;
+  size_t scanned_ = 0;
+  size_t head_size_ = 0;
+  size_t content_length_ = 0;
+  int error_status_ = 0;
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Minimal io_uring over the raw syscalls, so there is no liburing to
+// install on the VM. One ring per thread; not thread-safe.
+//
+// ok() is false when the kernel or a seccomp policy refuses io_uring
+// (ENOSYS, EPERM); callers then use plain syscalls. supports() reports
+// whether a given opcode exists on the running kernel.
+
+class IoRing {
+public:
+  explicit IoRing(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd_ = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd_ < 0) {
+      return;
+    }
+
+    size_t sq_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    sq_ring_size_ = sq_size;
+    cq_ring_size_ = single_mmap ? 0 : cq_size;
+
+    sq_ring_ = map(sq_size, IORING_OFF_SQ_RING);
+    cq_ring_ = single_mmap ? sq_ring_ : map(cq_size, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe *)map(sqes_size_, IORING_OFF_SQES);
+    if (!sq_ring_ || !cq_ring_ || !sqes_) {
+      release();
+      return;
+    }
+
+    char *sq = (char *)sq_ring_;
+    sq_head_ = (unsigned *)(sq + params.sq_off.head);
+    sq_tail_ = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask_ = *(unsigned *)(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_array_ = (unsigned *)(sq + params.sq_off.array);
+    char *cq = (char *)cq_ring_;
+    cq_head_ = (unsigned *)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask_ = *(unsigned *)(cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe *)(cq + params.cq_off.cqes);
+    sqe_tail_ = *sq_tail_;
+
+    load_probe();
+  }
+
+  ~IoRing() { release(); }
+
+  IoRing(const IoRing &) = delete;
+  IoRing &operator=(const IoRing &) = delete;
+
+  bool ok() const { return fd_ >= 0; }
+
+  bool supports(unsigned op) const {
+    return ok() && op < sizeof(supported_) && supported_[op];
+  }
+
+  // Pin buffers for READ_FIXED/WRITE_FIXED; fails under a low
+  // RLIMIT_MEMLOCK, in which case plain READ/WRITE still work on them
+  bool register_buffers(const iovec *buffers, unsigned count) {
+    return ok() && syscall(__NR_io_uring_register, fd_,
+                           IORING_REGISTER_BUFFERS, buffers, count) == 0;
+  }
+
+  // Free submission entries
+  unsigned space() const {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    return sq_entries_ - (sqe_tail_ - head);
+  }
+
+  // Next free submission entry, zeroed; nullptr if the queue is full
+  io_uring_sqe *get_sqe() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sqe_tail_ - head >= sq_entries_) {
+      return nullptr;
+    }
+    unsigned index = sqe_tail_ & sq_mask_;
+    io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    sqe_tail_++;
+    return sqe;
+  }
+
+  // Hand queued entries to the kernel and optionally wait for `wait`
+  // completions; returns the number submitted or -errno
+  int submit(unsigned wait = 0) {
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+    unsigned pending = sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    while (true) {
+      int rc = (int)syscall(__NR_io_uring_enter, fd_, pending, wait,
+                            wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+      if (rc >= 0 || errno != EINTR) {
+        return rc < 0 ? -errno : rc;
+      }
+    }
+  }
+
+  // Pop one completion if there is one
+  bool peek(io_uring_cqe &cqe) {
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    cqe = cqes_[head & cq_mask_];
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Pop one completion, blocking until it arrives
+  bool wait(io_uring_cqe &cqe) {
+    while (!peek(cqe)) {
+      if (submit(1) < 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  void *map(size_t size, off_t offset) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, offset);
+    return p == MAP_FAILED ? nullptr : p;
+  }
+
+  void load_probe() {
+    alignas(io_uring_probe) char buffer[sizeof(io_uring_probe) +
+                                        sizeof(supported_) *
+                                            sizeof(io_uring_probe_op)];
+    memset(buffer, 0, sizeof(buffer));
+    io_uring_probe *probe = (io_uring_probe *)buffer;
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+                sizeof(supported_)) < 0) {
+      return;
+    }
+    for (unsigned op = 0; op < probe->ops_len && op < sizeof(supported_);
+         op++) {
+      supported_[op] = probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+    }
+  }
+
+  void release() {
+    if (sqes_) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+    sq_ring_ = cq_ring_ = nullptr;
+    sqes_ = nullptr;
+    if (fd_ >= 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  int fd_ = -1;
+  void *sq_ring_ = nullptr;
+  void *cq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned *sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sqe_tail_ = 0;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+
+  bool supported_[64] = {};
+};
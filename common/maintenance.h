@@ -0,0 +1,567 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "db.h"
+#include "tag_index.h"
+
+// Background database maintenance.
+//
+// A thread keeps one connection open and checks PRAGMA data_version every
+// tick; the database counts as idle once no other connection has committed
+// for MAINTENANCE_IDLE_SECONDS. In an idle period (at most once per
+// MAINTENANCE_INTERVAL_SECONDS) it runs, within MAINTENANCE_BUDGET_MS:
+//
+//   checkpoint  PASSIVE, or TRUNCATE once the WAL is large (WAL mode only)
+//   vacuum      incremental_vacuum while more than MAINTENANCE_FREE_RATIO
+//               of the file is free pages (needs auto_vacuum=INCREMENTAL,
+//               set by migration 012)
+//   optimize    PRAGMA optimize, or a bounded ANALYZE on SQLite versions
+//               whose optimize only looks at tables this connection used
+//   survey      pages, unused bytes and leaf order of every b-tree from
+//               dbstat, for the storage page; one b-tree at a time within
+//               its own MAINTENANCE_SURVEY_BUDGET_MS, carrying on where
+//               it stopped in the next run until every b-tree is done
+//
+// Every TAG_INDEX_PRUNE_INTERVAL_SECONDS, idle or not, it also trims the
+// tag index change log (common/tag_index.h), which grows with every write;
+// prunes that delete nothing are left out of the history.
+//
+// A task that runs out of budget is interrupted, rolls back and is retried
+// in the next idle period. A b-tree that alone outlasts a survey's budget
+// keeps the figures read so far and is shown as incomplete. Writers are
+// never waited on for long: the connection's busy timeout is short and a
+// busy task is simply skipped.
+//
+// With several db_admin processes (common/supervisor.h) only the one that
+// holds an flock on "<database>-maintenance" runs on schedule; run_now()
+// runs in whichever process is asked.
+
+#define MAINTENANCE_TICK_SECONDS 30
+#define MAINTENANCE_IDLE_SECONDS 120
+#define MAINTENANCE_INTERVAL_SECONDS 600
+#define MAINTENANCE_BUDGET_MS 2000
+#define MAINTENANCE_BUSY_TIMEOUT_MS 100
+#define MAINTENANCE_OPTIMIZE_SECONDS (6 * 60 * 60)
+#define MAINTENANCE_SURVEY_SECONDS (6 * 60 * 60)
+#define MAINTENANCE_SURVEY_BUDGET_MS 10000
+#define MAINTENANCE_ANALYSIS_LIMIT 1000 // rows sampled per index
+#define MAINTENANCE_FREE_RATIO 0.10
+#define MAINTENANCE_VACUUM_PAGES 512 // per incremental_vacuum step
+#define MAINTENANCE_WAL_TRUNCATE_BYTES (64LL << 20)
+#define MAINTENANCE_HISTORY 50
+#define MAINTENANCE_PROGRESS_OPS 1000
+
+enum class MaintenanceTask { Checkpoint, Vacuum, Optimize, Survey, Prune };
+
+inline const char *maintenance_task_name(MaintenanceTask task) {
+  switch (task) {
+  case MaintenanceTask::Checkpoint:
+    return "checkpoint";
+  case MaintenanceTask::Vacuum:
+    return "vacuum";
+  case MaintenanceTask::Optimize:
+    return "optimize";
+  case MaintenanceTask::Survey:
+    return "survey";
+  default:
+    return "prune";
+  }
+}
+
+struct MaintenanceRecord {
+  time_t at = 0;
+  MaintenanceTask task = MaintenanceTask::Checkpoint;
+  bool ok = true;
+  double ms = 0;
+  std::string detail;
+};
+
+// File-level numbers, from pragmas; cheap enough to read every tick
+struct StorageState {
+  time_t at = 0;
+  int64_t page_size = 0;
+  int64_t page_count = 0;
+  int64_t freelist_count = 0;
+  int auto_vacuum = 0; // 0 none, 1 full, 2 incremental
+  std::string journal_mode;
+  int64_t wal_bytes = 0;
+
+  double free_ratio() const {
+    return page_count ? (double)freelist_count / page_count : 0;
+  }
+};
+
+// One table or index as dbstat sees it
+struct BtreeUsage {
+  std::string name;
+  std::string type; // "table" or "index"
+  int64_t pages = 0;
+  int64_t leaf_pages = 0;
+  int64_t bytes = 0;
+  int64_t unused_bytes = 0;
+  int64_t out_of_order = 0; // leaf pages not right after the previous one
+  bool complete = true;      // false: out of budget partway through
+
+  // Share of leaf-to-leaf steps that seek; 0 for a perfectly packed tree
+  double fragmentation() const {
+    return leaf_pages > 1 ? (double)out_of_order / (leaf_pages - 1) : 0;
+  }
+};
+
+struct StorageSurvey {
+  time_t at = 0;  // when the last b-tree was done
+  double ms = 0;  // summed over the runs it took
+  std::vector<BtreeUsage> btrees; // by root page
+};
+
+struct MaintenanceStats {
+  StorageState storage;
+  StorageSurvey survey;     // the last complete one
+  size_t surveying = 0;     // b-trees done of a survey in progress
+  size_t surveying_of = 0;  // and how many it covers; 0 if none
+  std::deque<MaintenanceRecord> history; // newest first
+  uint64_t runs = 0;
+  time_t started = 0;
+  time_t idle_since = 0;
+  time_t last_run = 0;
+  time_t last_optimize = 0;
+  bool scheduled = false; // this process holds the schedule lock
+  std::string error;      // why the connection is not open
+};
+
+class MaintenanceScheduler {
+public:
+  void start(const std::string &path) {
+    path_ = path;
+    std::thread([this] { run(); }).detach();
+  }
+
+  // Run every task now, idle or not
+  void run_now() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    forced_ = true;
+    cv_.notify_one();
+  }
+
+  MaintenanceStats stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  void run() {
+    time_t now = time(nullptr);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats_.started = stats_.idle_since = now;
+      stats_.scheduled = lock_schedule();
+    }
+    sqlite3 *db = nullptr;
+    int64_t data_version = -1;
+    while (true) {
+      if (!db && !open(db)) {
+        db = nullptr;
+      }
+      bool forced;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (db && !forced_) {
+          cv_.wait_for(lock, std::chrono::seconds(MAINTENANCE_TICK_SECONDS),
+                       [this] { return forced_; });
+        }
+        forced = forced_;
+        forced_ = false;
+      }
+      if (!db) {
+        std::this_thread::sleep_for(
+            std::chrono::seconds(MAINTENANCE_TICK_SECONDS));
+        continue;
+      }
+
+      now = time(nullptr);
+      int64_t version = scalar(db, "PRAGMA data_version", -1);
+      StorageState storage = read_storage(db);
+      bool scheduled, due;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (version != data_version) {
+          stats_.idle_since = now; // someone committed since the last tick
+        }
+        stats_.storage = storage;
+        stats_.scheduled = scheduled = lock_schedule();
+        due = scheduled &&
+              now - stats_.idle_since >= MAINTENANCE_IDLE_SECONDS &&
+              now - stats_.last_run >= MAINTENANCE_INTERVAL_SECONDS;
+      }
+      data_version = version;
+      if (scheduled && now - last_prune_ >= TAG_INDEX_PRUNE_INTERVAL_SECONDS) {
+        last_prune_ = now;
+        prune(db);
+      }
+      if (forced || due) {
+        run_tasks(db, forced);
+      }
+    }
+  }
+
+  void prune(sqlite3 *db) {
+    MaintenanceRecord record;
+    record.at = time(nullptr);
+    record.task = MaintenanceTask::Prune;
+    Clock::time_point start = Clock::now();
+    int64_t deleted = prune_tag_index_changes(db);
+    record.ms =
+        std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    if (deleted == 0) {
+      return;
+    }
+    record.ok = deleted > 0;
+    record.detail = record.ok ? std::to_string(deleted) +
+                                    " tag index change log rows deleted"
+                              : failure(db, sqlite3_errcode(db));
+    add_history(std::move(record));
+  }
+
+  // Taken once and held until exit; retried every tick until then
+  bool lock_schedule() {
+    if (lock_fd_ >= 0) {
+      return true;
+    }
+    int fd = ::open((path_ + "-maintenance").c_str(),
+                    O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0) {
+      lock_fd_ = fd;
+      return true;
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+
+  bool open(sqlite3 *&db) {
+    std::string error;
+    if (open_db(path_.c_str(), &db, SQLITE_OPEN_READWRITE) != SQLITE_OK) {
+      error = db ? sqlite3_errmsg(db) : "cannot open database";
+      sqlite3_close(db);
+    } else {
+      sqlite3_busy_timeout(db, MAINTENANCE_BUSY_TIMEOUT_MS);
+      sqlite3_progress_handler(db, MAINTENANCE_PROGRESS_OPS, on_progress,
+                               this);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.error = error;
+    return error.empty();
+  }
+
+  // Nonzero interrupts the statement once the run is out of budget
+  static int on_progress(void *arg) {
+    MaintenanceScheduler *self = (MaintenanceScheduler *)arg;
+    return self->running_ && Clock::now() > self->deadline_;
+  }
+
+  bool over_budget() const { return Clock::now() > deadline_; }
+
+  void run_tasks(sqlite3 *db, bool forced) {
+    time_t now = time(nullptr);
+    time_t last_optimize, last_survey;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      last_optimize = stats_.last_optimize;
+      last_survey = stats_.survey.at;
+    }
+    deadline_ = Clock::now() + std::chrono::milliseconds(MAINTENANCE_BUDGET_MS);
+    running_ = true;
+
+    StorageState storage = read_storage(db);
+    if (storage.journal_mode == "wal") {
+      timed(MaintenanceTask::Checkpoint, [&](std::string &detail) {
+        return checkpoint(db, storage, detail);
+      });
+    }
+    bool vacuum_due = forced ? storage.freelist_count > 0
+                             : storage.free_ratio() > MAINTENANCE_FREE_RATIO;
+    if (vacuum_due && !over_budget()) {
+      timed(MaintenanceTask::Vacuum, [&](std::string &detail) {
+        return vacuum(db, storage, detail);
+      });
+    }
+    if ((forced || now - last_optimize >= MAINTENANCE_OPTIMIZE_SECONDS) &&
+        !over_budget()) {
+      bool ok = timed(MaintenanceTask::Optimize, [&](std::string &detail) {
+        return optimize(db, detail);
+      });
+      if (ok) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.last_optimize = now;
+      }
+    }
+    if (forced || !survey_queue_.empty() ||
+        now - last_survey >= MAINTENANCE_SURVEY_SECONDS) {
+      // Its own budget: on a large database it would never fit in what
+      // the other tasks left
+      deadline_ = Clock::now() +
+                  std::chrono::milliseconds(MAINTENANCE_SURVEY_BUDGET_MS);
+      timed(MaintenanceTask::Survey, [&](std::string &detail) {
+        return survey(db, detail);
+      });
+    }
+
+    running_ = false;
+    storage = read_storage(db);
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.storage = storage;
+    stats_.runs++;
+    stats_.last_run = now;
+  }
+
+  // Run `task` and add it to the history
+  template <typename F> bool timed(MaintenanceTask task, F body) {
+    MaintenanceRecord record;
+    record.at = time(nullptr);
+    record.task = task;
+    Clock::time_point start = Clock::now();
+    record.ok = body(record.detail);
+    record.ms =
+        std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    bool ok = record.ok;
+    add_history(std::move(record));
+    return ok;
+  }
+
+  void add_history(MaintenanceRecord record) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.history.push_front(std::move(record));
+    if (stats_.history.size() > MAINTENANCE_HISTORY) {
+      stats_.history.pop_back();
+    }
+  }
+
+  // What a failed statement means for the task
+  static std::string failure(sqlite3 *db, int rc) {
+    if (rc == SQLITE_INTERRUPT) {
+      return "out of budget, stopped";
+    }
+    if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+      return "database busy, skipped";
+    }
+    return sqlite3_errmsg(db);
+  }
+
+  bool checkpoint(sqlite3 *db, const StorageState &storage,
+                  std::string &detail) {
+    bool truncate = storage.wal_bytes >= MAINTENANCE_WAL_TRUNCATE_BYTES;
+    int log = 0, done = 0;
+    int rc = sqlite3_wal_checkpoint_v2(
+        db, NULL,
+        truncate ? SQLITE_CHECKPOINT_TRUNCATE : SQLITE_CHECKPOINT_PASSIVE,
+        &log, &done);
+    if (rc != SQLITE_OK) {
+      detail = failure(db, rc);
+      return false;
+    }
+    detail = std::string(truncate ? "truncate" : "passive") + ": " +
+             std::to_string(done) + " of " + std::to_string(log) +
+             " WAL frames copied";
+    return true;
+  }
+
+  bool vacuum(sqlite3 *db, const StorageState &storage, std::string &detail) {
+    if (storage.auto_vacuum != 2) {
+      detail = "auto_vacuum is not INCREMENTAL (migration 012); " +
+               std::to_string(storage.freelist_count) + " free pages kept";
+      return false;
+    }
+    int64_t before = storage.freelist_count;
+    int64_t free_pages = before;
+    int rc = SQLITE_OK;
+    std::string sql = "PRAGMA incremental_vacuum(" +
+                      std::to_string(MAINTENANCE_VACUUM_PAGES) + ")";
+    while (free_pages > 0 && !over_budget()) {
+      rc = sqlite3_exec(db, sql.c_str(), NULL, NULL, NULL);
+      int64_t left = scalar(db, "PRAGMA freelist_count", 0);
+      if (rc != SQLITE_OK || left == free_pages) {
+        break;
+      }
+      free_pages = left;
+    }
+    detail = std::to_string(before - free_pages) + " of " +
+             std::to_string(before) + " free pages released";
+    if (rc != SQLITE_OK) {
+      detail += "; " + failure(db, rc);
+    }
+    return rc == SQLITE_OK;
+  }
+
+  // PRAGMA optimize only considers every table (0x10000) from 3.46 on;
+  // before that a fresh connection has used none, so sample with ANALYZE
+  bool optimize(sqlite3 *db, std::string &detail) {
+    std::string limit = "PRAGMA analysis_limit = " +
+                        std::to_string(MAINTENANCE_ANALYSIS_LIMIT);
+    sqlite3_exec(db, limit.c_str(), NULL, NULL, NULL);
+    bool has_mask = sqlite3_libversion_number() >= 3046000;
+    const char *sql = has_mask ? "PRAGMA optimize = 0x10002" : "ANALYZE";
+    int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+      detail = failure(db, rc);
+      return false;
+    }
+    detail = sql;
+    return true;
+  }
+
+  // Survey b-trees from survey_queue_ until it is empty (the survey is
+  // published) or the budget runs out (the next run carries on)
+  bool survey(sqlite3 *db, std::string &detail) {
+    sqlite3_stmt *stmt;
+    if (survey_queue_.empty()) {
+      surveyed_ = StorageSurvey();
+      // sqlite_schema is the one table not listed in itself
+      survey_queue_.push_back({"sqlite_schema", "table"});
+      if (sqlite3_prepare_v2(db,
+                             "SELECT name, type FROM sqlite_master "
+                             "WHERE rootpage > 0 ORDER BY rootpage",
+                             -1, &stmt, NULL) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+          survey_queue_.push_back({text(stmt, 0), text(stmt, 1)});
+        }
+      }
+      sqlite3_finalize(stmt);
+    }
+
+    // Rows come in traversal order
+    if (sqlite3_prepare_v2(db,
+                           "SELECT pageno, pagetype, pgsize, unused "
+                           "FROM dbstat WHERE name = ?",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+      detail = sqlite3_errmsg(db); // SQLite built without dbstat
+      survey_queue_.clear();
+      return false;
+    }
+    Clock::time_point start = Clock::now();
+    size_t done = 0;
+    int64_t pages = 0;
+    int rc = SQLITE_DONE;
+    while (!survey_queue_.empty() && !over_budget()) {
+      BtreeUsage btree;
+      btree.name = survey_queue_.front().first;
+      btree.type = survey_queue_.front().second;
+      sqlite3_bind_text(stmt, 1, btree.name.c_str(), -1, SQLITE_STATIC);
+      int64_t last_leaf = -1;
+      while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int64_t pageno = sqlite3_column_int64(stmt, 0);
+        btree.pages++;
+        btree.bytes += sqlite3_column_int64(stmt, 2);
+        btree.unused_bytes += sqlite3_column_int64(stmt, 3);
+        if (text(stmt, 1) == "leaf") {
+          btree.leaf_pages++;
+          btree.out_of_order += last_leaf >= 0 && pageno != last_leaf + 1;
+          last_leaf = pageno;
+        }
+      }
+      sqlite3_reset(stmt);
+      // Retried next run, unless it had this run's whole budget
+      if (rc == SQLITE_INTERRUPT && done > 0) {
+        break;
+      }
+      if (rc != SQLITE_DONE && rc != SQLITE_INTERRUPT) {
+        break;
+      }
+      btree.complete = rc == SQLITE_DONE;
+      pages += btree.pages;
+      surveyed_.btrees.push_back(std::move(btree));
+      survey_queue_.pop_front();
+      done++;
+    }
+    sqlite3_finalize(stmt);
+    surveyed_.ms +=
+        std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    if (rc != SQLITE_DONE && rc != SQLITE_INTERRUPT) {
+      detail = failure(db, rc);
+      return false;
+    }
+
+    size_t total = surveyed_.btrees.size() + survey_queue_.size();
+    detail = std::to_string(pages) + " pages in " + std::to_string(done) +
+             " b-trees; " + std::to_string(surveyed_.btrees.size()) + " of " +
+             std::to_string(total) + " done";
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!survey_queue_.empty()) {
+      stats_.surveying = surveyed_.btrees.size();
+      stats_.surveying_of = total;
+      return true;
+    }
+    surveyed_.at = time(nullptr);
+    stats_.survey = std::move(surveyed_);
+    stats_.surveying = stats_.surveying_of = 0;
+    return true;
+  }
+
+  StorageState read_storage(sqlite3 *db) {
+    StorageState storage;
+    storage.at = time(nullptr);
+    storage.page_size = scalar(db, "PRAGMA page_size", 0);
+    storage.page_count = scalar(db, "PRAGMA page_count", 0);
+    storage.freelist_count = scalar(db, "PRAGMA freelist_count", 0);
+    storage.auto_vacuum = (int)scalar(db, "PRAGMA auto_vacuum", 0);
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "PRAGMA journal_mode", -1, &stmt, NULL) ==
+            SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+      storage.journal_mode = text(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    struct stat st;
+    if (stat((path_ + "-wal").c_str(), &st) == 0) {
+      storage.wal_bytes = st.st_size;
+    }
+    return storage;
+  }
+
+  static std::string text(sqlite3_stmt *stmt, int column) {
+    const char *value = (const char *)sqlite3_column_text(stmt, column);
+    return value ? value : "";
+  }
+
+  static int64_t scalar(sqlite3 *db, const char *sql, int64_t fallback) {
+    sqlite3_stmt *stmt;
+    int64_t value = fallback;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+      value = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+  }
+
+  std::string path_;
+  int lock_fd_ = -1; // schedule lock, maintenance thread only
+  // A survey in progress (maintenance thread only): b-trees still to do,
+  // as (name, type), and the ones done
+  std::deque<std::pair<std::string, std::string>> survey_queue_;
+  StorageSurvey surveyed_;
+  time_t last_prune_ = 0;
+  Clock::time_point deadline_;
+  bool running_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool forced_ = false;
+  MaintenanceStats stats_;
+};
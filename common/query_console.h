@@ -0,0 +1,337 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <poll.h>
+#include <sqlite3.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "db.h"
+
+// Ad-hoc read-only SQL for db_admin's /query console.
+//
+// Statements run on a dedicated read-only connection (ATTACH disabled,
+// PRAGMA query_only on), one statement per request. sqlite3_stmt_readonly
+// also passes BEGIN, SAVEPOINT and pragma assignments, so the authorizer
+// rejects those, and a transaction somehow left open is rolled back after
+// each run rather than pinning a read snapshot. A progress handler
+// enforces a wall-clock budget and a VM-step budget; a watchdog thread
+// watches the client's socket while a query runs and stops it with
+// sqlite3_interrupt when the client goes away, which is how the console's
+// Cancel button (aborting the streaming fetch) reaches the query. The
+// accept loop is single-threaded, so a separate cancel request could only
+// arrive after the query it is meant to stop.
+//
+//   QueryConsole console;
+//   console.open(path, error);
+//   sqlite3_stmt *stmt = console.prepare(sql, error);
+//   QueryResult result = console.run(stmt, budget, client_fd, on_row);
+
+#define QUERY_TIME_BUDGET_MS 5000
+#define QUERY_MAX_TIME_BUDGET_MS 60000
+#define QUERY_STEP_BUDGET 100000000LL
+#define QUERY_MAX_STEP_BUDGET 2000000000LL
+#define QUERY_ROW_LIMIT 100000
+#define QUERY_PROGRESS_OPS 1000 // VM instructions between budget checks
+#define QUERY_WATCH_MS 50
+
+enum class QueryOutcome {
+  Done,
+  Timeout,
+  StepBudget,
+  RowLimit,
+  Cancelled,
+  Error
+};
+
+inline const char *query_outcome_name(QueryOutcome outcome) {
+  switch (outcome) {
+  case QueryOutcome::Done:
+    return "done";
+  case QueryOutcome::Timeout:
+    return "timeout";
+  case QueryOutcome::StepBudget:
+    return "step budget";
+  case QueryOutcome::RowLimit:
+    return "row limit";
+  case QueryOutcome::Cancelled:
+    return "cancelled";
+  default:
+    return "error";
+  }
+}
+
+struct QueryBudget {
+  int64_t time_ms = QUERY_TIME_BUDGET_MS;
+  int64_t steps = QUERY_STEP_BUDGET;
+  size_t rows = QUERY_ROW_LIMIT;
+};
+
+struct QueryResult {
+  QueryOutcome outcome = QueryOutcome::Done;
+  size_t rows = 0;
+  int64_t steps = 0; // VM steps of the statement
+  double ms = 0;
+  std::string error;
+};
+
+// One row of EXPLAIN QUERY PLAN; `parent` is another row's id or 0
+struct QueryPlanRow {
+  int id;
+  int parent;
+  std::string detail;
+};
+
+class QueryConsole {
+public:
+  ~QueryConsole() {
+    if (db_) {
+      sqlite3_close(db_);
+    }
+  }
+
+  bool open(const char *path, std::string &error) {
+    if (open_db(path, &db_, SQLITE_OPEN_READONLY) != SQLITE_OK) {
+      error = db_ ? sqlite3_errmsg(db_) : "out of memory";
+      sqlite3_close(db_);
+      db_ = nullptr;
+      return false;
+    }
+    // The file is opened read-only; these keep the console to it
+    sqlite3_limit(db_, SQLITE_LIMIT_ATTACHED, 0);
+    sqlite3_exec(db_, "PRAGMA query_only = 1", NULL, NULL, NULL);
+    sqlite3_set_authorizer(db_, authorize, this);
+    sqlite3_progress_handler(db_, QUERY_PROGRESS_OPS, on_progress, this);
+    std::thread([this] { watch(); }).detach();
+    return true;
+  }
+
+  bool ready() const { return db_ != nullptr; }
+
+  // Prepare `sql` as a single read-only statement; nullptr and `error`
+  // otherwise. The caller finalizes it.
+  sqlite3_stmt *prepare(std::string_view sql, std::string &error) {
+    sqlite3_stmt *stmt = nullptr;
+    const char *tail = nullptr;
+    if (!db_) {
+      error = "query connection not open";
+      return nullptr;
+    }
+    denied_ = nullptr;
+    if (sqlite3_prepare_v2(db_, sql.data(), (int)sql.size(), &stmt, &tail) !=
+        SQLITE_OK) {
+      error = denied_ ? denied_ : sqlite3_errmsg(db_);
+      return nullptr;
+    }
+    if (!stmt) {
+      error = "empty statement";
+      return nullptr;
+    }
+    std::string_view rest(tail, sql.data() + sql.size() - tail);
+    if (rest.find_first_not_of(" \t\r\n;") != std::string_view::npos) {
+      error = "only one statement per query";
+    } else if (!sqlite3_stmt_readonly(stmt)) {
+      error = "only read-only statements are allowed";
+    } else {
+      return stmt;
+    }
+    sqlite3_finalize(stmt);
+    return nullptr;
+  }
+
+  bool plan(std::string_view sql, std::vector<QueryPlanRow> &rows,
+            std::string &error) {
+    sqlite3_stmt *check = prepare(sql, error);
+    if (!check) {
+      return false;
+    }
+    sqlite3_finalize(check);
+
+    std::string explain = "EXPLAIN QUERY PLAN " + std::string(sql);
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db_, explain.c_str(), -1, &stmt, NULL) !=
+        SQLITE_OK) {
+      error = sqlite3_errmsg(db_);
+      return false;
+    }
+    rows.clear();
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      const char *detail = (const char *)sqlite3_column_text(stmt, 3);
+      rows.push_back({sqlite3_column_int(stmt, 0),
+                      sqlite3_column_int(stmt, 1), detail ? detail : ""});
+    }
+    sqlite3_finalize(stmt);
+    return true;
+  }
+
+  // Step `stmt` under `budget`, handing each row to `on_row` (false stops
+  // the query, e.g. when the client cannot be written to). Finalizes
+  // `stmt`. While it runs, a hangup on `client_fd` cancels it.
+  QueryResult run(sqlite3_stmt *stmt, const QueryBudget &budget, int client_fd,
+                  const std::function<bool(sqlite3_stmt *)> &on_row) {
+    QueryResult result;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    deadline_ = start + std::chrono::milliseconds(budget.time_ms);
+    step_budget_ = budget.steps;
+    steps_ = 0;
+    stop_ = QueryOutcome::Done;
+    running_ = true;
+    arm(client_fd);
+
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      if (result.rows == budget.rows) {
+        result.outcome = QueryOutcome::RowLimit;
+        break;
+      }
+      result.rows++;
+      result.steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+      if (!on_row(stmt)) {
+        result.outcome = QueryOutcome::Cancelled;
+        break;
+      }
+    }
+    disarm();
+    running_ = false;
+
+    if (rc == SQLITE_INTERRUPT) {
+      result.outcome = stop_ == QueryOutcome::Done ? QueryOutcome::Cancelled
+                                                   : stop_.load();
+    } else if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+      result.outcome = QueryOutcome::Error;
+      result.error = sqlite3_errmsg(db_);
+    }
+    // The statement's own count is reset when it finishes (the query
+    // profiler collects it), so fall back on what was seen while stepping
+    result.steps = std::max<int64_t>(
+        {result.steps, steps_,
+         sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 0)});
+    result.ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    sqlite3_finalize(stmt);
+
+    if (!sqlite3_get_autocommit(db_)) {
+      internal_ = true;
+      sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL);
+      internal_ = false;
+    }
+    return result;
+  }
+
+  // Whether a transaction is open on the console's connection (tests)
+  bool in_transaction() const { return db_ && !sqlite3_get_autocommit(db_); }
+
+private:
+  // Reject, when prepared rather than when run, what could take the
+  // connection out of its read-only, autocommit state
+  static int authorize(void *arg, int action, const char *arg1,
+                       const char *arg2, const char *, const char *) {
+    QueryConsole *console = (QueryConsole *)arg;
+    if (console->internal_) {
+      return SQLITE_OK;
+    }
+    if (action == SQLITE_ATTACH || action == SQLITE_DETACH) {
+      console->denied_ = "ATTACH and DETACH are not allowed";
+    } else if (action == SQLITE_TRANSACTION || action == SQLITE_SAVEPOINT) {
+      console->denied_ = "transaction control is not allowed";
+    } else if (action == SQLITE_PRAGMA && arg2 && !pragma_takes_name(arg1)) {
+      console->denied_ = "pragma assignments are not allowed";
+    } else {
+      return SQLITE_OK;
+    }
+    return SQLITE_DENY;
+  }
+
+  // Pragmas whose argument names a table or index to describe
+  static bool pragma_takes_name(const char *pragma) {
+    static const char *const names[] = {
+        "foreign_key_check", "foreign_key_list", "index_info",
+        "index_list",        "index_xinfo",      "integrity_check",
+        "quick_check",       "table_info",       "table_list",
+        "table_xinfo"};
+    for (const char *name : names) {
+      if (sqlite3_stricmp(pragma, name) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Every QUERY_PROGRESS_OPS VM instructions; nonzero interrupts
+  static int on_progress(void *arg) {
+    QueryConsole *console = (QueryConsole *)arg;
+    if (!console->running_) {
+      return 0; // EXPLAIN QUERY PLAN and other unbudgeted statements
+    }
+    console->steps_ += QUERY_PROGRESS_OPS;
+    if (console->steps_ > console->step_budget_) {
+      console->stop_ = QueryOutcome::StepBudget;
+      return 1;
+    }
+    if (std::chrono::steady_clock::now() > console->deadline_) {
+      console->stop_ = QueryOutcome::Timeout;
+      return 1;
+    }
+    return 0;
+  }
+
+  void arm(int client_fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    client_fd_ = client_fd;
+    armed_ = true;
+    cv_.notify_one();
+  }
+
+  void disarm() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    armed_ = false;
+  }
+
+  // Interrupt the running query when its client hangs up. The check under
+  // the lock keeps a late wakeup from interrupting a later statement.
+  void watch() {
+    while (true) {
+      int fd;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return armed_; });
+        fd = client_fd_;
+      }
+      pollfd p = {fd, POLLRDHUP, 0};
+      int n = poll(&p, 1, QUERY_WATCH_MS);
+      if (n <= 0 || !(p.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (armed_ && client_fd_ == fd) {
+        stop_ = QueryOutcome::Cancelled;
+        sqlite3_interrupt(db_);
+        armed_ = false;
+      }
+    }
+  }
+
+  sqlite3 *db_ = nullptr;
+  const char *denied_ = nullptr; // why the authorizer refused, if it did
+  bool internal_ = false;        // the console's own statements
+  std::chrono::steady_clock::time_point deadline_;
+  int64_t step_budget_ = 0;
+  int64_t steps_ = 0;
+  bool running_ = false;
+  std::atomic<QueryOutcome> stop_{QueryOutcome::Done};
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool armed_ = false;
+  int client_fd_ = -1;
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+#include "html_template.h"
+#include "server.h"
+
+// Response assembly for the request handlers.
+//
+// Handlers set a status and headers and render straight into body(); send()
+// then puts the head and every body segment on the wire with one writev
+// (resumed after short writes and EAGAIN), with a Content-Length so clients
+// can tell a complete page from a truncated one. File bodies go out with
+// sendfile behind a corked head instead of being read into memory.
+//
+// Responses whose size is not known up front (streamed query results) use
+// chunked transfer encoding instead: start_chunked() sends the head, each
+// flush_chunk() sends what body() holds and clears it, and finish_chunked()
+// ends the body.
+//
+//   ResponseWriter response(conn);
+//   generate_main_page(db, response.body());
+//   response.send();
+
+class ResponseWriter {
+public:
+  explicit ResponseWriter(Connection &conn) : conn_(conn) {}
+
+  ResponseWriter(const ResponseWriter &) = delete;
+  ResponseWriter &operator=(const ResponseWriter &) = delete;
+
+  void set_status(int status) { status_ = status; }
+  int status() const { return status_; }
+
+  void set_content_type(std::string_view type) {
+    content_type_.assign(type.data(), type.size());
+  }
+
+  void add_header(std::string_view name, std::string_view value) {
+    headers_.append(name.data(), name.size());
+    headers_ += ": ";
+    headers_.append(value.data(), value.size());
+    headers_ += "\r\n";
+  }
+
+  HtmlOutput &body() { return body_; }
+
+  // Plain-text body, e.g. "404 - Page not found"
+  void text(int status, std::string_view text) {
+    status_ = status;
+    set_content_type("text/plain");
+    body_.append_copy(text);
+  }
+
+  void redirect(std::string_view location) {
+    status_ = 303;
+    add_header("Location", location);
+  }
+
+  bool send() {
+    std::string head = build_head(body_.size());
+    return conn_.write_vectors(body_.segments().data(),
+                               body_.segments().size(), head);
+  }
+
+  // Send `length` bytes of `file_fd` from `offset` as the body
+  bool send_file(int file_fd, off_t offset, size_t length) {
+    std::string head = build_head(length);
+    conn_.set_cork(true);
+    bool ok = conn_.write_all(head);
+    while (ok && length > 0) {
+      ssize_t n = conn_.send_file(file_fd, offset, length);
+      if (n <= 0) {
+        ok = false;
+        break;
+      }
+      offset += n;
+      length -= (size_t)n;
+    }
+    conn_.set_cork(false);
+    return ok;
+  }
+
+  bool start_chunked() {
+    chunked_ = true;
+    return conn_.write_all(build_head(0));
+  }
+
+  bool flush_chunk() {
+    if (body_.size() == 0) {
+      return true;
+    }
+    char size[24];
+    snprintf(size, sizeof(size), "%zx\r\n", body_.size());
+    body_.append_static("\r\n");
+    bool ok = conn_.write_vectors(body_.segments().data(),
+                                  body_.segments().size(), size);
+    body_.clear();
+    return ok;
+  }
+
+  bool finish_chunked() {
+    return flush_chunk() && conn_.write_all(std::string("0\r\n\r\n"));
+  }
+
+private:
+  std::string build_head(size_t content_length) const {
+    std::string head;
+    head.reserve(128 + headers_.size());
+    head += "HTTP/1.1 ";
+    head += std::to_string(status_);
+    head += ' ';
+    head += http_reason(status_);
+    if (status_ != 204) {
+      head += "\r\nContent-Type: ";
+      head += content_type_;
+      if (chunked_) {
+        head += "\r\nTransfer-Encoding: chunked";
+      } else {
+        head += "\r\nContent-Length: ";
+        head += std::to_string(content_length);
+      }
+    }
+    head += "\r\nConnection: close\r\n";
+    head += headers_;
+    head += "\r\n";
+    return head;
+  }
+
+  Connection &conn_;
+  int status_ = 200;
+  std::string content_type_ = "text/html; charset=UTF-8";
+  std::string headers_;
+  HtmlOutput body_;
+  bool chunked_ = false;
+};
@@ -0,0 +1,584 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ROARING_X86 1
+#endif
+
+// Compressed bitmap of 32-bit ids (Roaring). Ids are grouped by their high
+// 16 bits into chunks; a chunk is a sorted array of low halves while it
+// holds at most ROARING_ARRAY_MAX ids, and a 65536-bit set above that, so
+// sparse tags cost two bytes per id and dense ones eight kilobytes per
+// chunk.
+//
+// AND, OR and AND NOT work chunk by chunk. Array intersections compare
+// eight ids at a time with SSE4.2 string instructions and bitset chunks are
+// combined 256 bits at a time with AVX2; the kernel is chosen once at
+// startup from CPUID, as in common/escape.h.
+
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_BITSET_WORDS 1024
+
+enum class RoaringKernel { Scalar, Sse42, Avx2 };
+enum class RoaringOp { And, Or, AndNot };
+
+inline RoaringKernel detect_roaring_kernel() {
+#ifdef ROARING_X86
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2") &&
+      __builtin_cpu_supports("popcnt")) {
+    return RoaringKernel::Avx2;
+  }
+  if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+    return RoaringKernel::Sse42;
+  }
+#endif
+  return RoaringKernel::Scalar;
+}
+
+// The kernel in use; benchmarks overwrite it to compare
+inline RoaringKernel &roaring_kernel() {
+  static RoaringKernel kernel = detect_roaring_kernel();
+  return kernel;
+}
+
+inline const char *roaring_kernel_name(RoaringKernel kernel) {
+  switch (kernel) {
+  case RoaringKernel::Avx2:
+    return "avx2";
+  case RoaringKernel::Sse42:
+    return "sse4.2";
+  default:
+    return "scalar";
+  }
+}
+
+// One chunk: `bits` is empty for an array chunk
+struct RoaringContainer {
+  std::vector<uint16_t> array;
+  std::vector<uint64_t> bits;
+  uint32_t cardinality = 0;
+
+  bool is_bitset() const { return !bits.empty(); }
+
+  bool contains(uint16_t low) const {
+    if (is_bitset()) {
+      return bits[low >> 6] >> (low & 63) & 1;
+    }
+    return std::binary_search(array.begin(), array.end(), low);
+  }
+
+  void to_bitset() {
+    bits.assign(ROARING_BITSET_WORDS, 0);
+    for (uint16_t low : array) {
+      bits[low >> 6] |= 1ULL << (low & 63);
+    }
+    std::vector<uint16_t>().swap(array);
+  }
+
+  void to_array() {
+    array.clear();
+    array.reserve(cardinality);
+    for (uint32_t w = 0; w < ROARING_BITSET_WORDS; w++) {
+      for (uint64_t word = bits[w]; word; word &= word - 1) {
+        array.push_back((uint16_t)(w * 64 + __builtin_ctzll(word)));
+      }
+    }
+    std::vector<uint64_t>().swap(bits);
+  }
+
+  // Back to an array once a bitset no longer pays for itself
+  void shrink() {
+    if (is_bitset() && cardinality <= ROARING_ARRAY_MAX) {
+      to_array();
+    }
+  }
+
+  bool add(uint16_t low) {
+    if (is_bitset()) {
+      uint64_t &word = bits[low >> 6];
+      uint64_t mask = 1ULL << (low & 63);
+      if (word & mask) {
+        return false;
+      }
+      word |= mask;
+      cardinality++;
+      return true;
+    }
+    // Ids mostly arrive in order, so appending is the common case
+    if (array.empty() || array.back() < low) {
+      array.push_back(low);
+    } else {
+      auto it = std::lower_bound(array.begin(), array.end(), low);
+      if (*it == low) {
+        return false;
+      }
+      array.insert(it, low);
+    }
+    cardinality++;
+    if (cardinality > ROARING_ARRAY_MAX) {
+      to_bitset();
+    }
+    return true;
+  }
+
+  bool remove(uint16_t low) {
+    if (is_bitset()) {
+      uint64_t &word = bits[low >> 6];
+      uint64_t mask = 1ULL << (low & 63);
+      if (!(word & mask)) {
+        return false;
+      }
+      word &= ~mask;
+      cardinality--;
+      shrink();
+      return true;
+    }
+    auto it = std::lower_bound(array.begin(), array.end(), low);
+    if (it == array.end() || *it != low) {
+      return false;
+    }
+    array.erase(it);
+    cardinality--;
+    return true;
+  }
+
+  size_t bytes() const {
+    return array.capacity() * sizeof(uint16_t) +
+           bits.capacity() * sizeof(uint64_t);
+  }
+};
+
+// Bitset kernels: out = a op b over ROARING_BITSET_WORDS words; returns the
+// cardinality of out
+
+template <RoaringOp Op> inline uint64_t roaring_word(uint64_t a, uint64_t b) {
+  return Op == RoaringOp::And ? a & b : Op == RoaringOp::Or ? a | b : a & ~b;
+}
+
+template <RoaringOp Op>
+inline uint32_t roaring_bitset_scalar(const uint64_t *a, const uint64_t *b,
+                                      uint64_t *out) {
+  uint32_t cardinality = 0;
+  for (size_t i = 0; i < ROARING_BITSET_WORDS; i++) {
+    out[i] = roaring_word<Op>(a[i], b[i]);
+    cardinality += __builtin_popcountll(out[i]);
+  }
+  return cardinality;
+}
+
+#ifdef ROARING_X86
+template <RoaringOp Op>
+__attribute__((target("avx2,popcnt"))) inline uint32_t
+roaring_bitset_avx2(const uint64_t *a, const uint64_t *b, uint64_t *out) {
+  uint32_t cardinality = 0;
+  for (size_t i = 0; i < ROARING_BITSET_WORDS; i += 4) {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    __m256i v = Op == RoaringOp::And  ? _mm256_and_si256(va, vb)
+                : Op == RoaringOp::Or ? _mm256_or_si256(va, vb)
+                                      : _mm256_andnot_si256(vb, va);
+    _mm256_storeu_si256((__m256i *)(out + i), v);
+    cardinality += __builtin_popcountll(out[i]) +
+                   __builtin_popcountll(out[i + 1]) +
+                   __builtin_popcountll(out[i + 2]) +
+                   __builtin_popcountll(out[i + 3]);
+  }
+  return cardinality;
+}
+
+// Byte shuffles that pack the 16-bit lanes selected by an 8-bit mask to
+// the front of a vector
+inline const uint8_t *roaring_shuffle_table() {
+  static const std::vector<uint8_t> table = [] {
+    std::vector<uint8_t> t(256 * 16, 0xff);
+    for (int mask = 0; mask < 256; mask++) {
+      int out = 0;
+      for (int lane = 0; lane < 8; lane++) {
+        if (mask >> lane & 1) {
+          t[mask * 16 + out++] = (uint8_t)(lane * 2);
+          t[mask * 16 + out++] = (uint8_t)(lane * 2 + 1);
+        }
+      }
+    }
+    return t;
+  }();
+  return table.data();
+}
+#endif
+
+template <RoaringOp Op>
+inline uint32_t roaring_bitset_op(const uint64_t *a, const uint64_t *b,
+                                  uint64_t *out) {
+#ifdef ROARING_X86
+  if (roaring_kernel() == RoaringKernel::Avx2) {
+    return roaring_bitset_avx2<Op>(a, b, out);
+  }
+#endif
+  return roaring_bitset_scalar<Op>(a, b, out);
+}
+
+// Array kernels: sorted, duplicate-free inputs; `out` is appended to
+
+inline void roaring_intersect_scalar(const uint16_t *a, size_t na,
+                                     const uint16_t *b, size_t nb,
+                                     std::vector<uint16_t> &out) {
+  size_t i = 0, j = 0;
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (b[j] < a[i]) {
+      j++;
+    } else {
+      out.push_back(a[i]);
+      i++;
+      j++;
+    }
+  }
+}
+
+// For a much smaller `a`: exponential search for each of its ids in `b`
+inline void roaring_intersect_galloping(const uint16_t *a, size_t na,
+                                        const uint16_t *b, size_t nb,
+                                        std::vector<uint16_t> &out) {
+  size_t j = 0;
+  for (size_t i = 0; i < na && j < nb; i++) {
+    size_t step = 1, high = j;
+    while (high < nb && b[high] < a[i]) {
+      j = high + 1;
+      high += step;
+      step *= 2;
+    }
+    j = std::lower_bound(b + j, b + std::min(high + 1, nb), a[i]) - b;
+    if (j < nb && b[j] == a[i]) {
+      out.push_back(a[i]);
+      j++;
+    }
+  }
+}
+
+#ifdef ROARING_X86
+// Eight ids of each side per step: PCMPESTRM marks the ids of `a` found
+// anywhere in the current block of `b`, and a shuffle packs them to the
+// front of the output. The tails are merged one id at a time.
+__attribute__((target("sse4.2,popcnt"))) inline void
+roaring_intersect_sse42(const uint16_t *a, size_t na, const uint16_t *b,
+                        size_t nb, std::vector<uint16_t> &out) {
+  const uint8_t *shuffles = roaring_shuffle_table();
+  size_t base = out.size();
+  out.resize(base + std::min(na, nb) + 8);
+  uint16_t *dst = out.data() + base;
+  size_t count = 0, i = 0, j = 0;
+  size_t blocks_a = na / 8 * 8, blocks_b = nb / 8 * 8;
+  if (blocks_a && blocks_b) {
+    __m128i va = _mm_loadu_si128((const __m128i *)a);
+    __m128i vb = _mm_loadu_si128((const __m128i *)b);
+    while (true) {
+      __m128i found =
+          _mm_cmpestrm(vb, 8, va, 8,
+                       _SIDD_UWORD_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK);
+      int mask = _mm_cvtsi128_si32(found);
+      __m128i shuffle =
+          _mm_loadu_si128((const __m128i *)(shuffles + mask * 16));
+      _mm_storeu_si128((__m128i *)(dst + count), _mm_shuffle_epi8(va, shuffle));
+      count += __builtin_popcount(mask);
+      uint16_t max_a = a[i + 7], max_b = b[j + 7];
+      if (max_a <= max_b) {
+        i += 8;
+        if (i == blocks_a) {
+          break;
+        }
+        va = _mm_loadu_si128((const __m128i *)(a + i));
+      }
+      if (max_b <= max_a) {
+        j += 8;
+        if (j == blocks_b) {
+          break;
+        }
+        vb = _mm_loadu_si128((const __m128i *)(b + j));
+      }
+    }
+  }
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (b[j] < a[i]) {
+      j++;
+    } else {
+      dst[count++] = a[i];
+      i++;
+      j++;
+    }
+  }
+  out.resize(base + count);
+}
+#endif
+
+inline void roaring_intersect(const uint16_t *a, size_t na, const uint16_t *b,
+                              size_t nb, std::vector<uint16_t> &out) {
+  if (na > nb) {
+    std::swap(a, b);
+    std::swap(na, nb);
+  }
+  if (na * 32 < nb) {
+    roaring_intersect_galloping(a, na, b, nb, out);
+    return;
+  }
+#ifdef ROARING_X86
+  if (roaring_kernel() != RoaringKernel::Scalar) {
+    roaring_intersect_sse42(a, na, b, nb, out);
+    return;
+  }
+#endif
+  roaring_intersect_scalar(a, na, b, nb, out);
+}
+
+inline void roaring_union(const uint16_t *a, size_t na, const uint16_t *b,
+                          size_t nb, std::vector<uint16_t> &out) {
+  size_t i = 0, j = 0;
+  out.reserve(out.size() + na + nb);
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      out.push_back(a[i++]);
+    } else if (b[j] < a[i]) {
+      out.push_back(b[j++]);
+    } else {
+      out.push_back(a[i]);
+      i++;
+      j++;
+    }
+  }
+  out.insert(out.end(), a + i, a + na);
+  out.insert(out.end(), b + j, b + nb);
+}
+
+inline void roaring_difference(const uint16_t *a, size_t na, const uint16_t *b,
+                               size_t nb, std::vector<uint16_t> &out) {
+  size_t j = 0;
+  for (size_t i = 0; i < na; i++) {
+    while (j < nb && b[j] < a[i]) {
+      j++;
+    }
+    if (j == nb || b[j] != a[i]) {
+      out.push_back(a[i]);
+    }
+  }
+}
+
+// a op b for one chunk; an empty result has cardinality 0
+template <RoaringOp Op>
+inline RoaringContainer roaring_combine(const RoaringContainer &a,
+                                        const RoaringContainer &b) {
+  RoaringContainer out;
+  if (a.is_bitset() && b.is_bitset()) {
+    out.bits.resize(ROARING_BITSET_WORDS);
+    out.cardinality =
+        roaring_bitset_op<Op>(a.bits.data(), b.bits.data(), out.bits.data());
+    out.shrink();
+    return out;
+  }
+
+  if (!a.is_bitset() && !b.is_bitset()) {
+    switch (Op) {
+    case RoaringOp::And:
+      roaring_intersect(a.array.data(), a.array.size(), b.array.data(),
+                        b.array.size(), out.array);
+      break;
+    case RoaringOp::Or:
+      roaring_union(a.array.data(), a.array.size(), b.array.data(),
+                    b.array.size(), out.array);
+      break;
+    case RoaringOp::AndNot:
+      roaring_difference(a.array.data(), a.array.size(), b.array.data(),
+                         b.array.size(), out.array);
+      break;
+    }
+    out.cardinality = (uint32_t)out.array.size();
+    if (out.cardinality > ROARING_ARRAY_MAX) {
+      out.to_bitset();
+    }
+    return out;
+  }
+
+  // One array and one bitset
+  const RoaringContainer &array = a.is_bitset() ? b : a;
+  const RoaringContainer &bitset = a.is_bitset() ? a : b;
+  switch (Op) {
+  case RoaringOp::And:
+    for (uint16_t low : array.array) {
+      if (bitset.contains(low)) {
+        out.array.push_back(low);
+      }
+    }
+    out.cardinality = (uint32_t)out.array.size();
+    return out;
+  case RoaringOp::Or:
+    out = bitset;
+    for (uint16_t low : array.array) {
+      uint64_t &word = out.bits[low >> 6];
+      out.cardinality += !(word >> (low & 63) & 1);
+      word |= 1ULL << (low & 63);
+    }
+    return out;
+  case RoaringOp::AndNot:
+    if (!a.is_bitset()) {
+      for (uint16_t low : a.array) {
+        if (!b.contains(low)) {
+          out.array.push_back(low);
+        }
+      }
+      out.cardinality = (uint32_t)out.array.size();
+      return out;
+    }
+    out = a;
+    for (uint16_t low : b.array) {
+      uint64_t &word = out.bits[low >> 6];
+      out.cardinality -= word >> (low & 63) & 1;
+      word &= ~(1ULL << (low & 63));
+    }
+    out.shrink();
+    return out;
+  }
+  return out;
+}
+
+class RoaringBitmap {
+public:
+  bool add(uint32_t id) {
+    return container(id >> 16, true)->add((uint16_t)id);
+  }
+
+  bool remove(uint32_t id) {
+    RoaringContainer *c = container(id >> 16, false);
+    if (!c || !c->remove((uint16_t)id)) {
+      return false;
+    }
+    if (c->cardinality == 0) {
+      size_t index = c - containers_.data();
+      keys_.erase(keys_.begin() + index);
+      containers_.erase(containers_.begin() + index);
+    }
+    return true;
+  }
+
+  bool contains(uint32_t id) const {
+    auto it = std::lower_bound(keys_.begin(), keys_.end(), id >> 16);
+    return it != keys_.end() && *it == id >> 16 &&
+           containers_[it - keys_.begin()].contains((uint16_t)id);
+  }
+
+  uint64_t size() const {
+    uint64_t total = 0;
+    for (const RoaringContainer &c : containers_) {
+      total += c.cardinality;
+    }
+    return total;
+  }
+
+  bool empty() const { return containers_.empty(); }
+
+  // Approximate heap footprint
+  size_t bytes() const {
+    size_t total = keys_.capacity() * sizeof(uint16_t) +
+                   containers_.capacity() * sizeof(RoaringContainer);
+    for (const RoaringContainer &c : containers_) {
+      total += c.bytes();
+    }
+    return total;
+  }
+
+  // Call fn(id) in ascending order until it returns false
+  template <typename Fn> void for_each(Fn fn) const {
+    for (size_t k = 0; k < keys_.size(); k++) {
+      uint32_t high = (uint32_t)keys_[k] << 16;
+      const RoaringContainer &c = containers_[k];
+      if (!c.is_bitset()) {
+        for (uint16_t low : c.array) {
+          if (!fn(high | low)) {
+            return;
+          }
+        }
+        continue;
+      }
+      for (uint32_t w = 0; w < ROARING_BITSET_WORDS; w++) {
+        for (uint64_t word = c.bits[w]; word; word &= word - 1) {
+          if (!fn(high | (w * 64 + __builtin_ctzll(word)))) {
+            return;
+          }
+        }
+      }
+    }
+  }
+
+  template <RoaringOp Op>
+  static RoaringBitmap combine(const RoaringBitmap &a, const RoaringBitmap &b) {
+    RoaringBitmap out;
+    size_t i = 0, j = 0;
+    while (i < a.keys_.size() || j < b.keys_.size()) {
+      bool has_a = i < a.keys_.size(), has_b = j < b.keys_.size();
+      if (has_a && (!has_b || a.keys_[i] < b.keys_[j])) {
+        if (Op != RoaringOp::And) {
+          out.append(a.keys_[i], a.containers_[i]);
+        }
+        i++;
+      } else if (has_b && (!has_a || b.keys_[j] < a.keys_[i])) {
+        if (Op == RoaringOp::Or) {
+          out.append(b.keys_[j], b.containers_[j]);
+        }
+        j++;
+      } else {
+        RoaringContainer c =
+            roaring_combine<Op>(a.containers_[i], b.containers_[j]);
+        if (c.cardinality) {
+          out.keys_.push_back(a.keys_[i]);
+          out.containers_.push_back(std::move(c));
+        }
+        i++;
+        j++;
+      }
+    }
+    return out;
+  }
+
+  RoaringBitmap &operator&=(const RoaringBitmap &other) {
+    return *this = combine<RoaringOp::And>(*this, other);
+  }
+  RoaringBitmap &operator|=(const RoaringBitmap &other) {
+    return *this = combine<RoaringOp::Or>(*this, other);
+  }
+  RoaringBitmap &operator-=(const RoaringBitmap &other) {
+    return *this = combine<RoaringOp::AndNot>(*this, other);
+  }
+
+private:
+  RoaringContainer *container(uint32_t key, bool create) {
+    // Ids mostly arrive in order, so the last chunk is the common hit
+    if (!keys_.empty() && keys_.back() == key) {
+      return &containers_.back();
+    }
+    auto it = std::lower_bound(keys_.begin(), keys_.end(), key);
+    size_t index = it - keys_.begin();
+    if (it != keys_.end() && *it == key) {
+      return &containers_[index];
+    }
+    if (!create) {
+      return nullptr;
+    }
+    keys_.insert(it, (uint16_t)key);
+    containers_.insert(containers_.begin() + index, RoaringContainer());
+    return &containers_[index];
+  }
+
+  void append(uint16_t key, const RoaringContainer &c) {
+    keys_.push_back(key);
+    containers_.push_back(c);
+  }
+
+  std::vector<uint16_t> keys_;
+  std::vector<RoaringContainer> containers_;
+};
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <sqlite3.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "db.h"
+
+// In-memory copy of the database schema: tables with their columns, types,
+// primary keys, indexes and foreign keys.
+//
+// Loaded at open() from sqlite_master and the table-valued pragmas (table
+// names are bound, never spliced into SQL) and reloaded by refresh() only
+// when PRAGMA schema_version has moved, which SQLite bumps on every schema
+// change by any connection. refresh() is cheap enough to call per request.
+// Names from requests are looked up with find(); a table that is not in
+// the catalog does not exist. Not thread-safe; one catalog per server
+// thread.
+
+struct CatalogColumn {
+  std::string name;
+  std::string type;
+  bool not_null = false;
+  std::string default_value; // SQL text; empty if none
+  int primary_key = 0;       // position in the primary key, 0 if not in it
+
+  // SQLite's column affinity rules 1 and 2: TEXT unless the declared type
+  // contains INT, and only if it contains CHAR, CLOB or TEXT
+  bool text_affinity() const {
+    std::string upper = type;
+    for (char &c : upper) {
+      c = c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+    }
+    auto has = [&](const char *word) {
+      return upper.find(word) != std::string::npos;
+    };
+    return !has("INT") && (has("CHAR") || has("CLOB") || has("TEXT"));
+  }
+};
+
+struct CatalogIndex {
+  std::string name;
+  bool unique = false;
+  std::string origin; // "c" CREATE INDEX, "u" UNIQUE, "pk" PRIMARY KEY
+  std::vector<std::string> columns;
+};
+
+struct CatalogForeignKey {
+  std::vector<std::string> from;
+  std::string table;
+  std::vector<std::string> to; // empty entries: the parent's primary key
+  std::string on_update;
+  std::string on_delete;
+};
+
+struct CatalogTable {
+  std::string name;
+  std::vector<CatalogColumn> columns;
+  std::vector<CatalogIndex> indexes;
+  std::vector<CatalogForeignKey> foreign_keys;
+
+  const CatalogColumn *column(std::string_view column_name) const {
+    for (const CatalogColumn &c : columns) {
+      if (c.name == column_name) {
+        return &c;
+      }
+    }
+    return nullptr;
+  }
+
+  // Position of `column_name` in columns, or columns.size()
+  size_t column_index(std::string_view column_name) const {
+    const CatalogColumn *c = column(column_name);
+    return c ? c - columns.data() : columns.size();
+  }
+};
+
+struct SchemaCatalogStats {
+  int64_t schema_version = -1;
+  size_t tables = 0;
+  uint64_t loads = 0;
+  double load_ms = 0; // last load
+};
+
+// Append `name` to `sql` as an SQL identifier: "a""b" for a"b
+template <typename String>
+void append_identifier(String &sql, std::string_view name) {
+  sql += '"';
+  for (char c : name) {
+    sql += c;
+    if (c == '"') {
+      sql += '"';
+    }
+  }
+  sql += '"';
+}
+
+class SchemaCatalog {
+public:
+  SchemaCatalog() = default;
+  ~SchemaCatalog() { close(); }
+
+  SchemaCatalog(const SchemaCatalog &) = delete;
+  SchemaCatalog &operator=(const SchemaCatalog &) = delete;
+
+  bool ready() const { return db_ != nullptr; }
+
+  // Open a read-only connection and load the schema
+  bool open(const char *path, std::string &error) {
+    close();
+    if (open_db(path, &db_, SQLITE_OPEN_READONLY) != SQLITE_OK ||
+        sqlite3_prepare_v2(db_, "PRAGMA schema_version", -1, &version_stmt_,
+                           NULL) != SQLITE_OK) {
+      error = db_ ? sqlite3_errmsg(db_) : "cannot open database";
+      close();
+      return false;
+    }
+    if (!refresh(error)) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  // Reload if the schema changed since the last call. On failure the
+  // previous catalog is kept.
+  bool refresh(std::string &error) {
+    if (!db_) {
+      error = "schema catalog not open";
+      return false;
+    }
+    int64_t version = -1;
+    if (sqlite3_step(version_stmt_) == SQLITE_ROW) {
+      version = sqlite3_column_int64(version_stmt_, 0);
+    }
+    sqlite3_reset(version_stmt_);
+    if (version < 0) {
+      error = sqlite3_errmsg(db_);
+      return false;
+    }
+    if (version == stats_.schema_version) {
+      return true;
+    }
+    if (!load(error)) {
+      return false;
+    }
+    stats_.schema_version = version;
+    return true;
+  }
+
+  // Sorted by name
+  const std::vector<CatalogTable> &tables() const { return tables_; }
+
+  const CatalogTable *find(std::string_view name) const {
+    auto it = std::lower_bound(
+        tables_.begin(), tables_.end(), name,
+        [](const CatalogTable &t, std::string_view n) { return t.name < n; });
+    return it != tables_.end() && it->name == name ? &*it : nullptr;
+  }
+
+  const SchemaCatalogStats &stats() const { return stats_; }
+
+private:
+  void close() {
+    sqlite3_finalize(version_stmt_);
+    version_stmt_ = nullptr;
+    if (db_) {
+      sqlite3_close(db_);
+      db_ = nullptr;
+    }
+  }
+
+  static std::string text(sqlite3_stmt *stmt, int column) {
+    const char *value = (const char *)sqlite3_column_text(stmt, column);
+    return value ? value : "";
+  }
+
+  // In one read transaction, so every pragma sees the same schema. A change
+  // that lands after schema_version was read only causes another load.
+  bool load(std::string &error) {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    sqlite3_exec(db_, "BEGIN", NULL, NULL, NULL);
+    std::vector<CatalogTable> tables;
+    bool ok = load_tables(tables, error);
+    sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL);
+    if (!ok) {
+      return false;
+    }
+    std::sort(tables.begin(), tables.end(),
+              [](const CatalogTable &a, const CatalogTable &b) {
+                return a.name < b.name;
+              });
+    tables_.swap(tables);
+    stats_.tables = tables_.size();
+    stats_.loads++;
+    stats_.load_ms = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    return true;
+  }
+
+  bool load_tables(std::vector<CatalogTable> &tables, std::string &error) {
+    static const char *const sql[] = {
+        "SELECT name FROM sqlite_master WHERE type = 'table'",
+        "SELECT name, type, \"notnull\", dflt_value, pk "
+        "FROM pragma_table_info(?) ORDER BY cid",
+        "SELECT name, \"unique\", origin FROM pragma_index_list(?) "
+        "ORDER BY seq",
+        "SELECT name FROM pragma_index_info(?) ORDER BY seqno",
+        "SELECT id, \"table\", \"from\", \"to\", on_update, on_delete "
+        "FROM pragma_foreign_key_list(?) ORDER BY id, seq"};
+    sqlite3_stmt *stmts[5] = {};
+    bool ok = true;
+    for (int i = 0; i < 5 && ok; i++) {
+      ok = sqlite3_prepare_v2(db_, sql[i], -1, &stmts[i], NULL) == SQLITE_OK;
+    }
+    if (ok) {
+      sqlite3_stmt *list = stmts[0];
+      while (sqlite3_step(list) == SQLITE_ROW) {
+        tables.emplace_back();
+        tables.back().name = text(list, 0);
+      }
+      for (CatalogTable &table : tables) {
+        load_columns(stmts[1], table);
+        load_indexes(stmts[2], stmts[3], table);
+        load_foreign_keys(stmts[4], table);
+      }
+    }
+    if (!ok) {
+      error = sqlite3_errmsg(db_);
+    }
+    for (sqlite3_stmt *stmt : stmts) {
+      sqlite3_finalize(stmt);
+    }
+    return ok;
+  }
+
+  void load_columns(sqlite3_stmt *stmt, CatalogTable &table) {
+    sqlite3_bind_text(stmt, 1, table.name.c_str(), -1, SQLITE_STATIC);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      CatalogColumn column;
+      column.name = text(stmt, 0);
+      column.type = text(stmt, 1);
+      column.not_null = sqlite3_column_int(stmt, 2);
+      column.default_value = text(stmt, 3);
+      column.primary_key = sqlite3_column_int(stmt, 4);
+      table.columns.push_back(std::move(column));
+    }
+    sqlite3_reset(stmt);
+  }
+
+  void load_indexes(sqlite3_stmt *list, sqlite3_stmt *info,
+                    CatalogTable &table) {
+    sqlite3_bind_text(list, 1, table.name.c_str(), -1, SQLITE_STATIC);
+    while (sqlite3_step(list) == SQLITE_ROW) {
+      CatalogIndex index;
+      index.name = text(list, 0);
+      index.unique = sqlite3_column_int(list, 1);
+      index.origin = text(list, 2);
+      table.indexes.push_back(std::move(index));
+    }
+    sqlite3_reset(list);
+    for (CatalogIndex &index : table.indexes) {
+      sqlite3_bind_text(info, 1, index.name.c_str(), -1, SQLITE_STATIC);
+      while (sqlite3_step(info) == SQLITE_ROW) {
+        index.columns.push_back(text(info, 0)); // empty for an expression
+      }
+      sqlite3_reset(info);
+    }
+  }
+
+  void load_foreign_keys(sqlite3_stmt *stmt, CatalogTable &table) {
+    sqlite3_bind_text(stmt, 1, table.name.c_str(), -1, SQLITE_STATIC);
+    int last_id = -1;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      int id = sqlite3_column_int(stmt, 0);
+      if (id != last_id) {
+        table.foreign_keys.emplace_back();
+        CatalogForeignKey &key = table.foreign_keys.back();
+        key.table = text(stmt, 1);
+        key.on_update = text(stmt, 4);
+        key.on_delete = text(stmt, 5);
+        last_id = id;
+      }
+      CatalogForeignKey &key = table.foreign_keys.back();
+      key.from.push_back(text(stmt, 2));
+      key.to.push_back(text(stmt, 3));
+    }
+    sqlite3_reset(stmt);
+  }
+
+  sqlite3 *db_ = nullptr;
+  sqlite3_stmt *version_stmt_ = nullptr;
+  std::vector<CatalogTable> tables_;
+  SchemaCatalogStats stats_;
+};
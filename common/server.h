@@ -0,0 +1,863 @@
+#pragma once
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <string>
+#include <string_view>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "http.h"
+
+// Shared accept loop and connection type for db_admin and media_manager.
+//
+// Plain HTTP on 127.0.0.1 stays the default (reached through SSH port
+// forwarding). Setting GRABBIEL_TLS_CERT and GRABBIEL_TLS_KEY terminates TLS
+// in-process instead; GRABBIEL_BIND_ADDRESS then picks the interface to
+// listen on. With TLS the kernel TLS offload is requested so that, when the
+// negotiated cipher allows it, record encryption/decryption happens in the
+// kernel and file bodies go out through sendfile. The blocking accept loop
+// runs each handshake non-blocking against a TLS_HANDSHAKE_TIMEOUT_MS
+// deadline, so a client that connects and never sends a ClientHello cannot
+// hold up the connections behind it; reads and writes after it time out
+// after REQUEST_TIMEOUT_MS and SEND_TIMEOUT_MS for the same reason.
+//
+// Session resumption: TLS 1.3 tickets and a TLS 1.2 server-side session
+// cache are enabled. GRABBIEL_TLS_TICKET_KEY may name an 80-byte file of
+// random data so ticket keys survive restarts and are shared by workers.
+
+#define LISTEN_BACKLOG 128
+#define IOV_BATCH 256
+#define REQUEST_TIMEOUT_MS 30000
+#define SEND_TIMEOUT_MS 30000
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000
+#define TLS_SESSION_CONTEXT "grabbiel"
+
+class Connection {
+public:
+  Connection(int fd, SSL *ssl) : fd_(fd), ssl_(ssl) {
+    if (ssl_) {
+      ktls_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_)) > 0;
+      ktls_recv_ = BIO_get_ktls_recv(SSL_get_rbio(ssl_)) > 0;
+    }
+  }
+
+  ~Connection() { close(); }
+
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+
+  int fd() const { return fd_; }
+  bool is_tls() const { return ssl_ != nullptr; }
+  bool ktls_send() const { return ktls_send_; }
+  bool ktls_recv() const { return ktls_recv_; }
+
+  // Like read(2): bytes read, 0 on orderly close, -1 on error. On a
+  // non-blocking socket -1 with errno EAGAIN means wait for wants().
+  ssize_t read(void *buffer, size_t length) {
+    if (!ssl_) {
+      ssize_t n;
+      do {
+        n = ::read(fd_, buffer, length);
+      } while (n < 0 && errno == EINTR);
+      wants_ = POLLIN;
+      return n;
+    }
+
+    size_t n = 0;
+    int rc = SSL_read_ex(ssl_, buffer, length, &n);
+    if (rc > 0) {
+      return (ssize_t)n;
+    }
+    return ssl_failure(rc);
+  }
+
+  // Like write(2), possibly short. A full send buffer on a non-blocking
+  // socket is waited out rather than reported, or with queue_writes the
+  // data is queued for flush().
+  ssize_t write(const void *data, size_t length) {
+    if (!queue_.empty()) {
+      return enqueue(data, length);
+    }
+    while (true) {
+      ssize_t n = send_now(data, length);
+      if (n >= 0 || !would_block()) {
+        return n;
+      }
+      if (queue_writes_) {
+        return enqueue(data, length);
+      }
+      if (!wait_for(wants_)) {
+        return -1;
+      }
+    }
+  }
+
+  bool write_all(const void *data, size_t length) {
+    const char *p = (const char *)data;
+    while (length > 0) {
+      ssize_t n = write(p, length);
+      if (n <= 0) {
+        return false;
+      }
+      p += n;
+      length -= (size_t)n;
+    }
+    return true;
+  }
+
+  bool write_all(const std::string &data) {
+    return write_all(data.data(), data.size());
+  }
+
+  // Write `head` (if any) and then every segment: writev for plain TCP,
+  // resuming after short writes; for TLS the segments are coalesced into
+  // record-sized SSL_writes
+  bool write_vectors(const iovec *iov, size_t count,
+                     std::string_view head = std::string_view()) {
+    size_t first = head.empty() ? 0 : 1;
+    auto segment = [&](size_t i) -> iovec {
+      if (i < first) {
+        return {(void *)head.data(), head.size()};
+      }
+      return iov[i - first];
+    };
+    count += first;
+
+    if (ssl_) {
+      char buffer[16384];
+      size_t used = 0;
+      for (size_t i = 0; i < count; i++) {
+        iovec v = segment(i);
+        const char *data = (const char *)v.iov_base;
+        size_t length = v.iov_len;
+        if (used == 0 && length >= sizeof(buffer)) {
+          if (!write_all(data, length)) {
+            return false;
+          }
+          continue;
+        }
+        while (length > 0) {
+          size_t n = std::min(length, sizeof(buffer) - used);
+          memcpy(buffer + used, data, n);
+          used += n;
+          data += n;
+          length -= n;
+          if (used == sizeof(buffer)) {
+            if (!write_all(buffer, used)) {
+              return false;
+            }
+            used = 0;
+          }
+        }
+      }
+      return used == 0 || write_all(buffer, used);
+    }
+
+    size_t index = 0;
+    size_t offset = 0; // bytes of segment(index) already written
+    while (true) {
+      while (index < count && segment(index).iov_len == offset) {
+        index++;
+        offset = 0;
+      }
+      if (index == count) {
+        return true;
+      }
+      if (!queue_.empty()) {
+        iovec v = segment(index);
+        enqueue((char *)v.iov_base + offset, v.iov_len - offset);
+        offset = v.iov_len;
+        continue;
+      }
+
+      iovec batch[IOV_BATCH];
+      int n = 0;
+      for (size_t i = index; i < count && n < IOV_BATCH; i++) {
+        batch[n++] = segment(i);
+      }
+      batch[0].iov_base = (char *)batch[0].iov_base + offset;
+      batch[0].iov_len -= offset;
+
+      ssize_t written = ::writev(fd_, batch, n);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (would_block() && queue_writes_) {
+          enqueue(batch[0].iov_base, batch[0].iov_len);
+          offset = segment(index).iov_len;
+          continue;
+        }
+        if (retry_after_wait(POLLOUT)) {
+          continue;
+        }
+        return false;
+      }
+      for (size_t left = (size_t)written; left > 0;) {
+        size_t available = segment(index).iov_len - offset;
+        if (left < available) {
+          offset += left;
+          break;
+        }
+        left -= available;
+        index++;
+        offset = 0;
+      }
+    }
+  }
+
+  // Send part of a file: sendfile(2) for plain TCP, SSL_sendfile when kTLS
+  // owns the send path, otherwise read + encrypt in userspace
+  ssize_t send_file(int file_fd, off_t offset, size_t length) {
+    if (!queue_.empty()) {
+      return enqueue_file(file_fd, offset, length);
+    }
+    if (!ssl_ || ktls_send_) {
+      while (true) {
+        ssize_t n = send_file_now(file_fd, offset, length);
+        if (n >= 0) {
+          return n;
+        }
+        if (errno == EINTR) {
+          continue;
+        }
+        if (would_block() && queue_writes_) {
+          return enqueue_file(file_fd, offset, length);
+        }
+        if (!retry_after_wait(POLLOUT)) {
+          return n;
+        }
+      }
+    }
+
+    char buffer[65536];
+    ssize_t n = pread(file_fd, buffer, std::min(length, sizeof(buffer)), offset);
+    if (n <= 0) {
+      return n;
+    }
+    return write_all(buffer, (size_t)n) ? n : -1;
+  }
+
+  // TCP_CORK: hold partial frames until uncorked, so a head written
+  // before a sendfile body shares its first segment
+  void set_cork(bool on) {
+    int value = on ? 1 : 0;
+    setsockopt(fd_, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+  }
+
+  // For event loops: writes that would block are queued (data copied,
+  // files dup'd) instead of waited out, so a handler never stalls on a
+  // slow reader. The loop then calls flush() whenever the socket is ready
+  // for wants().
+  void set_queue_writes(bool on) { queue_writes_ = on; }
+  bool has_queued() const { return !queue_.empty(); }
+  // Events the last EAGAIN is waiting for (TLS may need POLLIN to write)
+  short wants() const { return wants_; }
+
+  // Send queued output: 1 when it is all out, 0 when the socket is full
+  // again, -1 on error
+  int flush() {
+    while (!queue_.empty()) {
+      QueuedOutput &front = queue_.front();
+      if (front.file_fd >= 0 && ssl_ && !ktls_send_) {
+        // Encrypted in userspace: read the next piece ahead of the file so
+        // a retried SSL_write sees the same bytes
+        char buffer[65536];
+        ssize_t n = pread(front.file_fd, buffer,
+                          std::min(front.length, sizeof(buffer)),
+                          front.offset);
+        if (n <= 0) {
+          return -1;
+        }
+        front.offset += n;
+        front.length -= (size_t)n;
+        QueuedOutput piece;
+        piece.data.assign(buffer, (size_t)n);
+        if (front.length == 0) {
+          ::close(front.file_fd);
+          queue_.front() = std::move(piece);
+        } else {
+          queue_.push_front(std::move(piece));
+        }
+        continue;
+      }
+
+      ssize_t n;
+      do {
+        n = front.file_fd >= 0
+                ? send_file_now(front.file_fd, front.offset, front.length)
+                : send_now(front.data.data() + front.offset,
+                           front.data.size() - front.offset);
+      } while (n < 0 && errno == EINTR);
+      if (n < 0) {
+        return would_block() ? 0 : -1;
+      }
+      if (front.file_fd >= 0) {
+        if (n == 0) {
+          return -1; // the file shrank
+        }
+        front.length -= (size_t)n;
+        front.offset += n;
+        if (front.length == 0) {
+          ::close(front.file_fd);
+          queue_.pop_front();
+        }
+      } else if ((front.offset += n) == (off_t)front.data.size()) {
+        queue_.pop_front();
+      }
+    }
+    return 1;
+  }
+
+  void close() {
+    for (QueuedOutput &output : queue_) {
+      if (output.file_fd >= 0) {
+        ::close(output.file_fd);
+      }
+    }
+    queue_.clear();
+    if (ssl_) {
+      SSL_shutdown(ssl_);
+      SSL_free(ssl_);
+      ssl_ = nullptr;
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+private:
+  // Output waiting for the socket: bytes, or `length` bytes of a file
+  struct QueuedOutput {
+    std::string data;
+    int file_fd = -1;
+    off_t offset = 0; // into data, or into the file
+    size_t length = 0;
+  };
+
+  // One attempt; -1 with errno EAGAIN when the socket is not ready
+  ssize_t send_now(const void *data, size_t length) {
+    if (!ssl_) {
+      ssize_t n;
+      do {
+        n = ::send(fd_, data, length, MSG_NOSIGNAL);
+      } while (n < 0 && errno == EINTR);
+      wants_ = POLLOUT;
+      return n;
+    }
+
+    size_t n = 0;
+    int rc = SSL_write_ex(ssl_, data, length, &n);
+    if (rc > 0) {
+      return (ssize_t)n;
+    }
+    return ssl_failure(rc);
+  }
+
+  ssize_t send_file_now(int file_fd, off_t offset, size_t length) {
+    wants_ = POLLOUT;
+    return ssl_ ? SSL_sendfile(ssl_, file_fd, offset, length, 0)
+                : ::sendfile(fd_, file_fd, &offset, length);
+  }
+
+  // After a failed SSL call: 0 on close_notify, otherwise -1 with errno
+  // EAGAIN if the record layer waits for the socket
+  ssize_t ssl_failure(int rc) {
+    int err = SSL_get_error(ssl_, rc);
+    if (err == SSL_ERROR_ZERO_RETURN) {
+      return 0;
+    }
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+      wants_ = err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+      errno = EAGAIN;
+    } else {
+      ERR_clear_error(); // or it would fail the next connection's call
+      errno = EIO;
+    }
+    return -1;
+  }
+
+  ssize_t enqueue(const void *data, size_t length) {
+    QueuedOutput output;
+    output.data.assign((const char *)data, length);
+    queue_.push_back(std::move(output));
+    return (ssize_t)length;
+  }
+
+  ssize_t enqueue_file(int file_fd, off_t offset, size_t length) {
+    QueuedOutput output;
+    output.file_fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+    if (output.file_fd < 0) {
+      return -1;
+    }
+    output.offset = offset;
+    output.length = length;
+    queue_.push_back(std::move(output));
+    return (ssize_t)length;
+  }
+
+  static bool would_block() {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+
+  // Block until the socket is ready for `events`; false on timeout or error
+  bool wait_for(short events) {
+    pollfd p = {fd_, events, 0};
+    int rc;
+    do {
+      rc = poll(&p, 1, SEND_TIMEOUT_MS);
+    } while (rc < 0 && errno == EINTR);
+    return rc > 0 && !(p.revents & (POLLERR | POLLNVAL));
+  }
+
+  // After a failed syscall: true if it was EAGAIN and the socket became
+  // ready again
+  bool retry_after_wait(short events) {
+    return would_block() && wait_for(events);
+  }
+
+  int fd_;
+  SSL *ssl_;
+  bool ktls_send_ = false;
+  bool ktls_recv_ = false;
+  bool queue_writes_ = false;
+  short wants_ = POLLIN;
+  std::deque<QueuedOutput> queue_;
+};
+
+// Receive buffer plus parser for the requests on one connection. The buffer
+// is reused, so once it has grown to fit a typical request, reading and
+// parsing a GET allocates nothing.
+class RequestReader {
+public:
+  explicit RequestReader(size_t initial_size = 16384)
+      : buffer_(initial_size, '\0'), initial_size_(initial_size) {}
+
+  // Read until a whole request (head and body) is buffered. Error covers
+  // both malformed requests (parser().error_status() is the HTTP status to
+  // answer with) and the peer closing or failing (error_status() == 0).
+  // Incomplete: a non-blocking socket has nothing more for now.
+  HttpParser::Status read(Connection &conn, HttpRequest &request) {
+    while (true) {
+      HttpParser::Status status =
+          parser_.parse(&buffer_[0], length_, request);
+      if (status != HttpParser::Incomplete) {
+        return status;
+      }
+
+      // Grow geometrically as bytes arrive, never past the request's size:
+      // a Content-Length alone does not reserve memory for the whole body
+      if (length_ == buffer_.size()) {
+        size_t size = buffer_.size() * 2;
+        size_t expected = parser_.expected_size();
+        if (expected > length_) {
+          size = std::min(size, expected);
+        }
+        buffer_.resize(size);
+      }
+
+      ssize_t n = conn.read(&buffer_[length_], buffer_.size() - length_);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return HttpParser::Incomplete;
+      }
+      if (n <= 0) {
+        return HttpParser::Error;
+      }
+      length_ += (size_t)n;
+    }
+  }
+
+  // Drop the request just handled, keeping any pipelined bytes after it
+  void next() {
+    size_t used = std::min(parser_.consumed(), length_);
+    memmove(&buffer_[0], &buffer_[used], length_ - used);
+    length_ -= used;
+    parser_.reset();
+  }
+
+  // Forget everything buffered (new connection); gives back memory a large
+  // upload made the buffer grow to
+  void clear() {
+    length_ = 0;
+    parser_.reset();
+    if (buffer_.size() > 4 * initial_size_) {
+      buffer_.resize(initial_size_);
+      buffer_.shrink_to_fit();
+    }
+  }
+
+  const HttpParser &parser() const { return parser_; }
+  void set_body_limit(HttpParser::BodyLimit limit) {
+    parser_.set_body_limit(limit);
+  }
+
+private:
+  std::string buffer_;
+  size_t initial_size_;
+  size_t length_ = 0;
+  HttpParser parser_;
+};
+
+// Plain-text error page, e.g. for requests the parser rejected
+inline void write_error(Connection &conn, int status) {
+  std::string reason = http_reason(status);
+  conn.write_all("HTTP/1.1 " + std::to_string(status) + " " + reason +
+                 "\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n" +
+                 std::to_string(status) + " - " + reason);
+}
+
+class TlsContext {
+public:
+  // Returns nullptr when TLS is not configured
+  static std::unique_ptr<TlsContext> from_env() {
+    const char *cert = getenv("GRABBIEL_TLS_CERT");
+    const char *key = getenv("GRABBIEL_TLS_KEY");
+    if (!cert || !*cert || !key || !*key) {
+      return nullptr;
+    }
+
+    std::unique_ptr<TlsContext> tls(new TlsContext());
+    if (!tls->load(cert, key, getenv("GRABBIEL_TLS_TICKET_KEY"))) {
+      ERR_print_errors_fp(stderr);
+      return nullptr;
+    }
+    return tls;
+  }
+
+  ~TlsContext() { SSL_CTX_free(ctx_); }
+
+  // Server-side session on a socket, before the handshake
+  SSL *create(int fd) {
+    SSL *ssl = SSL_new(ctx_);
+    if (ssl) {
+      SSL_set_fd(ssl, fd);
+    }
+    return ssl;
+  }
+
+  // Run the server handshake on an accepted blocking socket; nullptr on
+  // failure or when it is not done within TLS_HANDSHAKE_TIMEOUT_MS. The
+  // socket is non-blocking meanwhile, so the deadline bounds the whole
+  // handshake, not each read.
+  SSL *accept(int fd) {
+    SSL *ssl = create(fd);
+    if (!ssl) {
+      return nullptr;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += TLS_HANDSHAKE_TIMEOUT_MS / 1000;
+
+    bool ok = false;
+    while (true) {
+      int rc = SSL_accept(ssl);
+      if (rc == 1) {
+        ok = true;
+        break;
+      }
+      int err = SSL_get_error(ssl, rc);
+      if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        break;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long left = (deadline.tv_sec - now.tv_sec) * 1000 +
+                  (deadline.tv_nsec - now.tv_nsec) / 1000000;
+      pollfd p = {fd, short(err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT),
+                  0};
+      int ready = left > 0 ? poll(&p, 1, (int)left) : 0;
+      if (ready < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ready <= 0) {
+        break;
+      }
+    }
+
+    fcntl(fd, F_SETFL, flags);
+    if (!ok) {
+      ERR_clear_error();
+      SSL_free(ssl);
+      return nullptr;
+    }
+    return ssl;
+  }
+
+private:
+  TlsContext() : ctx_(SSL_CTX_new(TLS_server_method())) {}
+
+  bool load(const char *cert, const char *key, const char *ticket_key_path) {
+    if (!ctx_) {
+      return false;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+    // AES-GCM and ChaCha20-Poly1305 are the suites the kernel can offload
+    SSL_CTX_set_cipher_list(ctx_, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    SSL_CTX_set_ciphersuites(ctx_, "TLS_AES_128_GCM_SHA256:"
+                                   "TLS_AES_256_GCM_SHA384:"
+                                   "TLS_CHACHA20_POLY1305_SHA256");
+    SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS |
+                                  SSL_OP_CIPHER_SERVER_PREFERENCE |
+                                  SSL_OP_NO_RENEGOTIATION);
+    // Writes queued on a full socket are retried from the queue's copy
+    SSL_CTX_set_mode(ctx_, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // Resumption: stateless tickets plus a server cache for TLS 1.2
+    SSL_CTX_set_session_id_context(ctx_,
+                                   (const unsigned char *)TLS_SESSION_CONTEXT,
+                                   sizeof(TLS_SESSION_CONTEXT) - 1);
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx_, 20000);
+    SSL_CTX_set_timeout(ctx_, 24 * 3600);
+    SSL_CTX_set_num_tickets(ctx_, 2);
+
+    if (ticket_key_path && *ticket_key_path) {
+      unsigned char keys[80];
+      FILE *f = fopen(ticket_key_path, "rb");
+      size_t n = f ? fread(keys, 1, sizeof(keys), f) : 0;
+      if (f) {
+        fclose(f);
+      }
+      if (n != sizeof(keys) ||
+          SSL_CTX_set_tlsext_ticket_keys(ctx_, keys, sizeof(keys)) != 1) {
+        fprintf(stderr, "Invalid TLS ticket key file %s\n", ticket_key_path);
+        return false;
+      }
+    }
+
+    return SSL_CTX_use_certificate_chain_file(ctx_, cert) == 1 &&
+           SSL_CTX_use_PrivateKey_file(ctx_, key, SSL_FILETYPE_PEM) == 1 &&
+           SSL_CTX_check_private_key(ctx_) == 1;
+  }
+
+  SSL_CTX *ctx_;
+};
+
+// Socket bound to address:port and listening; exits on failure like the
+// original per-server setup did
+inline int open_listener(const char *address, int port) {
+  int server_fd;
+  int opt = 1;
+
+  if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    perror("Socket creation failed");
+    exit(EXIT_FAILURE);
+  }
+
+  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+      setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+    perror("Setsockopt failed");
+    exit(EXIT_FAILURE);
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+    fprintf(stderr, "Invalid bind address %s\n", address);
+    exit(EXIT_FAILURE);
+  }
+
+  if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("Bind failed");
+    exit(EXIT_FAILURE);
+  }
+
+  if (listen(server_fd, LISTEN_BACKLOG) < 0) {
+    perror("Listen failed");
+    exit(EXIT_FAILURE);
+  }
+
+  return server_fd;
+}
+
+// Set in a worker's environment by the supervisor (common/supervisor.h)
+struct WorkerEnvironment {
+  int slot = -1; // -1 when not started by a supervisor
+  int workers = 1;
+  int listen_fd = -1; // the slot's listener, inherited
+  int ready_fd = -1;  // written once the worker accepts connections
+};
+
+inline const WorkerEnvironment &worker_environment() {
+  static const WorkerEnvironment environment = [] {
+    auto number = [](const char *name) {
+      const char *value = getenv(name);
+      return value && *value ? atoi(value) : -1;
+    };
+    WorkerEnvironment env;
+    env.slot = number("GRABBIEL_WORKER_SLOT");
+    if (env.slot >= 0) {
+      env.workers = std::max(1, number("GRABBIEL_WORKERS"));
+      env.listen_fd = number("GRABBIEL_LISTEN_FD");
+      env.ready_fd = number("GRABBIEL_READY_FD");
+    }
+    return env;
+  }();
+  return environment;
+}
+
+inline volatile sig_atomic_t server_stop_requested = 0;
+
+inline void request_server_stop(int) { server_stop_requested = 1; }
+
+// SIGTERM and SIGINT stop the accept loop once the request in progress has
+// been answered: they stay blocked except while run_server waits for a
+// connection. Threads inherit the mask, so this has to run before the first
+// thread is started (run_supervisor does it).
+inline void block_stop_signals() {
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGTERM);
+  sigaddset(&stop, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &stop, nullptr);
+}
+
+// Interface to listen on; exits rather than serve plain HTTP off localhost
+inline const char *listen_address(bool tls) {
+  const char *address = getenv("GRABBIEL_BIND_ADDRESS");
+  if (!address || !*address) {
+    address = "127.0.0.1"; // Only bind to localhost
+  }
+  if (!tls && strcmp(address, "127.0.0.1") != 0) {
+    fprintf(stderr, "Refusing to serve plain HTTP on %s; configure "
+                    "GRABBIEL_TLS_CERT and GRABBIEL_TLS_KEY\n",
+            address);
+    exit(EXIT_FAILURE);
+  }
+  return address;
+}
+
+// Non-blocking listening socket, announced on stdout. A supervised worker
+// serves the listener it inherited and tells the supervisor it is ready;
+// otherwise the socket is opened here.
+inline int start_listening(const char *name, int port, bool tls) {
+  const char *address = listen_address(tls);
+  const WorkerEnvironment &worker = worker_environment();
+  int server_fd = worker.listen_fd >= 0 ? worker.listen_fd
+                                        : open_listener(address, port);
+  // Workers of two generations share a slot's listener during a reload;
+  // the one that loses a connection to the other must not block in accept
+  fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+  if (worker.slot >= 0) {
+    printf("%s worker %d (pid %d) started on %s://%s:%d\n", name,
+           worker.slot, (int)getpid(), tls ? "https" : "http", address, port);
+  } else {
+    printf("%s started on %s://%s:%d\n", name, tls ? "https" : "http",
+           address, port);
+  }
+  fflush(stdout);
+  if (worker.ready_fd >= 0) {
+    char ready = 1;
+    if (write(worker.ready_fd, &ready, 1) != 1) {
+      perror("Cannot notify the supervisor");
+    }
+    close(worker.ready_fd);
+  }
+  return server_fd;
+}
+
+// Bound blocking reads and writes on an accepted socket, so a client that
+// goes silent gives up its connection instead of holding the accept loop
+inline void set_connection_timeouts(int fd, int receive_ms, int send_ms) {
+  struct timeval receive = {receive_ms / 1000, (receive_ms % 1000) * 1000};
+  struct timeval send = {send_ms / 1000, (send_ms % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &receive, sizeof(receive));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send, sizeof(send));
+}
+
+// Accept connections until SIGTERM or SIGINT, handing each one to
+// `handler` in turn. A client silent for REQUEST_TIMEOUT_MS is dropped.
+inline int run_server(const char *name, int port,
+                      const std::function<void(Connection &)> &handler) {
+  signal(SIGPIPE, SIG_IGN);
+  block_stop_signals();
+  struct sigaction stop;
+  memset(&stop, 0, sizeof(stop));
+  stop.sa_handler = request_server_stop; // no SA_RESTART: ends the ppoll
+  sigaction(SIGTERM, &stop, nullptr);
+  sigaction(SIGINT, &stop, nullptr);
+
+  std::unique_ptr<TlsContext> tls = TlsContext::from_env();
+  int server_fd = start_listening(name, port, tls != nullptr);
+
+  sigset_t waiting;
+  pthread_sigmask(SIG_SETMASK, nullptr, &waiting);
+  sigdelset(&waiting, SIGTERM);
+  sigdelset(&waiting, SIGINT);
+
+  while (!server_stop_requested) {
+    struct pollfd listener = {server_fd, POLLIN, 0};
+    if (ppoll(&listener, 1, nullptr, &waiting) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Poll failed");
+      exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_in client;
+    socklen_t addrlen = sizeof(client);
+    int fd = accept(server_fd, (struct sockaddr *)&client, &addrlen);
+    if (fd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+          errno == ECONNABORTED) {
+        continue;
+      }
+      perror("Accept failed");
+      exit(EXIT_FAILURE);
+    }
+
+    // The TLS handshake and ticket flights are several small writes
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    set_connection_timeouts(fd, REQUEST_TIMEOUT_MS, SEND_TIMEOUT_MS);
+
+    SSL *ssl = nullptr;
+    if (tls && !(ssl = tls->accept(fd))) {
+      close(fd);
+      continue;
+    }
+
+    Connection conn(fd, ssl);
+    handler(conn);
+  }
+
+  // A worker's listener stays open in the supervisor, so connections still
+  // queued on it go to the slot's next worker instead of being reset
+  close(server_fd);
+  return 0;
+}
+
+// End a server process after run_server. The services' background threads
+// are still waiting on their condition variables, whose destructors would
+// block on them, so static destructors are skipped.
+[[noreturn]] inline void exit_server(int status) {
+  fflush(stdout);
+  fflush(stderr);
+  _exit(status);
+}
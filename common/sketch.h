@@ -0,0 +1,615 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Streaming frequency sketches for "top K over the last hour" without
+// keeping the events:
+//
+//   CountMinSketch  fixed-size counter matrix; estimates never undercount
+//                   and overcount by at most e/width of the stream w.h.p.
+//   SpaceSaving     the `capacity` heaviest keys seen, with error bounds
+//   SlidingTopK     a ring of time buckets, each with both, plus a running
+//                   sum of the live buckets' Count-Min cells so the window
+//                   needs no merge at query time. Candidates are the keys
+//                   some live bucket holds as a heavy hitter; top() ranks
+//                   them by their window estimate.
+//
+// Not thread-safe; callers serialize access.
+
+// Persisted bucket encodings (SlidingTopK::take_dirty). What take_dirty()
+// hands out is what each bucket gained since the last call, so processes
+// sharing a table add their parts with merge_data() instead of
+// overwriting each other's.
+#define SKETCH_DENSE 1
+#define SKETCH_SPARSE 2
+
+// 64-bit hash of a string key (FNV-1a with a final mix)
+inline uint64_t sketch_hash(std::string_view text) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (char c : text) {
+    h = (h ^ (unsigned char)c) * 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 33);
+}
+
+// Spread an integer key (a content id) over all 64 bits
+inline uint64_t sketch_hash(uint64_t key) {
+  key += 0x9e3779b97f4a7c15ULL;
+  key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+  return key ^ (key >> 31);
+}
+
+class CountMinSketch {
+public:
+  // `width` is rounded up to a power of two
+  CountMinSketch(uint32_t width, uint32_t depth) : depth_(depth) {
+    width_ = 1;
+    while (width_ < width) {
+      width_ <<= 1;
+    }
+    cells_.assign((size_t)width_ * depth_, 0);
+  }
+
+  void add(uint64_t hash, uint32_t count) {
+    for (uint32_t row = 0; row < depth_; row++) {
+      cells_[cell(row, hash)] += count;
+    }
+  }
+
+  uint32_t estimate(uint64_t hash) const {
+    uint32_t best = UINT32_MAX;
+    for (uint32_t row = 0; row < depth_; row++) {
+      best = std::min(best, cells_[cell(row, hash)]);
+    }
+    return best;
+  }
+
+  // Cell-wise sum and difference; both sketches have the same shape
+  void merge(const CountMinSketch &other) {
+    for (size_t i = 0; i < cells_.size(); i++) {
+      cells_[i] += other.cells_[i];
+    }
+  }
+  void subtract(const CountMinSketch &other) {
+    for (size_t i = 0; i < cells_.size(); i++) {
+      cells_[i] -= other.cells_[i];
+    }
+  }
+
+  void clear() { std::fill(cells_.begin(), cells_.end(), 0); }
+
+  std::vector<uint32_t> &cells() { return cells_; }
+  const std::vector<uint32_t> &cells() const { return cells_; }
+
+private:
+  // Row hashes derived from one 64-bit hash (Kirsch-Mitzenmacher)
+  size_t cell(uint32_t row, uint64_t hash) const {
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+    return (size_t)row * width_ + ((h1 + row * h2) & (width_ - 1));
+  }
+
+  uint32_t width_;
+  uint32_t depth_;
+  std::vector<uint32_t> cells_;
+};
+
+// Space-Saving heavy hitters over an indexed min-heap: a key that is not
+// tracked replaces the smallest entry and inherits its count as error
+class SpaceSaving {
+public:
+  struct Entry {
+    uint64_t key;
+    uint32_t count; // upper bound of the key's true count
+    uint32_t error; // count - error is a lower bound
+  };
+
+  explicit SpaceSaving(size_t capacity) : capacity_(capacity) {
+    heap_.reserve(capacity);
+  }
+
+  // Count `key`. `entered` is set if it was not tracked before and
+  // `evicted` to the key it displaced, if any.
+  void offer(uint64_t key, uint32_t count, bool &entered, bool &evicted,
+             uint64_t &evicted_key) {
+    entered = evicted = false;
+    auto it = position_.find(key);
+    if (it != position_.end()) {
+      heap_[it->second].count += count;
+      sift_down(it->second);
+      return;
+    }
+    entered = true;
+    if (heap_.size() < capacity_) {
+      heap_.push_back({key, count, 0});
+      position_[key] = heap_.size() - 1;
+      sift_up(heap_.size() - 1);
+      return;
+    }
+    evicted = true;
+    evicted_key = heap_[0].key;
+    position_.erase(evicted_key);
+    uint32_t floor = heap_[0].count;
+    heap_[0] = {key, floor + count, floor};
+    position_[key] = 0;
+    sift_down(0);
+  }
+
+  // Put back an entry as persisted; false if it was not kept (full, or
+  // the key is already tracked)
+  bool restore(const Entry &entry) {
+    if (heap_.size() >= capacity_ || position_.count(entry.key)) {
+      return false;
+    }
+    heap_.push_back(entry);
+    position_[entry.key] = heap_.size() - 1;
+    sift_up(heap_.size() - 1);
+    return true;
+  }
+
+  const std::vector<Entry> &entries() const { return heap_; }
+
+  void clear() {
+    heap_.clear();
+    position_.clear();
+  }
+
+private:
+  void swap_entries(size_t a, size_t b) {
+    std::swap(heap_[a], heap_[b]);
+    position_[heap_[a].key] = a;
+    position_[heap_[b].key] = b;
+  }
+
+  void sift_up(size_t i) {
+    while (i > 0 && heap_[(i - 1) / 2].count > heap_[i].count) {
+      swap_entries(i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+  }
+
+  void sift_down(size_t i) {
+    while (true) {
+      size_t smallest = i, left = 2 * i + 1, right = left + 1;
+      if (left < heap_.size() && heap_[left].count < heap_[smallest].count) {
+        smallest = left;
+      }
+      if (right < heap_.size() && heap_[right].count < heap_[smallest].count) {
+        smallest = right;
+      }
+      if (smallest == i) {
+        return;
+      }
+      swap_entries(i, smallest);
+      i = smallest;
+    }
+  }
+
+  size_t capacity_;
+  std::vector<Entry> heap_;
+  std::unordered_map<uint64_t, size_t> position_;
+};
+
+struct TopEntry {
+  uint64_t key;
+  std::string_view label; // as passed to add(); valid until the next call
+  uint32_t count;         // Count-Min estimate over the window
+};
+
+class SlidingTopK {
+public:
+  struct Options {
+    uint32_t bucket_seconds;
+    uint32_t buckets;
+    uint32_t width = 2048;
+    uint32_t depth = 4;
+    size_t heavy = 128; // heavy hitters tracked per bucket
+  };
+
+  explicit SlidingTopK(const Options &options)
+      : options_(options), window_(options.width, options.depth) {
+    ring_.reserve(options.buckets);
+    for (uint32_t i = 0; i < options.buckets; i++) {
+      ring_.emplace_back(options);
+    }
+  }
+
+  const Options &options() const { return options_; }
+
+  // Count one occurrence of `key` at `now`. `label` names the key in
+  // results (a hashtag); it is kept only while the key is a candidate.
+  void add(uint64_t key, time_t now, uint32_t count = 1,
+           std::string_view label = std::string_view()) {
+    int64_t index = advance(now);
+    Bucket &bucket = ring_[slot(index)];
+    if (bucket.index != index) {
+      return; // older than the window
+    }
+    uint64_t hash = sketch_hash(key);
+    bucket.cms.add(hash, count);
+    window_.add(hash, count);
+
+    if (!bucket.unsaved) {
+      bucket.unsaved.reset(
+          new CountMinSketch(options_.width, options_.depth));
+    }
+    bucket.unsaved->add(hash, count);
+
+    bool entered, evicted;
+    uint64_t evicted_key;
+    bucket.heavy.offer(key, count, entered, evicted, evicted_key);
+    if (entered) {
+      Candidate &candidate = acquire(key, label);
+      candidate.count = window_.estimate(hash);
+    } else if (!stale_) {
+      auto it = slots_.find(key);
+      if (it != slots_.end()) {
+        candidates_[it->second].count = window_.estimate(hash);
+      }
+    }
+    if (evicted) {
+      release(evicted_key);
+    }
+  }
+
+  // The `k` keys with the highest estimated count over the window
+  std::vector<TopEntry> top(size_t k, time_t now) {
+    advance(now);
+    if (stale_) {
+      for (Candidate &candidate : candidates_) {
+        candidate.count = window_.estimate(sketch_hash(candidate.key));
+      }
+      stale_ = false;
+    }
+    auto before = [this](uint32_t a, uint32_t b) {
+      const Candidate &x = candidates_[a], &y = candidates_[b];
+      return x.count != y.count ? x.count > y.count : x.key < y.key;
+    };
+    order_.resize(candidates_.size());
+    for (uint32_t i = 0; i < order_.size(); i++) {
+      order_[i] = i;
+    }
+    k = std::min(k, order_.size());
+    std::partial_sort(order_.begin(), order_.begin() + k, order_.end(),
+                      before);
+    std::vector<TopEntry> out;
+    out.reserve(k);
+    for (size_t i = 0; i < k; i++) {
+      const Candidate &candidate = candidates_[order_[i]];
+      out.push_back({candidate.key, candidate.label, candidate.count});
+    }
+    return out;
+  }
+
+  // Estimated count of one key over the window
+  uint32_t estimate(uint64_t key, time_t now) {
+    advance(now);
+    return window_.estimate(sketch_hash(key));
+  }
+
+  size_t candidates() const { return candidates_.size(); }
+
+  // What each bucket counted since the last call, serialized, as (index,
+  // data); add it to what is stored with merge_data()
+  std::vector<std::pair<int64_t, std::string>> take_dirty() {
+    std::vector<std::pair<int64_t, std::string>> out;
+    for (Bucket &bucket : ring_) {
+      if (bucket.index < 0 || !bucket.unsaved) {
+        continue;
+      }
+      // Heavy hitters only grow while tracked; a key evicted and taken
+      // back in starts above the count it left with
+      std::vector<SpaceSaving::Entry> gained;
+      for (const SpaceSaving::Entry &entry : bucket.heavy.entries()) {
+        SpaceSaving::Entry &saved = bucket.saved[entry.key];
+        if (entry.count > saved.count) {
+          gained.push_back({entry.key, entry.count - saved.count,
+                            entry.error - std::min(entry.error, saved.error)});
+        }
+        saved = entry;
+      }
+      out.emplace_back(bucket.index,
+                       serialize(*bucket.unsaved, gained, [this](uint64_t key) {
+                         return label(key);
+                       }));
+      bucket.unsaved.reset();
+    }
+    return out;
+  }
+
+  // Sum of two serialized buckets of this stream: cells add up, and the
+  // heavy hitters are combined by key, keeping the largest. Malformed
+  // `stored` data is replaced by `delta`.
+  std::string merge_data(std::string_view stored,
+                         std::string_view delta) const {
+    CountMinSketch cms(options_.width, options_.depth);
+    CountMinSketch added(options_.width, options_.depth);
+    std::vector<LabeledEntry> heavy, added_heavy;
+    if (!decode(delta, added, added_heavy)) {
+      return std::string(stored);
+    }
+    if (!decode(stored, cms, heavy)) {
+      return std::string(delta);
+    }
+    cms.merge(added);
+
+    std::unordered_map<uint64_t, size_t> position;
+    for (size_t i = 0; i < heavy.size(); i++) {
+      position[heavy[i].entry.key] = i;
+    }
+    for (const LabeledEntry &item : added_heavy) {
+      auto it = position.find(item.entry.key);
+      if (it == position.end()) {
+        position[item.entry.key] = heavy.size();
+        heavy.push_back(item);
+        continue;
+      }
+      LabeledEntry &entry = heavy[it->second];
+      entry.entry.count += item.entry.count;
+      entry.entry.error += item.entry.error;
+      if (entry.label.empty()) {
+        entry.label = item.label;
+      }
+    }
+    std::sort(heavy.begin(), heavy.end(),
+              [](const LabeledEntry &a, const LabeledEntry &b) {
+                return a.entry.count > b.entry.count;
+              });
+    if (heavy.size() > options_.heavy) {
+      heavy.resize(options_.heavy);
+    }
+
+    std::vector<SpaceSaving::Entry> entries;
+    std::unordered_map<uint64_t, std::string_view> labels;
+    for (const LabeledEntry &item : heavy) {
+      entries.push_back(item.entry);
+      labels[item.entry.key] = item.label;
+    }
+    return serialize(cms, entries, [&](uint64_t key) { return labels[key]; });
+  }
+
+  // Oldest bucket index still in the window at `now`
+  int64_t first_live(time_t now) const {
+    return now / options_.bucket_seconds - options_.buckets + 1;
+  }
+
+  // Load a bucket written by take_dirty(); false if malformed
+  bool restore(int64_t index, std::string_view data, time_t now) {
+    advance(now);
+    if (index < first_live(now) || index > head_) {
+      return true; // expired while we were down
+    }
+    Bucket &bucket = ring_[slot(index)];
+    expire(bucket);
+    bucket.index = index;
+    std::vector<LabeledEntry> heavy;
+    if (!decode(data, bucket.cms, heavy)) {
+      bucket.cms.clear(); // not yet part of the window
+      return false;
+    }
+    window_.merge(bucket.cms);
+    stale_ = true;
+    for (const LabeledEntry &item : heavy) {
+      // A candidate only for entries given a heavy-hitter slot, as expire()
+      // releases one per slot
+      if (!bucket.heavy.restore(item.entry)) {
+        continue;
+      }
+      bucket.saved[item.entry.key] = item.entry;
+      acquire(item.entry.key, item.label);
+    }
+    return true;
+  }
+
+private:
+  struct Bucket {
+    explicit Bucket(const Options &options)
+        : cms(options.width, options.depth), heavy(options.heavy) {}
+    int64_t index = -1; // now / bucket_seconds when it was opened
+    CountMinSketch cms;
+    SpaceSaving heavy;
+    // Cells counted since take_dirty() last saw the bucket, only while
+    // there are any, and the heavy hitters as it saw them
+    std::unique_ptr<CountMinSketch> unsaved;
+    std::unordered_map<uint64_t, SpaceSaving::Entry> saved;
+  };
+
+  struct LabeledEntry {
+    SpaceSaving::Entry entry;
+    std::string_view label; // into the decoded data
+  };
+
+  // A candidate's estimate is refreshed whenever the key is counted. Other
+  // keys only add to its cells, so between refreshes it stays an upper
+  // bound; expiring a bucket lowers cells and marks them all stale.
+  struct Candidate {
+    uint64_t key;
+    uint32_t buckets = 0; // live buckets holding the key as heavy
+    uint32_t count = 0;   // window estimate when last refreshed
+    std::string label;
+  };
+
+  size_t slot(int64_t index) const { return (size_t)(index % ring_.size()); }
+
+  Candidate &acquire(uint64_t key, std::string_view label) {
+    auto inserted = slots_.emplace(key, (uint32_t)candidates_.size());
+    if (inserted.second) {
+      candidates_.emplace_back();
+      candidates_.back().key = key;
+      candidates_.back().label.assign(label.data(), label.size());
+    }
+    Candidate &candidate = candidates_[inserted.first->second];
+    candidate.buckets++;
+    return candidate;
+  }
+
+  void release(uint64_t key) {
+    auto it = slots_.find(key);
+    if (it == slots_.end() || --candidates_[it->second].buckets) {
+      return;
+    }
+    // Swap the last candidate into the freed slot
+    uint32_t slot = it->second;
+    slots_.erase(it);
+    if (slot + 1 != candidates_.size()) {
+      candidates_[slot] = std::move(candidates_.back());
+      slots_[candidates_[slot].key] = slot;
+    }
+    candidates_.pop_back();
+  }
+
+  void expire(Bucket &bucket) {
+    if (bucket.index < 0) {
+      return;
+    }
+    window_.subtract(bucket.cms);
+    stale_ = true;
+    for (const SpaceSaving::Entry &entry : bucket.heavy.entries()) {
+      release(entry.key);
+    }
+    bucket.cms.clear();
+    bucket.heavy.clear();
+    bucket.index = -1;
+    bucket.unsaved.reset();
+    bucket.saved.clear();
+  }
+
+  // Open buckets up to `now`, expiring what falls out of the window
+  int64_t advance(time_t now) {
+    int64_t index = now / options_.bucket_seconds;
+    if (index <= head_) {
+      return index;
+    }
+    int64_t from = std::max(head_ + 1, index - (int64_t)ring_.size() + 1);
+    for (int64_t i = from; i <= index; i++) {
+      Bucket &bucket = ring_[slot(i)];
+      expire(bucket);
+      bucket.index = i;
+    }
+    head_ = index;
+    return index;
+  }
+
+  static bool read_u32(std::string_view data, size_t &p, uint32_t &value) {
+    if (data.size() - p < 4) {
+      return false;
+    }
+    memcpy(&value, data.data() + p, 4);
+    p += 4;
+    return true;
+  }
+
+  std::string_view label(uint64_t key) const {
+    auto it = slots_.find(key);
+    return it == slots_.end() ? std::string_view()
+                              : std::string_view(candidates_[it->second].label);
+  }
+
+  // Read what serialize() wrote into `cms` (of this stream's shape) and
+  // `heavy`; false if malformed
+  bool decode(std::string_view data, CountMinSketch &cms,
+              std::vector<LabeledEntry> &heavy) const {
+    std::vector<uint32_t> &cells = cms.cells();
+    size_t p = 0;
+    uint32_t encoding, count;
+    bool ok = read_u32(data, p, encoding);
+    if (ok && encoding == SKETCH_DENSE) {
+      size_t cell_bytes = cells.size() * sizeof(uint32_t);
+      ok = data.size() - p >= cell_bytes;
+      if (ok) {
+        memcpy(cells.data(), data.data() + p, cell_bytes);
+        p += cell_bytes;
+      }
+    } else if (ok && encoding == SKETCH_SPARSE && read_u32(data, p, count)) {
+      for (uint32_t i = 0; ok && i < count; i++) {
+        uint32_t cell, value;
+        ok = read_u32(data, p, cell) && read_u32(data, p, value) &&
+             cell < cells.size();
+        if (ok) {
+          cells[cell] = value;
+        }
+      }
+    } else {
+      ok = false;
+    }
+    if (!ok || !read_u32(data, p, count)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      LabeledEntry item;
+      uint32_t label_length;
+      if (data.size() - p < 20) {
+        return false;
+      }
+      memcpy(&item.entry.key, data.data() + p, 8);
+      memcpy(&item.entry.count, data.data() + p + 8, 4);
+      memcpy(&item.entry.error, data.data() + p + 12, 4);
+      memcpy(&label_length, data.data() + p + 16, 4);
+      p += 20;
+      if (data.size() - p < label_length) {
+        return false;
+      }
+      item.label = data.substr(p, label_length);
+      heavy.push_back(item);
+      p += label_length;
+    }
+    return true;
+  }
+
+  // A bucket of a quiet minute is mostly zero cells; those are written
+  // as (cell, value) pairs instead of the whole matrix
+  template <typename Labels>
+  static std::string serialize(const CountMinSketch &cms,
+                               const std::vector<SpaceSaving::Entry> &heavy,
+                               Labels labels) {
+    const std::vector<uint32_t> &cells = cms.cells();
+    size_t nonzero = cells.size() - std::count(cells.begin(), cells.end(), 0);
+    std::string out;
+    if (nonzero * 2 < cells.size()) {
+      uint32_t header[2] = {SKETCH_SPARSE, (uint32_t)nonzero};
+      out.append((const char *)header, sizeof(header));
+      for (uint32_t i = 0; i < cells.size(); i++) {
+        if (cells[i]) {
+          uint32_t pair[2] = {i, cells[i]};
+          out.append((const char *)pair, sizeof(pair));
+        }
+      }
+    } else {
+      uint32_t header = SKETCH_DENSE;
+      out.append((const char *)&header, 4);
+      out.append((const char *)cells.data(), cells.size() * sizeof(uint32_t));
+    }
+    uint32_t count = (uint32_t)heavy.size();
+    out.append((const char *)&count, 4);
+    for (const SpaceSaving::Entry &entry : heavy) {
+      std::string_view label = labels(entry.key);
+      uint32_t label_length = (uint32_t)label.size();
+      out.append((const char *)&entry.key, 8);
+      out.append((const char *)&entry.count, 4);
+      out.append((const char *)&entry.error, 4);
+      out.append((const char *)&label_length, 4);
+      out.append(label.data(), label.size());
+    }
+    return out;
+  }
+
+  Options options_;
+  std::vector<Bucket> ring_;
+  CountMinSketch window_; // sum of the live buckets
+  // Candidates are kept dense so top() scans an array, not hash nodes
+  std::vector<Candidate> candidates_;
+  std::unordered_map<uint64_t, uint32_t> slots_;
+  std::vector<uint32_t> order_;
+  int64_t head_ = -1; // newest bucket index opened
+  bool stale_ = false;  // candidate counts need recomputing
+};
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read side of the published-content snapshot written by
+// tools/snapshot_export: one immutable file holding every published content
+// block with its type, article, thumbnail, tags and metadata, so the public
+// site can resolve a url_slug without touching SQLite.
+//
+// Layout (little-endian, every section 8-byte aligned):
+//
+//   SnapshotHeader
+//   uint32_t seeds[bucket_count]       displacement per hash bucket
+//   SnapshotRecord records[count]      fixed width, in hash slot order
+//   SnapshotString tags[tag_count]     tag names, a range per record
+//   SnapshotPair meta[meta_count]      metadata, a range per record
+//   char heap[heap_size]               every string, deduplicated
+//
+// The slug index is a minimal perfect hash (hash and displace): the slug's
+// bucket gives a seed, the seed gives the slot, and the record in that slot
+// is the only candidate. Lookups read the mapping only: no allocation and
+// no syscalls once the file is mapped. The exporter replaces the file with
+// rename(), so a SnapshotStore can swap the new one in while readers keep
+// the old mapping alive through their shared_ptr.
+
+#define SNAPSHOT_MAGIC "GRBSNAP1"
+#define SNAPSHOT_VERSION 1
+
+struct SnapshotString {
+  uint32_t offset; // into the heap
+  uint32_t length;
+};
+
+struct SnapshotPair {
+  SnapshotString key;
+  SnapshotString value;
+};
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint32_t bucket_count;
+  uint32_t tag_count;
+  uint32_t meta_count;
+  uint32_t reserved;
+  int64_t created_at; // unix seconds
+  uint64_t seeds_offset;
+  uint64_t records_offset;
+  uint64_t tags_offset;
+  uint64_t meta_offset;
+  uint64_t heap_offset;
+  uint64_t heap_size;
+  uint64_t file_size;
+};
+
+struct SnapshotRecord {
+  int64_t id;
+  SnapshotString slug;
+  SnapshotString title;
+  SnapshotString type;
+  SnapshotString language;
+  SnapshotString created_at;
+  SnapshotString updated_at;
+  // Newest article of the block, empty strings if there is none
+  SnapshotString summary;
+  SnapshotString author;
+  SnapshotString published_at;
+  SnapshotString body;
+  // Newest complete thumbnail image, else content_blocks.thumbnail_url
+  SnapshotString thumbnail_url;
+  uint32_t thumbnail_width;
+  uint32_t thumbnail_height;
+  uint32_t tags_begin;
+  uint32_t tags_count;
+  uint32_t meta_begin;
+  uint32_t meta_count;
+};
+
+static_assert(sizeof(SnapshotHeader) == 96, "snapshot header layout");
+static_assert(sizeof(SnapshotRecord) == 120, "snapshot record layout");
+
+// 64-bit hash of a slug; the index derives everything else from it
+inline uint64_t snapshot_hash(std::string_view key) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ key.size();
+  size_t i = 0;
+  for (; i + 8 <= key.size(); i += 8) {
+    uint64_t word;
+    memcpy(&word, key.data() + i, 8);
+    h = (h ^ word) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, key.data() + i, key.size() - i);
+  h = (h ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 29;
+  h *= 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 32);
+}
+
+// Map a 64-bit value onto [0, n) without a division
+inline uint32_t snapshot_reduce(uint64_t value, uint32_t n) {
+  return (uint32_t)(((unsigned __int128)value * n) >> 64);
+}
+
+inline uint32_t snapshot_bucket(uint64_t hash, uint32_t bucket_count) {
+  return snapshot_reduce(hash, bucket_count);
+}
+
+inline uint32_t snapshot_slot(uint64_t hash, uint32_t seed, uint32_t count) {
+  uint64_t x = (hash ^ (seed * 0x9e3779b97f4a7c15ULL)) * 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 31;
+  return snapshot_reduce(x * 0x94d049bb133111ebULL, count);
+}
+
+// Changes whenever the file at a path is replaced or rewritten
+inline uint64_t snapshot_file_identity(const struct stat &st) {
+  return (uint64_t)st.st_ino ^ ((uint64_t)st.st_mtim.tv_nsec << 32) ^
+         (uint64_t)st.st_mtim.tv_sec;
+}
+
+class ContentSnapshot {
+public:
+  // Map and validate a snapshot file; nullptr with `error` set on failure
+  static std::shared_ptr<const ContentSnapshot> open(const std::string &path,
+                                                     std::string &error) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      error = "cannot open " + path + ": " + strerror(errno);
+      return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+      close(fd);
+      error = path + " is not a snapshot";
+      return nullptr;
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ,
+                      MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      error = "cannot map " + path + ": " + strerror(errno);
+      return nullptr;
+    }
+
+    std::shared_ptr<ContentSnapshot> snapshot(
+        new ContentSnapshot((const char *)data, st.st_size));
+    if (!snapshot->validate(error)) {
+      return nullptr;
+    }
+    snapshot->identity_ = snapshot_file_identity(st);
+    return snapshot;
+  }
+
+  ~ContentSnapshot() { munmap((void *)data_, size_); }
+
+  ContentSnapshot(const ContentSnapshot &) = delete;
+  ContentSnapshot &operator=(const ContentSnapshot &) = delete;
+
+  // The published block with this slug, or nullptr
+  const SnapshotRecord *find(std::string_view slug) const {
+    if (header_->count == 0) {
+      return nullptr;
+    }
+    uint64_t hash = snapshot_hash(slug);
+    uint32_t seed = seeds_[snapshot_bucket(hash, header_->bucket_count)];
+    const SnapshotRecord &record =
+        records_[snapshot_slot(hash, seed, header_->count)];
+    return str(record.slug) == slug ? &record : nullptr;
+  }
+
+  std::string_view str(SnapshotString s) const {
+    return std::string_view(heap_ + s.offset, s.length);
+  }
+
+  const SnapshotString *tags(const SnapshotRecord &record) const {
+    return tags_ + record.tags_begin;
+  }
+
+  const SnapshotPair *metadata(const SnapshotRecord &record) const {
+    return meta_ + record.meta_begin;
+  }
+
+  // Metadata value for `key`, empty if the block has none
+  std::string_view metadata(const SnapshotRecord &record,
+                            std::string_view key) const {
+    const SnapshotPair *pairs = metadata(record);
+    for (uint32_t i = 0; i < record.meta_count; i++) {
+      if (str(pairs[i].key) == key) {
+        return str(pairs[i].value);
+      }
+    }
+    return std::string_view();
+  }
+
+  size_t size() const { return header_->count; }
+  const SnapshotRecord *begin() const { return records_; }
+  const SnapshotRecord *end() const { return records_ + header_->count; }
+  int64_t created_at() const { return header_->created_at; }
+  uint64_t bytes() const { return size_; }
+
+private:
+  friend class SnapshotStore;
+
+  ContentSnapshot(const char *data, size_t size) : data_(data), size_(size) {}
+
+  bool section(uint64_t offset, uint64_t length) const {
+    return offset <= size_ && length <= size_ - offset;
+  }
+
+  // Bounds-check everything a lookup could follow, once, so lookups
+  // themselves need no checks
+  bool validate(std::string &error) {
+    header_ = (const SnapshotHeader *)data_;
+    const SnapshotHeader &h = *header_;
+    if (memcmp(h.magic, SNAPSHOT_MAGIC, 8) != 0 ||
+        h.version != SNAPSHOT_VERSION || h.file_size != size_) {
+      error = "bad snapshot header";
+      return false;
+    }
+    if (!section(h.seeds_offset, (uint64_t)h.bucket_count * 4) ||
+        !section(h.records_offset,
+                 (uint64_t)h.count * sizeof(SnapshotRecord)) ||
+        !section(h.tags_offset,
+                 (uint64_t)h.tag_count * sizeof(SnapshotString)) ||
+        !section(h.meta_offset,
+                 (uint64_t)h.meta_count * sizeof(SnapshotPair)) ||
+        !section(h.heap_offset, h.heap_size) ||
+        (h.count > 0 && h.bucket_count == 0)) {
+      error = "snapshot section out of bounds";
+      return false;
+    }
+    seeds_ = (const uint32_t *)(data_ + h.seeds_offset);
+    records_ = (const SnapshotRecord *)(data_ + h.records_offset);
+    tags_ = (const SnapshotString *)(data_ + h.tags_offset);
+    meta_ = (const SnapshotPair *)(data_ + h.meta_offset);
+    heap_ = data_ + h.heap_offset;
+
+    auto string_ok = [&](SnapshotString s) {
+      return (uint64_t)s.offset + s.length <= h.heap_size;
+    };
+    for (uint32_t i = 0; i < h.tag_count; i++) {
+      if (!string_ok(tags_[i])) {
+        error = "snapshot tag out of bounds";
+        return false;
+      }
+    }
+    for (uint32_t i = 0; i < h.meta_count; i++) {
+      if (!string_ok(meta_[i].key) || !string_ok(meta_[i].value)) {
+        error = "snapshot metadata out of bounds";
+        return false;
+      }
+    }
+    for (const SnapshotRecord &r : *this) {
+      const SnapshotString strings[] = {
+          r.slug,    r.title,  r.type,         r.language, r.created_at,
+          r.updated_at, r.summary, r.author, r.published_at, r.body,
+          r.thumbnail_url};
+      for (SnapshotString s : strings) {
+        if (!string_ok(s)) {
+          error = "snapshot string out of bounds";
+          return false;
+        }
+      }
+      if ((uint64_t)r.tags_begin + r.tags_count > h.tag_count ||
+          (uint64_t)r.meta_begin + r.meta_count > h.meta_count) {
+        error = "snapshot range out of bounds";
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const char *data_;
+  size_t size_;
+  uint64_t identity_ = 0; // inode and mtime, to notice a replaced file
+  const SnapshotHeader *header_ = nullptr;
+  const uint32_t *seeds_ = nullptr;
+  const SnapshotRecord *records_ = nullptr;
+  const SnapshotString *tags_ = nullptr;
+  const SnapshotPair *meta_ = nullptr;
+  const char *heap_ = nullptr;
+};
+
+// The snapshot currently published at a path. Readers take current() per
+// request and keep using that snapshot even if a reload swaps in a newer
+// one meanwhile; the old mapping goes away with its last reader.
+class SnapshotStore {
+public:
+  explicit SnapshotStore(const std::string &path) : path_(path) {}
+
+  std::shared_ptr<const ContentSnapshot> current() const {
+    return std::atomic_load(&current_);
+  }
+
+  // Map the file again if it was replaced since the last load; call it
+  // from a timer or after a publish, not per lookup. False if the file
+  // could not be loaded, in which case the previous snapshot stays.
+  bool reload(std::string &error) {
+    struct stat st;
+    if (stat(path_.c_str(), &st) != 0) {
+      error = "cannot stat " + path_ + ": " + strerror(errno);
+      return false;
+    }
+    std::shared_ptr<const ContentSnapshot> old = current();
+    if (old && old->identity_ == snapshot_file_identity(st)) {
+      return true;
+    }
+    std::shared_ptr<const ContentSnapshot> next =
+        ContentSnapshot::open(path_, error);
+    if (!next) {
+      return false;
+    }
+    std::atomic_store(&current_, next);
+    return true;
+  }
+
+private:
+  std::string path_;
+  std::shared_ptr<const ContentSnapshot> current_;
+};
@@ -0,0 +1,419 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/time.h>
+
+#include "histogram.h"
+
+// Turn a SQL statement into its workload "shape": literals become '?',
+// runs of whitespace collapse to one space and IN (?, ?, ?) lists collapse
+// to IN (?) so statements that only differ by their values group together.
+inline std::string normalize_sql(const char *sql) {
+  std::string out;
+  if (!sql) {
+    return out;
+  }
+
+  const char *p = sql;
+  while (*p) {
+    char c = *p;
+
+    if (std::isspace((unsigned char)c)) {
+      while (*p && std::isspace((unsigned char)*p)) {
+        p++;
+      }
+      if (!out.empty() && out.back() != ' ') {
+        out += ' ';
+      }
+      continue;
+    }
+
+    // String and blob literals
+    if (c == '\'' || ((c == 'x' || c == 'X') && p[1] == '\'')) {
+      if (c != '\'') {
+        p++;
+      }
+      p++;
+      while (*p) {
+        if (*p == '\'' && p[1] == '\'') {
+          p += 2;
+        } else if (*p == '\'') {
+          p++;
+          break;
+        } else {
+          p++;
+        }
+      }
+      out += '?';
+      continue;
+    }
+
+    // Quoted identifiers are kept verbatim
+    if (c == '"' || c == '`' || c == '[') {
+      char close = c == '[' ? ']' : c;
+      out += *p++;
+      while (*p && *p != close) {
+        out += *p++;
+      }
+      if (*p) {
+        out += *p++;
+      }
+      continue;
+    }
+
+    // Numeric literals (but not digits that are part of an identifier)
+    bool prev_ident = !out.empty() && (std::isalnum((unsigned char)out.back()) ||
+                                       out.back() == '_');
+    if (!prev_ident &&
+        (std::isdigit((unsigned char)c) ||
+         (c == '.' && std::isdigit((unsigned char)p[1])))) {
+      while (*p && (std::isalnum((unsigned char)*p) || *p == '.')) {
+        p++;
+      }
+      out += '?';
+      continue;
+    }
+
+    // Positional and named parameters
+    if (c == '?' || ((c == ':' || c == '@' || c == '$') &&
+                     (std::isalnum((unsigned char)p[1]) || p[1] == '_'))) {
+      p++;
+      while (*p && (std::isalnum((unsigned char)*p) || *p == '_')) {
+        p++;
+      }
+      out += '?';
+      continue;
+    }
+
+    out += (char)std::toupper((unsigned char)c);
+    p++;
+  }
+
+  while (!out.empty() && (out.back() == ' ' || out.back() == ';')) {
+    out.pop_back();
+  }
+
+  // Collapse "?, ?, ?" and "?,?" runs
+  std::string collapsed;
+  collapsed.reserve(out.size());
+  for (size_t i = 0; i < out.size(); i++) {
+    collapsed += out[i];
+    if (out[i] != '?') {
+      continue;
+    }
+    size_t j = i + 1;
+    while (true) {
+      size_t k = j;
+      while (k < out.size() && out[k] == ' ') {
+        k++;
+      }
+      if (k >= out.size() || out[k] != ',') {
+        break;
+      }
+      k++;
+      while (k < out.size() && out[k] == ' ') {
+        k++;
+      }
+      if (k >= out.size() || out[k] != '?') {
+        break;
+      }
+      j = k + 1;
+    }
+    i = j - 1;
+  }
+
+  return collapsed;
+}
+
+// Replace tabs and newlines so a statement fits on one workload log line
+inline std::string flatten_sql(const char *sql) {
+  std::string out = sql ? sql : "";
+  for (char &c : out) {
+    if (c == '\t' || c == '\n' || c == '\r') {
+      c = ' ';
+    }
+  }
+  return out;
+}
+
+// Workload capture. When GRABBIEL_SQL_WORKLOAD names a file, every finished
+// statement is appended to it as one tab separated line:
+//
+//   <unix time us> <elapsed ns> <normalized sql> <sql text> <expanded sql>
+//
+// tools/index_advisor replays these lines against EXPLAIN QUERY PLAN.
+class WorkloadCapture {
+public:
+  static WorkloadCapture &instance() {
+    static WorkloadCapture capture;
+    return capture;
+  }
+
+  bool enabled() const { return file_ != nullptr; }
+
+  void record(sqlite3_stmt *stmt, sqlite3_int64 elapsed_ns) {
+    if (!file_) {
+      return;
+    }
+
+    const char *text = sqlite3_sql(stmt);
+    char *expanded = sqlite3_expanded_sql(stmt);
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long long now_us = (long long)now.tv_sec * 1000000LL + now.tv_usec;
+
+    std::string line = std::to_string(now_us) + "\t" +
+                       std::to_string((long long)elapsed_ns) + "\t" +
+                       normalize_sql(text) + "\t" + flatten_sql(text) + "\t" +
+                       flatten_sql(expanded ? expanded : text) + "\n";
+    sqlite3_free(expanded);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    fwrite(line.data(), 1, line.size(), file_);
+    fflush(file_);
+  }
+
+private:
+  WorkloadCapture() {
+    const char *path = getenv("GRABBIEL_SQL_WORKLOAD");
+    if (path && *path) {
+      file_ = fopen(path, "a");
+    }
+  }
+
+  ~WorkloadCapture() {
+    if (file_) {
+      fclose(file_);
+    }
+  }
+
+  FILE *file_ = nullptr;
+  std::mutex mutex_;
+};
+
+struct QueryStats {
+  std::string normalized;
+  std::string sample;
+  uint64_t count = 0;
+  uint64_t total_ns = 0;
+  uint64_t max_ns = 0;
+  uint64_t vm_steps = 0;
+  uint64_t fullscan_steps = 0;
+  uint64_t sorts = 0;
+  uint64_t autoindexes = 0;
+  uint32_t histogram[LATENCY_BUCKETS] = {};
+
+  uint64_t percentile_ns(double p) const {
+    uint64_t target = (uint64_t)(p * count);
+    if (target >= count) {
+      target = count ? count - 1 : 0;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+      seen += histogram[i];
+      if (seen > target) {
+        return std::min(latency_bucket_upper(i), max_ns);
+      }
+    }
+    return max_ns;
+  }
+};
+
+// Per-statement profile aggregated over the life of the process. Every
+// connection opened through open_db() feeds it from its profile trace.
+// Statements slower than GRABBIEL_SLOW_QUERY_MS (default 100) are also
+// appended to GRABBIEL_SLOW_QUERY_LOG (default /tmp/grabbiel-slow-queries.log).
+class QueryProfiler {
+public:
+  static QueryProfiler &instance() {
+    static QueryProfiler profiler;
+    return profiler;
+  }
+
+  void record(sqlite3_stmt *stmt, sqlite3_int64 elapsed_ns) {
+    uint64_t ns = elapsed_ns > 0 ? (uint64_t)elapsed_ns : 0;
+    uint64_t vm_steps =
+        sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+    uint64_t fullscan_steps =
+        sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+    uint64_t sorts = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+    uint64_t autoindexes =
+        sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+    std::string normalized = normalize_sql(sqlite3_sql(stmt));
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      QueryStats &stats = stats_[normalized];
+      if (stats.count == 0) {
+        stats.normalized = normalized;
+        stats.sample = flatten_sql(sqlite3_sql(stmt));
+      }
+      stats.count++;
+      stats.total_ns += ns;
+      stats.max_ns = std::max(stats.max_ns, ns);
+      stats.vm_steps += vm_steps;
+      stats.fullscan_steps += fullscan_steps;
+      stats.sorts += sorts;
+      stats.autoindexes += autoindexes;
+      stats.histogram[latency_bucket(ns)]++;
+    }
+
+    if (slow_log_ && ns >= slow_threshold_ns_) {
+      char *expanded = sqlite3_expanded_sql(stmt);
+      char header[160];
+      snprintf(header, sizeof(header),
+               "[%ld] %.3f ms vm_steps=%llu fullscan_steps=%llu sorts=%llu "
+               "autoindexes=%llu ",
+               (long)time(NULL), ns / 1e6, (unsigned long long)vm_steps,
+               (unsigned long long)fullscan_steps, (unsigned long long)sorts,
+               (unsigned long long)autoindexes);
+      std::string line = header +
+                         flatten_sql(expanded ? expanded : sqlite3_sql(stmt)) +
+                         "\n";
+      sqlite3_free(expanded);
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      fwrite(line.data(), 1, line.size(), slow_log_);
+      fflush(slow_log_);
+    }
+  }
+
+  std::vector<QueryStats> snapshot() {
+    std::vector<QueryStats> out;
+    std::lock_guard<std::mutex> lock(mutex_);
+    out.reserve(stats_.size());
+    for (const auto &entry : stats_) {
+      out.push_back(entry.second);
+    }
+    return out;
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.clear();
+  }
+
+  uint64_t slow_threshold_ns() const { return slow_threshold_ns_; }
+
+private:
+  QueryProfiler() {
+    const char *ms = getenv("GRABBIEL_SLOW_QUERY_MS");
+    slow_threshold_ns_ = (uint64_t)((ms && *ms ? atof(ms) : 100.0) * 1e6);
+
+    const char *path = getenv("GRABBIEL_SLOW_QUERY_LOG");
+    slow_log_ = fopen(path && *path ? path : "/tmp/grabbiel-slow-queries.log",
+                      "a");
+  }
+
+  ~QueryProfiler() {
+    if (slow_log_) {
+      fclose(slow_log_);
+    }
+  }
+
+  std::unordered_map<std::string, QueryStats> stats_;
+  uint64_t slow_threshold_ns_;
+  FILE *slow_log_ = nullptr;
+  std::mutex mutex_;
+};
+
+// Top `limit` statements ordered by total time or by p99 latency
+inline std::vector<QueryStats> top_queries(std::vector<QueryStats> stats,
+                                           size_t limit, bool by_p99) {
+  std::sort(stats.begin(), stats.end(),
+            [by_p99](const QueryStats &a, const QueryStats &b) {
+              if (by_p99) {
+                return a.percentile_ns(0.99) > b.percentile_ns(0.99);
+              }
+              return a.total_ns > b.total_ns;
+            });
+  if (stats.size() > limit) {
+    stats.resize(limit);
+  }
+  return stats;
+}
+
+// Plain text rendering of top_queries() for servers without an HTML page
+inline std::string query_stats_report(const std::vector<QueryStats> &stats,
+                                      size_t limit) {
+  std::string out;
+  char line[256];
+
+  for (int by_p99 = 0; by_p99 < 2; by_p99++) {
+    out += by_p99 ? "\nTop by p99 latency\n" : "Top by total time\n";
+    snprintf(line, sizeof(line), "%8s %12s %10s %10s %12s %12s %6s %6s  %s\n",
+             "calls", "total_ms", "p99_ms", "max_ms", "vm_steps",
+             "scan_steps", "sorts", "autoix", "statement");
+    out += line;
+    for (const auto &q : top_queries(stats, limit, by_p99)) {
+      snprintf(line, sizeof(line),
+               "%8llu %12.3f %10.3f %10.3f %12llu %12llu %6llu %6llu  ",
+               (unsigned long long)q.count, q.total_ns / 1e6,
+               q.percentile_ns(0.99) / 1e6, q.max_ns / 1e6,
+               (unsigned long long)q.vm_steps,
+               (unsigned long long)q.fullscan_steps,
+               (unsigned long long)q.sorts, (unsigned long long)q.autoindexes);
+      out += line + q.normalized + "\n";
+    }
+  }
+
+  return out;
+}
+
+// SQLite's own profile clock only has millisecond resolution, so the start
+// of each run is stamped from SQLITE_TRACE_STMT and timed with steady_clock.
+inline std::unordered_map<sqlite3_stmt *, std::chrono::steady_clock::time_point> &
+statement_start_times() {
+  thread_local std::unordered_map<sqlite3_stmt *,
+                                  std::chrono::steady_clock::time_point>
+      starts;
+  return starts;
+}
+
+inline int sql_trace_callback(unsigned type, void *, void *p, void *x) {
+  sqlite3_stmt *stmt = (sqlite3_stmt *)p;
+
+  if (type == SQLITE_TRACE_STMT) {
+    // A new run replaces the start time a reset or interrupted run left
+    // behind; a trigger starting within the run ("-- " text) does not
+    const char *text = (const char *)x;
+    auto now = std::chrono::steady_clock::now();
+    if (text && strncmp(text, "--", 2) == 0) {
+      statement_start_times().emplace(stmt, now);
+    } else {
+      statement_start_times().insert_or_assign(stmt, now);
+    }
+  } else if (type == SQLITE_TRACE_PROFILE) {
+    sqlite3_int64 elapsed_ns = *(sqlite3_int64 *)x;
+    auto &starts = statement_start_times();
+    auto it = starts.find(stmt);
+    if (it != starts.end()) {
+      elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - it->second)
+                       .count();
+      starts.erase(it);
+    }
+    QueryProfiler::instance().record(stmt, elapsed_ns);
+    WorkloadCapture::instance().record(stmt, elapsed_ns);
+  }
+  return 0;
+}
+
+// Attach the profiling trace to a connection
+inline void install_sql_trace(sqlite3 *db) {
+  sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, sql_trace_callback,
+                   NULL);
+}
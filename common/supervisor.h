@@ -0,0 +1,433 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "server.h"
+
+// Multi-process serving on one port with zero-downtime reloads.
+//
+// With GRABBIEL_WORKERS set (0: one per CPU), run_supervisor() turns the
+// process into a supervisor. It opens one SO_REUSEPORT listener per worker
+// slot, so the kernel spreads connections over the slots, and starts a
+// worker per slot by re-executing the binary with that listener inherited
+// (see WorkerEnvironment). With several workers each one is pinned to a
+// CPU, and its listener prefers connections whose packets that CPU
+// handled (SO_INCOMING_CPU).
+//
+// SIGHUP reloads: a new worker is started for every slot from the binary
+// now on disk, and once all of them accept connections the old ones get
+// SIGTERM, finish the request in hand and exit. The listeners belong to
+// the supervisor, so connections queued on a slot wait for whichever of its
+// workers accepts next rather than being reset. If a new worker exits or
+// is not ready within SUPERVISOR_READY_SECONDS the reload is abandoned and
+// the old workers keep serving. A serving worker that dies is restarted
+// after SUPERVISOR_RESTART_MS. SIGTERM or SIGINT stops the workers the same
+// way and then the supervisor. A worker sent SIGTERM that has not exited
+// within SUPERVISOR_DRAIN_SECONDS is killed with SIGKILL, so a stuck
+// request cannot hold up a reload or a stop.
+//
+// Without GRABBIEL_WORKERS the server runs as a single process.
+
+#define SUPERVISOR_READY_SECONDS 30
+#define SUPERVISOR_RESTART_MS 1000
+#define SUPERVISOR_DRAIN_SECONDS 60 // over REQUEST_TIMEOUT_MS
+#define SUPERVISOR_MAX_WORKERS 256
+
+class Supervisor {
+public:
+  Supervisor(const char *name, int port, int workers)
+      : name_(name), port_(port), workers_(workers) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+          cpus_.push_back(cpu);
+        }
+      }
+    }
+    if (workers_ <= 0) {
+      workers_ = std::max<int>(1, (int)cpus_.size());
+    }
+    workers_ = std::min(workers_, SUPERVISOR_MAX_WORKERS);
+  }
+
+  Supervisor(const Supervisor &) = delete;
+  Supervisor &operator=(const Supervisor &) = delete;
+
+  // Serve until stopped; the process exit status
+  int run() {
+    char exe[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (length <= 0) {
+      perror("Cannot find the server binary");
+      return EXIT_FAILURE;
+    }
+    // Resolved now, so a reload runs whatever a deploy put at this path
+    exe_.assign(exe, length);
+
+    std::unique_ptr<TlsContext> tls = TlsContext::from_env();
+    const char *address = listen_address(tls != nullptr);
+    for (int slot = 0; slot < workers_; slot++) {
+      int fd = open_listener(address, port_);
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      int cpu = worker_cpu(slot);
+      if (cpu >= 0 &&
+          setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu))) {
+        perror("SO_INCOMING_CPU");
+      }
+      listeners_.push_back(fd);
+    }
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    for (int s : {SIGCHLD, SIGHUP, SIGTERM, SIGINT}) {
+      sigaddset(&signals, s);
+    }
+    sigprocmask(SIG_BLOCK, &signals, nullptr);
+    signal_fd_ = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd_ < 0) {
+      perror("signalfd");
+      return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "%s supervisor (pid %d): %d workers on %s:%d\n", name_,
+            (int)getpid(), workers_, address, port_);
+    start_generation();
+
+    while (!(stopping_ && processes_.empty())) {
+      std::vector<struct pollfd> fds = {{signal_fd_, POLLIN, 0}};
+      for (const Process &process : processes_) {
+        if (process.ready_fd >= 0) {
+          fds.push_back({process.ready_fd, POLLIN, 0});
+        }
+      }
+      if (poll(fds.data(), fds.size(), next_timeout_ms()) < 0 &&
+          errno != EINTR) {
+        perror("Poll failed");
+        return EXIT_FAILURE;
+      }
+      handle_signals();
+      for (size_t i = 1; i < fds.size(); i++) {
+        if (fds[i].revents) {
+          handle_ready(fds[i].fd);
+        }
+      }
+      if (starting_ && !stopping_) {
+        check_generation();
+      }
+      if (!serving_ && !starting_ && !stopping_) {
+        fprintf(stderr, "%s: workers failed to start\n", name_);
+        return EXIT_FAILURE;
+      }
+      restart_due();
+      kill_overdue();
+    }
+    fprintf(stderr, "%s supervisor stopped\n", name_);
+    return EXIT_SUCCESS;
+  }
+
+private:
+  struct Process {
+    pid_t pid = -1;
+    int slot = 0;
+    uint64_t generation = 0;
+    int ready_fd = -1; // read end until the worker reports
+    bool ready = false;
+    int64_t kill_at = 0; // SIGKILL deadline once sent SIGTERM
+  };
+
+  static int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+
+  // -1 when there is one worker, which keeps every CPU
+  int worker_cpu(int slot) const {
+    return workers_ > 1 && !cpus_.empty() ? cpus_[slot % cpus_.size()] : -1;
+  }
+
+  void start_generation() {
+    starting_ = ++generation_;
+    starting_deadline_ = now_ms() + SUPERVISOR_READY_SECONDS * 1000;
+    for (int slot = 0; slot < workers_; slot++) {
+      spawn(slot, starting_);
+    }
+  }
+
+  void spawn(int slot, uint64_t generation) {
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) != 0) {
+      perror("pipe");
+      return;
+    }
+    pid_t supervisor = getpid();
+    pid_t pid = fork();
+    if (pid == 0) {
+      // Workers go too if the supervisor is killed
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      if (getppid() != supervisor) {
+        _exit(EXIT_FAILURE);
+      }
+      int cpu = worker_cpu(slot);
+      if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+      }
+      for (int s = 0; s < (int)listeners_.size(); s++) {
+        if (s != slot) {
+          close(listeners_[s]);
+        }
+      }
+      fcntl(ready[1], F_SETFD, 0);
+      setenv("GRABBIEL_WORKERS", std::to_string(workers_).c_str(), 1);
+      setenv("GRABBIEL_WORKER_SLOT", std::to_string(slot).c_str(), 1);
+      setenv("GRABBIEL_LISTEN_FD", std::to_string(listeners_[slot]).c_str(),
+             1);
+      setenv("GRABBIEL_READY_FD", std::to_string(ready[1]).c_str(), 1);
+      sigset_t none;
+      sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, nullptr);
+      char *argv[] = {(char *)exe_.c_str(), nullptr};
+      execv(exe_.c_str(), argv);
+      perror("Cannot start worker");
+      _exit(127);
+    }
+    close(ready[1]);
+    if (pid < 0) {
+      perror("fork");
+      close(ready[0]);
+      if (generation == serving_) {
+        restart_at_.push_back({now_ms() + SUPERVISOR_RESTART_MS, slot});
+      }
+      return;
+    }
+    Process process;
+    process.pid = pid;
+    process.slot = slot;
+    process.generation = generation;
+    process.ready_fd = ready[0];
+    processes_.push_back(process);
+  }
+
+  void handle_signals() {
+    struct signalfd_siginfo info;
+    while (read(signal_fd_, &info, sizeof(info)) == sizeof(info)) {
+      if (info.ssi_signo == SIGCHLD) {
+        reap();
+      } else if (info.ssi_signo == SIGHUP) {
+        if (stopping_) {
+          continue;
+        }
+        if (starting_) {
+          fprintf(stderr, "%s: reload already in progress\n", name_);
+          continue;
+        }
+        fprintf(stderr, "%s: reloading\n", name_);
+        start_generation();
+      } else if (!stopping_) {
+        fprintf(stderr, "%s: stopping workers\n", name_);
+        stopping_ = true;
+        starting_ = 0;
+        restart_at_.clear();
+        for (Process &process : processes_) {
+          retire(process);
+        }
+      }
+    }
+  }
+
+  void reap() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      auto it = std::find_if(
+          processes_.begin(), processes_.end(),
+          [pid](const Process &process) { return process.pid == pid; });
+      if (it == processes_.end()) {
+        continue;
+      }
+      Process process = *it;
+      processes_.erase(it);
+      if (process.ready_fd >= 0) {
+        close(process.ready_fd);
+      }
+      if (stopping_) {
+        continue;
+      }
+      if (process.generation == starting_) {
+        fprintf(stderr, "%s: new worker %d (pid %d) exited with status %d; "
+                        "reload abandoned\n",
+                name_, process.slot, (int)pid, exit_code(status));
+        abandon_generation();
+      } else if (process.generation == serving_) {
+        fprintf(stderr, "%s: worker %d (pid %d) exited with status %d; "
+                        "restarting\n",
+                name_, process.slot, (int)pid, exit_code(status));
+        restart_at_.push_back({now_ms() + SUPERVISOR_RESTART_MS,
+                               process.slot});
+      }
+    }
+  }
+
+  static int exit_code(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  }
+
+  void handle_ready(int fd) {
+    for (Process &process : processes_) {
+      if (process.ready_fd == fd) {
+        char ready = 0;
+        process.ready = read(fd, &ready, 1) == 1 && ready == 1;
+        close(fd);
+        process.ready_fd = -1;
+        return;
+      }
+    }
+  }
+
+  // Promote the new generation once all of it is ready, or give up on it
+  void check_generation() {
+    int ready = 0;
+    for (const Process &process : processes_) {
+      ready += process.generation == starting_ && process.ready;
+    }
+    if (ready == workers_) {
+      serving_ = starting_;
+      starting_ = 0;
+      // Restarts still due were for the previous generation's slots
+      restart_at_.clear();
+      for (Process &process : processes_) {
+        if (process.generation < serving_) {
+          retire(process);
+        }
+      }
+      fprintf(stderr, "%s: generation %llu serving\n", name_,
+              (unsigned long long)serving_);
+    } else if (now_ms() >= starting_deadline_) {
+      fprintf(stderr, "%s: new workers not ready after %d s; reload "
+                      "abandoned\n",
+              name_, SUPERVISOR_READY_SECONDS);
+      abandon_generation();
+    }
+  }
+
+  // A worker that is not ready yet still has SIGTERM blocked
+  void abandon_generation() {
+    for (Process &process : processes_) {
+      if (process.generation != starting_) {
+        continue;
+      }
+      if (process.ready) {
+        retire(process);
+      } else {
+        kill(process.pid, SIGKILL);
+      }
+    }
+    starting_ = 0;
+  }
+
+  // SIGTERM: finish the request in hand and exit, or be killed once the
+  // drain deadline passes
+  void retire(Process &process) {
+    if (process.kill_at) {
+      return;
+    }
+    kill(process.pid, SIGTERM);
+    process.kill_at = now_ms() + SUPERVISOR_DRAIN_SECONDS * 1000;
+  }
+
+  void kill_overdue() {
+    int64_t now = now_ms();
+    for (Process &process : processes_) {
+      if (process.kill_at && process.kill_at <= now) {
+        fprintf(stderr, "%s: worker %d (pid %d) still running %d s after "
+                        "SIGTERM; killing it\n",
+                name_, process.slot, (int)process.pid,
+                SUPERVISOR_DRAIN_SECONDS);
+        kill(process.pid, SIGKILL);
+        process.kill_at = INT64_MAX; // reaped on its SIGCHLD
+      }
+    }
+  }
+
+  void restart_due() {
+    int64_t now = now_ms();
+    std::vector<std::pair<int64_t, int>> due;
+    for (auto it = restart_at_.begin(); it != restart_at_.end();) {
+      if (it->first <= now) {
+        due.push_back(*it);
+        it = restart_at_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    for (const auto &restart : due) {
+      spawn(restart.second, serving_);
+    }
+  }
+
+  int next_timeout_ms() const {
+    int64_t next = -1;
+    if (starting_) {
+      next = starting_deadline_;
+    }
+    for (const auto &restart : restart_at_) {
+      next = next < 0 ? restart.first : std::min(next, restart.first);
+    }
+    for (const Process &process : processes_) {
+      if (process.kill_at && process.kill_at != INT64_MAX) {
+        next = next < 0 ? process.kill_at : std::min(next, process.kill_at);
+      }
+    }
+    return next < 0 ? -1 : (int)std::max<int64_t>(0, next - now_ms());
+  }
+
+  const char *name_;
+  int port_;
+  int workers_;
+  std::vector<int> cpus_;
+  std::string exe_;
+  std::vector<int> listeners_;
+  int signal_fd_ = -1;
+  std::vector<Process> processes_;
+  std::vector<std::pair<int64_t, int>> restart_at_; // (due, slot)
+  uint64_t generation_ = 0;
+  uint64_t serving_ = 0;  // 0 until the first generation is ready
+  uint64_t starting_ = 0; // generation being started, 0 if none
+  int64_t starting_deadline_ = 0;
+  bool stopping_ = false;
+};
+
+// Call first thing in main(), before any thread is started. Returns in a
+// worker, or at once when GRABBIEL_WORKERS is not set; the supervisor
+// process exits here when it stops.
+inline void run_supervisor(const char *name, int port) {
+  block_stop_signals();
+  const char *workers = getenv("GRABBIEL_WORKERS");
+  if (worker_environment().slot >= 0 || !workers || !*workers) {
+    return;
+  }
+  Supervisor supervisor(name, port, atoi(workers));
+  exit(supervisor.run());
+}
@@ -0,0 +1,577 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <sqlite3.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "db.h"
+#include "roaring.h"
+
+// In-memory tag index: a Roaring bitmap of content ids per tag
+// (content_tags) and per hashtag (sochee_hashtag; sochee ids are content
+// block ids), plus bitmaps of every content block, per status and per
+// site to filter with. Multi-tag queries become bitmap AND/OR/AND NOT
+// instead of one self-join per tag.
+//
+// Built from the tables at open() and kept current by refresh(), which is
+// cheap enough to call per request: PRAGMA data_version tells whether any
+// other connection committed, and if so the rows named in
+// tag_index_changes (filled by triggers, migration 009) since the last
+// refresh are re-read. Without that table, or after a gap in it, the index
+// is rebuilt instead. Not thread-safe; one index per server thread.
+//
+// The change log is trimmed by prune_tag_index_changes(), which db_admin's
+// maintenance scheduler runs on a timer (common/maintenance.h), so it
+// keeps shrinking whether or not anything reads the index.
+
+#define TAG_INDEX_REBUILD_CHANGES 100000 // re-reading more rows than this
+                                         // is slower than a rebuild
+#define TAG_INDEX_CHANGE_RETENTION_SECONDS 3600
+#define TAG_INDEX_PRUNE_INTERVAL_SECONDS 300
+#define TAG_INDEX_BUSY_TIMEOUT_MS 1000
+
+enum class TagFamily { Content, Hashtag };
+
+struct TagQuery {
+  std::vector<std::string> all;  // every one of these
+  std::vector<std::string> any;  // at least one of these
+  std::vector<std::string> none; // none of these
+  std::string status;            // empty for any status
+  std::string site;              // slug or id, empty for any site
+};
+
+struct TagIndexStats {
+  size_t tags = 0;
+  size_t hashtags = 0;
+  size_t blocks = 0;
+  size_t bytes = 0;
+  double build_ms = 0;
+  uint64_t rebuilds = 0;
+  uint64_t changes = 0; // change log rows applied
+};
+
+// "a, b,c" -> {"a", "b", "c"}
+inline std::vector<std::string> split_tag_list(std::string_view text) {
+  std::vector<std::string> out;
+  while (!text.empty()) {
+    size_t comma = text.find(',');
+    std::string_view item = text.substr(0, comma);
+    while (!item.empty() && item.front() == ' ') {
+      item.remove_prefix(1);
+    }
+    while (!item.empty() && item.back() == ' ') {
+      item.remove_suffix(1);
+    }
+    if (!item.empty()) {
+      out.emplace_back(item);
+    }
+    text.remove_prefix(comma == std::string_view::npos ? text.size()
+                                                       : comma + 1);
+  }
+  return out;
+}
+
+class TagIndex {
+public:
+  TagIndex() = default;
+  ~TagIndex() { close(); }
+
+  TagIndex(const TagIndex &) = delete;
+  TagIndex &operator=(const TagIndex &) = delete;
+
+  bool ready() const { return db_ != nullptr; }
+
+  // Open a dedicated connection and build the index
+  bool open(const char *path, std::string &error) {
+    close();
+    if (open_db(path, &db_, SQLITE_OPEN_READWRITE) != SQLITE_OK) {
+      error = db_ ? sqlite3_errmsg(db_) : "cannot open database";
+      close();
+      return false;
+    }
+    sqlite3_busy_timeout(db_, TAG_INDEX_BUSY_TIMEOUT_MS);
+    if (!rebuild(error)) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  // Catch up with commits made since the last call
+  bool refresh(std::string &error) {
+    int64_t version = data_version();
+    if (version == data_version_) {
+      return true;
+    }
+    bool ok = has_change_log_ ? apply_changes(error) : rebuild(error);
+    if (ok) {
+      data_version_ = version;
+    }
+    return ok;
+  }
+
+  // Content ids matching `q`; false only if the database failed
+  bool query(TagFamily family, const TagQuery &q, RoaringBitmap &out,
+             std::string &error) {
+    out = RoaringBitmap();
+    std::vector<const RoaringBitmap *> all, any, none;
+    if (!find(family, q.all, all, error) || !find(family, q.any, any, error) ||
+        !find(family, q.none, none, error)) {
+      return false;
+    }
+    if (all.size() < q.all.size() || (!q.any.empty() && any.empty())) {
+      return true; // a required tag does not exist
+    }
+
+    // Smallest first, so every AND is at most that large
+    std::sort(all.begin(), all.end(),
+              [](const RoaringBitmap *a, const RoaringBitmap *b) {
+                return a->size() < b->size();
+              });
+    if (!all.empty()) {
+      out = *all[0];
+      for (size_t i = 1; i < all.size() && !out.empty(); i++) {
+        out &= *all[i];
+      }
+    }
+    if (!any.empty()) {
+      RoaringBitmap either = *any[0];
+      for (size_t i = 1; i < any.size(); i++) {
+        either |= *any[i];
+      }
+      if (all.empty()) {
+        out = std::move(either);
+      } else {
+        out &= either;
+      }
+    }
+    if (all.empty() && any.empty()) {
+      out = blocks_;
+    } else {
+      out &= blocks_; // tag rows can outlive their block
+    }
+
+    if (!q.status.empty()) {
+      auto it = statuses_.find(q.status);
+      if (it == statuses_.end()) {
+        out = RoaringBitmap();
+        return true;
+      }
+      out &= it->second;
+    }
+    if (!q.site.empty()) {
+      int64_t site_id = 0;
+      if (!resolve_site(q.site, site_id, error)) {
+        return false;
+      }
+      auto it = sites_.find(site_id);
+      if (it == sites_.end()) {
+        out = RoaringBitmap();
+        return true;
+      }
+      out &= it->second;
+    }
+    for (const RoaringBitmap *bitmap : none) {
+      out -= *bitmap;
+    }
+    return true;
+  }
+
+  TagIndexStats stats() const {
+    TagIndexStats s = stats_;
+    s.tags = tags_.size();
+    s.hashtags = hashtags_.size();
+    s.blocks = blocks_.size();
+    s.bytes = blocks_.bytes();
+    for (const auto &entry : tags_) {
+      s.bytes += entry.second.bytes();
+    }
+    for (const auto &entry : hashtags_) {
+      s.bytes += entry.second.bytes();
+    }
+    for (const auto &entry : statuses_) {
+      s.bytes += entry.second.bytes();
+    }
+    for (const auto &entry : sites_) {
+      s.bytes += entry.second.bytes();
+    }
+    return s;
+  }
+
+private:
+  void close() {
+    for (sqlite3_stmt *stmt :
+         {tag_id_stmt_, site_id_stmt_, content_tag_stmt_, hashtag_stmt_,
+          block_stmt_}) {
+      sqlite3_finalize(stmt);
+    }
+    tag_id_stmt_ = site_id_stmt_ = content_tag_stmt_ = hashtag_stmt_ =
+        block_stmt_ = nullptr;
+    if (db_) {
+      sqlite3_close(db_);
+      db_ = nullptr;
+    }
+  }
+
+  static bool valid_id(int64_t id) { return id >= 0 && id <= UINT32_MAX; }
+
+  int64_t scalar(const char *sql, int64_t fallback) {
+    sqlite3_stmt *stmt;
+    int64_t value = fallback;
+    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, NULL) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW &&
+        sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+      value = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+  }
+
+  int64_t data_version() { return scalar("PRAGMA data_version", -1); }
+
+  // Highest change log id ever handed out
+  int64_t change_sequence() {
+    return scalar("SELECT seq FROM sqlite_sequence "
+                  "WHERE name = 'tag_index_changes'",
+                  0);
+  }
+
+  bool prepare(sqlite3_stmt *&stmt, const char *sql, std::string &error) {
+    if (stmt) {
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      return true;
+    }
+    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, NULL) != SQLITE_OK) {
+      error = sqlite3_errmsg(db_);
+      return false;
+    }
+    return true;
+  }
+
+  // Run `sql` and call fn(stmt) per row
+  template <typename Fn>
+  bool scan(const char *sql, std::string &error, Fn fn) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, NULL) != SQLITE_OK) {
+      error = sqlite3_errmsg(db_);
+      return false;
+    }
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      fn(stmt);
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+      error = sqlite3_errmsg(db_);
+      return false;
+    }
+    return true;
+  }
+
+  // Read everything again inside one read transaction, then swap it in
+  bool rebuild(std::string &error) {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    int64_t version = data_version();
+    sqlite3_exec(db_, "BEGIN", NULL, NULL, NULL);
+
+    bool change_log =
+        scalar("SELECT 1 FROM sqlite_master WHERE type = 'table' "
+               "AND name = 'tag_index_changes'",
+               0) == 1;
+    int64_t position = change_log ? change_sequence() : 0;
+
+    RoaringBitmap blocks;
+    std::unordered_map<std::string, RoaringBitmap> statuses;
+    std::unordered_map<int64_t, RoaringBitmap> sites;
+    bool ok = scan("SELECT id, status, site_id FROM content_blocks", error,
+                   [&](sqlite3_stmt *stmt) {
+                     int64_t id = sqlite3_column_int64(stmt, 0);
+                     if (!valid_id(id)) {
+                       return;
+                     }
+                     const char *status =
+                         (const char *)sqlite3_column_text(stmt, 1);
+                     blocks.add((uint32_t)id);
+                     statuses[status ? status : ""].add((uint32_t)id);
+                     if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+                       sites[sqlite3_column_int64(stmt, 2)].add((uint32_t)id);
+                     }
+                   });
+
+    std::unordered_map<int64_t, RoaringBitmap> tags;
+    RoaringBitmap *last = nullptr;
+    int64_t last_tag = -1;
+    ok = ok && scan("SELECT tag_id, content_id FROM content_tags", error,
+                    [&](sqlite3_stmt *stmt) {
+                      int64_t tag = sqlite3_column_int64(stmt, 0);
+                      int64_t id = sqlite3_column_int64(stmt, 1);
+                      if (!valid_id(id)) {
+                        return;
+                      }
+                      if (tag != last_tag) {
+                        last = &tags[tag];
+                        last_tag = tag;
+                      }
+                      last->add((uint32_t)id);
+                    });
+
+    std::unordered_map<std::string, RoaringBitmap> hashtags;
+    ok = ok && scan("SELECT hashtag, content_id FROM sochee_hashtag", error,
+                    [&](sqlite3_stmt *stmt) {
+                      const char *hashtag =
+                          (const char *)sqlite3_column_text(stmt, 0);
+                      int64_t id = sqlite3_column_int64(stmt, 1);
+                      if (hashtag && valid_id(id)) {
+                        hashtags[hashtag].add((uint32_t)id);
+                      }
+                    });
+    sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL);
+    if (!ok) {
+      return false;
+    }
+
+    blocks_ = std::move(blocks);
+    statuses_ = std::move(statuses);
+    sites_ = std::move(sites);
+    tags_ = std::move(tags);
+    hashtags_ = std::move(hashtags);
+    has_change_log_ = change_log;
+    position_ = position;
+    data_version_ = version;
+    stats_.rebuilds++;
+    stats_.build_ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+    return true;
+  }
+
+  static void set(RoaringBitmap &bitmap, uint32_t id, bool present) {
+    if (present) {
+      bitmap.add(id);
+    } else {
+      bitmap.remove(id);
+    }
+  }
+
+  // Re-read the rows named in the change log since position_
+  bool apply_changes(std::string &error) {
+    sqlite3_exec(db_, "BEGIN", NULL, NULL, NULL);
+    int64_t sequence = change_sequence();
+    int64_t first =
+        scalar("SELECT min(id) FROM tag_index_changes", sequence + 1);
+    if (first > position_ + 1 ||
+        sequence - position_ > TAG_INDEX_REBUILD_CHANGES) {
+      // Rows we never saw were pruned, or there is too much to replay
+      sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL);
+      return rebuild(error);
+    }
+
+    sqlite3_stmt *changes;
+    if (sqlite3_prepare_v2(db_,
+                           "SELECT id, kind, content_id, tag_id, hashtag "
+                           "FROM tag_index_changes WHERE id > ? ORDER BY id",
+                           -1, &changes, NULL) != SQLITE_OK) {
+      error = sqlite3_errmsg(db_);
+      sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL);
+      return false;
+    }
+    sqlite3_bind_int64(changes, 1, position_);
+    bool ok = true;
+    int rc;
+    while (ok && (rc = sqlite3_step(changes)) == SQLITE_ROW) {
+      int64_t id = sqlite3_column_int64(changes, 2);
+      if (valid_id(id)) {
+        switch (sqlite3_column_int(changes, 1)) {
+        case 1:
+          ok = apply_content_tag(id, sqlite3_column_int64(changes, 3), error);
+          break;
+        case 2:
+          ok = apply_hashtag(id, (const char *)sqlite3_column_text(changes, 4),
+                             error);
+          break;
+        case 3:
+          ok = apply_block(id, error);
+          break;
+        }
+      }
+      if (ok) {
+        position_ = sqlite3_column_int64(changes, 0);
+        stats_.changes++;
+      }
+    }
+    if (ok && rc != SQLITE_DONE) {
+      error = sqlite3_errmsg(db_);
+      ok = false;
+    }
+    sqlite3_finalize(changes);
+    sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL);
+    return ok;
+  }
+
+  bool apply_content_tag(int64_t id, int64_t tag, std::string &error) {
+    if (!prepare(content_tag_stmt_,
+                 "SELECT 1 FROM content_tags WHERE content_id = ? "
+                 "AND tag_id = ?",
+                 error)) {
+      return false;
+    }
+    sqlite3_bind_int64(content_tag_stmt_, 1, id);
+    sqlite3_bind_int64(content_tag_stmt_, 2, tag);
+    bool present = sqlite3_step(content_tag_stmt_) == SQLITE_ROW;
+    sqlite3_reset(content_tag_stmt_);
+    RoaringBitmap &bitmap = tags_[tag];
+    set(bitmap, (uint32_t)id, present);
+    if (bitmap.empty()) {
+      tags_.erase(tag);
+    }
+    return true;
+  }
+
+  bool apply_hashtag(int64_t id, const char *hashtag, std::string &error) {
+    if (!hashtag) {
+      return true;
+    }
+    // Hashtags are not unique per post, so check for any remaining row
+    if (!prepare(hashtag_stmt_,
+                 "SELECT 1 FROM sochee_hashtag WHERE content_id = ? "
+                 "AND hashtag = ? LIMIT 1",
+                 error)) {
+      return false;
+    }
+    sqlite3_bind_int64(hashtag_stmt_, 1, id);
+    sqlite3_bind_text(hashtag_stmt_, 2, hashtag, -1, SQLITE_STATIC);
+    bool present = sqlite3_step(hashtag_stmt_) == SQLITE_ROW;
+    sqlite3_reset(hashtag_stmt_);
+    RoaringBitmap &bitmap = hashtags_[hashtag];
+    set(bitmap, (uint32_t)id, present);
+    if (bitmap.empty()) {
+      hashtags_.erase(hashtag);
+    }
+    return true;
+  }
+
+  bool apply_block(int64_t id, std::string &error) {
+    if (!prepare(block_stmt_,
+                 "SELECT status, site_id FROM content_blocks WHERE id = ?",
+                 error)) {
+      return false;
+    }
+    blocks_.remove((uint32_t)id);
+    for (auto &entry : statuses_) {
+      entry.second.remove((uint32_t)id);
+    }
+    for (auto &entry : sites_) {
+      entry.second.remove((uint32_t)id);
+    }
+    sqlite3_bind_int64(block_stmt_, 1, id);
+    if (sqlite3_step(block_stmt_) == SQLITE_ROW) {
+      const char *status = (const char *)sqlite3_column_text(block_stmt_, 0);
+      blocks_.add((uint32_t)id);
+      statuses_[status ? status : ""].add((uint32_t)id);
+      if (sqlite3_column_type(block_stmt_, 1) != SQLITE_NULL) {
+        sites_[sqlite3_column_int64(block_stmt_, 1)].add((uint32_t)id);
+      }
+    }
+    sqlite3_reset(block_stmt_); // else it holds the read lock
+    return true;
+  }
+
+  bool find(TagFamily family, const std::vector<std::string> &names,
+            std::vector<const RoaringBitmap *> &out, std::string &error) {
+    for (const std::string &name : names) {
+      const RoaringBitmap *bitmap = nullptr;
+      if (family == TagFamily::Hashtag) {
+        auto it = hashtags_.find(name);
+        bitmap = it == hashtags_.end() ? nullptr : &it->second;
+      } else {
+        if (!prepare(tag_id_stmt_, "SELECT id FROM tags WHERE name = ?",
+                     error)) {
+          return false;
+        }
+        sqlite3_bind_text(tag_id_stmt_, 1, name.data(), (int)name.size(),
+                          SQLITE_STATIC);
+        if (sqlite3_step(tag_id_stmt_) == SQLITE_ROW) {
+          auto it = tags_.find(sqlite3_column_int64(tag_id_stmt_, 0));
+          bitmap = it == tags_.end() ? nullptr : &it->second;
+        }
+        sqlite3_reset(tag_id_stmt_);
+      }
+      if (bitmap) {
+        out.push_back(bitmap);
+      }
+    }
+    return true;
+  }
+
+  bool resolve_site(const std::string &site, int64_t &id, std::string &error) {
+    if (std::all_of(site.begin(), site.end(),
+                    [](char c) { return c >= '0' && c <= '9'; })) {
+      id = std::stoll(site.substr(0, 18));
+      return true;
+    }
+    if (!prepare(site_id_stmt_, "SELECT id FROM sites WHERE slug = ?",
+                 error)) {
+      return false;
+    }
+    sqlite3_bind_text(site_id_stmt_, 1, site.data(), (int)site.size(),
+                      SQLITE_STATIC);
+    id = sqlite3_step(site_id_stmt_) == SQLITE_ROW
+             ? sqlite3_column_int64(site_id_stmt_, 0)
+             : -1;
+    sqlite3_reset(site_id_stmt_);
+    return true;
+  }
+
+  sqlite3 *db_ = nullptr;
+  sqlite3_stmt *tag_id_stmt_ = nullptr;
+  sqlite3_stmt *site_id_stmt_ = nullptr;
+  sqlite3_stmt *content_tag_stmt_ = nullptr;
+  sqlite3_stmt *hashtag_stmt_ = nullptr;
+  sqlite3_stmt *block_stmt_ = nullptr;
+
+  bool has_change_log_ = false;
+  int64_t position_ = 0;     // last change log id applied
+  int64_t data_version_ = -1;
+
+  RoaringBitmap blocks_; // every content block
+  std::unordered_map<std::string, RoaringBitmap> statuses_;
+  std::unordered_map<int64_t, RoaringBitmap> sites_;
+  std::unordered_map<int64_t, RoaringBitmap> tags_; // by tags.id
+  std::unordered_map<std::string, RoaringBitmap> hashtags_;
+  TagIndexStats stats_;
+};
+
+// Drop change log rows every reader has had time to apply: those older
+// than TAG_INDEX_CHANGE_RETENTION_SECONDS. A reader further behind sees
+// the gap and rebuilds. Rows deleted; 0 without a change log, -1 on error
+// (e.g. a busy database; retry next interval).
+inline int64_t prune_tag_index_changes(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db,
+                         "SELECT 1 FROM sqlite_master "
+                         "WHERE name = 'tag_index_changes'",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    return -1;
+  }
+  bool has_change_log = sqlite3_step(stmt) == SQLITE_ROW;
+  sqlite3_finalize(stmt);
+  if (!has_change_log) {
+    return 0;
+  }
+  std::string sql = "DELETE FROM tag_index_changes WHERE created_at < "
+                    "datetime('now', '-" +
+                    std::to_string(TAG_INDEX_CHANGE_RETENTION_SECONDS) +
+                    " seconds')";
+  if (sqlite3_exec(db, sql.c_str(), NULL, NULL, NULL) != SQLITE_OK) {
+    return -1;
+  }
+  return sqlite3_changes(db);
+}
@@ -1,7 +1,8 @@
 #!/bin/bash
 
 # Compile the admin interface
-g++ -std=c++17 -o db_admin db_admin.cpp -lsqlite3
+source "$(dirname "$0")/../common/build_flags.sh"
+g++ $DB_ADMIN_FLAGS -o db_admin db_admin.cpp $SERVER_LIBS
 
 # Create a systemd service for auto-start
 cat >/tmp/db-admin.service <<'EOF'
@@ -1,4 +1,7 @@
+#include <algorithm>
 #include <arpa/inet.h>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -15,326 +18,1329 @@
 #include <unistd.h>
 #include <vector>
 
+#include "../common/alloc_stats.h"
+#include "../common/db.h"
+#include "../common/html_template.h"
+#include "../common/maintenance.h"
+#include "../common/query_console.h"
+#include "../common/response.h"
+#include "../common/schema_catalog.h"
+#include "../common/server.h"
+#include "../common/supervisor.h"
+#include "../common/tag_index.h"
+
 #define ADMIN_PORT 8888
 #define BUFFER_SIZE 16384
 #define DB_PATH "/var/lib/grabbiel-db/content.db"
+#define TAG_QUERY_LIMIT 100
+#define TAG_QUERY_MAX_LIMIT 10000
+#define QUERY_FLUSH_MS 100
+#define QUERY_FLUSH_BYTES 16384
+#define QUERY_BLOB_PREVIEW 32 // bytes of a blob shown in results
+#define TABLE_PAGE_ROWS 100
+#define TABLE_MAX_PAGE_ROWS 1000
+#define TABLE_MAX_FILTERS 8
+
+COUNT_HEAP_ALLOCATIONS()
+
+typedef std::pmr::vector<std::pmr::string> Row; // values in column order
+
+// Tables, columns, indexes and foreign keys, reloaded when the schema
+// version changes
+SchemaCatalog &schema_catalog() {
+  static SchemaCatalog catalog;
+  return catalog;
+}
+
+// Bring the catalog up to date, opening it if that failed at startup
+bool refresh_schema_catalog(std::string &error) {
+  SchemaCatalog &catalog = schema_catalog();
+  return catalog.ready() ? catalog.refresh(error)
+                         : catalog.open(resolve_db_path(DB_PATH), error);
+}
 
-struct Column {
-  std::string name;
-  std::string type;
+// Comparison for ?filter=column:op:value
+struct FilterOp {
+  const char *name;
+  const char *sql;
+  bool takes_value;
 };
 
-struct Table {
-  std::string name;
-  std::vector<Column> columns;
+static const FilterOp FILTER_OPS[] = {
+    {"eq", " = ?", true},      {"ne", " <> ?", true},
+    {"lt", " < ?", true},      {"le", " <= ?", true},
+    {"gt", " > ?", true},      {"ge", " >= ?", true},
+    {"like", " LIKE ?", true}, {"null", " IS NULL", false},
+    {"notnull", " IS NOT NULL", false}};
+
+struct TableFilter {
+  std::string_view spec; // as given, for links
+  const CatalogColumn *column;
+  const FilterOp *op;
+  std::string_view value;
 };
 
-std::vector<std::string> get_tables(sqlite3 *db) {
-  std::vector<std::string> tables;
-  sqlite3_stmt *stmt;
+// What a table view shows: ?sort=column (-column for descending), any
+// number of ?filter=column:op:value, ?q= (substring of any text column)
+// and a page of rows from ?offset= and ?limit=. Views into the request.
+struct TableView {
+  explicit TableView(std::pmr::memory_resource *mr) : filters(mr) {}
 
-  const char *sql =
-      "SELECT name FROM sqlite_master WHERE type='table' ORDER BY name;";
+  const CatalogTable *table = nullptr;
+  const CatalogColumn *sort = nullptr;
+  bool descending = false;
+  std::pmr::vector<TableFilter> filters;
+  std::string_view search;
+  size_t offset = 0;
+  size_t limit = TABLE_PAGE_ROWS;
+};
 
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-    return tables;
+// Columns and operators are checked against the catalog
+bool parse_table_view(const HttpRequest &request, const CatalogTable &table,
+                      TableView &view, std::string &error) {
+  view.table = &table;
+  std::string_view sort = request.param("sort");
+  if (!sort.empty()) {
+    view.descending = sort[0] == '-';
+    sort.remove_prefix(view.descending);
+    if (!(view.sort = table.column(sort))) {
+      error = "No column " + std::string(sort) + " to sort by";
+      return false;
+    }
   }
 
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
-    const char *table_name = (const char *)sqlite3_column_text(stmt, 0);
-    tables.push_back(table_name);
+  for (size_t i = 0; i < request.param_count; i++) {
+    const HttpParam &param = request.params[i];
+    if (param.key != "filter" || param.value.empty()) {
+      continue;
+    }
+    size_t first = param.value.find(':');
+    size_t second = param.value.find(':', first + 1);
+    std::string_view column = param.value.substr(0, first);
+    std::string_view op =
+        first == std::string_view::npos
+            ? std::string_view()
+            : param.value.substr(first + 1, second - first - 1);
+    TableFilter filter = {param.value, table.column(column), nullptr,
+                          second == std::string_view::npos
+                              ? std::string_view()
+                              : param.value.substr(second + 1)};
+    for (const FilterOp &candidate : FILTER_OPS) {
+      if (op == candidate.name) {
+        filter.op = &candidate;
+      }
+    }
+    if (!filter.column || !filter.op ||
+        filter.op->takes_value != (second != std::string_view::npos)) {
+      error = "Invalid filter " + std::string(param.value) +
+              " (expected column:op:value; op is eq, ne, lt, le, gt, ge or "
+              "like, or column:null / column:notnull)";
+      return false;
+    }
+    if (view.filters.size() == TABLE_MAX_FILTERS) {
+      error = "Too many filters";
+      return false;
+    }
+    view.filters.push_back(filter);
   }
 
-  sqlite3_finalize(stmt);
-  return tables;
+  view.search = request.param("q");
+  view.offset = parse_unsigned(request.param("offset"), 0);
+  view.limit = std::min<size_t>(
+      parse_unsigned(request.param("limit"), TABLE_PAGE_ROWS),
+      TABLE_MAX_PAGE_ROWS);
+  if (!view.limit) {
+    view.limit = TABLE_PAGE_ROWS;
+  }
+  return true;
 }
 
-// Get columns for a specific table
-std::vector<Column> get_table_columns(sqlite3 *db,
-                                      const std::string &table_name) {
-  std::vector<Column> columns;
-  sqlite3_stmt *stmt;
+// Columns ?q= looks in: the text ones, or all if there are none
+std::pmr::vector<const CatalogColumn *>
+search_columns(const CatalogTable &table, std::pmr::memory_resource *mr) {
+  std::pmr::vector<const CatalogColumn *> columns(mr);
+  for (const CatalogColumn &column : table.columns) {
+    if (column.text_affinity()) {
+      columns.push_back(&column);
+    }
+  }
+  if (columns.empty()) {
+    for (const CatalogColumn &column : table.columns) {
+      columns.push_back(&column);
+    }
+  }
+  return columns;
+}
 
-  std::string sql = "PRAGMA table_info(" + table_name + ");";
+// SELECT for `view`; every value is a parameter, bound by
+// bind_table_view in the same order
+std::pmr::string table_view_sql(const TableView &view,
+                                std::pmr::memory_resource *mr) {
+  std::pmr::string sql("SELECT * FROM ", mr);
+  append_identifier(sql, view.table->name);
+  const char *joiner = " WHERE ";
+  for (const TableFilter &filter : view.filters) {
+    sql += joiner;
+    append_identifier(sql, filter.column->name);
+    sql += filter.op->sql;
+    joiner = " AND ";
+  }
+  if (!view.search.empty()) {
+    sql += joiner;
+    sql += '(';
+    const char *either = "";
+    for (const CatalogColumn *column : search_columns(*view.table, mr)) {
+      sql += either;
+      append_identifier(sql, column->name);
+      sql += " LIKE ? ESCAPE '\\'";
+      either = " OR ";
+    }
+    sql += ')';
+  }
+  if (view.sort) {
+    sql += " ORDER BY ";
+    append_identifier(sql, view.sort->name);
+    sql += view.descending ? " DESC" : " ASC";
+  }
+  sql += " LIMIT ? OFFSET ?";
+  return sql;
+}
 
-  if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
-    return columns;
+// `pattern` holds the ?q= pattern while the statement runs
+void bind_table_view(sqlite3_stmt *stmt, const TableView &view,
+                     std::pmr::string &pattern) {
+  int n = 1;
+  for (const TableFilter &filter : view.filters) {
+    if (filter.op->takes_value) {
+      sqlite3_bind_text(stmt, n++, filter.value.data(), filter.value.size(),
+                        SQLITE_STATIC);
+    }
   }
+  if (!view.search.empty()) {
+    // Substring match: LIKE's wildcards in the search are literal
+    pattern.assign(1, '%');
+    for (char c : view.search) {
+      if (c == '%' || c == '_' || c == '\\') {
+        pattern += '\\';
+      }
+      pattern += c;
+    }
+    pattern += '%';
+    int count = sqlite3_bind_parameter_count(stmt) - 2;
+    while (n <= count) {
+      sqlite3_bind_text(stmt, n++, pattern.data(), pattern.size(),
+                        SQLITE_STATIC);
+    }
+  }
+  sqlite3_bind_int64(stmt, n++, (sqlite3_int64)view.limit);
+  sqlite3_bind_int64(stmt, n++, (sqlite3_int64)view.offset);
+}
 
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
-    Column col;
-    col.name = (const char *)sqlite3_column_text(stmt, 1);
-    col.type = (const char *)sqlite3_column_text(stmt, 2);
-    columns.push_back(col);
+// One page of the view's rows; false and `error` if the query failed
+bool get_table_data(sqlite3 *db, const TableView &view,
+                    std::pmr::vector<Row> &records, std::string &error) {
+  std::pmr::memory_resource *mr = records.get_allocator().resource();
+  std::pmr::string sql = table_view_sql(view, mr);
+  std::pmr::string pattern(mr);
+  sqlite3_stmt *stmt;
+
+  if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+    error = sqlite3_errmsg(db);
+    return false;
   }
+  bind_table_view(stmt, view, pattern);
 
+  int column_count = sqlite3_column_count(stmt);
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    Row &record = records.emplace_back();
+    record.reserve(column_count);
+    for (int i = 0; i < column_count; i++) {
+      const char *value = (const char *)sqlite3_column_text(stmt, i);
+      record.emplace_back(value ? value : "NULL");
+    }
+  }
+  if (rc != SQLITE_DONE) {
+    error = sqlite3_errmsg(db);
+  }
   sqlite3_finalize(stmt);
-  return columns;
+  return rc == SQLITE_DONE;
 }
 
-// Get all table records
-std::vector<std::map<std::string, std::string>>
-get_table_data(sqlite3 *db, const std::string &table_name,
-               const std::vector<Column> &columns) {
-  std::vector<std::map<std::string, std::string>> records;
-  sqlite3_stmt *stmt;
+// How SQLite will run the view's query, from EXPLAIN QUERY PLAN
+struct TableViewPlan {
+  bool full_sort = false;    // ORDER BY needs a temp b-tree over all matches
+  bool partial_sort = false; // only part of the ORDER BY comes from an index
+  bool full_scan = false;    // no index narrows the filters
+  std::pmr::vector<std::pmr::string> details;
 
-  std::string sql = "SELECT * FROM " + table_name + ";";
+  explicit TableViewPlan(std::pmr::memory_resource *mr) : details(mr) {}
+};
 
+void plan_table_view(sqlite3 *db, const TableView &view, TableViewPlan &plan) {
+  std::pmr::memory_resource *mr = plan.details.get_allocator().resource();
+  std::pmr::string sql("EXPLAIN QUERY PLAN ", mr);
+  sql += table_view_sql(view, mr);
+  sqlite3_stmt *stmt;
   if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
-    return records;
+    return;
   }
-
   while (sqlite3_step(stmt) == SQLITE_ROW) {
-    std::map<std::string, std::string> record;
-    for (int i = 0; i < columns.size(); i++) {
-      const char *value = (const char *)sqlite3_column_text(stmt, i);
-      record[columns[i].name] = value ? value : "NULL";
+    const char *text = (const char *)sqlite3_column_text(stmt, 3);
+    std::string_view detail = text ? text : "";
+    if (detail.find("TEMP B-TREE FOR RIGHT PART OF ORDER BY") !=
+        std::string_view::npos) {
+      plan.partial_sort = true;
+    } else if (detail.find("TEMP B-TREE FOR ORDER BY") !=
+               std::string_view::npos) {
+      plan.full_sort = true;
+    } else if (detail.substr(0, 5) == "SCAN " &&
+               detail.find(" USING ") == std::string_view::npos) {
+      plan.full_scan = true;
     }
-    records.push_back(record);
+    plan.details.emplace_back(detail);
   }
+  sqlite3_finalize(stmt);
+}
 
+// Rows in `table` as of the last ANALYZE (sqlite_stat1), without counting;
+// -1 if there are no statistics for it
+int64_t estimate_table_rows(sqlite3 *db, const CatalogTable &table) {
+  if (!schema_catalog().find("sqlite_stat1")) {
+    return -1;
+  }
+  sqlite3_stmt *stmt;
+  const char *sql =
+      "SELECT max(CAST(stat AS INTEGER)) FROM sqlite_stat1 WHERE tbl = ?";
+  int64_t rows = -1;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+    sqlite3_bind_text(stmt, 1, table.name.c_str(), -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW &&
+        sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+      rows = sqlite3_column_int64(stmt, 0);
+    }
+  }
   sqlite3_finalize(stmt);
-  return records;
+  return rows;
 }
 
-// Parse URL parameters
-std::map<std::string, std::string> parse_params(const std::string &query) {
-  std::map<std::string, std::string> params;
-  std::istringstream iss(query);
-  std::string pair;
+// Page templates; see common/html_template.h for the hole syntax
+#define ADMIN_STYLE                                                            \
+  "body { font-family: Arial, sans-serif; margin: 20px; }"                     \
+  "table { border-collapse: collapse; width: 100%; margin-top: 20px; }"        \
+  "th, td { border: 1px solid #ddd; padding: 8px; text-align: left; }"        \
+  "th { background-color: #f2f2f2; }"                                          \
+  "tr:hover { background-color: #f5f5f5; }"
+
+HTML_TEMPLATE(MENU_LINK, "<a href='/table?name={{name:url}}'>{{name}}</a>");
+
+HTML_TEMPLATE(MAIN_PAGE,
+              "<!DOCTYPE html><html><head><title>SQLite Admin</title>"
+              "<style>" ADMIN_STYLE
+              ".menu { display: flex; background-color: #333; padding: 10px; "
+              "overflow: scroll; }"
+              ".menu a { color: white; padding: 10px; text-decoration: none; }"
+              ".menu a:hover { background-color: #555; }"
+              "</style></head><body>"
+              "<h1>SQLite Database Admin</h1><div class='menu'>"
+              "<a href='/'>Tables</a><a href='/admin/queries'>Queries</a>"
+              "<a href='/query'>SQL</a><a href='/storage'>Storage</a>"
+              "{{menu:raw}}</div>"
+              "<h2>Database Tables</h2><ul>{{tables:raw}}"
+              "</ul></body></html>");
+
+HTML_TEMPLATE(TABLE_LIST_ITEM,
+              "<li><a href='/table?name={{name:url}}'>{{name}}</a></li>");
+
+HTML_TEMPLATE(
+    TABLE_PAGE,
+    "<!DOCTYPE html><html><head><title>Table: {{table}}</title>"
+    "<style>" ADMIN_STYLE
+    ".menu { display: flex; background-color: #333; padding: 10px; }"
+    ".menu a { color: white; padding: 10px; text-decoration: none; }"
+    ".menu a:hover { background-color: #555; }"
+    ".actions { display: flex; gap: 10px; margin-top: 20px; }"
+    "button { padding: 10px; background-color: #4CAF50; color: white; "
+    "border: none; cursor: pointer; }"
+    "button:hover { background-color: #45a049; }"
+    "form.view { margin-top: 20px; }"
+    ".notice { color: #8a6d00; }"
+    ".error { color: #b00; }"
+    ".plan { background-color: #f8f8f8; border: 1px solid #ddd; "
+    "padding: 10px; font-family: monospace; }"
+    "</style></head><body><h1>SQLite Database Admin</h1>"
+    "<div class='menu'><a href='/'>Tables</a>{{menu:raw}}</div>"
+    "<h2>Table: {{table}}</h2><div class='actions'>"
+    "<button onclick=\"location.href='/insert?table={{table_param:url}}'\">"
+    "Add New Record</button>"
+    "<button onclick=\"location.href='/export?table={{table_param:url}}'\">"
+    "Export CSV</button></div>{{controls:raw}}{{status:raw}}"
+    "<table><tr>{{headers:raw}}</tr>{{rows:raw}}</table>{{pager:raw}}"
+    "{{schema:raw}}</body></html>");
+
+HTML_TEMPLATE(
+    TABLE_CONTROLS,
+    "<form class='view' action='/table'>"
+    "<input type='hidden' name='name' value='{{table:attr}}'>{{sort:raw}}"
+    "Search <input name='q' value='{{q:attr}}'> Filter {{filters:raw}}"
+    "<input name='filter' placeholder='column:op:value'> "
+    "<button type='submit'>Apply</button> "
+    "<a href='/table?name={{table_param:url}}'>Clear</a></form>");
+
+HTML_TEMPLATE(SORT_INPUT,
+              "<input type='hidden' name='sort' value='{{sort:attr}}'>");
+
+HTML_TEMPLATE(FILTER_INPUT, "<input name='filter' value='{{spec:attr}}'> ");
+
+HTML_TEMPLATE(COLUMN_HEADER, "<th><a href='{{href:raw}}'>{{name}}</a> "
+                             "({{type}}{{key}}){{arrow:raw}}</th>");
+
+HTML_TEMPLATE(ROW_RANGE, "<p>Rows {{first}} to {{last}}{{estimate:raw}}</p>");
+
+HTML_TEMPLATE(ROW_ESTIMATE, "; the table has about {{rows}} rows "
+                            "(sqlite_stat1)");
+
+HTML_TEMPLATE(SORT_NOTICE,
+              "<p class='notice'>Sorting by {{column}} needs a full sort of "
+              "every matching row: {{reason}}.</p>");
+
+HTML_TEMPLATE(PARTIAL_SORT_NOTICE,
+              "<p class='notice'>Sorting by {{column}} is partly done with a "
+              "temporary b-tree.</p>");
+
+HTML_TEMPLATE(SCAN_NOTICE, "<p class='notice'>No index narrows this view; "
+                           "every row of {{table}} is scanned.</p>");
+
+HTML_TEMPLATE(VIEW_PLAN, "<details><summary>Query plan</summary>"
+                         "<div class='plan'>{{plan:raw}}</div></details>");
+
+HTML_TEMPLATE(VIEW_ERROR, "<p class='error'>{{error}}</p>");
+
+HTML_TEMPLATE(PAGER_LINK, "<a href='{{href:raw}}'>{{label:raw}}</a> ");
+
+HTML_TEMPLATE(SCHEMA_INDEX, "<li>{{name}}{{unique}}: {{columns:raw}}</li>");
+
+HTML_TEMPLATE(SCHEMA_FOREIGN_KEY,
+              "<li>{{from:raw}} references "
+              "<a href='/table?name={{table:url}}'>{{table}}</a> "
+              "({{to:raw}}), on delete {{on_delete}}</li>");
+
+HTML_TEMPLATE(ROW_ACTIONS,
+              "<td><a href='/edit?table={{table:url}}&id={{id:url}}'>Edit</a> "
+              "| <a href='/delete?table={{table:url}}&id={{id:url}}' "
+              "onclick='return confirm(\"Are you sure?\")'>Delete</a></td>");
 
-  while (std::getline(iss, pair, '&')) {
-    std::istringstream pair_stream(pair);
-    std::string key, value;
+HTML_TEMPLATE(
+    QUERIES_PAGE,
+    "<!DOCTYPE html><html><head><title>Query Profile</title>"
+    "<style>" ADMIN_STYLE
+    ".menu { display: flex; background-color: #333; padding: 10px; "
+    "overflow: scroll; }"
+    ".menu a { color: white; padding: 10px; text-decoration: none; }"
+    ".menu a:hover { background-color: #555; }"
+    "</style></head><body><h1>SQLite Database Admin</h1><div class='menu'>"
+    "<a href='/'>Tables</a><a href='/admin/queries'>Queries</a>"
+    "<a href='/query'>SQL</a><a href='/storage'>Storage</a>{{menu:raw}}"
+    "</div><h2>Query Profile</h2>"
+    "<p>{{distinct}} distinct statements since "
+    "startup. Statements slower than {{slow_ms}} ms are written to the slow "
+    "query log.</p>"
+    "<h3>Top {{limit}} by total time</h3>{{by_total:raw}}"
+    "<h3>Top {{limit}} by p99 latency</h3>{{by_p99:raw}}</body></html>");
 
-    if (std::getline(pair_stream, key, '=')) {
-      std::getline(pair_stream, value);
-      params[key] = value;
+HTML_TEMPLATE(
+    STORAGE_PAGE,
+    "<!DOCTYPE html><html><head><title>Storage</title>"
+    "<style>" ADMIN_STYLE
+    ".menu { display: flex; background-color: #333; padding: 10px; "
+    "overflow: scroll; }"
+    ".menu a { color: white; padding: 10px; text-decoration: none; }"
+    ".menu a:hover { background-color: #555; }"
+    ".error { color: #b00; }"
+    "</style></head><body><h1>SQLite Database Admin</h1><div class='menu'>"
+    "<a href='/'>Tables</a><a href='/admin/queries'>Queries</a>"
+    "<a href='/query'>SQL</a><a href='/storage'>Storage</a>{{menu:raw}}"
+    "</div><h2>Storage</h2>"
+    "<p>{{mb}} MB in {{pages}} pages of {{page_size}} bytes, {{free}} free "
+    "({{free_pct}}%). Journal mode {{journal}}, auto_vacuum {{auto_vacuum}}, "
+    "WAL {{wal_kb}} KB.</p>"
+    "<p>Maintenance runs in idle periods (no commits for {{idle_need}} s), "
+    "at most every {{interval}} s, within {{budget}} ms, and the survey "
+    "within {{survey_budget}} ms of its own. {{runs}} runs; idle for "
+    "{{idle}} s.{{error:raw}}</p>"
+    "<form method='post' action='/storage/run'>"
+    "<button type='submit'>Run maintenance now</button></form>"
+    "<h3>B-trees</h3>{{survey:raw}}"
+    "<h3>Recent tasks</h3><table><tr><th>When</th><th>Task</th>"
+    "<th>Time (ms)</th><th>Result</th><th>Detail</th></tr>{{history:raw}}"
+    "</table></body></html>");
+
+HTML_TEMPLATE(STORAGE_ERROR, " <span class='error'>{{error}}</span>");
+
+HTML_TEMPLATE(SURVEY_PROGRESS,
+              "<p class='error'>Survey incomplete: {{done}} of {{total}} "
+              "b-trees so far; it carries on in the next run.</p>");
+
+HTML_TEMPLATE(SURVEY_TABLE,
+              "<p>Surveyed {{age}} s ago from dbstat in {{ms}} ms.</p>"
+              "<table><tr><th>Name</th><th>Type</th><th>Pages</th>"
+              "<th>Size (KB)</th><th>Unused (%)</th>"
+              "<th>Fragmentation (%)</th></tr>{{rows:raw}}</table>");
+
+HTML_TEMPLATE(SURVEY_ROW,
+              "<tr><td>{{name}}{{incomplete:raw}}</td>"
+              "<td>{{type}}</td><td>{{pages}}</td><td>{{kb}}</td>"
+              "<td>{{unused}}</td><td>{{fragmentation}}</td></tr>");
+
+HTML_TEMPLATE(TASK_ROW, "<tr><td>{{age}} s ago</td><td>{{task}}</td>"
+                        "<td>{{ms}}</td><td>{{result}}</td>"
+                        "<td>{{detail}}</td></tr>");
+
+HTML_TEMPLATE(QUERY_TABLE,
+              "<table><tr><th>Statement</th><th>Calls</th><th>Total (ms)</th>"
+              "<th>Mean (ms)</th><th>p99 (ms)</th><th>Max (ms)</th>"
+              "<th>VM steps</th><th>Full scan steps</th><th>Sorts</th>"
+              "<th>Auto indexes</th></tr>{{rows:raw}}</table>");
+
+HTML_TEMPLATE(QUERY_ROW,
+              "<tr><td><code>{{sql}}</code></td><td>{{count}}</td>"
+              "<td>{{total_ms}}</td><td>{{mean_ms}}</td><td>{{p99_ms}}</td>"
+              "<td>{{max_ms}}</td><td>{{vm_steps}}</td>"
+              "<td>{{fullscan_steps}}</td><td>{{sorts}}</td>"
+              "<td>{{autoindexes}}</td></tr>");
+
+HTML_TEMPLATE(
+    QUERY_PAGE,
+    "<!DOCTYPE html><html><head><title>SQL Console</title>"
+    "<style>" ADMIN_STYLE
+    ".menu { display: flex; background-color: #333; padding: 10px; "
+    "overflow: scroll; }"
+    ".menu a { color: white; padding: 10px; text-decoration: none; }"
+    ".menu a:hover { background-color: #555; }"
+    "textarea { width: 100%; font-family: monospace; }"
+    ".plan { background-color: #f8f8f8; border: 1px solid #ddd; "
+    "padding: 10px; font-family: monospace; }"
+    ".error { color: #b00; }"
+    "</style></head><body><h1>SQLite Database Admin</h1><div class='menu'>"
+    "<a href='/'>Tables</a><a href='/admin/queries'>Queries</a>"
+    "<a href='/query'>SQL</a><a href='/storage'>Storage</a>{{menu:raw}}"
+    "</div><h2>SQL Console</h2>"
+    "<form id='query' action='/query'>"
+    "<textarea name='sql' rows='8' "
+    "oninput=\"document.getElementById('run').disabled = true\">{{sql}}"
+    "</textarea><p>"
+    "Time budget <input name='timeout_ms' size='7' value='{{timeout_ms}}'> ms "
+    "Step budget <input name='steps' size='11' value='{{steps}}'> "
+    "<button type='submit'>Explain</button> "
+    "<button type='button' id='run' onclick='runQuery()' {{run_state}}>"
+    "Run</button> <button type='button' id='cancel' onclick='cancelQuery()' "
+    "disabled>Cancel</button></p></form>{{plan:raw}}"
+    "<p id='status'></p><table id='rows'></table>{{script:raw}}"
+    "</body></html>");
+
+HTML_TEMPLATE(QUERY_PLAN_PANEL, "<h3>EXPLAIN QUERY PLAN</h3>"
+                                "<div class='plan'>{{plan:raw}}</div>");
+
+HTML_TEMPLATE(QUERY_PLAN_ERROR, "<p class='error'>{{error}}</p>");
+
+HTML_TEMPLATE(QUERY_PLAN_NODE, "<li>{{detail}}{{children:raw}}</li>");
+
+// Streams /query/run (one JSON value per line) into the results table;
+// Cancel aborts the fetch, and the server interrupts the query when it
+// sees the connection close
+#define QUERY_CONSOLE_SCRIPT                                                   \
+  "<script>let controller = null;"                                             \
+  "function cell(tag, value) {"                                                \
+  "  const c = document.createElement(tag);"                                   \
+  "  c.textContent = value === null ? 'NULL' : value; return c; }"             \
+  "function show(line) {"                                                      \
+  "  const table = document.getElementById('rows');"                           \
+  "  if (Array.isArray(line)) {"                                               \
+  "    const tr = table.insertRow(); line.forEach(v => tr.append(cell('td', "  \
+  "v)));"                                                                      \
+  "  } else if (line.columns) {"                                               \
+  "    const tr = table.insertRow();"                                          \
+  "    line.columns.forEach(c => tr.append(cell('th', c)));"                   \
+  "  } else {"                                                                 \
+  "    document.getElementById('status').textContent = line.status + ': ' + "  \
+  "line.rows + ' rows, ' + line.steps + ' VM steps, ' + line.ms + ' ms' + "    \
+  "(line.error ? ' - ' + line.error : ''); } }"                                \
+  "async function runQuery() {"                                                \
+  "  const params = new URLSearchParams(new FormData("                         \
+  "document.getElementById('query')));"                                        \
+  "  const status = document.getElementById('status');"                        \
+  "  document.getElementById('rows').innerHTML = '';"                          \
+  "  status.textContent = 'Running...';"                                       \
+  "  controller = new AbortController();"                                      \
+  "  document.getElementById('cancel').disabled = false;"                      \
+  "  try {"                                                                    \
+  "    const r = await fetch('/query/run?' + params, "                         \
+  "{ signal: controller.signal });"                                            \
+  "    if (!r.ok) { status.textContent = await r.text(); } else {"             \
+  "      const reader = r.body.getReader(), decoder = new TextDecoder();"      \
+  "      let buffer = '';"                                                     \
+  "      for (;;) {"                                                           \
+  "        const { done, value } = await reader.read(); if (done) break;"      \
+  "        buffer += decoder.decode(value, { stream: true }); let nl;"         \
+  "        while ((nl = buffer.indexOf('\\n')) >= 0) {"                        \
+  "          show(JSON.parse(buffer.slice(0, nl)));"                           \
+  "          buffer = buffer.slice(nl + 1); } } }"                             \
+  "  } catch (e) {"                                                            \
+  "    status.textContent = e.name === 'AbortError' ? 'Cancelled' : '' + e; }" \
+  "  document.getElementById('cancel').disabled = true; }"                     \
+  "function cancelQuery() { if (controller) controller.abort(); }"             \
+  "</script>"
+
+// Links to every table for the menu bar
+void render_table_menu(HtmlOutput &out) {
+  for (const CatalogTable &table : schema_catalog().tables()) {
+    render<MENU_LINK>(out, table.name);
+  }
+}
+
+// "a, b"; an empty name is an expression in an index or, in a foreign
+// key, the parent's primary key
+void render_name_list(HtmlOutput &out, const std::vector<std::string> &names) {
+  for (size_t i = 0; i < names.size(); i++) {
+    if (i) {
+      out.append_static(", ");
+    }
+    if (names[i].empty()) {
+      out.append_static("<i>expr</i>");
+    } else {
+      out.append_html(names[i]);
     }
   }
+}
 
-  return params;
+// Indexes and foreign keys under a table's rows
+void render_table_schema(HtmlOutput &out, const CatalogTable &table) {
+  if (!table.indexes.empty()) {
+    out.append_static("<h3>Indexes</h3><ul>");
+    for (const CatalogIndex &index : table.indexes) {
+      render<SCHEMA_INDEX>(out, index.name, index.unique ? " (unique)" : "",
+                           [&](HtmlOutput &o) {
+                             render_name_list(o, index.columns);
+                           });
+    }
+    out.append_static("</ul>");
+  }
+  if (!table.foreign_keys.empty()) {
+    out.append_static("<h3>Foreign keys</h3><ul>");
+    for (const CatalogForeignKey &key : table.foreign_keys) {
+      render<SCHEMA_FOREIGN_KEY>(
+          out, [&](HtmlOutput &o) { render_name_list(o, key.from); },
+          key.table, [&](HtmlOutput &o) { render_name_list(o, key.to); },
+          key.on_delete);
+    }
+    out.append_static("</ul>");
+  }
 }
 
 // Generate HTML for the main page
-std::string generate_main_page(sqlite3 *db) {
-  std::stringstream html;
-  std::vector<std::string> tables = get_tables(db);
+void generate_main_page(HtmlOutput &out) {
+  render<MAIN_PAGE>(
+      out, [&](HtmlOutput &o) { render_table_menu(o); },
+      [&](HtmlOutput &o) {
+        for (const CatalogTable &table : schema_catalog().tables()) {
+          render<TABLE_LIST_ITEM>(o, table.name);
+        }
+      });
+}
 
-  html << "<!DOCTYPE html>" << "<html><head><title>SQLite Admin</title>"
-       << "<style>" << "body { font-family: Arial, sans-serif; margin: 20px; }"
-       << "table { border-collapse: collapse; width: 100%; margin-top: 20px; }"
-       << "th, td { border: 1px solid #ddd; padding: 8px; text-align: left; }"
-       << "th { background-color: #f2f2f2; }"
-       << "tr:hover { background-color: #f5f5f5; }"
-       << ".menu { display: flex; background-color: #333; padding: 10px; "
-          "overflow: scroll; }"
-       << ".menu a { color: white; padding: 10px; text-decoration: none; }"
-       << ".menu a:hover { background-color: #555; }" << "</style></head><body>"
-       << "<h1>SQLite Database Admin</h1>" << "<div class='menu'>"
-       << "<a href='/'>Tables</a>";
+// Link to `view` sorted by `sort` and starting at `offset`
+void render_view_href(HtmlOutput &out, const TableView &view,
+                      const CatalogColumn *sort, bool descending,
+                      size_t offset) {
+  out.append_static("/table?name=");
+  out.append_url(view.table->name);
+  if (sort) {
+    out.append_static(descending ? "&sort=-" : "&sort=");
+    out.append_url(sort->name);
+  }
+  for (const TableFilter &filter : view.filters) {
+    out.append_static("&filter=");
+    out.append_url(filter.spec);
+  }
+  if (!view.search.empty()) {
+    out.append_static("&q=");
+    out.append_url(view.search);
+  }
+  if (offset) {
+    out.append_static("&offset=");
+    out.append_number(offset);
+  }
+  if (view.limit != TABLE_PAGE_ROWS) {
+    out.append_static("&limit=");
+    out.append_number(view.limit);
+  }
+}
 
-  for (const auto &table : tables) {
-    html << "<a href='/table?name=" << table << "'>" << table << "</a>";
+// Why ORDER BY `column` needs a sort
+const char *full_sort_reason(const CatalogTable &table,
+                             const CatalogColumn &column) {
+  for (const CatalogIndex &index : table.indexes) {
+    if (!index.columns.empty() && index.columns[0] == column.name) {
+      return "its index cannot be used together with these filters";
+    }
   }
+  return "no index starts with this column";
+}
 
-  html << "</div><h2>Database Tables</h2><ul>";
+// Search and filter form, row range and what the plan says about them
+void render_view_status(HtmlOutput &out, sqlite3 *db, const TableView &view,
+                        size_t rows, std::pmr::memory_resource *arena) {
+  TableViewPlan plan(arena);
+  plan_table_view(db, view, plan);
 
-  for (const auto &table : tables) {
-    html << "<li><a href='/table?name=" << table << "'>" << table
-         << "</a></li>";
+  int64_t estimate = estimate_table_rows(db, *view.table);
+  if (rows) {
+    render<ROW_RANGE>(out, view.offset + 1, view.offset + rows,
+                      [&](HtmlOutput &o) {
+                        if (estimate >= 0) {
+                          render<ROW_ESTIMATE>(o, estimate);
+                        }
+                      });
+  } else {
+    out.append_static("<p>No matching rows</p>");
   }
+  if (plan.full_sort) {
+    render<SORT_NOTICE>(out, view.sort->name,
+                        full_sort_reason(*view.table, *view.sort));
+  } else if (plan.partial_sort) {
+    render<PARTIAL_SORT_NOTICE>(out, view.sort->name);
+  }
+  if (plan.full_scan && (!view.filters.empty() || !view.search.empty())) {
+    render<SCAN_NOTICE>(out, view.table->name);
+  }
+  render<VIEW_PLAN>(out, [&](HtmlOutput &o) {
+    for (const auto &detail : plan.details) {
+      o.append_html(detail);
+      o.append_static("<br>");
+    }
+  });
+}
 
-  html << "</ul></body></html>";
+// Generate HTML for table view; false if there is no such table
+bool generate_table_view(sqlite3 *db, const HttpRequest &request,
+                         HtmlOutput &out, std::pmr::memory_resource *arena) {
+  std::string_view table_name = request.param("name");
+  const CatalogTable *table = schema_catalog().find(table_name);
+  if (!table) {
+    return false;
+  }
 
-  return html.str();
-}
+  TableView view(arena);
+  std::pmr::vector<Row> records(arena);
+  std::string error;
+  bool ok = parse_table_view(request, *table, view, error) &&
+            get_table_data(db, view, records, error);
 
-// Generate HTML for table view
-std::string generate_table_view(sqlite3 *db, const std::string &table_name) {
-  std::stringstream html;
-  std::vector<Column> columns = get_table_columns(db, table_name);
-  std::vector<std::map<std::string, std::string>> records =
-      get_table_data(db, table_name, columns);
+  size_t id_column = table->column_index("id");
+  bool has_id_column = id_column < table->columns.size();
 
-  std::vector<std::string> tables = get_tables(db);
+  auto controls = [&](HtmlOutput &o) {
+    render<TABLE_CONTROLS>(
+        o, table_name,
+        [&](HtmlOutput &p) {
+          if (view.sort) {
+            std::pmr::string sort(view.descending ? "-" : "", arena);
+            sort += view.sort->name;
+            render<SORT_INPUT>(p, sort);
+          }
+        },
+        view.search,
+        [&](HtmlOutput &p) {
+          for (const TableFilter &filter : view.filters) {
+            render<FILTER_INPUT>(p, filter.spec);
+          }
+        },
+        table_name);
+  };
 
-  html << "<!DOCTYPE html>" << "<html><head><title>Table: " << table_name
-       << "</title>" << "<style>"
-       << "body { font-family: Arial, sans-serif; margin: 20px; }"
-       << "table { border-collapse: collapse; width: 100%; margin-top: 20px; }"
-       << "th, td { border: 1px solid #ddd; padding: 8px; text-align: left; }"
-       << "th { background-color: #f2f2f2; }"
-       << "tr:hover { background-color: #f5f5f5; }"
-       << ".menu { display: flex; background-color: #333; padding: 10px; }"
-       << ".menu a { color: white; padding: 10px; text-decoration: none; }"
-       << ".menu a:hover { background-color: #555; }"
-       << ".actions { display: flex; gap: 10px; margin-top: 20px; }"
-       << "button { padding: 10px; background-color: #4CAF50; color: white; "
-          "border: none; cursor: pointer; }"
-       << "button:hover { background-color: #45a049; }"
-       << "</style></head><body>" << "<h1>SQLite Database Admin</h1>"
-       << "<div class='menu'>" << "<a href='/'>Tables</a>";
+  auto status = [&](HtmlOutput &o) {
+    if (ok) {
+      render_view_status(o, db, view, records.size(), arena);
+    } else {
+      render<VIEW_ERROR>(o, error);
+    }
+  };
 
-  for (const auto &table : tables) {
-    html << "<a href='/table?name=" << table << "'>" << table << "</a>";
-  }
+  auto headers = [&](HtmlOutput &o) {
+    for (const CatalogColumn &column : table->columns) {
+      bool sorted = view.sort == &column;
+      render<COLUMN_HEADER>(
+          o,
+          [&](HtmlOutput &p) {
+            render_view_href(p, view, &column, sorted && !view.descending, 0);
+          },
+          column.name, column.type, column.primary_key ? ", primary key" : "",
+          !sorted ? "" : view.descending ? " &#9660;" : " &#9650;");
+    }
+    if (has_id_column) {
+      o.append_static("<th>Actions</th>");
+    }
+  };
 
-  html << "</div>" << "<h2>Table: " << table_name << "</h2>"
-       << "<div class='actions'>"
-       << "<button onclick=\"location.href='/insert?table=" << table_name
-       << "'\">Add New Record</button>"
-       << "<button onclick=\"location.href='/export?table=" << table_name
-       << "'\">Export CSV</button>" << "</div>" << "<table><tr>";
+  auto rows = [&](HtmlOutput &o) {
+    for (const auto &record : records) {
+      o.append_static("<tr>");
+      for (const auto &value : record) {
+        o.append_static("<td>");
+        o.append_html(value);
+        o.append_static("</td>");
+      }
 
-  bool has_id_column = false;
-  for (const auto &column : columns) {
-    if (column.name == "id") {
-      has_id_column = true;
-      break;
+      // Add action buttons for each row
+      if (has_id_column && id_column < record.size()) {
+        render<ROW_ACTIONS>(o, table_name, record[id_column]);
+      }
+      o.append_static("</tr>");
     }
-  }
+  };
 
-  // Table headers
-  for (const auto &column : columns) {
-    html << "<th>" << column.name << " (" << column.type << ")</th>";
+  auto pager = [&](HtmlOutput &o) {
+    o.append_static("<p>");
+    if (view.offset) {
+      size_t previous = view.offset - std::min(view.offset, view.limit);
+      render<PAGER_LINK>(
+          o,
+          [&](HtmlOutput &p) {
+            render_view_href(p, view, view.sort, view.descending, previous);
+          },
+          "&laquo; Previous");
+    }
+    if (records.size() == view.limit) {
+      render<PAGER_LINK>(
+          o,
+          [&](HtmlOutput &p) {
+            render_view_href(p, view, view.sort, view.descending,
+                             view.offset + view.limit);
+          },
+          "Next &raquo;");
+    }
+    o.append_static("</p>");
+  };
+
+  render<TABLE_PAGE>(
+      out, table_name, [&](HtmlOutput &o) { render_table_menu(o); },
+      table_name, controls, status, headers, rows, pager,
+      [&](HtmlOutput &o) { render_table_schema(o, *table); });
+  return true;
+}
+
+void render_query_table(HtmlOutput &out,
+                        const std::vector<QueryStats> &queries) {
+  render<QUERY_TABLE>(out, [&](HtmlOutput &o) {
+    for (const auto &q : queries) {
+      render<QUERY_ROW>(o, q.normalized, q.count, q.total_ns / 1e6,
+                        q.count ? q.total_ns / 1e6 / q.count : 0.0,
+                        q.percentile_ns(0.99) / 1e6, q.max_ns / 1e6,
+                        q.vm_steps, q.fullscan_steps, q.sorts,
+                        q.autoindexes);
+    }
+  });
+}
+
+// Checkpoints, incremental vacuum, ANALYZE and the dbstat survey
+MaintenanceScheduler &maintenance() {
+  static MaintenanceScheduler scheduler;
+  return scheduler;
+}
+
+// One decimal place
+double percent(double ratio) { return std::round(ratio * 1000) / 10; }
+
+// Generate HTML for the storage page: file usage, b-tree survey and
+// maintenance history
+void generate_storage_page(HtmlOutput &out) {
+  MaintenanceStats stats = maintenance().stats();
+  const StorageState &storage = stats.storage;
+  static const char *const auto_vacuum_modes[] = {"none", "full",
+                                                  "incremental"};
+  time_t now = time(nullptr);
+
+  // Largest first
+  std::vector<const BtreeUsage *> btrees;
+  for (const BtreeUsage &btree : stats.survey.btrees) {
+    btrees.push_back(&btree);
   }
-  if (has_id_column) {
-    html << "<th>Actions</th>";
+  std::sort(btrees.begin(), btrees.end(),
+            [](const BtreeUsage *a, const BtreeUsage *b) {
+              return a->pages > b->pages;
+            });
+
+  render<STORAGE_PAGE>(
+      out, [&](HtmlOutput &o) { render_table_menu(o); },
+      storage.page_size * storage.page_count >> 20, storage.page_count,
+      storage.page_size, storage.freelist_count,
+      percent(storage.free_ratio()), storage.journal_mode,
+      auto_vacuum_modes[storage.auto_vacuum % 3], storage.wal_bytes >> 10,
+      MAINTENANCE_IDLE_SECONDS, MAINTENANCE_INTERVAL_SECONDS,
+      MAINTENANCE_BUDGET_MS, MAINTENANCE_SURVEY_BUDGET_MS, stats.runs,
+      now - stats.idle_since,
+      [&](HtmlOutput &o) {
+        if (!stats.scheduled) {
+          o.append_static(" Another db_admin worker runs the schedule; the "
+                          "tasks below are the ones run here.");
+        }
+        if (!stats.error.empty()) {
+          render<STORAGE_ERROR>(o, stats.error);
+        }
+      },
+      [&](HtmlOutput &o) {
+        if (stats.surveying_of) {
+          render<SURVEY_PROGRESS>(o, stats.surveying, stats.surveying_of);
+        }
+        if (!stats.survey.at) {
+          o.append_static("<p>No complete survey yet.</p>");
+          return;
+        }
+        render<SURVEY_TABLE>(
+            o, now - stats.survey.at, stats.survey.ms, [&](HtmlOutput &p) {
+              for (const BtreeUsage *btree : btrees) {
+                render<SURVEY_ROW>(
+                    p, btree->name,
+                    btree->complete
+                        ? ""
+                        : " <span class='error'>(incomplete)</span>",
+                    btree->type, btree->pages,
+                    btree->bytes >> 10,
+                    percent(btree->bytes ? (double)btree->unused_bytes /
+                                               btree->bytes
+                                         : 0),
+                    percent(btree->fragmentation()));
+              }
+            });
+      },
+      [&](HtmlOutput &o) {
+        for (const MaintenanceRecord &record : stats.history) {
+          render<TASK_ROW>(o, now - record.at,
+                           maintenance_task_name(record.task), record.ms,
+                           record.ok ? "ok" : "failed", record.detail);
+        }
+      });
+}
+
+// Generate HTML for the per-statement profile of this process
+void generate_queries_page(size_t limit, HtmlOutput &out) {
+  std::vector<QueryStats> stats = QueryProfiler::instance().snapshot();
+
+  render<QUERIES_PAGE>(
+      out, [&](HtmlOutput &o) { render_table_menu(o); }, stats.size(),
+      QueryProfiler::instance().slow_threshold_ns() / 1e6, limit,
+      [&](HtmlOutput &o) {
+        render_query_table(o, top_queries(stats, limit, false));
+      },
+      [&](HtmlOutput &o) {
+        render_query_table(o, top_queries(stats, limit, true));
+      });
+}
+
+// Dump a table as CSV (RFC 4180, NULL as an empty field) or as a JSON array
+// of row objects. Returns false if there is no such table.
+bool export_table(sqlite3 *db, std::string_view table_name, bool json,
+                  HtmlOutput &out, std::pmr::memory_resource *arena) {
+  const CatalogTable *table = schema_catalog().find(table_name);
+  if (!table) {
+    return false;
   }
-  html << "</tr>";
 
-  // Table data
-  for (const auto &record : records) {
-    html << "<tr>";
+  sqlite3_stmt *stmt;
+  std::pmr::string sql("SELECT * FROM ", arena);
+  append_identifier(sql, table->name);
+  if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+    return false;
+  }
 
-    for (const auto &column : columns) {
-      html << "<td>" << record.at(column.name) << "</td>";
+  int column_count = sqlite3_column_count(stmt);
+  if (json) {
+    out.append_static("[");
+  } else {
+    for (int i = 0; i < column_count; i++) {
+      if (i) {
+        out.append_static(",");
+      }
+      out.append_escaped(EscapeMode::Csv, sqlite3_column_name(stmt, i));
     }
+    out.append_static("\r\n");
+  }
 
-    // Add action buttons for each row
-    if (has_id_column) {
-      html << "<td>" << "<a href='/edit?table=" << table_name
-           << "&id=" << record.at("id") << "'>Edit</a> | "
-           << "<a href='/delete?table=" << table_name
-           << "&id=" << record.at("id")
-           << "' onclick='return confirm(\"Are you sure?\")'>Delete</a>"
-           << "</td>";
+  bool first_row = true;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    if (json) {
+      out.append_static(first_row ? "{" : ",{");
     }
+    first_row = false;
+
+    for (int i = 0; i < column_count; i++) {
+      int type = sqlite3_column_type(stmt, i);
+      const char *text = (const char *)sqlite3_column_text(stmt, i);
+      std::string_view value(text ? text : "",
+                             text ? sqlite3_column_bytes(stmt, i) : 0);
+      if (i) {
+        out.append_static(",");
+      }
+      if (!json) {
+        out.append_escaped(EscapeMode::Csv, value);
+        continue;
+      }
 
-    html << "</tr>";
+      out.append_static("\"");
+      out.append_escaped(EscapeMode::Json, sqlite3_column_name(stmt, i));
+      out.append_static("\":");
+      if (type == SQLITE_NULL) {
+        out.append_static("null");
+      } else if (type == SQLITE_INTEGER || type == SQLITE_FLOAT) {
+        out.append_copy(value);
+      } else {
+        out.append_static("\"");
+        out.append_escaped(EscapeMode::Json, value);
+        out.append_static("\"");
+      }
+    }
+    out.append_static(json ? "}" : "\r\n");
+  }
+  if (json) {
+    out.append_static("]");
   }
 
-  html << "</table></body></html>";
+  sqlite3_finalize(stmt);
+  return true;
+}
 
-  return html.str();
+TagIndex &tag_index() {
+  static TagIndex index;
+  return index;
 }
 
-void handle_request(int client_socket, const char *request) {
-  sqlite3 *db;
-  int rc = sqlite3_open(DB_PATH, &db);
+// Content ids matching a tag query as JSON, e.g.
+// /api/tags?all=rust,linux&not=draft-notes&status=published&site=blog
+// /api/hashtags?any=%23food,%23travel&limit=50&offset=100
+void serve_tag_query(TagFamily family, const HttpRequest &request,
+                     ResponseWriter &response) {
+  std::string error;
+  TagIndex &index = tag_index();
+  if (!index.ready() || !index.refresh(error)) {
+    response.text(503, "Tag index unavailable: " + error);
+    return;
+  }
 
-  if (rc) {
-    sqlite3_close(db);
-    std::string response = "HTTP/1.1 500 Internal Server Error\r\n";
-    response += "Content-Type: text/plain\r\n\r\n";
-    response += "Failed to open database";
-    send(client_socket, response.c_str(), response.length(), 0);
+  TagQuery query;
+  query.all = split_tag_list(request.param("all"));
+  query.any = split_tag_list(request.param("any"));
+  query.none = split_tag_list(request.param("not"));
+  query.status = std::string(request.param("status"));
+  query.site = std::string(request.param("site"));
+  size_t limit = std::min<size_t>(
+      parse_unsigned(request.param("limit"), TAG_QUERY_LIMIT),
+      TAG_QUERY_MAX_LIMIT);
+  size_t offset = parse_unsigned(request.param("offset"), 0);
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  RoaringBitmap result;
+  if (!index.query(family, query, result, error)) {
+    response.text(500, "Tag query failed: " + error);
     return;
   }
+  double micros = std::chrono::duration<double, std::micro>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
 
-  std::string req(request);
-  std::string response = "HTTP/1.1 200 OK\r\n";
-  response += "Content-Type: text/html; charset=UTF-8\r\n\r\n";
+  HtmlOutput &out = response.body();
+  out.append_copy("{\"count\":" + std::to_string(result.size()) +
+                  ",\"offset\":" + std::to_string(offset) +
+                  ",\"micros\":" + std::to_string((uint64_t)micros) +
+                  ",\"ids\":[");
+  size_t position = 0;
+  std::string ids;
+  result.for_each([&](uint32_t id) {
+    if (position++ < offset) {
+      return true;
+    }
+    if (position > offset + limit) {
+      return false;
+    }
+    if (position > offset + 1) {
+      ids += ',';
+    }
+    ids += std::to_string(id);
+    return true;
+  });
+  out.append_copy(ids);
+  out.append_static("]}");
+  response.set_content_type("application/json");
+}
 
-  // Parse request path
-  size_t path_start = req.find(" ") + 1;
-  size_t path_end = req.find(" ", path_start);
-  std::string path = req.substr(path_start, path_end - path_start);
+QueryConsole &query_console() {
+  static QueryConsole console;
+  return console;
+}
 
-  // Parse URL parameters
-  std::map<std::string, std::string> params;
-  size_t query_start = path.find('?');
+// Budgets from the request, capped at the console's maximums
+QueryBudget query_budget(const HttpRequest &request) {
+  QueryBudget budget;
+  budget.time_ms = (int64_t)std::min<size_t>(
+      parse_unsigned(request.param("timeout_ms"), QUERY_TIME_BUDGET_MS),
+      QUERY_MAX_TIME_BUDGET_MS);
+  budget.steps = (int64_t)std::min<size_t>(
+      parse_unsigned(request.param("steps"), QUERY_STEP_BUDGET),
+      QUERY_MAX_STEP_BUDGET);
+  return budget;
+}
 
-  if (query_start != std::string::npos) {
-    std::string query = path.substr(query_start + 1);
-    path = path.substr(0, query_start);
-    params = parse_params(query);
+// The plan as nested lists, children under the row they hang from
+void render_plan_nodes(HtmlOutput &out, const std::vector<QueryPlanRow> &plan,
+                       int parent) {
+  bool open = false;
+  for (const auto &row : plan) {
+    if (row.parent != parent) {
+      continue;
+    }
+    if (!open) {
+      out.append_static("<ul>");
+      open = true;
+    }
+    render<QUERY_PLAN_NODE>(out, row.detail, [&](HtmlOutput &o) {
+      render_plan_nodes(o, plan, row.id);
+    });
   }
-
-  // Route requests
-  if (path == "/" || path == "/index") {
-    response += generate_main_page(db);
-  } else if (path == "/table" && params.find("name") != params.end()) {
-    response += generate_table_view(db, params["name"]);
-  } else {
-    response = "HTTP/1.1 404 Not Found\r\n";
-    response += "Content-Type: text/plain\r\n\r\n";
-    response += "404 - Page not found";
+  if (open) {
+    out.append_static("</ul>");
   }
+}
 
-  sqlite3_close(db);
-  send(client_socket, response.c_str(), response.length(), 0);
+// Generate HTML for the SQL console. A statement is explained first; Run
+// is enabled once its plan is on the page.
+void generate_query_page(const HttpRequest &request, HtmlOutput &out) {
+  std::string_view sql = request.param("sql");
+  QueryBudget budget = query_budget(request);
+  std::vector<QueryPlanRow> plan;
+  std::string error;
+  bool planned = !sql.empty() && query_console().plan(sql, plan, error);
+
+  render<QUERY_PAGE>(
+      out, [&](HtmlOutput &o) { render_table_menu(o); }, sql,
+      budget.time_ms, budget.steps, planned ? "" : "disabled",
+      [&](HtmlOutput &o) {
+        if (planned) {
+          render<QUERY_PLAN_PANEL>(o, [&](HtmlOutput &p) {
+            render_plan_nodes(p, plan, 0);
+          });
+        } else if (!sql.empty()) {
+          render<QUERY_PLAN_ERROR>(o, error);
+        }
+      },
+      [](HtmlOutput &o) { o.append_static(QUERY_CONSOLE_SCRIPT); });
 }
 
-int main() {
-  int server_fd, new_socket;
-  struct sockaddr_in address;
-  int opt = 1;
-  socklen_t addrlen = sizeof(address);
-  char buffer[BUFFER_SIZE] = {0};
+// One result row as a JSON array
+void append_json_row(HtmlOutput &out, sqlite3_stmt *stmt, int columns) {
+  out.append_static("[");
+  for (int i = 0; i < columns; i++) {
+    if (i) {
+      out.append_static(",");
+    }
+    int type = sqlite3_column_type(stmt, i);
+    bool finite = type != SQLITE_FLOAT ||
+                  std::isfinite(sqlite3_column_double(stmt, i));
+    if (type == SQLITE_NULL || !finite) {
+      out.append_static("null");
+    } else if (type == SQLITE_INTEGER || type == SQLITE_FLOAT) {
+      out.append_copy((const char *)sqlite3_column_text(stmt, i));
+    } else if (type == SQLITE_BLOB) {
+      static const char hex[] = "0123456789abcdef";
+      const unsigned char *blob =
+          (const unsigned char *)sqlite3_column_blob(stmt, i);
+      int length = sqlite3_column_bytes(stmt, i);
+      std::string text = "x'";
+      for (int b = 0; b < std::min(length, QUERY_BLOB_PREVIEW); b++) {
+        text += hex[blob[b] >> 4];
+        text += hex[blob[b] & 15];
+      }
+      text += length > QUERY_BLOB_PREVIEW ? "...'" : "'";
+      out.append_static("\"");
+      out.append_copy(text);
+      out.append_static("\"");
+    } else {
+      const char *text = (const char *)sqlite3_column_text(stmt, i);
+      out.append_static("\"");
+      out.append_escaped(EscapeMode::Json,
+                         std::string_view(text, sqlite3_column_bytes(stmt, i)));
+      out.append_static("\"");
+    }
+  }
+  out.append_static("]\n");
+}
 
-  // Create socket
-  if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    perror("Socket creation failed");
-    exit(EXIT_FAILURE);
+// Run the console's statement and stream the result as it is stepped, one
+// JSON value per line: the column names, each row, then a summary.
+//   {"columns":["id","name"]}
+//   [1,"intro"]
+//   {"status":"done","rows":1,"steps":12,"ms":0.1}
+// Rows go out every QUERY_FLUSH_MS or QUERY_FLUSH_BYTES, whichever first.
+void stream_query(Connection &conn, const HttpRequest &request,
+                  ResponseWriter &response) {
+  std::string error;
+  QueryConsole &console = query_console();
+  sqlite3_stmt *stmt = console.prepare(request.param("sql"), error);
+  if (!stmt) {
+    response.text(400, error);
+    response.send();
+    return;
   }
 
-  // Set socket options
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
-                 sizeof(opt))) {
-    perror("Setsockopt failed");
-    exit(EXIT_FAILURE);
+  response.set_content_type("application/x-ndjson");
+  if (!response.start_chunked()) {
+    sqlite3_finalize(stmt);
+    return;
+  }
+  HtmlOutput &out = response.body();
+  int columns = sqlite3_column_count(stmt);
+  out.append_static("{\"columns\":[");
+  for (int i = 0; i < columns; i++) {
+    out.append_static(i ? ",\"" : "\"");
+    out.append_escaped(EscapeMode::Json, sqlite3_column_name(stmt, i));
+    out.append_static("\"");
   }
+  out.append_static("]}\n");
+  bool connected = response.flush_chunk();
 
-  // Configure address
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = inet_addr("127.0.0.1"); // Only bind to localhost
-  address.sin_port = htons(ADMIN_PORT);
+  std::chrono::steady_clock::time_point flushed =
+      std::chrono::steady_clock::now();
+  auto on_row = [&](sqlite3_stmt *row) {
+    append_json_row(out, row, columns);
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    if (out.size() < QUERY_FLUSH_BYTES &&
+        now - flushed < std::chrono::milliseconds(QUERY_FLUSH_MS)) {
+      return connected;
+    }
+    flushed = now;
+    return connected = connected && response.flush_chunk();
+  };
+  QueryResult result =
+      console.run(stmt, query_budget(request), conn.fd(), on_row);
+  if (!connected) {
+    return;
+  }
 
-  // Bind socket
-  if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-    perror("Bind failed");
-    exit(EXIT_FAILURE);
+  char ms[32];
+  snprintf(ms, sizeof(ms), "%.1f", result.ms);
+  out.append_static("{\"status\":\"");
+  out.append_static(query_outcome_name(result.outcome));
+  out.append_copy("\",\"rows\":" + std::to_string(result.rows) +
+                  ",\"steps\":" + std::to_string(result.steps) +
+                  ",\"ms\":" + ms);
+  if (!result.error.empty()) {
+    out.append_static(",\"error\":\"");
+    out.append_escaped(EscapeMode::Json, result.error);
+    out.append_static("\"");
   }
+  out.append_static("}\n");
+  response.finish_chunked();
+}
 
-  // Listen for connections
-  if (listen(server_fd, 3) < 0) {
-    perror("Listen failed");
-    exit(EXIT_FAILURE);
+void handle_request(Connection &conn, const HttpRequest &request,
+                    std::pmr::memory_resource *arena) {
+  ResponseWriter response(conn);
+
+  // Streamed on the console's own connection
+  if (request.path == "/query/run") {
+    stream_query(conn, request, response);
+    return;
   }
 
-  printf("SQLite Admin Server started on localhost:%d\n", ADMIN_PORT);
+  sqlite3 *db;
+  int rc = open_db(resolve_db_path(DB_PATH), &db);
 
-  while (1) {
-    if ((new_socket =
-             accept(server_fd, (struct sockaddr *)&address, &addrlen)) < 0) {
-      perror("Accept failed");
-      exit(EXIT_FAILURE);
-    }
+  if (rc) {
+    sqlite3_close(db);
+    response.text(500, "Failed to open database");
+    response.send();
+    return;
+  }
 
-    memset(buffer, 0, BUFFER_SIZE);
-    int bytes_read = read(new_socket, buffer, BUFFER_SIZE);
+  std::string_view path = request.path;
+  std::string error;
 
-    if (bytes_read > 0) {
-      buffer[bytes_read] = '\0';
-      handle_request(new_socket, buffer);
+  // Route requests
+  if (path == "/api/tags" || path == "/api/hashtags") {
+    serve_tag_query(path == "/api/tags" ? TagFamily::Content
+                                        : TagFamily::Hashtag,
+                    request, response);
+  } else if (path == "/admin/allocations") {
+    response.text(200, AllocationProfiler::instance().report());
+  } else if (path == "/storage/run" && request.method == "POST") {
+    maintenance().run_now();
+    response.redirect("/storage");
+  } else if (!refresh_schema_catalog(error)) {
+    response.text(503, "Schema catalog unavailable: " + error);
+  } else if (path == "/" || path == "/index") {
+    generate_main_page(response.body());
+  } else if (path == "/table" && request.has_param("name")) {
+    if (!generate_table_view(db, request, response.body(), arena)) {
+      response.text(404, "404 - Table not found");
     }
+  } else if (path == "/query") {
+    generate_query_page(request, response.body());
+  } else if (path == "/storage") {
+    generate_storage_page(response.body());
+  } else if (path == "/admin/queries") {
+    size_t limit = parse_unsigned(request.param("n"), 20);
+    generate_queries_page(limit ? limit : 20, response.body());
+  } else if (path == "/export" && request.has_param("table")) {
+    std::string table_name(request.param("table"));
+    bool json = request.param("format") == "json";
+    if (export_table(db, table_name, json, response.body(), arena)) {
+      response.set_content_type(json ? "application/json"
+                                     : "text/csv; charset=UTF-8");
+      response.add_header("Content-Disposition",
+                          "attachment; filename=\"" + table_name +
+                              (json ? ".json\"" : ".csv\""));
+    } else {
+      response.text(404, "404 - Table not found");
+    }
+  } else {
+    response.text(404, "404 - Page not found");
+  }
+
+  sqlite3_close(db);
+  response.send();
+}
 
-    close(new_socket);
+int main() {
+  // With GRABBIEL_WORKERS this process only supervises; workers go on below
+  run_supervisor("SQLite Admin Server", ADMIN_PORT);
+
+  static RequestReader reader(BUFFER_SIZE);
+  static RequestArena arena;
+
+  std::string error;
+  if (!tag_index().open(resolve_db_path(DB_PATH), error)) {
+    fprintf(stderr, "Tag index disabled: %s\n", error.c_str());
   }
+  if (!query_console().open(resolve_db_path(DB_PATH), error)) {
+    fprintf(stderr, "SQL console disabled: %s\n", error.c_str());
+  }
+  if (!schema_catalog().open(resolve_db_path(DB_PATH), error)) {
+    fprintf(stderr, "Schema catalog not loaded: %s\n", error.c_str());
+  }
+  maintenance().start(resolve_db_path(DB_PATH));
+
+  exit_server(
+      run_server("SQLite Admin Server", ADMIN_PORT, [](Connection &conn) {
+        HttpRequest request;
+        reader.clear();
 
-  close(server_fd);
-  return 0;
+        if (reader.read(conn, request) == HttpParser::Complete) {
+          HeapCounters before = thread_heap_counters();
+          handle_request(conn, request, &arena);
+          record_request_allocations(request.path, before, arena);
+          arena.reset();
+        } else if (reader.parser().error_status()) {
+          write_error(conn, reader.parser().error_status());
+        }
+      }));
 }
@@ -4,7 +4,8 @@
 sudo mkdir -p /tmp/grabbiel-uploads
 sudo mkdir -p /usr/local/bin
 
-g++ -std=c++17 -o media_manager media_manager.cpp -lsqlite3
+source "$(dirname "$0")/../common/build_flags.sh"
+g++ $MEDIA_MANAGER_FLAGS -o media_manager media_manager.cpp $SERVER_LIBS
 
 # Create systemd service file
 cat >/tmp/media-manager.service <<'EOF'
@@ -1,93 +1,176 @@
 #include <arpa/inet.h>
+#include <cerrno>
 #include <array>
+#include <charconv>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <netinet/in.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <sqlite3.h>
 #include <sstream>
 #include <string>
+#include <sys/file.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <type_traits>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "../common/counters.h"
+#include "../common/alloc_stats.h"
+#include "../common/async_server.h"
+#include "../common/db.h"
+#include "../common/file_io.h"
+#include "../common/html_template.h"
+#include "../common/response.h"
+#include "../common/server.h"
+#include "../common/sketch.h"
+#include "../common/supervisor.h"
+
 #define MEDIA_PORT 8889
-#define BUFFER_SIZE 65536
+#define BUFFER_SIZE 16384 // per connection; grows to fit a request
 #define DB_PATH "/var/lib/grabbiel-db/content.db"
 #define TEMP_UPLOAD_DIR "/tmp/grabbiel-uploads"
-
+#define MEDIA_CACHE_DIR "/tmp/grabbiel-media-cache"
+#define MEDIA_CACHE_MB 1024
+#define DB_POOL_THREADS 4
+#define BLOCKING_POOL_THREADS 8
+#define COMPOSITE_UPLOAD_MIN_SIZE (256ULL << 20)
+#define COMPOSITE_PART_MIN_SIZE (64ULL << 20)
+#define COMPOSITE_MAX_PARTS 32 // what one GCS compose request accepts
+#define COMPOSITE_MAX_STREAMS 8
+#define STORAGE_DELETE_STREAMS 8
+#define GC_INTERVAL_SECONDS 30
+#define GC_BATCH 256
+#define GC_BUSY_TIMEOUT_MS 5000
+#define RECONCILE_INTERVAL_SECONDS (6 * 60 * 60)
+#define RECONCILE_GRACE_SECONDS (60 * 60)
+#define RESUMABLE_UPLOAD_DIR TEMP_UPLOAD_DIR "/resumable"
+#define RESUMABLE_MAX_SIZE (64ULL << 30)
+#define RESUMABLE_EXPIRY_SECONDS (24 * 60 * 60)
+#define COUNTER_JOURNAL_DIR "/var/lib/grabbiel-db/counters"
+#define SOCHEE_COUNTER_MAX_DELTA 1000
+#define ANALYTICS_SKETCH_WIDTH 2048
+#define ANALYTICS_HEAVY_HITTERS 128 // per bucket
+#define ANALYTICS_TAIL_SECONDS 5
+#define ANALYTICS_TAIL_BATCH 10000
+#define ANALYTICS_PERSIST_SECONDS 60
+#define ANALYTICS_BUSY_TIMEOUT_MS 5000
+#define ANALYTICS_TOP_MAX 100
+#define ANALYTICS_MAX_HASHTAG 256
+#define DEBUG_LOG_PATH "/tmp/grabbiel-debug.log"
+
+COUNT_HEAP_ALLOCATIONS()
+
+// Rows for the listing pages; the strings live in the request arena
 struct Image {
+  explicit Image(std::pmr::memory_resource *mr)
+      : original_url(mr), filename(mr), mime_type(mr), image_type(mr),
+        processing_status(mr) {}
+
   int id;
-  std::string original_url;
-  std::string filename;
-  std::string mime_type;
+  std::pmr::string original_url;
+  std::pmr::string filename;
+  std::pmr::string mime_type;
   int size;
   int width;
   int height;
   int content_id;
-  std::string image_type;
-  std::string processing_status;
+  std::pmr::string image_type;
+  std::pmr::string processing_status;
 };
 
 struct Video {
+  explicit Video(std::pmr::memory_resource *mr)
+      : title(mr), gcs_path(mr), mime_type(mr), processing_status(mr) {}
+
   int id;
-  std::string title;
-  std::string gcs_path;
-  std::string mime_type;
-  int size_bytes;
+  std::pmr::string title;
+  std::pmr::string gcs_path;
+  std::pmr::string mime_type;
+  int64_t size_bytes;
   int duration_seconds;
   int content_id;
-  std::string processing_status;
+  std::pmr::string processing_status;
 };
 
-void log_to_file(const std::string &message) {
-  std::ofstream log_file("/tmp/grabbiel-debug.log", std::ios::app);
-  if (log_file) {
-    log_file << "[" << time(NULL) << "] " << message << std::endl;
-    log_file.close();
-  }
+inline void append_log_part(std::string &line, std::string_view part) {
+  line.append(part.data(), part.size());
 }
 
-void log_file_content(const std::string &filepath, size_t max_bytes = 100) {
-  std::ifstream file(filepath, std::ios::binary);
-  if (!file) {
-    log_to_file("Failed to open file for debugging: " + filepath);
-    return;
+template <typename T,
+          typename = std::enable_if_t<std::is_integral<T>::value>>
+inline void append_log_part(std::string &line, T value) {
+  char digits[24];
+  line.append(digits,
+              std::to_chars(digits, digits + sizeof(digits), value).ptr);
+}
+
+// Append "[time] " and the parts to the debug log. The line is assembled
+// in a per-thread buffer that keeps its capacity, so per-request logging
+// does not allocate: log_to_file("Read ", n, " bytes from ", path).
+template <typename... Parts> void log_to_file(const Parts &...parts) {
+  static thread_local std::string line;
+  line.clear();
+  line += '[';
+  append_log_part(line, (long long)time(NULL));
+  line += "] ";
+  (append_log_part(line, parts), ...);
+  line += '\n';
+  int fd = open(DEBUG_LOG_PATH, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                0644);
+  if (fd >= 0) {
+    ssize_t written = write(fd, line.data(), line.size());
+    (void)written;
+    close(fd);
   }
+}
 
-  std::vector<char> buffer(max_bytes);
-  file.read(buffer.data(), max_bytes);
-  size_t bytes_read = file.gcount();
+// Hex dump of the start of a file just written from `data`
+void log_file_content(const std::string &filepath,
+                      const std::vector<char> &data, size_t max_bytes = 100) {
+  size_t bytes_read = std::min(max_bytes, data.size());
 
   std::stringstream hex_dump;
   for (size_t i = 0; i < bytes_read; i++) {
     hex_dump << std::hex << std::setw(2) << std::setfill('0')
-             << (int)(unsigned char)buffer[i] << " ";
+             << (int)(unsigned char)data[i] << " ";
     if ((i + 1) % 16 == 0)
       hex_dump << "\n";
   }
 
-  log_to_file("File preview for " + filepath + " (" +
-              std::to_string(bytes_read) + " bytes):\n" + hex_dump.str());
+  log_to_file("File preview for ", filepath, " (", bytes_read, " bytes):\n",
+              hex_dump.view());
 }
 
 // Utility function to parse multipart form data
 std::map<std::string, std::string>
-parse_multipart_form_data(const std::string &body, const std::string &boundary,
+parse_multipart_form_data(std::string_view body, const std::string &boundary,
                           std::map<std::string, std::vector<char>> &files) {
   std::map<std::string, std::string> form_data;
   std::string delimiter = "--" + boundary;
   std::string final_delimiter = delimiter + "--";
 
-  log_to_file("Parsing multipart form data with boundary: '" + boundary + "'");
-  log_to_file("Total body size: " + std::to_string(body.size()) + " bytes");
+  log_to_file("Parsing multipart form data with boundary: '", boundary, "'");
+  log_to_file("Total body size: ", body.size(), " bytes");
 
   // Debug: Log first 50 bytes of body as hex
   std::stringstream hex_dump;
@@ -95,7 +178,7 @@ parse_multipart_form_data(const std::string &body, const std::string &boundary,
     hex_dump << std::hex << std::setw(2) << std::setfill('0')
              << (int)(unsigned char)body[i] << " ";
   }
-  log_to_file("First 50 bytes of body as hex: " + hex_dump.str());
+  log_to_file("First 50 bytes of body as hex: ", hex_dump.view());
 
   // Try to find first boundary
   size_t pos = body.find(delimiter);
@@ -104,7 +187,7 @@ parse_multipart_form_data(const std::string &body, const std::string &boundary,
     return form_data;
   }
 
-  log_to_file("First boundary found at position: " + std::to_string(pos));
+  log_to_file("First boundary found at position: ", pos);
 
   while (pos != std::string::npos) {
     // Move position past delimiter
@@ -120,8 +203,7 @@ parse_multipart_form_data(const std::string &body, const std::string &boundary,
     if (pos + 2 <= body.size() && body.substr(pos, 2) == "\r\n") {
       pos += 2;
     } else {
-      log_to_file("Warning: No CRLF after boundary at position " +
-                  std::to_string(pos));
+      log_to_file("Warning: No CRLF after boundary at position ", pos);
     }
 
     // Find next boundary
@@ -135,8 +217,7 @@ parse_multipart_form_data(const std::string &body, const std::string &boundary,
         log_to_file("ERROR: Could not find final boundary either");
         break;
       } else {
-        log_to_file("Found final delimiter at position: " +
-                    std::to_string(next_pos));
+        log_to_file("Found final delimiter at position: ", next_pos);
       }
     }
 
@@ -147,9 +228,8 @@ parse_multipart_form_data(const std::string &body, const std::string &boundary,
     }
 
     // Extract the part content (including headers)
-    std::string part = body.substr(pos, next_pos - pos);
-    log_to_file("Extracted part size: " + std::to_string(part.size()) +
-                " bytes");
+    std::string_view part = body.substr(pos, next_pos - pos);
+    log_to_file("Extracted part size: ", part.size(), " bytes");
 
     // Find the end of the headers
     size_t header_end = part.find("\r\n\r\n");
@@ -158,12 +238,12 @@ parse_multipart_form_data(const std::string &body, const std::string &boundary,
       continue;
     }
 
-    std::string headers = part.substr(0, header_end);
-    log_to_file("Headers size: " + std::to_string(headers.size()) + " bytes");
+    std::string_view headers = part.substr(0, header_end);
+    log_to_file("Headers size: ", headers.size(), " bytes");
 
     // The content starts after the \r\n\r\n and ends with \r\n before the next
     // boundary
-    std::string content;
+    std::string_view content;
     if (part.size() > header_end + 4) {
       // Most parts end with \r\n, but not all - handle both cases
       if (part.size() >= 2 && part.substr(part.size() - 2) == "\r\n") {
@@ -174,7 +254,7 @@ parse_multipart_form_data(const std::string &body, const std::string &boundary,
       }
     }
 
-    log_to_file("Content size: " + std::to_string(content.size()) + " bytes");
+    log_to_file("Content size: ", content.size(), " bytes");
 
     // Extract field name and filename if present
     std::string name;
@@ -183,50 +263,53 @@ parse_multipart_form_data(const std::string &body, const std::string &boundary,
     size_t name_pos = headers.find("name=\"");
     if (name_pos != std::string::npos) {
       size_t name_end = headers.find("\"", name_pos + 6);
-      name = headers.substr(name_pos + 6, name_end - (name_pos + 6));
+      name = std::string(
+          headers.substr(name_pos + 6, name_end - (name_pos + 6)));
     }
 
     size_t filename_pos = headers.find("filename=\"");
     if (filename_pos != std::string::npos) {
       size_t filename_end = headers.find("\"", filename_pos + 10);
-      filename =
-          headers.substr(filename_pos + 10, filename_end - (filename_pos + 10));
+      filename = std::string(headers.substr(
+          filename_pos + 10, filename_end - (filename_pos + 10)));
     }
 
-    log_to_file("Found part name='" + name + "'" +
-                (filename.empty() ? "" : ", filename='" + filename + "'"));
+    if (filename.empty()) {
+      log_to_file("Found part name='", name, "'");
+    } else {
+      log_to_file("Found part name='", name, "', filename='", filename, "'");
+    }
 
     // If we have a filename, this is a file upload
     if (!filename.empty()) {
       // Store file data
-      std::vector<char> file_data(content.begin(), content.end());
-      files[name] = file_data;
+      std::vector<char> &file_data = files[name];
+      file_data.assign(content.begin(), content.end());
 
-      log_to_file("Extracted file '" + filename +
-                  "', size: " + std::to_string(file_data.size()) + " bytes");
+      log_to_file("Extracted file '", filename, "', size: ", file_data.size(),
+                  " bytes");
 
       // Store the filename
       form_data[name + "_filename"] = filename;
     } else {
-      form_data[name] = content;
-      log_to_file("Extracted form field '" + name + "', value: '" + content +
-                  "'");
+      form_data[name] = std::string(content);
+      log_to_file("Extracted form field '", name, "', value: '", content, "'");
     }
 
     // Move to next boundary
     pos = next_pos;
   }
 
-  log_to_file("Finished parsing multipart form data, found " +
-              std::to_string(files.size()) + " files and " +
-              std::to_string(form_data.size() - files.size()) + " form fields");
+  log_to_file("Finished parsing multipart form data, found ", files.size(),
+              " files and ", form_data.size() - files.size(), " form fields");
 
   return form_data;
 }
 
 // Fetch images from database
-std::vector<Image> get_images(sqlite3 *db, int limit = 20) {
-  std::vector<Image> images;
+std::pmr::vector<Image> get_images(sqlite3 *db, std::pmr::memory_resource *mr,
+                                   int limit = 20) {
+  std::pmr::vector<Image> images(mr);
   sqlite3_stmt *stmt;
 
   const char *sql = "SELECT id, original_url, filename, mime_type, size, "
@@ -238,9 +321,10 @@ std::vector<Image> get_images(sqlite3 *db, int limit = 20) {
   }
 
   sqlite3_bind_int(stmt, 1, limit);
+  images.reserve(limit);
 
   while (sqlite3_step(stmt) == SQLITE_ROW) {
-    Image img;
+    Image &img = images.emplace_back(mr);
     img.id = sqlite3_column_int(stmt, 0);
 
     const char *url = (const char *)sqlite3_column_text(stmt, 1);
@@ -262,8 +346,6 @@ std::vector<Image> get_images(sqlite3 *db, int limit = 20) {
 
     const char *status = (const char *)sqlite3_column_text(stmt, 9);
     img.processing_status = status ? status : "";
-
-    images.push_back(img);
   }
 
   sqlite3_finalize(stmt);
@@ -271,8 +353,9 @@ std::vector<Image> get_images(sqlite3 *db, int limit = 20) {
 }
 
 // Fetch videos from database
-std::vector<Video> get_videos(sqlite3 *db, int limit = 20) {
-  std::vector<Video> videos;
+std::pmr::vector<Video> get_videos(sqlite3 *db, std::pmr::memory_resource *mr,
+                                   int limit = 20) {
+  std::pmr::vector<Video> videos(mr);
   sqlite3_stmt *stmt;
 
   const char *sql =
@@ -284,9 +367,10 @@ std::vector<Video> get_videos(sqlite3 *db, int limit = 20) {
   }
 
   sqlite3_bind_int(stmt, 1, limit);
+  videos.reserve(limit);
 
   while (sqlite3_step(stmt) == SQLITE_ROW) {
-    Video vid;
+    Video &vid = videos.emplace_back(mr);
     vid.id = sqlite3_column_int(stmt, 0);
 
     const char *title = (const char *)sqlite3_column_text(stmt, 1);
@@ -298,36 +382,49 @@ std::vector<Video> get_videos(sqlite3 *db, int limit = 20) {
     const char *mime = (const char *)sqlite3_column_text(stmt, 3);
     vid.mime_type = mime ? mime : "";
 
-    vid.size_bytes = sqlite3_column_int(stmt, 4);
+    vid.size_bytes = sqlite3_column_int64(stmt, 4);
     vid.duration_seconds = sqlite3_column_int(stmt, 5);
     vid.content_id = sqlite3_column_int(stmt, 6);
 
     const char *status = (const char *)sqlite3_column_text(stmt, 7);
     vid.processing_status = status ? status : "";
-
-    videos.push_back(vid);
   }
 
   sqlite3_finalize(stmt);
   return videos;
 }
 
-bool save_file(const std::vector<char> &file_data,
-               const std::string &filename) {
-  // Create upload directory if it doesn't exist
-  system(("mkdir -p " + std::string(TEMP_UPLOAD_DIR)).c_str());
+// Requests run as coroutines on this loop; what blocks is awaited on the
+// pools below
+EventLoop &event_loop() {
+  static EventLoop loop;
+  return loop;
+}
 
-  std::string filepath = std::string(TEMP_UPLOAD_DIR) + "/" + filename;
-  std::ofstream outfile(filepath, std::ios::binary);
+// SQLite work, on connections owned by the pool's threads
+ThreadPool &db_pool() {
+  static ThreadPool pool(event_loop(), DB_POOL_THREADS,
+                         resolve_db_path(DB_PATH));
+  return pool;
+}
 
-  if (!outfile) {
-    return false;
-  }
+// Spooling, storage uploads and cache fills: disk writes and subprocesses
+ThreadPool &blocking_pool() {
+  static ThreadPool pool(event_loop(), BLOCKING_POOL_THREADS);
+  return pool;
+}
 
-  outfile.write(file_data.data(), file_data.size());
-  outfile.close();
+// Uploads wait here until the storage backend has them
+UploadSpool &upload_spool() {
+  static UploadSpool spool(TEMP_UPLOAD_DIR);
+  return spool;
+}
 
-  return true;
+// Spool an uploaded file; returns its path, or "" on failure
+std::string save_file(const std::vector<char> &file_data,
+                      const std::string &filename) {
+  return upload_spool().store(
+      filename, std::string_view(file_data.data(), file_data.size()));
 }
 
 // Execute a shell command and get output
@@ -336,7 +433,7 @@ std::string exec_command(const std::string &cmd) {
   std::string result;
   char buffer[128];
 
-  log_to_file("Executing command: " + cmd);
+  log_to_file("Executing command: ", cmd);
 
   FILE *pipe = popen(cmd.c_str(), "r");
   if (!pipe) {
@@ -350,8 +447,7 @@ std::string exec_command(const std::string &cmd) {
 
   int status = pclose(pipe);
   if (status != 0) {
-    log_to_file("Command execution failed with status: " +
-                std::to_string(status));
+    log_to_file("Command execution failed with status: ", status);
   } else {
     log_to_file("Command executed successfully");
   }
@@ -359,855 +455,2781 @@ std::string exec_command(const std::string &cmd) {
   return result;
 }
 
-// Upload a file to GCS
-bool upload_to_gcs(const std::string &local_path, const std::string &gcs_path,
-                   bool public_access = false) {
-  std::string cmd = "sudo gsutil cp " + local_path + " " + gcs_path;
-  std::string result = exec_command(cmd);
-
-  if (public_access) {
-    cmd = "sudo gsutil acl ch -u AllUsers:R " + gcs_path;
-    exec_command(cmd);
+// Where uploaded media ends up. Objects are always addressed by their
+// gs://bucket/object path so the database looks the same whichever backend
+// is in use.
+//
+// Large files go up as a parallel composite upload: put() splits them into
+// parts that are uploaded as separate objects over several connections at
+// once, then composed into the destination object server-side, since a
+// single stream is limited to one connection's throughput.
+class StorageBackend {
+public:
+  virtual ~StorageBackend() {}
+  virtual bool upload(const std::string &local_path,
+                      const std::string &gcs_path, bool public_access) = 0;
+  virtual bool remove(const std::string &gcs_path) = 0;
+  virtual bool download(const std::string &gcs_path,
+                        const std::string &local_path) = 0;
+
+  struct StoredObject {
+    std::string path; // gs://bucket/object
+    time_t modified;
+  };
+  // Every object under `prefix` (gs://bucket/dir/); false if the listing
+  // failed, as opposed to finding nothing
+  virtual bool list(const std::string &prefix,
+                    std::vector<StoredObject> &objects) = 0;
+
+  // Delete objects over several connections at once; returns the ones that
+  // could not be deleted. An object that is already gone counts as deleted.
+  virtual std::vector<std::string>
+  remove_all(const std::vector<std::string> &paths) {
+    std::vector<char> failed(paths.size(), 0);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    size_t streams = std::min<size_t>(paths.size(), STORAGE_DELETE_STREAMS);
+    for (size_t w = 0; w < streams; w++) {
+      workers.emplace_back([&] {
+        for (size_t i; (i = next++) < paths.size();) {
+          failed[i] = !remove(paths[i]);
+        }
+      });
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+    std::vector<std::string> result;
+    for (size_t i = 0; i < paths.size(); i++) {
+      if (failed[i]) {
+        result.push_back(paths[i]);
+      }
+    }
+    return result;
   }
 
-  // Check if upload was successful
-  cmd = "sudo gsutil stat " + gcs_path + " 2>/dev/null";
-  result = exec_command(cmd);
-
-  return !result.empty();
-}
+  // Upload `length` bytes of a local file from `offset` as its own object
+  virtual bool upload_part(const std::string &local_path, uint64_t offset,
+                           uint64_t length, const std::string &part_path) = 0;
+  // Concatenate parts into `gcs_path`, deleting the parts
+  virtual bool compose(const std::vector<std::string> &parts,
+                       const std::string &gcs_path, bool public_access) = 0;
+
+  // Upload a local file, in parallel parts if it is large
+  bool put(const std::string &local_path, const std::string &gcs_path,
+           bool public_access) {
+    struct stat st;
+    if (stat(local_path.c_str(), &st) != 0) {
+      return false;
+    }
+    uint64_t size = st.st_size;
+    if (size < COMPOSITE_UPLOAD_MIN_SIZE) {
+      return upload(local_path, gcs_path, public_access);
+    }
 
-// Insert image record into database
-int insert_image(sqlite3 *db, const std::string &gcs_path,
-                 const std::string &filename, const std::string &mime_type,
-                 int size, int width, int height, int content_id,
-                 const std::string &image_type) {
-  sqlite3_stmt *stmt;
-  const char *sql =
-      "INSERT INTO images (original_url, filename, mime_type, size, width, "
-      "height, content_id, image_type, processing_status) "
-      "VALUES (?, ?, ?, ?, ?, ?, ?, ?, 'complete')";
+    // At least COMPOSITE_PART_MIN_SIZE per part, and no more parts than
+    // one compose call takes; 1 MB aligned
+    uint64_t part_size = std::max<uint64_t>(
+        COMPOSITE_PART_MIN_SIZE,
+        (size + COMPOSITE_MAX_PARTS - 1) / COMPOSITE_MAX_PARTS);
+    part_size = (part_size + (1 << 20) - 1) & ~((uint64_t(1) << 20) - 1);
+    size_t count = (size + part_size - 1) / part_size;
+    size_t streams = std::min<size_t>(count, COMPOSITE_MAX_STREAMS);
+
+    std::vector<std::string> parts;
+    for (size_t i = 0; i < count; i++) {
+      parts.push_back(gcs_path + ".part-" + std::to_string(i));
+    }
+    log_to_file("Composite upload of ", gcs_path, ": ", count, " parts of ",
+                part_size >> 20, " MB over ", streams, " streams");
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < streams; w++) {
+      workers.emplace_back([&] {
+        for (size_t i; !failed && (i = next++) < count;) {
+          uint64_t offset = i * part_size;
+          uint64_t length = std::min(part_size, size - offset);
+          if (!upload_part(local_path, offset, length, parts[i])) {
+            log_to_file("Composite upload part failed: ", parts[i]);
+            failed = true;
+          }
+        }
+      });
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
 
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-    return 0;
+    if (!failed && compose(parts, gcs_path, public_access)) {
+      return true;
+    }
+    for (const std::string &part : parts) {
+      remove(part);
+    }
+    return false;
   }
+};
 
-  sqlite3_bind_text(stmt, 1, gcs_path.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 2, filename.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 3, mime_type.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 4, size);
-  sqlite3_bind_int(stmt, 5, width);
-  sqlite3_bind_int(stmt, 6, height);
-  sqlite3_bind_int(stmt, 7, content_id);
-  sqlite3_bind_text(stmt, 8, image_type.c_str(), -1, SQLITE_STATIC);
-
-  sqlite3_step(stmt);
-  int last_id = sqlite3_last_insert_rowid(db);
+// Google Cloud Storage through gsutil
+class GcsStorage : public StorageBackend {
+public:
+  bool upload(const std::string &local_path, const std::string &gcs_path,
+              bool public_access) override {
+    std::string cmd = "sudo gsutil cp " + local_path + " " + gcs_path;
+    std::string result = exec_command(cmd);
 
-  sqlite3_finalize(stmt);
-  return last_id;
-}
+    if (public_access) {
+      cmd = "sudo gsutil acl ch -u AllUsers:R " + gcs_path;
+      exec_command(cmd);
+    }
 
-// Insert video record into database
-int insert_video(sqlite3 *db, const std::string &title,
-                 const std::string &gcs_path, const std::string &mime_type,
-                 int size, int duration, int content_id) {
-  sqlite3_stmt *stmt;
-  const char *sql =
-      "INSERT INTO videos (title, gcs_path, mime_type, size_bytes, "
-      "duration_seconds, content_id, processing_status) "
-      "VALUES (?, ?, ?, ?, ?, ?, 'complete')";
+    // Check if upload was successful
+    cmd = "sudo gsutil stat " + gcs_path + " 2>/dev/null";
+    result = exec_command(cmd);
 
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-    return 0;
+    return !result.empty();
   }
 
-  sqlite3_bind_text(stmt, 1, title.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 2, gcs_path.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 3, mime_type.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 4, size);
-  sqlite3_bind_int(stmt, 5, duration);
-  sqlite3_bind_int(stmt, 6, content_id);
-
-  sqlite3_step(stmt);
-  int last_id = sqlite3_last_insert_rowid(db);
-
-  sqlite3_finalize(stmt);
-  return last_id;
-}
-
-// Generate HTML for the main media manager page
-std::string generate_main_page(sqlite3 *db) {
-  std::vector<Image> images = get_images(db, 10);
-  std::vector<Video> videos = get_videos(db, 10);
-
-  std::stringstream html;
-  html << "<!DOCTYPE html>" << "<html><head><title>Media Manager</title>"
-       << "<style>" << "body { font-family: Arial, sans-serif; margin: 20px; }"
-       << "h1, h2 { color: #333; }"
-       << ".tabs { display: flex; margin-bottom: 20px; }"
-       << ".tab { padding: 10px 20px; background: #f0f0f0; cursor: pointer; "
-          "border: 1px solid #ccc; }"
-       << ".tab.active { background: #007bff; color: white; border-color: "
-          "#007bff; }"
-       << ".tab-content { display: none; }"
-       << ".tab-content.active { display: block; }"
-       << ".media-grid { display: grid; grid-template-columns: "
-          "repeat(auto-fill, minmax(200px, 1fr)); gap: 20px; }"
-       << ".media-item { border: 1px solid #ddd; padding: 10px; border-radius: "
-          "4px; }"
-       << ".media-item img { width: 100%; height: 150px; object-fit: cover; }"
-       << ".media-item .title { font-weight: bold; margin-top: 10px; }"
-       << ".media-item .info { color: #666; font-size: 0.8em; }"
-       << ".upload-form { margin: 20px 0; padding: 20px; border: 1px solid "
-          "#ddd; border-radius: 4px; }"
-       << "input, select, button { margin: 10px 0; padding: 8px; width: 100%; }"
-       << ".button { background: #007bff; color: white; border: none; padding: "
-          "10px 15px; cursor: pointer; }"
-       << ".button:hover { background: #0069d9; }" << "</style>" << "<script>"
-       << "function showTab(tabId) {"
-       << "  document.querySelectorAll('.tab-content').forEach(tab => "
-          "tab.classList.remove('active'));"
-       << "  document.querySelectorAll('.tab').forEach(tab => "
-          "tab.classList.remove('active'));"
-       << "  document.getElementById(tabId).classList.add('active');"
-       << "  "
-          "document.querySelector(`[data-tab=\"${tabId}\"]`).classList.add('"
-          "active');"
-       << "}" << "</script>" << "</head><body>" << "<h1>Media Manager</h1>"
-       << "<div class='tabs'>"
-       << "<div class='tab active' data-tab='dashboard' "
-          "onclick='showTab(\"dashboard\")'>Dashboard</div>"
-       << "<div class='tab' data-tab='upload-image' "
-          "onclick='showTab(\"upload-image\")'>Upload Image</div>"
-       << "<div class='tab' data-tab='upload-video' "
-          "onclick='showTab(\"upload-video\")'>Upload Video</div>"
-       << "<div class='tab' data-tab='manage-images' "
-          "onclick='showTab(\"manage-images\")'>Manage Images</div>"
-       << "<div class='tab' data-tab='manage-videos' "
-          "onclick='showTab(\"manage-videos\")'>Manage Videos</div>"
-       << "</div>"
-
-       << "<div id='dashboard' class='tab-content active'>"
-       << "<h2>Media Dashboard</h2>" << "<div class='stats'>"
-       << "<p>Recent Images: " << images.size() << "</p>"
-       << "<p>Recent Videos: " << videos.size() << "</p>" << "</div>"
-       << "<h3>Recent Images</h3>" << "<div class='media-grid'>";
-
-  for (const auto &img : images) {
-    html << "<div class='media-item'>" << "<img src='" << img.original_url
-         << "' alt='" << img.filename << "'>" << "<div class='title'>"
-         << img.filename << "</div>" << "<div class='info'>" << img.width << "x"
-         << img.height << " | " << (img.size / 1024) << " KB</div>" << "</div>";
+  bool remove(const std::string &gcs_path) override {
+    std::string result = exec_command("sudo gsutil rm " + gcs_path + " 2>&1");
+    log_to_file("GCS delete result: ", result);
+    return result.find("Removing") != std::string::npos ||
+           result.find("No URLs matched") != std::string::npos;
   }
 
-  html << "</div>" << "<h3>Recent Videos</h3>" << "<div class='media-grid'>";
-
-  for (const auto &vid : videos) {
-    html << "<div class='media-item'>"
-         << "<div class='video-placeholder' style='height: 150px; background: "
-            "#eee; display: flex; align-items: center; justify-content: "
-            "center;'>"
-         << "<div style='font-size: 40px;'>▶️</div>" << "</div>"
-         << "<div class='title'>" << vid.title << "</div>"
-         << "<div class='info'>" << (vid.size_bytes / 1024 / 1024) << " MB | "
-         << (vid.duration_seconds / 60) << ":" << (vid.duration_seconds % 60)
-         << "</div>" << "</div>";
-  }
-
-  html
-      << "</div>" << "</div>"
-
-      << "<div id='upload-image' class='tab-content'>"
-      << "<h2>Upload Image</h2>" << "<div class='upload-form'>"
-      << "<form action='/upload-image' method='post' "
-         "enctype='multipart/form-data'>"
-      << "<div><label>Image File:</label><input type='file' name='image' "
-         "accept='image/*' required></div>"
-      << "<div><label>Associated Content ID:</label><input type='number' "
-         "name='content_id' value='0'></div>"
-      << "<div><label>Image Type:</label>" << "<select name='image_type'>"
-      << "<option value='thumbnail'>Thumbnail</option>"
-      << "<option value='content' selected>Content</option>"
-      << "</select></div>" << "<div><label>Storage Type:</label>"
-      << "<select name='storage_type'>"
-      << "<option value='public' selected>Public</option>"
-      << "<option value='private'>Private</option>" << "</select></div>"
-      << "<div><button type='submit' class='button'>Upload Image</button></div>"
-      << "</form>" << "</div>" << "</div>"
-
-      << "<div id='upload-video' class='tab-content'>"
-      << "<h2>Upload Video</h2>" << "<div class='upload-form'>"
-      << "<form action='/upload-video' method='post' "
-         "enctype='multipart/form-data'>"
-      << "<div><label>Video File:</label><input type='file' name='video' "
-         "accept='video/*' required></div>"
-      << "<div><label>Title:</label><input type='text' name='title' "
-         "required></div>"
-      << "<div><label>Associated Content ID:</label><input type='number' "
-         "name='content_id' value='0'></div>"
-      << "<div><label>Duration (seconds):</label><input type='number' "
-         "name='duration' value='0'></div>"
-      << "<div><label>Storage Type:</label>" << "<select name='storage_type'>"
-      << "<option value='public' selected>Public</option>"
-      << "<option value='private'>Private</option>" << "</select></div>"
-      << "<div><button type='submit' class='button'>Upload Video</button></div>"
-      << "</form>" << "</div>" << "</div>"
-
-      << "<div id='manage-images' class='tab-content'>"
-      << "<h2>Manage Images</h2>" << "<div class='media-grid'>";
-
-  for (const auto &img : images) {
-    html << "<div class='media-item'>" << "<img src='" << img.original_url
-         << "' alt='" << img.filename << "'>" << "<div class='title'>"
-         << img.filename << "</div>" << "<div class='info'>" << img.width << "x"
-         << img.height << " | " << (img.size / 1024) << " KB</div>"
-         << "<div class='actions'>" << "<a href='/delete-image?id=" << img.id
-         << "' onclick='return confirm(\"Are you sure you want to delete this "
-            "image?\")'>Delete</a>"
-         << "</div>" << "</div>";
+  // One `gsutil -m rm` per batch; gsutil runs the deletes in parallel
+  std::vector<std::string>
+  remove_all(const std::vector<std::string> &paths) override {
+    std::string cmd = "sudo gsutil -m rm";
+    for (const std::string &path : paths) {
+      cmd += " " + path;
+    }
+    std::string result = exec_command(cmd + " 2>&1");
+    std::vector<std::string> failed;
+    for (const std::string &path : paths) {
+      if (result.find("Removing " + path + "...") == std::string::npos &&
+          result.find("No URLs matched: " + path) == std::string::npos) {
+        failed.push_back(path);
+      }
+    }
+    return failed;
   }
 
-  html << "</div>" << "</div>"
-
-       << "<div id='manage-videos' class='tab-content'>"
-       << "<h2>Manage Videos</h2>" << "<div class='media-grid'>";
-
-  for (const auto &vid : videos) {
-    html << "<div class='media-item'>"
-         << "<div class='video-placeholder' style='height: 150px; background: "
-            "#eee; display: flex; align-items: center; justify-content: "
-            "center;'>"
-         << "<div style='font-size: 40px;'>▶️</div>" << "</div>"
-         << "<div class='title'>" << vid.title << "</div>"
-         << "<div class='info'>" << (vid.size_bytes / 1024 / 1024) << " MB | "
-         << (vid.duration_seconds / 60) << ":" << (vid.duration_seconds % 60)
-         << "</div>" << "<div class='actions'>"
-         << "<a href='/delete-video?id=" << vid.id
-         << "' onclick='return confirm(\"Are you sure you want to delete this "
-            "video?\")'>Delete</a>"
-         << "</div>" << "</div>";
-  }
-
-  html << "</div>" << "</div>"
-
-       << "</body></html>";
-
-  return html.str();
-}
-
-// Process image upload
-std::string
-handle_image_upload(sqlite3 *db,
-                    const std::map<std::string, std::string> &form_data,
-                    const std::map<std::string, std::vector<char>> &files) {
-  std::stringstream response;
-  response << "HTTP/1.1 303 See Other\r\n";
-  response << "Location: /\r\n\r\n";
-
-  if (files.find("image") == files.end()) {
-    return response.str();
+  bool list(const std::string &prefix,
+            std::vector<StoredObject> &objects) override {
+    std::string result =
+        exec_command("sudo gsutil ls -l " + prefix + "** 2>&1");
+    if (result.find("matched no objects") != std::string::npos) {
+      return true;
+    }
+    if (result.find("Exception") != std::string::npos) {
+      log_to_file("GCS listing failed: ", result);
+      return false;
+    }
+    // "   <size>  2024-01-31T12:00:00Z  gs://bucket/object" per object,
+    // then a TOTAL line
+    std::istringstream lines(result);
+    std::string size, stamp, path;
+    while (lines >> size >> stamp) {
+      if (size == "TOTAL:") {
+        break;
+      }
+      lines >> path;
+      struct tm tm;
+      memset(&tm, 0, sizeof(tm));
+      if (strptime(stamp.c_str(), "%Y-%m-%dT%H:%M:%SZ", &tm)) {
+        objects.push_back({path, timegm(&tm)});
+      }
+    }
+    return true;
   }
 
-  // Get form data
-  const std::vector<char> &file_data = files.at("image");
-  std::string filename = form_data.at("image_filename");
-
-  log_to_file("Handling image upload: " + filename +
-              ", size: " + std::to_string(file_data.size()) + " bytes");
-
-  std::string image_type = form_data.find("image_type") != form_data.end()
-                               ? form_data.at("image_type")
-                               : "content";
-  std::string storage_type = form_data.find("storage_type") != form_data.end()
-                                 ? form_data.at("storage_type")
-                                 : "public";
-  int content_id = form_data.find("content_id") != form_data.end()
-                       ? std::stoi(form_data.at("content_id"))
-                       : 0;
-
-  // Save file temporarily
-  if (!save_file(file_data, filename)) {
-    return response.str();
+  bool download(const std::string &gcs_path,
+                const std::string &local_path) override {
+    std::string result =
+        exec_command("sudo gsutil cp " + gcs_path + " " + local_path + " 2>&1");
+    struct stat st;
+    if (stat(local_path.c_str(), &st) != 0) {
+      log_to_file("GCS download failed: ", result);
+      return false;
+    }
+    return true;
   }
 
-  // Determine correct bucket and path
-  std::string bucket = storage_type == "public" ? "gs://grabbiel-media-public"
-                                                : "gs://grabbiel-media";
-  std::string gcs_path = bucket + "/images/originals/" + filename;
-  std::string local_path = std::string(TEMP_UPLOAD_DIR) + "/" + filename;
+  bool upload_part(const std::string &local_path, uint64_t offset,
+                   uint64_t length, const std::string &part_path) override {
+    // dd streams just the part into gsutil, with no temporary copy
+    std::string result = exec_command(
+        "dd if=" + local_path + " iflag=skip_bytes,count_bytes skip=" +
+        std::to_string(offset) + " count=" + std::to_string(length) +
+        " bs=1M status=none | sudo gsutil -q cp - " + part_path +
+        " 2>&1 && echo PART_OK");
+    return result.find("PART_OK") != std::string::npos;
+  }
 
-  log_to_file("File saved to: " + local_path);
-  log_file_content(local_path);
+  bool compose(const std::vector<std::string> &parts,
+               const std::string &gcs_path, bool public_access) override {
+    std::string list;
+    for (const std::string &part : parts) {
+      list += " " + part;
+    }
+    std::string result = exec_command("sudo gsutil -q compose" + list + " " +
+                                      gcs_path + " 2>&1 && echo COMPOSE_OK");
+    if (result.find("COMPOSE_OK") == std::string::npos) {
+      log_to_file("GCS compose failed: ", result);
+      return false;
+    }
+    exec_command("sudo gsutil -q -m rm" + list + " 2>&1");
+    if (public_access) {
+      exec_command("sudo gsutil acl ch -u AllUsers:R " + gcs_path);
+    }
+    return true;
+  }
+};
 
-  // Upload to GCS
-  log_to_file("Attempting to upload to GCS: " + gcs_path);
-  bool success = upload_to_gcs(local_path, gcs_path, storage_type == "public");
-  log_to_file(std::string("GCS upload result: ") +
-              (success ? "success" : "failure"));
-  if (success) {
-    // Get image dimensions (would require image processing library)
-    // For now, we'll use placeholder values
-    int width = 1920;
-    int height = 1080;
-    int size = file_data.size();
+// Stand-in backend that keeps objects under a local directory, laid out as
+// <root>/<bucket>/<object>. Used for benchmarks and local testing.
+// GRABBIEL_STORAGE_STREAM_MBPS caps each upload stream, to mimic the
+// per-connection throughput of a remote store.
+class LocalStorage : public StorageBackend {
+public:
+  explicit LocalStorage(const std::string &root) : root_(root) {
+    const char *mbps = getenv("GRABBIEL_STORAGE_STREAM_MBPS");
+    stream_rate_ = parse_unsigned(mbps ? mbps : "", 0) * 1000000 / 8;
+  }
 
-    // Determine the public URL
-    std::string public_url;
-    if (storage_type == "public") {
-      public_url = "https://storage.googleapis.com/grabbiel-media-public/"
-                   "images/originals/" +
-                   filename;
-    } else {
-      public_url = gcs_path; // Store GCS path for private images
+  bool upload(const std::string &local_path, const std::string &gcs_path,
+              bool) override {
+    struct stat st;
+    if (stat(local_path.c_str(), &st) != 0) {
+      return false;
     }
-
-    // Store in database
-    insert_image(db, public_url, filename, "image/jpeg", size, width, height,
-                 content_id, image_type);
+    return upload_part(local_path, 0, st.st_size, gcs_path);
   }
 
-  // Clean up temporary file
-  std::string rm_cmd = "rm -f " + local_path;
-  system(rm_cmd.c_str());
+  bool download(const std::string &gcs_path,
+                const std::string &local_path) override {
+    std::string source = path_for(gcs_path);
+    return !source.empty() && copy_file(source, local_path);
+  }
 
-  return response.str();
-}
+  bool remove(const std::string &gcs_path) override {
+    std::string target = path_for(gcs_path);
+    return !target.empty() &&
+           (unlink(target.c_str()) == 0 || errno == ENOENT);
+  }
 
-// Process video upload
-std::string
-handle_video_upload(sqlite3 *db,
-                    const std::map<std::string, std::string> &form_data,
-                    const std::map<std::string, std::vector<char>> &files) {
-  std::stringstream response;
-  response << "HTTP/1.1 303 See Other\r\n";
-  response << "Location: /\r\n\r\n";
+  bool list(const std::string &prefix,
+            std::vector<StoredObject> &objects) override {
+    std::string dir = path_for(prefix);
+    if (dir.empty()) {
+      return false;
+    }
+    if (dir.back() == '/') {
+      dir.pop_back();
+    }
+    return walk(dir, prefix.substr(0, prefix.rfind('/')), objects);
+  }
 
-  if (files.find("video") == files.end()) {
-    return response.str();
+  bool upload_part(const std::string &local_path, uint64_t offset,
+                   uint64_t length, const std::string &part_path) override {
+    Clock::time_point start = Clock::now();
+    std::string target = path_for(part_path);
+    if (target.empty() || !make_dirs(target.substr(0, target.rfind('/')))) {
+      return false;
+    }
+    // Parts are short-lived; only the composed object is synced
+    bool ok = copy_range(local_path, offset, length, target, 0, O_TRUNC,
+                         part_path.find(".part-") == std::string::npos);
+    if (ok && stream_rate_) {
+      std::this_thread::sleep_until(
+          start + std::chrono::microseconds(length * 1000000 / stream_rate_));
+    }
+    return ok;
   }
 
-  // Get form data
-  const std::vector<char> &file_data = files.at("video");
-  std::string filename = form_data.at("video_filename");
-  std::string title = form_data.find("title") != form_data.end()
-                          ? form_data.at("title")
-                          : filename;
-  std::string storage_type = form_data.find("storage_type") != form_data.end()
-                                 ? form_data.at("storage_type")
-                                 : "public";
-  int content_id = form_data.find("content_id") != form_data.end()
-                       ? std::stoi(form_data.at("content_id"))
-                       : 0;
-  int duration = form_data.find("duration") != form_data.end()
-                     ? std::stoi(form_data.at("duration"))
-                     : 0;
+  bool compose(const std::vector<std::string> &parts,
+               const std::string &gcs_path, bool) override {
+    std::string target = path_for(gcs_path);
+    if (target.empty()) {
+      return false;
+    }
+    uint64_t offset = 0;
+    for (const std::string &part : parts) {
+      std::string source = path_for(part);
+      struct stat st;
+      if (stat(source.c_str(), &st) != 0 ||
+          !copy_range(source, 0, st.st_size, target, offset,
+                      offset ? 0 : O_TRUNC, &part == &parts.back())) {
+        return false;
+      }
+      offset += st.st_size;
+    }
+    for (const std::string &part : parts) {
+      remove(part);
+    }
+    return true;
+  }
 
-  // Save file temporarily
-  if (!save_file(file_data, filename)) {
-    return response.str();
+  std::string path_for(const std::string &gcs_path) const {
+    if (gcs_path.rfind("gs://", 0) != 0) {
+      return "";
+    }
+    return root_ + "/" + gcs_path.substr(5);
   }
 
-  // Determine correct bucket and path
-  std::string bucket = storage_type == "public" ? "gs://grabbiel-media-public"
-                                                : "gs://grabbiel-media";
-  std::string gcs_path = bucket + "/videos/originals/" + filename;
-  std::string local_path = std::string(TEMP_UPLOAD_DIR) + "/" + filename;
+private:
+  typedef std::chrono::steady_clock Clock;
 
-  // Upload to GCS
-  bool success = upload_to_gcs(local_path, gcs_path, storage_type == "public");
+  // Files below `dir`, named as objects below `prefix`; a missing
+  // directory is an empty listing
+  static bool walk(const std::string &dir, const std::string &prefix,
+                   std::vector<StoredObject> &objects) {
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+      return errno == ENOENT;
+    }
+    bool ok = true;
+    while (dirent *entry = readdir(d)) {
+      std::string name = entry->d_name;
+      if (name == "." || name == "..") {
+        continue;
+      }
+      struct stat st;
+      std::string path = dir + "/" + name;
+      if (stat(path.c_str(), &st) != 0) {
+        continue;
+      }
+      if (S_ISDIR(st.st_mode)) {
+        ok = walk(path, prefix + "/" + name, objects) && ok;
+      } else {
+        objects.push_back({prefix + "/" + name, st.st_mtime});
+      }
+    }
+    closedir(d);
+    return ok;
+  }
 
-  if (success) {
-    // Store in database
-    int size = file_data.size();
-    insert_video(db, title, gcs_path, "video/mp4", size, duration, content_id);
+  // Copy part of `from` into `to` at `to_offset`; the target is closed
+  // (and synced if `sync`) in the background
+  static bool copy_range(const std::string &from, uint64_t offset,
+                         uint64_t length, const std::string &to,
+                         uint64_t to_offset, int flags, bool sync) {
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+      return false;
+    }
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0644);
+    FileIo &io = FileIo::instance();
+    bool ok = out >= 0 && io.copy(in, out, length, offset, to_offset);
+    io.close_async(in);
+    if (out >= 0 && sync) {
+      io.sync_and_close_async(out);
+    } else if (out >= 0) {
+      io.close_async(out);
+    }
+    io.submit();
+    return ok;
   }
 
-  // Clean up temporary file
-  std::string rm_cmd = "rm -f " + local_path;
-  system(rm_cmd.c_str());
+  std::string root_;
+  uint64_t stream_rate_ = 0; // bytes per second, 0 for no limit
+};
 
-  return response.str();
+// GRABBIEL_STORAGE_DIR switches uploads to a local directory
+StorageBackend &storage() {
+  static std::unique_ptr<StorageBackend> backend;
+  if (!backend) {
+    const char *dir = getenv("GRABBIEL_STORAGE_DIR");
+    if (dir && *dir) {
+      backend.reset(new LocalStorage(dir));
+    } else {
+      backend.reset(new GcsStorage());
+    }
+  }
+  return *backend;
 }
 
-// Handle delete image request
-std::string
-handle_delete_image(sqlite3 *db,
-                    const std::map<std::string, std::string> &params) {
-  std::stringstream response;
-  response << "HTTP/1.1 303 See Other\r\n";
-  response << "Location: /\r\n\r\n";
-
-  if (params.find("id") == params.end()) {
-    log_to_file("Delete image request missing ID parameter");
-    return response.str();
+// Read-through cache of storage objects on local disk, so media requests
+// are answered with sendfile from the page cache instead of a round trip to
+// the bucket. Least recently used files are evicted once the cache outgrows
+// its size; a file being sent when it is evicted stays readable through the
+// open descriptor. Misses for an object that is already being fetched wait
+// for that fetch rather than starting another one.
+//
+// The index lives in memory, so files left by an earlier run are removed at
+// startup.
+class MediaCache {
+public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t coalesced = 0; // misses that waited on another fetch
+    uint64_t fetch_failures = 0;
+    uint64_t evictions = 0;
+    uint64_t bytes_fetched = 0;
+    uint64_t bytes_served = 0;
+    uint64_t bytes_served_from_cache = 0;
+    uint64_t entries = 0;
+    uint64_t size = 0;
+    uint64_t capacity = 0;
+  };
+
+  MediaCache(const std::string &dir, uint64_t capacity)
+      : dir_(dir), capacity_(capacity) {
+    make_dirs(dir_);
+    DIR *d = opendir(dir_.c_str());
+    if (d) {
+      while (dirent *entry = readdir(d)) {
+        if (entry->d_name[0] != '.') {
+          unlink((dir_ + "/" + entry->d_name).c_str());
+        }
+      }
+      closedir(d);
+    }
   }
 
-  int id = std::stoi(params.at("id"));
-  log_to_file("Handling delete request for image ID: " + std::to_string(id));
+  // Open the cached copy of `gcs_path`, fetching it on a miss; returns the
+  // descriptor and size, or -1 if the object could not be fetched
+  int open(const std::string &gcs_path, uint64_t &size, bool &hit) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    bool waited = false;
+    while (true) {
+      auto it = entries_.find(gcs_path);
+      if (it != entries_.end()) {
+        int fd = ::open(it->second.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+          lru_.splice(lru_.begin(), lru_, it->second.position);
+          size = it->second.size;
+          hit = !waited;
+          stats_.hits += hit;
+          return fd;
+        }
+        // Removed behind our back
+        drop(it);
+      }
+      auto fetching = fetches_.find(gcs_path);
+      if (fetching == fetches_.end()) {
+        break;
+      }
+      std::shared_ptr<Fetch> fetch = fetching->second;
+      stats_.coalesced += !waited;
+      waited = true;
+      cv_.wait(lock, [&] { return fetch->done; });
+      if (!fetch->ok) {
+        return -1;
+      }
+    }
 
-  // Get image info
-  sqlite3_stmt *stmt;
-  const char *sql = "SELECT original_url, filename FROM images WHERE id = ?";
+    stats_.misses++;
+    hit = false;
+    std::shared_ptr<Fetch> fetch = std::make_shared<Fetch>();
+    fetches_[gcs_path] = fetch;
+    std::string path = file_for(gcs_path);
+    lock.unlock();
+
+    // Fetch under a temporary name so a partial file is never served
+    std::string part = path + ".part";
+    struct stat st;
+    bool ok = storage().download(gcs_path, part) &&
+              stat(part.c_str(), &st) == 0 &&
+              rename(part.c_str(), path.c_str()) == 0;
+    int fd = ok ? ::open(path.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0) {
+      unlink(part.c_str());
+    }
 
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-    log_to_file("SQL error preparing statement: " +
-                std::string(sqlite3_errmsg(db)));
-    return response.str();
+    lock.lock();
+    fetches_.erase(gcs_path);
+    fetch->done = true;
+    fetch->ok = fd >= 0;
+    if (fd >= 0) {
+      size = st.st_size;
+      lru_.push_front(gcs_path);
+      entries_[gcs_path] = Entry{path, size, lru_.begin()};
+      size_ += size;
+      stats_.bytes_fetched += size;
+      evict();
+    } else {
+      stats_.fetch_failures++;
+      log_to_file("Media cache could not fetch ", gcs_path);
+    }
+    cv_.notify_all();
+    return fd;
   }
 
-  sqlite3_bind_int(stmt, 1, id);
-
-  std::string original_url;
-  std::string filename;
-  if (sqlite3_step(stmt) == SQLITE_ROW) {
-    const char *url = (const char *)sqlite3_column_text(stmt, 0);
-    original_url = url ? url : "";
-
-    const char *fname = (const char *)sqlite3_column_text(stmt, 1);
-    filename = fname ? fname : "";
+  // Forget an object that was deleted from storage
+  void invalidate(const std::string &gcs_path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(gcs_path);
+    if (it != entries_.end()) {
+      drop(it);
+    }
   }
 
-  sqlite3_finalize(stmt);
-
-  log_to_file("Image to delete - URL: " + original_url +
-              ", Filename: " + filename);
-
-  // Handle different URL formats
-  std::string gcs_path;
-  if (original_url.find("gs://") == 0) {
-    // Direct GCS path
-    gcs_path = original_url;
-  } else if (original_url.find("https://storage.googleapis.com/") == 0) {
-    // Convert https URL to gs:// format - fixed logic
-    std::string path_after_domain =
-        original_url.substr(strlen("https://storage.googleapis.com/"));
-
-    // Find the bucket name (everything up to the first slash)
-    size_t first_slash = path_after_domain.find('/');
-    if (first_slash != std::string::npos) {
-      std::string bucket = path_after_domain.substr(0, first_slash);
-      std::string object_path = path_after_domain.substr(first_slash + 1);
-      gcs_path = "gs://" + bucket + "/" + object_path;
-      log_to_file("Converted URL to GCS path: " + gcs_path);
-    } else {
-      // No slash found - the path is just the bucket name
-      gcs_path = "gs://" + path_after_domain;
-      log_to_file("Converted URL to GCS path (bucket only): " + gcs_path);
+  void record_sent(uint64_t bytes, bool hit) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.bytes_served += bytes;
+    if (hit) {
+      stats_.bytes_served_from_cache += bytes;
     }
   }
 
-  // Delete from GCS
-  if (!gcs_path.empty()) {
-    log_to_file("Attempting to delete from GCS: " + gcs_path);
-    std::string cmd = "sudo gsutil rm " + gcs_path + " 2>&1";
-    std::string result = exec_command(cmd);
-    log_to_file("GCS delete result: " + result);
-  } else if (!filename.empty()) {
-    // Try with constructed path as fallback
-    log_to_file("URL format not recognized, trying with constructed path");
-    std::string constructed_path =
-        "gs://grabbiel-media-public/images/originals/" + filename;
-    log_to_file("Attempting to delete from GCS: " + constructed_path);
-    std::string cmd = "sudo gsutil rm " + constructed_path + " 2>&1";
-    std::string result = exec_command(cmd);
-    log_to_file("GCS delete result: " + result);
-  } else {
-    log_to_file("Could not determine GCS path for deletion");
+  Stats stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = stats_;
+    stats.entries = entries_.size();
+    stats.size = size_;
+    stats.capacity = capacity_;
+    return stats;
   }
 
-  // Delete record
-  sql = "DELETE FROM images WHERE id = ?";
+private:
+  struct Entry {
+    std::string path;
+    uint64_t size;
+    std::list<std::string>::iterator position;
+  };
+
+  struct Fetch {
+    bool done = false;
+    bool ok = false;
+  };
+
+  std::string file_for(const std::string &gcs_path) const {
+    // FNV-1a keeps the names flat and free of path separators
+    uint64_t hash = 1469598103934665603ULL;
+    for (unsigned char c : gcs_path) {
+      hash = (hash ^ c) * 1099511628211ULL;
+    }
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+    return dir_ + "/" + name;
+  }
 
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-    log_to_file("SQL error preparing delete statement: " +
-                std::string(sqlite3_errmsg(db)));
-    return response.str();
+  void drop(std::unordered_map<std::string, Entry>::iterator it) {
+    unlink(it->second.path.c_str());
+    size_ -= it->second.size;
+    lru_.erase(it->second.position);
+    entries_.erase(it);
   }
 
-  sqlite3_bind_int(stmt, 1, id);
-  int result = sqlite3_step(stmt);
-  if (result != SQLITE_DONE) {
-    log_to_file("SQL error executing delete: " +
-                std::string(sqlite3_errmsg(db)));
-  } else {
-    log_to_file("Successfully deleted image record from database");
+  // The newest entry stays even if it alone exceeds the capacity
+  void evict() {
+    while (size_ > capacity_ && lru_.size() > 1) {
+      drop(entries_.find(lru_.back()));
+      stats_.evictions++;
+    }
   }
 
-  sqlite3_finalize(stmt);
+  std::string dir_;
+  uint64_t capacity_;
+  uint64_t size_ = 0;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::list<std::string> lru_; // most recently used first
+  std::unordered_map<std::string, std::shared_ptr<Fetch>> fetches_;
+  Stats stats_;
+};
 
-  return response.str();
+// GRABBIEL_MEDIA_CACHE_DIR and GRABBIEL_MEDIA_CACHE_MB override the defaults.
+// Each of several workers gets its own subdirectory and share of the space,
+// since a cache empties its directory when it starts.
+MediaCache &media_cache() {
+  static std::unique_ptr<MediaCache> cache;
+  if (!cache) {
+    const char *dir = getenv("GRABBIEL_MEDIA_CACHE_DIR");
+    const char *megabytes = getenv("GRABBIEL_MEDIA_CACHE_MB");
+    std::string path = dir && *dir ? dir : MEDIA_CACHE_DIR;
+    uint64_t capacity =
+        parse_unsigned(megabytes ? megabytes : "", MEDIA_CACHE_MB) << 20;
+    const WorkerEnvironment &worker = worker_environment();
+    if (worker.workers > 1) {
+      path += "/" + std::to_string(worker.slot);
+      capacity /= worker.workers;
+    }
+    cache.reset(new MediaCache(path, capacity));
+  }
+  return *cache;
 }
 
-// Handle delete video request
-std::string
-handle_delete_video(sqlite3 *db,
-                    const std::map<std::string, std::string> &params) {
-  std::stringstream response;
-  response << "HTTP/1.1 303 See Other\r\n";
-  response << "Location: /\r\n\r\n";
+std::string media_cache_report(const MediaCache::Stats &stats) {
+  uint64_t lookups = stats.hits + stats.misses;
+  std::ostringstream report;
+  report << std::fixed << std::setprecision(1);
+  report << "hits: " << stats.hits << "\n"
+         << "misses: " << stats.misses << "\n"
+         << "coalesced: " << stats.coalesced << "\n"
+         << "hit ratio: "
+         << (lookups ? 100.0 * stats.hits / lookups : 0.0) << "%\n"
+         << "fetch failures: " << stats.fetch_failures << "\n"
+         << "evictions: " << stats.evictions << "\n"
+         << "bytes fetched: " << stats.bytes_fetched << "\n"
+         << "bytes served: " << stats.bytes_served << "\n"
+         << "bytes served from cache: " << stats.bytes_served_from_cache
+         << "\n"
+         << "entries: " << stats.entries << "\n"
+         << "size: " << stats.size << " / " << stats.capacity << " bytes\n";
+  return report.str();
+}
 
-  if (params.find("id") == params.end()) {
-    return response.str();
+// Storage object behind a media URL: gs:// paths as they are, public
+// https://storage.googleapis.com/<bucket>/<object> URLs converted; "" for
+// anything else
+std::string object_path(const std::string &url) {
+  static const std::string public_prefix = "https://storage.googleapis.com/";
+  if (url.rfind("gs://", 0) == 0) {
+    return url;
   }
+  if (url.rfind(public_prefix, 0) == 0 &&
+      url.find('/', public_prefix.size()) != std::string::npos) {
+    return "gs://" + url.substr(public_prefix.size());
+  }
+  return "";
+}
 
-  int id = std::stoi(params.at("id"));
-
-  // Get video info
-  sqlite3_stmt *stmt;
-  const char *sql = "SELECT gcs_path FROM videos WHERE id = ?";
-
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-    return response.str();
+// Columns that may point at storage objects; tables missing from an older
+// schema are skipped
+static const char *const MEDIA_REFERENCE_QUERIES[] = {
+    "SELECT original_url FROM images", "SELECT url FROM image_variants",
+    "SELECT gcs_path FROM videos",     "SELECT gcs_path FROM video_variants",
+    "SELECT thumbnail_url FROM content_blocks",
+    "SELECT url FROM sochee_link"};
+
+// Only these prefixes of the media buckets are written by this server, so
+// only they are reconciled
+static const char *const MEDIA_PREFIXES[] = {
+    "gs://grabbiel-media/images/", "gs://grabbiel-media/videos/",
+    "gs://grabbiel-media-public/images/", "gs://grabbiel-media-public/videos/"};
+
+// Deletes storage objects in the background. Deleting media only records
+// its objects in storage_tombstones, in the same transaction as the row
+// deletes, so the request returns at once and a failed storage delete can
+// no longer leave an object nothing refers to. The collector deletes
+// tombstoned objects in batches and drops a tombstone only once its object
+// is gone; failures are retried on later passes.
+//
+// Every RECONCILE_INTERVAL_SECONDS it also lists the media prefixes and
+// tombstones objects no table references, as long as they are older than
+// RECONCILE_GRACE_SECONDS (an upload's object exists before its row).
+class StorageCollector {
+public:
+  struct Stats {
+    uint64_t deleted = 0;
+    uint64_t failed = 0;
+    uint64_t orphans = 0;
+    uint64_t reconciles = 0;
+    time_t last_reconcile = 0;
+  };
+
+  void start() {
+    std::thread([this] { run(); }).detach();
   }
 
-  sqlite3_bind_int(stmt, 1, id);
+  // Collect now rather than at the next interval
+  void wake() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    woken_ = true;
+    cv_.notify_one();
+  }
 
-  std::string gcs_path;
-  if (sqlite3_step(stmt) == SQLITE_ROW) {
-    const char *path = (const char *)sqlite3_column_text(stmt, 0);
-    gcs_path = path ? path : "";
+  Stats stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
   }
 
-  sqlite3_finalize(stmt);
+private:
+  void run() {
+    time_t next_reconcile = time(nullptr) + GC_INTERVAL_SECONDS;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait_for(lock, std::chrono::seconds(GC_INTERVAL_SECONDS),
+                     [this] { return woken_; });
+        woken_ = false;
+      }
+
+      sqlite3 *db;
+      if (open_db(resolve_db_path(DB_PATH), &db) != SQLITE_OK) {
+        log_to_file("Collector cannot open database");
+        sqlite3_close(db);
+        continue;
+      }
+      sqlite3_busy_timeout(db, GC_BUSY_TIMEOUT_MS);
+      if (time(nullptr) >= next_reconcile) {
+        reconcile(db);
+        next_reconcile = time(nullptr) + RECONCILE_INTERVAL_SECONDS;
+      }
+      collect(db);
+      sqlite3_close(db);
+    }
+  }
+
+  void collect(sqlite3 *db) {
+    sqlite3_stmt *select, *drop, *retry;
+    sqlite3_prepare_v2(db,
+                       "SELECT gcs_path FROM storage_tombstones "
+                       "ORDER BY attempts, created_at LIMIT ?",
+                       -1, &select, NULL);
+    sqlite3_prepare_v2(db, "DELETE FROM storage_tombstones WHERE gcs_path = ?",
+                       -1, &drop, NULL);
+    sqlite3_prepare_v2(db,
+                       "UPDATE storage_tombstones SET attempts = attempts + 1, "
+                       "last_attempt_at = CURRENT_TIMESTAMP WHERE gcs_path = ?",
+                       -1, &retry, NULL);
+    if (!select || !drop || !retry) {
+      log_to_file("Collector SQL error: ", sqlite3_errmsg(db));
+    }
+
+    while (select && drop && retry) {
+      std::vector<std::string> paths;
+      sqlite3_bind_int(select, 1, GC_BATCH);
+      while (sqlite3_step(select) == SQLITE_ROW) {
+        paths.push_back((const char *)sqlite3_column_text(select, 0));
+      }
+      sqlite3_reset(select);
+      if (paths.empty()) {
+        break;
+      }
+
+      std::vector<std::string> failed = storage().remove_all(paths);
+      std::unordered_set<std::string> failures(failed.begin(), failed.end());
+      sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+      for (const std::string &path : paths) {
+        sqlite3_stmt *stmt = failures.count(path) ? retry : drop;
+        sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_STATIC);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (!failures.count(path)) {
+          media_cache().invalidate(path);
+        }
+      }
+      sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+
+      log_to_file("Collector deleted ", paths.size() - failed.size(),
+                  " objects, ", failed.size(), " failed");
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.deleted += paths.size() - failed.size();
+        stats_.failed += failed.size();
+      }
+      // Failures are retried on the next pass rather than in a tight loop
+      if (!failed.empty() || paths.size() < GC_BATCH) {
+        break;
+      }
+    }
+    sqlite3_finalize(select);
+    sqlite3_finalize(drop);
+    sqlite3_finalize(retry);
+  }
+
+  void reconcile(sqlite3 *db) {
+    std::unordered_set<std::string> referenced;
+    for (const char *sql : MEDIA_REFERENCE_QUERIES) {
+      sqlite3_stmt *stmt;
+      if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        continue;
+      }
+      int rc;
+      while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *url = (const char *)sqlite3_column_text(stmt, 0);
+        std::string path = object_path(url ? url : "");
+        if (!path.empty()) {
+          referenced.insert(path);
+        }
+      }
+      sqlite3_finalize(stmt);
+      if (rc != SQLITE_DONE) {
+        log_to_file("Reconcile skipped, cannot read references: ",
+                    sqlite3_errmsg(db));
+        return;
+      }
+    }
+
+    std::vector<std::string> orphans;
+    time_t cutoff = time(nullptr) - RECONCILE_GRACE_SECONDS;
+    for (const char *prefix : MEDIA_PREFIXES) {
+      std::vector<StorageBackend::StoredObject> objects;
+      if (!storage().list(prefix, objects)) {
+        log_to_file("Reconcile skipped, cannot list ", prefix);
+        return;
+      }
+      for (const auto &object : objects) {
+        if (object.modified < cutoff && !referenced.count(object.path)) {
+          orphans.push_back(object.path);
+        }
+      }
+    }
+    // An empty reference set more likely means the wrong database than a
+    // bucket full of garbage
+    if (referenced.empty() && !orphans.empty()) {
+      log_to_file("Reconcile skipped, no media rows found");
+      return;
+    }
+
+    sqlite3_stmt *insert;
+    if (sqlite3_prepare_v2(db,
+                           "INSERT OR IGNORE INTO storage_tombstones "
+                           "(gcs_path) VALUES (?)",
+                           -1, &insert, NULL) != SQLITE_OK) {
+      log_to_file("Reconcile SQL error: ", sqlite3_errmsg(db));
+      return;
+    }
+    sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+    for (const std::string &path : orphans) {
+      sqlite3_bind_text(insert, 1, path.c_str(), -1, SQLITE_STATIC);
+      sqlite3_step(insert);
+      sqlite3_reset(insert);
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    sqlite3_finalize(insert);
+
+    log_to_file("Reconcile found ", orphans.size(), " orphaned objects");
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.orphans += orphans.size();
+    stats_.reconciles++;
+    stats_.last_reconcile = time(nullptr);
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool woken_ = false;
+  Stats stats_;
+};
+
+StorageCollector &storage_collector() {
+  static StorageCollector collector;
+  return collector;
+}
+
+std::string storage_collector_report(sqlite3 *db,
+                                     const StorageCollector::Stats &stats) {
+  long long pending = -1;
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM storage_tombstones", -1,
+                         &stmt, NULL) == SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      pending = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+  std::ostringstream report;
+  report << "pending tombstones: " << pending << "\n"
+         << "objects deleted: " << stats.deleted << "\n"
+         << "failed deletes: " << stats.failed << "\n"
+         << "orphans found: " << stats.orphans << "\n"
+         << "reconciles: " << stats.reconciles << "\n"
+         << "last reconcile: " << stats.last_reconcile << "\n";
+  return report.str();
+}
+
+// Trending hashtags and most viewed / liked content over sliding windows,
+// from streaming sketches (common/sketch.h) instead of GROUP BY over an
+// event history. Views arrive through POST /analytics/event, likes from
+// /sochee/counters, and hashtags by tailing the sochee_hashtag rows that
+// migration 009's triggers log to tag_index_changes. Each stream keeps a
+// one-hour window of minute buckets and a day of 15-minute buckets; what
+// each bucket gained is added to analytics_buckets (migration 011) every
+// ANALYTICS_PERSIST_SECONDS and when the server stops, and reloaded at
+// start. Adding rather than replacing lets workers and overlapping
+// generations (common/supervisor.h) share the table; only the one that
+// holds an flock on "<database>-analytics" tails the hashtag log, so no
+// hashtag is counted twice.
+enum class TrendingEvent { View, Like, Hashtag };
+
+struct TrendingWindow {
+  const char *name;
+  uint32_t bucket_seconds;
+  uint32_t buckets;
+};
+
+const TrendingWindow TRENDING_WINDOWS[] = {{"1h", 60, 60}, {"24h", 900, 96}};
+const char *const TRENDING_EVENTS[] = {"view", "like", "hashtag"};
+
+struct TrendingEntry {
+  uint64_t key; // content id, or the hashtag's sketch_hash
+  std::string label;
+  uint32_t count;
+};
+
+class TrendingAnalytics {
+public:
+  struct Stats {
+    uint64_t events = 0;
+    uint64_t hashtags_tailed = 0;
+    uint64_t persists = 0;
+    uint64_t buckets_written = 0;
+    uint64_t failures = 0;
+    time_t last_persist = 0;
+    int64_t position = 0; // last tag_index_changes id tailed
+    std::string last_error;
+  };
+
+  TrendingAnalytics() {
+    for (size_t e = 0; e < std::size(TRENDING_EVENTS); e++) {
+      for (const TrendingWindow &window : TRENDING_WINDOWS) {
+        SlidingTopK::Options options{window.bucket_seconds, window.buckets};
+        options.width = ANALYTICS_SKETCH_WIDTH;
+        options.heavy = ANALYTICS_HEAVY_HITTERS;
+        streams_.emplace_back(options);
+      }
+    }
+  }
+
+  // Reload persisted buckets, then tail and persist in the background
+  void start() {
+    sqlite3 *db;
+    if (open_db(resolve_db_path(DB_PATH), &db) == SQLITE_OK) {
+      load(db);
+    }
+    sqlite3_close(db);
+    std::thread([this] { run(); }).detach();
+  }
+
+  // Write what is not yet persisted, e.g. once the server has drained
+  void flush() {
+    sqlite3 *db;
+    if (open_db(resolve_db_path(DB_PATH), &db) == SQLITE_OK) {
+      sqlite3_busy_timeout(db, ANALYTICS_BUSY_TIMEOUT_MS);
+      persist(db);
+    }
+    sqlite3_close(db);
+  }
+
+  void record(TrendingEvent event, uint64_t key, uint32_t count,
+              std::string_view label = std::string_view()) {
+    time_t now = time(nullptr);
+    std::lock_guard<std::mutex> lock(mutex_);
+    record_locked(event, key, count, label, now);
+  }
+
+  void record_hashtag(std::string_view hashtag, uint32_t count) {
+    record(TrendingEvent::Hashtag, sketch_hash(hashtag), count, hashtag);
+  }
+
+  // False if `window` is not one of TRENDING_WINDOWS
+  bool top(TrendingEvent event, std::string_view window, size_t k,
+           std::vector<TrendingEntry> &out) {
+    for (size_t w = 0; w < std::size(TRENDING_WINDOWS); w++) {
+      if (window != TRENDING_WINDOWS[w].name) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      out.clear();
+      for (const TopEntry &entry :
+           stream(event, w).top(k, time(nullptr))) {
+        out.push_back({entry.key, std::string(entry.label), entry.count});
+      }
+      return true;
+    }
+    return false;
+  }
+
+  Stats stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+
+  // Heavy-hitter candidates per stream, for the admin report
+  std::vector<size_t> candidates() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<size_t> out;
+    for (const SlidingTopK &stream : streams_) {
+      out.push_back(stream.candidates());
+    }
+    return out;
+  }
+
+private:
+  SlidingTopK &stream(TrendingEvent event, size_t window) {
+    return streams_[(size_t)event * std::size(TRENDING_WINDOWS) + window];
+  }
+
+  std::string stream_name(size_t index) const {
+    return std::string(TRENDING_EVENTS[index / std::size(TRENDING_WINDOWS)]) +
+           "/" + TRENDING_WINDOWS[index % std::size(TRENDING_WINDOWS)].name;
+  }
+
+  void record_locked(TrendingEvent event, uint64_t key, uint32_t count,
+                     std::string_view label, time_t when) {
+    for (size_t w = 0; w < std::size(TRENDING_WINDOWS); w++) {
+      stream(event, w).add(key, when, count, label);
+    }
+    stats_.events++;
+  }
+
+  void load(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db,
+                           "SELECT stream, bucket, data FROM analytics_buckets",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+      log_to_file("Analytics state not loaded: ", sqlite3_errmsg(db));
+      return;
+    }
+    time_t now = time(nullptr);
+    size_t loaded = 0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      std::string_view name((const char *)sqlite3_column_text(stmt, 0),
+                            sqlite3_column_bytes(stmt, 0));
+      std::string_view data((const char *)sqlite3_column_blob(stmt, 2),
+                            sqlite3_column_bytes(stmt, 2));
+      for (size_t i = 0; i < streams_.size(); i++) {
+        if (name != stream_name(i)) {
+          continue;
+        }
+        if (streams_[i].restore(sqlite3_column_int64(stmt, 1), data, now)) {
+          loaded++;
+        } else {
+          log_to_file("Skipping malformed analytics bucket of ", name);
+        }
+      }
+    }
+    sqlite3_finalize(stmt);
+    stats_.position = read_position(db);
+    log_to_file("Loaded ", loaded, " analytics buckets");
+  }
+
+  void run() {
+    time_t next_persist = time(nullptr) + ANALYTICS_PERSIST_SECONDS;
+    while (true) {
+      std::this_thread::sleep_for(
+          std::chrono::seconds(ANALYTICS_TAIL_SECONDS));
+      sqlite3 *db;
+      if (open_db(resolve_db_path(DB_PATH), &db) != SQLITE_OK) {
+        sqlite3_close(db);
+        continue;
+      }
+      sqlite3_busy_timeout(db, ANALYTICS_BUSY_TIMEOUT_MS);
+      if (lock_tail(db)) {
+        tail_hashtags(db);
+      }
+      if (time(nullptr) >= next_persist) {
+        persist(db);
+        next_persist = time(nullptr) + ANALYTICS_PERSIST_SECONDS;
+      }
+      sqlite3_close(db);
+    }
+  }
+
+  // Taken once and held until exit. Whoever held it before may have
+  // tailed past the position loaded at start, so that is read again.
+  bool lock_tail(sqlite3 *db) {
+    if (tail_fd_ >= 0) {
+      return true;
+    }
+    std::string path = std::string(resolve_db_path(DB_PATH)) + "-analytics";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0) {
+      tail_fd_ = fd;
+      int64_t position = read_position(db);
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats_.position = std::max(stats_.position, position);
+      return true;
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+
+  int64_t read_position(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    int64_t position = 0;
+    if (sqlite3_prepare_v2(db,
+                           "SELECT position FROM analytics_cursors "
+                           "WHERE name = 'tag_index_changes'",
+                           -1, &stmt, NULL) == SQLITE_OK) {
+      if (sqlite3_step(stmt) == SQLITE_ROW) {
+        position = sqlite3_column_int64(stmt, 0);
+      }
+      sqlite3_finalize(stmt);
+    }
+    return position;
+  }
+
+  // Count hashtags added since the last pass, at the time they were
+  // logged. Deletes are logged too; a row still present is an addition.
+  void tail_hashtags(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(
+            db,
+            "SELECT c.id, c.hashtag, CAST(strftime('%s', c.created_at) AS "
+            "INTEGER), EXISTS (SELECT 1 FROM sochee_hashtag h WHERE "
+            "h.content_id = c.content_id AND h.hashtag = c.hashtag) "
+            "FROM tag_index_changes c WHERE c.id > ? AND c.kind = 2 "
+            "ORDER BY c.id LIMIT ?",
+            -1, &stmt, NULL) != SQLITE_OK) {
+      return; // no change log without migration 009
+    }
+    int64_t position;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      position = stats_.position;
+    }
+    // Step each batch without the lock, which record() and the trending
+    // pages take on the event loop; apply it in one short critical section
+    std::vector<std::pair<std::string, time_t>> added;
+    while (true) {
+      sqlite3_bind_int64(stmt, 1, position);
+      sqlite3_bind_int(stmt, 2, ANALYTICS_TAIL_BATCH);
+      int rows = 0;
+      added.clear();
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+        rows++;
+        position = sqlite3_column_int64(stmt, 0);
+        const char *hashtag = (const char *)sqlite3_column_text(stmt, 1);
+        if (hashtag && sqlite3_column_int(stmt, 3)) {
+          added.emplace_back(hashtag, (time_t)sqlite3_column_int64(stmt, 2));
+        }
+      }
+      sqlite3_reset(stmt);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto &tag : added) {
+          record_locked(TrendingEvent::Hashtag, sketch_hash(tag.first), 1,
+                        tag.first, tag.second);
+        }
+        stats_.hashtags_tailed += added.size();
+        stats_.position = position;
+      }
+      if (rows < ANALYTICS_TAIL_BATCH) {
+        break;
+      }
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  // Add what the buckets gained to the stored ones and write the tail
+  // position, in one transaction, and drop buckets that have left their
+  // window. What fails to write is kept for the next attempt.
+  void persist(sqlite3 *db) {
+    std::lock_guard<std::mutex> persisting(persist_mutex_);
+    int64_t position;
+    std::vector<int64_t> first_live;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      time_t now = time(nullptr);
+      for (size_t i = 0; i < streams_.size(); i++) {
+        for (auto &bucket : streams_[i].take_dirty()) {
+          std::string &unsaved = unsaved_[{i, bucket.first}];
+          unsaved = unsaved.empty()
+                        ? std::move(bucket.second)
+                        : streams_[i].merge_data(unsaved, bucket.second);
+        }
+        first_live.push_back(streams_[i].first_live(now));
+      }
+      position = stats_.position;
+    }
+
+    sqlite3_create_function(db, "analytics_merge", 3, SQLITE_UTF8, this,
+                            merge_function, NULL, NULL);
+    sqlite3_stmt *upsert = nullptr, *expire = nullptr, *cursor = nullptr;
+    bool ok =
+        sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) == SQLITE_OK &&
+        sqlite3_prepare_v2(db,
+                           "INSERT INTO analytics_buckets (stream, bucket, "
+                           "data) VALUES (?, ?, ?) ON CONFLICT (stream, "
+                           "bucket) DO UPDATE SET data = analytics_merge("
+                           "stream, data, excluded.data)",
+                           -1, &upsert, NULL) == SQLITE_OK &&
+        sqlite3_prepare_v2(db,
+                           "DELETE FROM analytics_buckets "
+                           "WHERE stream = ? AND bucket < ?",
+                           -1, &expire, NULL) == SQLITE_OK &&
+        sqlite3_prepare_v2(db,
+                           "INSERT INTO analytics_cursors (name, position) "
+                           "VALUES ('tag_index_changes', ?) ON CONFLICT "
+                           "(name) DO UPDATE SET position = "
+                           "max(position, excluded.position)",
+                           -1, &cursor, NULL) == SQLITE_OK;
+    for (const auto &bucket : unsaved_) {
+      if (!ok) {
+        break;
+      }
+      std::string name = stream_name(bucket.first.first);
+      sqlite3_bind_text(upsert, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_int64(upsert, 2, bucket.first.second);
+      sqlite3_bind_blob(upsert, 3, bucket.second.data(),
+                        (int)bucket.second.size(), SQLITE_STATIC);
+      ok = sqlite3_step(upsert) == SQLITE_DONE;
+      sqlite3_reset(upsert);
+    }
+    for (size_t i = 0; ok && i < streams_.size(); i++) {
+      std::string name = stream_name(i);
+      sqlite3_bind_text(expire, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_int64(expire, 2, first_live[i]);
+      ok = sqlite3_step(expire) == SQLITE_DONE;
+      sqlite3_reset(expire);
+    }
+    if (ok) {
+      sqlite3_bind_int64(cursor, 1, position);
+      ok = sqlite3_step(cursor) == SQLITE_DONE &&
+           sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK;
+    }
+    std::string error = ok ? "" : sqlite3_errmsg(db);
+    sqlite3_finalize(upsert);
+    sqlite3_finalize(expire);
+    sqlite3_finalize(cursor);
+    if (!ok) {
+      sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ok) {
+      stats_.persists++;
+      stats_.buckets_written += unsaved_.size();
+      stats_.last_persist = time(nullptr);
+      unsaved_.clear();
+      return;
+    }
+    // Keep only what is still inside its window
+    for (auto it = unsaved_.begin(); it != unsaved_.end();) {
+      it = it->first.second < first_live[it->first.first] ? unsaved_.erase(it)
+                                                          : std::next(it);
+    }
+    if (stats_.failures++ == 0 || error != stats_.last_error) {
+      log_to_file("Analytics persist failed: ", error);
+    }
+    stats_.last_error = error;
+  }
+
+  // analytics_merge(stream, stored, added): the stored bucket plus what
+  // was added to it, as SlidingTopK::merge_data() sums them
+  static void merge_function(sqlite3_context *context, int,
+                             sqlite3_value **args) {
+    TrendingAnalytics *self = (TrendingAnalytics *)sqlite3_user_data(context);
+    std::string_view name((const char *)sqlite3_value_text(args[0]),
+                          sqlite3_value_bytes(args[0]));
+    std::string_view stored((const char *)sqlite3_value_blob(args[1]),
+                            sqlite3_value_bytes(args[1]));
+    std::string_view added((const char *)sqlite3_value_blob(args[2]),
+                           sqlite3_value_bytes(args[2]));
+    // Only options are read, which never change: no lock needed
+    for (size_t i = 0; i < self->streams_.size(); i++) {
+      if (name == self->stream_name(i)) {
+        std::string merged = self->streams_[i].merge_data(stored, added);
+        sqlite3_result_blob(context, merged.data(), (int)merged.size(),
+                            SQLITE_TRANSIENT);
+        return;
+      }
+    }
+    sqlite3_result_value(context, args[2]);
+  }
+
+  std::mutex mutex_;
+  std::vector<SlidingTopK> streams_;
+  Stats stats_;
+
+  std::mutex persist_mutex_; // the background thread and flush()
+  std::map<std::pair<size_t, int64_t>, std::string> unsaved_;
+  int tail_fd_ = -1; // tail lock, background thread only
+};
+
+TrendingAnalytics &trending_analytics() {
+  static TrendingAnalytics analytics;
+  return analytics;
+}
+
+std::string trending_report(const TrendingAnalytics::Stats &stats,
+                            const std::vector<size_t> &candidates) {
+  std::ostringstream report;
+  report << "events recorded: " << stats.events << "\n"
+         << "hashtags tailed: " << stats.hashtags_tailed << "\n"
+         << "tail position: " << stats.position << "\n"
+         << "persists: " << stats.persists << "\n"
+         << "buckets written: " << stats.buckets_written << "\n"
+         << "failed persists: " << stats.failures << "\n"
+         << "last persist: " << stats.last_persist << "\n";
+  for (size_t i = 0; i < candidates.size(); i++) {
+    report << "candidates " << TRENDING_EVENTS[i / std::size(TRENDING_WINDOWS)]
+           << "/" << TRENDING_WINDOWS[i % std::size(TRENDING_WINDOWS)].name
+           << ": " << candidates[i] << "\n";
+  }
+  if (!stats.last_error.empty()) {
+    report << "last error: " << stats.last_error << "\n";
+  }
+  return report.str();
+}
+
+bool parse_trending_event(std::string_view name, TrendingEvent &event) {
+  for (size_t e = 0; e < std::size(TRENDING_EVENTS); e++) {
+    if (name == TRENDING_EVENTS[e]) {
+      event = (TrendingEvent)e;
+      return true;
+    }
+  }
+  return false;
+}
+
+// POST /analytics/event?type=view&id=42
+// POST /analytics/event?type=hashtag&tag=%23food
+// GET  /analytics/top?type=hashtag&window=1h&k=10
+//   {"type":"hashtag","window":"1h","micros":3,
+//    "top":[{"hashtag":"#food","count":120},...]}
+// Counts are Count-Min estimates: never below the true count.
+void handle_analytics(const HttpRequest &request, ResponseWriter &response) {
+  TrendingAnalytics &analytics = trending_analytics();
+  TrendingEvent event;
+  if (!parse_trending_event(request.param("type"), event)) {
+    response.text(400, "type must be view, like or hashtag");
+    return;
+  }
+
+  if (request.path == "/analytics/event" && request.method == "POST") {
+    if (event == TrendingEvent::Hashtag) {
+      std::string_view tag = request.param("tag");
+      if (tag.empty() || tag.size() > ANALYTICS_MAX_HASHTAG) {
+        response.text(400, "Missing or oversized tag");
+        return;
+      }
+      analytics.record_hashtag(tag, 1);
+    } else {
+      uint64_t id = parse_unsigned(request.param("id"), 0);
+      if (!id) {
+        response.text(400, "Missing id");
+        return;
+      }
+      analytics.record(event, id, 1);
+    }
+    response.set_status(204);
+    return;
+  }
+
+  if (request.path != "/analytics/top" || request.method != "GET") {
+    response.text(404, "404 - Page not found");
+    return;
+  }
+  std::string_view window = request.param("window");
+  if (window.empty()) {
+    window = TRENDING_WINDOWS[0].name;
+  }
+  size_t k = std::min(parse_unsigned(request.param("k"), 10),
+                      (size_t)ANALYTICS_TOP_MAX);
+  std::vector<TrendingEntry> entries;
+  auto start = std::chrono::steady_clock::now();
+  if (!analytics.top(event, window, k, entries)) {
+    response.text(400, "window must be 1h or 24h");
+    return;
+  }
+  long long micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+  std::string json = "{\"type\":\"" +
+                     std::string(TRENDING_EVENTS[(size_t)event]) +
+                     "\",\"window\":\"" + std::string(window) +
+                     "\",\"micros\":" + std::to_string(micros) + ",\"top\":[";
+  for (size_t i = 0; i < entries.size(); i++) {
+    json += i ? ",{" : "{";
+    if (event == TrendingEvent::Hashtag) {
+      json += "\"hashtag\":\"";
+      escape_append(json, EscapeMode::Json, entries[i].label);
+      json += "\"";
+    } else {
+      json += "\"id\":" + std::to_string(entries[i].key);
+    }
+    json += ",\"count\":" + std::to_string(entries[i].count) + "}";
+  }
+  json += "]}";
+  response.set_content_type("application/json");
+  response.body().append_copy(json);
+}
+
+// sochee.likes and sochee.comments, written through the coalescing
+// counter service instead of one transaction per action
+CounterService &sochee_counters() {
+  static CounterService counters("sochee", {"likes", "comments"});
+  return counters;
+}
+
+std::string counter_report(const CounterService &service,
+                           const CounterStats &stats) {
+  std::ostringstream report;
+  report << std::fixed << std::setprecision(1);
+  report << "journal directory: " << service.journal_dir() << "\n"
+         << "shards: " << service.shards() << "\n"
+         << "deltas recorded: " << stats.recorded << "\n"
+         << "flushes: " << stats.flushes << "\n"
+         << "rows written: " << stats.rows << "\n"
+         << "replayed at start: " << stats.replayed << "\n"
+         << "failed flushes: " << stats.failures << "\n"
+         << "journal segment: " << stats.segment << "\n"
+         << "last flush: " << stats.last_flush_ms << " ms\n";
+  if (!stats.last_error.empty()) {
+    report << "last error: " << stats.last_error << "\n";
+  }
+  return report.str();
+}
+
+// "+3", "-1" or "2"; false unless within SOCHEE_COUNTER_MAX_DELTA
+bool parse_delta(std::string_view text, int32_t &delta) {
+  bool negative = !text.empty() && text[0] == '-';
+  if (!text.empty() && (text[0] == '-' || text[0] == '+')) {
+    text.remove_prefix(1);
+  }
+  size_t magnitude = parse_unsigned(text, SIZE_MAX);
+  if (magnitude > SOCHEE_COUNTER_MAX_DELTA) {
+    return false;
+  }
+  delta = negative ? -(int32_t)magnitude : (int32_t)magnitude;
+  return true;
+}
+
+// GET  /sochee/counters?id=N                      current values
+// POST /sochee/counters?id=N&likes=1&comments=-1  apply deltas
+// Both answer {"id":N,"likes":L,"comments":C}, pending deltas included.
+void handle_sochee_counters(sqlite3 *db, const HttpRequest &request,
+                            ResponseWriter &response) {
+  CounterService &counters = sochee_counters();
+  const char *columns[] = {"likes", "comments"};
+  int64_t id = (int64_t)parse_unsigned(request.param("id"), 0);
+  if (!counters.ready()) {
+    response.text(503, "Counters unavailable");
+    return;
+  }
+  if (request.method != "GET" && request.method != "POST") {
+    response.text(405, "405 - Method Not Allowed");
+    return;
+  }
+
+  int32_t deltas[2] = {0, 0};
+  for (int c = 0; c < 2 && request.method == "POST"; c++) {
+    if (request.has_param(columns[c]) &&
+        !parse_delta(request.param(columns[c]), deltas[c])) {
+      response.text(400, "Invalid delta for " + std::string(columns[c]));
+      return;
+    }
+  }
+
+  std::vector<int64_t> values;
+  if (!id || !counters.read(db, id, values)) {
+    response.text(404, "404 - No such sochee post");
+    return;
+  }
+  for (int c = 0; c < 2; c++) {
+    if (!deltas[c]) {
+      continue;
+    }
+    if (!counters.add(id, c, deltas[c])) {
+      log_to_file("Counter journal write failed for sochee ", id);
+      response.text(503, "Counters unavailable");
+      return;
+    }
+    values[c] += deltas[c];
+  }
+  if (deltas[0] > 0) {
+    trending_analytics().record(TrendingEvent::Like, id, deltas[0]);
+  }
+
+  response.set_content_type("application/json");
+  HtmlOutput &out = response.body();
+  out.append_static("{\"id\":");
+  out.append_number(id);
+  out.append_static(",\"likes\":");
+  out.append_number(values[0]);
+  out.append_static(",\"comments\":");
+  out.append_number(values[1]);
+  out.append_static("}");
+}
+
+// Insert image record into database
+int insert_image(sqlite3 *db, const std::string &gcs_path,
+                 const std::string &filename, const std::string &mime_type,
+                 int size, int width, int height, int content_id,
+                 const std::string &image_type) {
+  sqlite3_stmt *stmt;
+  const char *sql =
+      "INSERT INTO images (original_url, filename, mime_type, size, width, "
+      "height, content_id, image_type, processing_status) "
+      "VALUES (?, ?, ?, ?, ?, ?, ?, ?, 'complete')";
+
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    return 0;
+  }
+
+  sqlite3_bind_text(stmt, 1, gcs_path.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, filename.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 3, mime_type.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 4, size);
+  sqlite3_bind_int(stmt, 5, width);
+  sqlite3_bind_int(stmt, 6, height);
+  sqlite3_bind_int(stmt, 7, content_id);
+  sqlite3_bind_text(stmt, 8, image_type.c_str(), -1, SQLITE_STATIC);
+
+  sqlite3_step(stmt);
+  int last_id = sqlite3_last_insert_rowid(db);
+
+  sqlite3_finalize(stmt);
+  return last_id;
+}
+
+// Insert video record into database
+int insert_video(sqlite3 *db, const std::string &title,
+                 const std::string &gcs_path, const std::string &mime_type,
+                 int64_t size, int duration, int content_id) {
+  sqlite3_stmt *stmt;
+  const char *sql =
+      "INSERT INTO videos (title, gcs_path, mime_type, size_bytes, "
+      "duration_seconds, content_id, processing_status) "
+      "VALUES (?, ?, ?, ?, ?, ?, 'complete')";
+
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    return 0;
+  }
+
+  sqlite3_bind_text(stmt, 1, title.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, gcs_path.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 3, mime_type.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 4, size);
+  sqlite3_bind_int(stmt, 5, duration);
+  sqlite3_bind_int(stmt, 6, content_id);
+
+  sqlite3_step(stmt);
+  int last_id = sqlite3_last_insert_rowid(db);
+
+  sqlite3_finalize(stmt);
+  return last_id;
+}
+
+// Page templates; see common/html_template.h for the hole syntax
+#define VIDEO_PLACEHOLDER                                                      \
+  "<div class='video-placeholder' style='height: 150px; background: #eee; "   \
+  "display: flex; align-items: center; justify-content: center;'>"             \
+  "<div style='font-size: 40px;'>▶️</div></div>"
+
+HTML_TEMPLATE(
+    MAIN_PAGE,
+    "<!DOCTYPE html><html><head><title>Media Manager</title><style>"
+    "body { font-family: Arial, sans-serif; margin: 20px; }"
+    "h1, h2 { color: #333; }"
+    ".tabs { display: flex; margin-bottom: 20px; }"
+    ".tab { padding: 10px 20px; background: #f0f0f0; cursor: pointer; "
+    "border: 1px solid #ccc; }"
+    ".tab.active { background: #007bff; color: white; border-color: "
+    "#007bff; }"
+    ".tab-content { display: none; }"
+    ".tab-content.active { display: block; }"
+    ".media-grid { display: grid; grid-template-columns: "
+    "repeat(auto-fill, minmax(200px, 1fr)); gap: 20px; }"
+    ".media-item { border: 1px solid #ddd; padding: 10px; border-radius: "
+    "4px; }"
+    ".media-item img { width: 100%; height: 150px; object-fit: cover; }"
+    ".media-item .title { font-weight: bold; margin-top: 10px; }"
+    ".media-item .info { color: #666; font-size: 0.8em; }"
+    ".upload-form { margin: 20px 0; padding: 20px; border: 1px solid "
+    "#ddd; border-radius: 4px; }"
+    "input, select, button { margin: 10px 0; padding: 8px; width: 100%; }"
+    ".button { background: #007bff; color: white; border: none; padding: "
+    "10px 15px; cursor: pointer; }"
+    ".button:hover { background: #0069d9; }</style><script>"
+    "function showTab(tabId) {"
+    "  document.querySelectorAll('.tab-content').forEach(tab => "
+    "tab.classList.remove('active'));"
+    "  document.querySelectorAll('.tab').forEach(tab => "
+    "tab.classList.remove('active'));"
+    "  document.getElementById(tabId).classList.add('active');"
+    "  document.querySelector(`[data-tab=\"${tabId}\"]`).classList.add('"
+    "active');"
+    "}</script></head><body><h1>Media Manager</h1><div class='tabs'>"
+    "<div class='tab active' data-tab='dashboard' "
+    "onclick='showTab(\"dashboard\")'>Dashboard</div>"
+    "<div class='tab' data-tab='upload-image' "
+    "onclick='showTab(\"upload-image\")'>Upload Image</div>"
+    "<div class='tab' data-tab='upload-video' "
+    "onclick='showTab(\"upload-video\")'>Upload Video</div>"
+    "<div class='tab' data-tab='manage-images' "
+    "onclick='showTab(\"manage-images\")'>Manage Images</div>"
+    "<div class='tab' data-tab='manage-videos' "
+    "onclick='showTab(\"manage-videos\")'>Manage Videos</div></div>"
+
+    "<div id='dashboard' class='tab-content active'><h2>Media Dashboard</h2>"
+    "<div class='stats'><p>Recent Images: {{image_count}}</p>"
+    "<p>Recent Videos: {{video_count}}</p></div>"
+    "<h3>Recent Images</h3><div class='media-grid'>{{images:raw}}</div>"
+    "<h3>Recent Videos</h3><div class='media-grid'>{{videos:raw}}</div></div>"
+
+    "<div id='upload-image' class='tab-content'><h2>Upload Image</h2>"
+    "<div class='upload-form'><form action='/upload-image' method='post' "
+    "enctype='multipart/form-data'>"
+    "<div><label>Image File:</label><input type='file' name='image' "
+    "accept='image/*' required></div>"
+    "<div><label>Associated Content ID:</label><input type='number' "
+    "name='content_id' value='0'></div>"
+    "<div><label>Image Type:</label><select name='image_type'>"
+    "<option value='thumbnail'>Thumbnail</option>"
+    "<option value='content' selected>Content</option></select></div>"
+    "<div><label>Storage Type:</label><select name='storage_type'>"
+    "<option value='public' selected>Public</option>"
+    "<option value='private'>Private</option></select></div>"
+    "<div><button type='submit' class='button'>Upload Image</button></div>"
+    "</form></div></div>"
+
+    "<div id='upload-video' class='tab-content'><h2>Upload Video</h2>"
+    "<div class='upload-form'><form action='/upload-video' method='post' "
+    "enctype='multipart/form-data'>"
+    "<div><label>Video File:</label><input type='file' name='video' "
+    "accept='video/*' required></div>"
+    "<div><label>Title:</label><input type='text' name='title' "
+    "required></div>"
+    "<div><label>Associated Content ID:</label><input type='number' "
+    "name='content_id' value='0'></div>"
+    "<div><label>Duration (seconds):</label><input type='number' "
+    "name='duration' value='0'></div>"
+    "<div><label>Storage Type:</label><select name='storage_type'>"
+    "<option value='public' selected>Public</option>"
+    "<option value='private'>Private</option></select></div>"
+    "<div><button type='submit' class='button'>Upload Video</button></div>"
+    "</form></div></div>"
+
+    "<div id='manage-images' class='tab-content'><h2>Manage Images</h2>"
+    "<div class='media-grid'>{{manage_images:raw}}</div></div>"
+    "<div id='manage-videos' class='tab-content'><h2>Manage Videos</h2>"
+    "<div class='media-grid'>{{manage_videos:raw}}</div></div>"
+    "</body></html>");
+
+HTML_TEMPLATE(IMAGE_ITEM,
+              "<div class='media-item'><img src='{{url:attr}}' "
+              "alt='{{filename:attr}}'><div class='title'>{{filename}}</div>"
+              "<div class='info'>{{width}}x{{height}} | {{kb}} KB</div>"
+              "{{actions:raw}}</div>");
+
+HTML_TEMPLATE(VIDEO_ITEM, "<div class='media-item'>" VIDEO_PLACEHOLDER
+                          "<div class='title'>{{title}}</div>"
+                          "<div class='info'>{{mb}} MB | {{minutes}}:"
+                          "{{seconds}}</div>{{actions:raw}}</div>");
+
+HTML_TEMPLATE(DELETE_ACTION,
+              "<div class='actions'><a href='/delete-{{kind:raw}}?id={{id}}' "
+              "onclick='return confirm(\"Are you sure you want to delete "
+              "this {{kind:raw}}?\")'>Delete</a></div>");
+
+// Private objects (gs:// URLs) are not reachable from a browser; point them
+// at the cache instead
+std::pmr::string media_url(std::string_view url,
+                           std::pmr::memory_resource *mr) {
+  std::pmr::string href(mr);
+  if (url.substr(0, 5) == "gs://") {
+    href.reserve(url.size() + 2);
+    href.append("/media/").append(url.substr(5));
+  } else {
+    href.assign(url);
+  }
+  return href;
+}
+
+void render_images(HtmlOutput &out, const std::pmr::vector<Image> &images,
+                   bool actions) {
+  std::pmr::memory_resource *mr = images.get_allocator().resource();
+  for (const auto &img : images) {
+    render<IMAGE_ITEM>(out, media_url(img.original_url, mr), img.filename,
+                       img.width, img.height, img.size / 1024,
+                       [&](HtmlOutput &o) {
+                         if (actions) {
+                           render<DELETE_ACTION>(o, "image", img.id);
+                         }
+                       });
+  }
+}
+
+void render_videos(HtmlOutput &out, const std::pmr::vector<Video> &videos,
+                   bool actions) {
+  for (const auto &vid : videos) {
+    render<VIDEO_ITEM>(out, vid.title, vid.size_bytes / 1024 / 1024,
+                       vid.duration_seconds / 60, vid.duration_seconds % 60,
+                       [&](HtmlOutput &o) {
+                         if (actions) {
+                           render<DELETE_ACTION>(o, "video", vid.id);
+                         }
+                       });
+  }
+}
+
+// Generate HTML for the main media manager page
+void generate_main_page(sqlite3 *db, HtmlOutput &out,
+                        std::pmr::memory_resource *arena) {
+  std::pmr::vector<Image> images = get_images(db, arena, 10);
+  std::pmr::vector<Video> videos = get_videos(db, arena, 10);
+
+  render<MAIN_PAGE>(
+      out, images.size(), videos.size(),
+      [&](HtmlOutput &o) { render_images(o, images, false); },
+      [&](HtmlOutput &o) { render_videos(o, videos, false); },
+      [&](HtmlOutput &o) { render_images(o, images, true); },
+      [&](HtmlOutput &o) { render_videos(o, videos, true); });
+}
+
+// Process image upload: spool the file, hand it to storage, record it
+Task<void>
+handle_image_upload(const std::map<std::string, std::string> &form_data,
+                    const std::map<std::string, std::vector<char>> &files) {
+  if (files.find("image") == files.end()) {
+    co_return;
+  }
+
+  // Get form data
+  const std::vector<char> &file_data = files.at("image");
+  std::string filename = form_data.at("image_filename");
+
+  log_to_file("Handling image upload: ", filename, ", size: ",
+              file_data.size(), " bytes");
+
+  std::string image_type = form_data.find("image_type") != form_data.end()
+                               ? form_data.at("image_type")
+                               : "content";
+  std::string storage_type = form_data.find("storage_type") != form_data.end()
+                                 ? form_data.at("storage_type")
+                                 : "public";
+  int content_id = form_data.find("content_id") != form_data.end()
+                       ? std::stoi(form_data.at("content_id"))
+                       : 0;
 
-  // Delete from GCS
-  if (!gcs_path.empty()) {
-    std::string cmd = "sudo gsutil rm " + gcs_path;
-    exec_command(cmd);
+  // Save file temporarily
+  std::string local_path = co_await blocking_pool().run(
+      [&] { return save_file(file_data, filename); });
+  if (local_path.empty()) {
+    co_return;
   }
 
-  // Delete record
-  sql = "DELETE FROM videos WHERE id = ?";
+  // Determine correct bucket and path
+  std::string bucket = storage_type == "public" ? "gs://grabbiel-media-public"
+                                                : "gs://grabbiel-media";
+  std::string gcs_path = bucket + "/images/originals/" + filename;
 
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-    return response.str();
+  log_to_file("File saved to: ", local_path);
+  log_file_content(local_path, file_data);
+
+  // Upload to GCS
+  log_to_file("Attempting to upload to GCS: ", gcs_path);
+  bool success = co_await blocking_pool().run([&] {
+    return storage().put(local_path, gcs_path, storage_type == "public");
+  });
+  log_to_file("GCS upload result: ", success ? "success" : "failure");
+  if (success) {
+    // Get image dimensions (would require image processing library)
+    // For now, we'll use placeholder values
+    int width = 1920;
+    int height = 1080;
+    int size = file_data.size();
+
+    // Determine the public URL
+    std::string public_url;
+    if (storage_type == "public") {
+      public_url = "https://storage.googleapis.com/grabbiel-media-public/"
+                   "images/originals/" +
+                   filename;
+    } else {
+      public_url = gcs_path; // Store GCS path for private images
+    }
+
+    // Store in database
+    co_await db_pool().run([&](sqlite3 *db) {
+      if (!db) {
+        log_to_file("Image not recorded, cannot open database: ", filename);
+        return;
+      }
+      insert_image(db, public_url, filename, "image/jpeg", size, width,
+                   height, content_id, image_type);
+    });
   }
 
-  sqlite3_bind_int(stmt, 1, id);
-  sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  // Clean up temporary file
+  co_await blocking_pool().run([&] { upload_spool().release(local_path); });
+}
+
+// Hand a spooled video to storage and record it; returns the new video id,
+// or 0 if storage did not take it or it could not be recorded
+Task<int> store_video(const std::string &local_path,
+                      const std::string &filename, const std::string &title,
+                      const std::string &storage_type, int content_id,
+                      int duration, int64_t size) {
+  // Determine correct bucket and path
+  std::string bucket = storage_type == "public" ? "gs://grabbiel-media-public"
+                                                : "gs://grabbiel-media";
+  std::string gcs_path = bucket + "/videos/originals/" + filename;
+
+  // Upload to GCS
+  if (!co_await blocking_pool().run([&] {
+        return storage().put(local_path, gcs_path, storage_type == "public");
+      })) {
+    co_return 0;
+  }
+  co_return co_await db_pool().run([&](sqlite3 *db) {
+    return db ? insert_video(db, title, gcs_path, "video/mp4", size,
+                             duration, content_id)
+              : 0;
+  });
+}
+
+// Process video upload
+Task<void>
+handle_video_upload(const std::map<std::string, std::string> &form_data,
+                    const std::map<std::string, std::vector<char>> &files) {
+  if (files.find("video") == files.end()) {
+    co_return;
+  }
+
+  // Get form data
+  const std::vector<char> &file_data = files.at("video");
+  std::string filename = form_data.at("video_filename");
+  std::string title = form_data.find("title") != form_data.end()
+                          ? form_data.at("title")
+                          : filename;
+  std::string storage_type = form_data.find("storage_type") != form_data.end()
+                                 ? form_data.at("storage_type")
+                                 : "public";
+  int content_id = form_data.find("content_id") != form_data.end()
+                       ? std::stoi(form_data.at("content_id"))
+                       : 0;
+  int duration = form_data.find("duration") != form_data.end()
+                     ? std::stoi(form_data.at("duration"))
+                     : 0;
+
+  // Save file temporarily
+  std::string local_path = co_await blocking_pool().run(
+      [&] { return save_file(file_data, filename); });
+  if (local_path.empty()) {
+    co_return;
+  }
 
-  return response.str();
+  co_await store_video(local_path, filename, title, storage_type, content_id,
+                       duration, file_data.size());
+
+  // Clean up temporary file
+  co_await blocking_pool().run([&] { upload_spool().release(local_path); });
 }
 
-// Parse URL parameters
-std::map<std::string, std::string> parse_url_params(const std::string &url) {
-  std::map<std::string, std::string> params;
-  size_t pos = url.find('?');
-
-  if (pos != std::string::npos) {
-    std::string query = url.substr(pos + 1);
-    std::istringstream iss(query);
-    std::string pair;
-
-    while (std::getline(iss, pair, '&')) {
-      size_t eq_pos = pair.find('=');
-      if (eq_pos != std::string::npos) {
-        std::string key = pair.substr(0, eq_pos);
-        std::string value = pair.substr(eq_pos + 1);
-        params[key] = value;
+// Delete media row `id` and its variants, tombstoning the storage objects
+// they point at (selected by `paths_sql`) in the same transaction; the
+// collector deletes the objects later
+bool tombstone_media(sqlite3 *db, int id, const char *paths_sql,
+                     std::initializer_list<const char *> deletes) {
+  sqlite3_busy_timeout(db, GC_BUSY_TIMEOUT_MS);
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+    log_to_file("Cannot start delete: ", sqlite3_errmsg(db));
+    return false;
+  }
+
+  std::vector<std::string> paths;
+  sqlite3_stmt *stmt;
+  bool ok = sqlite3_prepare_v2(db, paths_sql, -1, &stmt, NULL) == SQLITE_OK;
+  if (ok) {
+    sqlite3_bind_int(stmt, 1, id);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      const char *url = (const char *)sqlite3_column_text(stmt, 0);
+      std::string path = object_path(url ? url : "");
+      if (path.empty()) {
+        log_to_file("No storage object for URL: ", url ? url : "");
+      } else {
+        paths.push_back(path);
       }
     }
+    sqlite3_finalize(stmt);
   }
 
-  return params;
-}
+  const char *insert =
+      "INSERT OR IGNORE INTO storage_tombstones (gcs_path) VALUES (?)";
+  for (const std::string &path : paths) {
+    ok = ok && sqlite3_prepare_v2(db, insert, -1, &stmt, NULL) == SQLITE_OK;
+    if (ok) {
+      sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_STATIC);
+      ok = sqlite3_step(stmt) == SQLITE_DONE;
+      sqlite3_finalize(stmt);
+    }
+  }
+  for (const char *sql : deletes) {
+    ok = ok && sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK;
+    if (ok) {
+      sqlite3_bind_int(stmt, 1, id);
+      ok = sqlite3_step(stmt) == SQLITE_DONE;
+      sqlite3_finalize(stmt);
+    }
+  }
 
-// Extract content type and boundary from Content-Type header
-bool parse_content_type(const std::string &header, std::string &content_type,
-                        std::string &boundary) {
-  size_t pos = header.find("Content-Type: ");
-  if (pos == std::string::npos) {
+  if (!ok) {
+    log_to_file("Delete failed: ", sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
     return false;
   }
+  sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  for (const std::string &path : paths) {
+    media_cache().invalidate(path);
+  }
+  storage_collector().wake();
+  return true;
+}
+
+// Handle delete image request
+void handle_delete_image(sqlite3 *db, const HttpRequest &request) {
+  int id = (int)parse_unsigned(request.param("id"), 0);
+  if (!id) {
+    log_to_file("Delete image request missing ID parameter");
+    return;
+  }
+  log_to_file("Handling delete request for image ID: ", id);
+
+  if (tombstone_media(db, id,
+                      "SELECT original_url FROM images WHERE id = ?1 "
+                      "UNION ALL SELECT url FROM image_variants "
+                      "WHERE image_id = ?1",
+                      {"DELETE FROM image_variants WHERE image_id = ?",
+                       "DELETE FROM images WHERE id = ?"})) {
+    log_to_file("Successfully deleted image record from database");
+  }
+}
 
-  size_t start = pos + 14;
-  size_t end = header.find("\r\n", start);
-  std::string content_type_line = header.substr(start, end - start);
+// Handle delete video request
+void handle_delete_video(sqlite3 *db, const HttpRequest &request) {
+  int id = (int)parse_unsigned(request.param("id"), 0);
+  if (!id) {
+    return;
+  }
 
-  log_to_file("Content-Type header: " + content_type_line);
+  tombstone_media(db, id,
+                  "SELECT gcs_path FROM videos WHERE id = ?1 "
+                  "UNION ALL SELECT gcs_path FROM video_variants "
+                  "WHERE video_id = ?1",
+                  {"DELETE FROM video_variants WHERE video_id = ?",
+                   "DELETE FROM videos WHERE id = ?"});
+}
 
-  pos = content_type_line.find(';');
-  if (pos == std::string::npos) {
-    content_type = content_type_line;
+// Extract content type and boundary from the Content-Type header value;
+// both are views into `header`
+bool parse_content_type(std::string_view header,
+                        std::string_view &content_type,
+                        std::string_view &boundary) {
+  if (header.empty()) {
     return false;
   }
 
-  content_type = content_type_line.substr(0, pos);
+  log_to_file("Content-Type header: ", header);
 
-  pos = content_type_line.find("boundary=");
-  if (pos == std::string::npos) {
+  size_t pos = header.find(';');
+  if (pos == std::string_view::npos) {
+    content_type = header;
     return false;
   }
 
-  boundary = content_type_line.substr(pos + 9);
+  content_type = header.substr(0, pos);
+
+  pos = header.find("boundary=");
+  if (pos == std::string_view::npos) {
+    return false;
+  }
+
+  boundary = header.substr(pos + 9);
 
   // Remove quotes if present (handle both single and double quotes)
-  if (!boundary.empty()) {
-    if (boundary.front() == '"' && boundary.back() == '"') {
-      boundary = boundary.substr(1, boundary.length() - 2);
-    } else if (boundary.front() == '\'' && boundary.back() == '\'') {
-      boundary = boundary.substr(1, boundary.length() - 2);
+  if (boundary.size() >= 2) {
+    if ((boundary.front() == '"' && boundary.back() == '"') ||
+        (boundary.front() == '\'' && boundary.back() == '\'')) {
+      boundary = boundary.substr(1, boundary.size() - 2);
     }
   }
 
   // Also trim any whitespace
-  if (!boundary.empty()) {
-    size_t first = boundary.find_first_not_of(" \t");
-    size_t last = boundary.find_last_not_of(" \t");
-    if (first != std::string::npos && last != std::string::npos) {
-      boundary = boundary.substr(first, last - first + 1);
+  size_t first = boundary.find_first_not_of(" \t");
+  size_t last = boundary.find_last_not_of(" \t");
+  boundary = first == std::string_view::npos
+                 ? std::string_view()
+                 : boundary.substr(first, last - first + 1);
+
+  log_to_file("Parsed boundary: '", boundary, "'");
+  return true;
+}
+
+// Content type for a media object, from its extension
+const char *media_content_type(std::string_view path) {
+  static const std::pair<const char *, const char *> types[] = {
+      {".jpg", "image/jpeg"},   {".jpeg", "image/jpeg"},
+      {".png", "image/png"},    {".gif", "image/gif"},
+      {".webp", "image/webp"},  {".svg", "image/svg+xml"},
+      {".mp4", "video/mp4"},    {".webm", "video/webm"},
+      {".mov", "video/quicktime"}, {".m3u8", "application/vnd.apple.mpegurl"},
+      {".ts", "video/mp2t"},    {".mpd", "application/dash+xml"}};
+  size_t dot = path.rfind('.');
+  if (dot != std::string_view::npos) {
+    for (const auto &type : types) {
+      if (iequals(path.substr(dot), type.first)) {
+        return type.second;
+      }
     }
   }
+  return "application/octet-stream";
+}
 
-  log_to_file("Parsed boundary: '" + boundary + "'");
+// Object paths are handed to gsutil on a shell command line, so only plain
+// names are accepted, and no ".." segments
+bool valid_object_path(std::string_view object) {
+  if (object.empty() || object.front() == '/' || object.back() == '/') {
+    return false;
+  }
+  for (char c : object) {
+    if (!isalnum((unsigned char)c) && c != '/' && c != '.' && c != '-' &&
+        c != '_') {
+      return false;
+    }
+  }
+  for (size_t start = 0; start <= object.size();) {
+    size_t end = object.find('/', start);
+    if (end == std::string_view::npos) {
+      end = object.size();
+    }
+    std::string_view segment = object.substr(start, end - start);
+    if (segment.empty() || segment == "." || segment == "..") {
+      return false;
+    }
+    start = end + 1;
+  }
   return true;
 }
 
-// Main request handler
-void handle_request(int client_socket, const char *request,
-                    size_t request_size) {
-  // Open database connection
-  sqlite3 *db;
-  int rc = sqlite3_open(DB_PATH, &db);
+// GET /media/<bucket>/<object>: the object through the local cache, with
+// single byte ranges so video players can seek
+void serve_media(ResponseWriter &response, const HttpRequest &request) {
+  std::string_view object = request.path.substr(strlen("/media/"));
+  size_t slash = object.find('/');
+  std::string_view bucket = object.substr(0, slash);
+  if (slash == std::string_view::npos ||
+      (bucket != "grabbiel-media" && bucket != "grabbiel-media-public") ||
+      !valid_object_path(object.substr(slash + 1))) {
+    response.text(404, "404 - Media not found");
+    response.send();
+    return;
+  }
 
-  if (rc) {
-    sqlite3_close(db);
-    std::string response = "HTTP/1.1 500 Internal Server Error\r\n";
-    response += "Content-Type: text/plain\r\n\r\n";
-    response += "Failed to open database";
-    send(client_socket, response.c_str(), response.length(), 0);
+  uint64_t size = 0;
+  bool hit = false;
+  MediaCache &cache = media_cache();
+  int fd = cache.open("gs://" + std::string(object), size, hit);
+  if (fd < 0) {
+    response.text(404, "404 - Media not found");
+    response.send();
     return;
   }
 
-  // Parse request
-  std::string req(request, request_size);
-  log_to_file("Full request size in handle_request: " +
-              std::to_string(request_size) + " bytes");
-  std::string method, path;
+  uint64_t start, length;
+  ByteRange range =
+      parse_byte_range(request.header("Range"), size, start, length);
+  response.add_header("Accept-Ranges", "bytes");
+  if (range == ByteRange::Unsatisfiable) {
+    response.add_header("Content-Range", "bytes */" + std::to_string(size));
+    response.text(416, "416 - Range Not Satisfiable");
+    response.send();
+    close(fd);
+    return;
+  }
+  response.set_content_type(media_content_type(object));
+  if (range == ByteRange::Partial) {
+    response.set_status(206);
+    response.add_header("Content-Range",
+                        "bytes " + std::to_string(start) + "-" +
+                            std::to_string(start + length - 1) + "/" +
+                            std::to_string(size));
+  }
+  if (response.send_file(fd, start, length)) {
+    cache.record_sent(length, hit);
+  }
+  close(fd);
+}
 
-  // Extract method and path
-  size_t pos = req.find(' ');
-  if (pos != std::string::npos) {
-    method = req.substr(0, pos);
-    size_t path_end = req.find(' ', pos + 1);
-    if (path_end != std::string::npos) {
-      path = req.substr(pos + 1, path_end - (pos + 1));
+// Resumable video uploads, following the tus 1.0 protocol (core, creation
+// and termination) with an explicit finalize step:
+//
+//   POST   /uploads                Upload-Length, Upload-Metadata -> 201
+//   PATCH  /uploads/<id>           Upload-Offset and a chunk -> 204
+//   HEAD   /uploads/<id>           current Upload-Offset
+//   POST   /uploads/<id>/finalize  store the video once every byte is in
+//   DELETE /uploads/<id>           abandon the upload
+//
+// Unlike plain tus, a chunk may be sent at any offset, so a client can
+// split a file over several connections. Chunks are written at their
+// offsets into a preallocated spool file; Upload-Offset is the end of the
+// contiguous prefix received, which is where a single stream resumes.
+// Each session is two files in the spool directory: <id> holds the bytes
+// and <id>.info the length, Upload-Metadata and the ranges received. The
+// info file is replaced through a rename after every chunk, under an flock
+// on the spool file, so a session survives a restart or reload and can be
+// continued through any worker process. Sessions whose info file has not
+// changed for RESUMABLE_EXPIRY_SECONDS are deleted.
+
+// Upload-Metadata: comma-separated "key base64-value" pairs
+bool parse_upload_metadata(std::string_view header,
+                           std::map<std::string, std::string> &metadata) {
+  while (!header.empty()) {
+    size_t comma = header.find(',');
+    std::string_view pair = header.substr(0, comma);
+    header = comma == std::string_view::npos ? std::string_view()
+                                             : header.substr(comma + 1);
+    while (!pair.empty() && pair.front() == ' ') {
+      pair.remove_prefix(1);
+    }
+    size_t space = pair.find(' ');
+    std::string_view key = pair.substr(0, space);
+    if (key.empty()) {
+      return false;
     }
+    std::string value;
+    if (space != std::string_view::npos &&
+        !base64_decode(pair.substr(space + 1), value)) {
+      return false;
+    }
+    metadata[std::string(key)] = value;
   }
+  return true;
+}
 
-  // Parse base path (without query parameters)
-  std::string base_path = path;
-  size_t query_pos = path.find('?');
-  if (query_pos != std::string::npos) {
-    base_path = path.substr(0, query_pos);
-  }
+class ResumableUploads {
+public:
+  struct Session {
+    std::string id;
+    std::string path;
+    int fd = -1;
+    uint64_t length = 0;
+    std::map<uint64_t, uint64_t> received; // start -> end, disjoint
+    std::string metadata_header;           // as sent, for the info file
+    std::map<std::string, std::string> metadata;
+
+    uint64_t offset() const {
+      auto first = received.begin();
+      return first != received.end() && first->first == 0 ? first->second
+                                                           : 0;
+    }
+
+    bool complete() const { return offset() == length; }
 
-  // Parse query parameters
-  std::map<std::string, std::string> params = parse_url_params(path);
+    // Record [start, end) as written, merging with neighbouring ranges
+    void add(uint64_t start, uint64_t end) {
+      if (start == end) {
+        return;
+      }
+      auto it = received.upper_bound(start);
+      if (it != received.begin() && std::prev(it)->second >= start) {
+        --it;
+        start = it->first;
+      }
+      while (it != received.end() && it->first <= end) {
+        end = std::max(end, it->second);
+        it = received.erase(it);
+      }
+      received[start] = end;
+    }
+  };
 
-  // Find request body (after the headers)
-  size_t body_pos = req.find("\r\n\r\n");
-  std::string body;
-  if (body_pos != std::string::npos) {
-    // Calculate the actual body size based on remaining data
-    size_t body_size = req.size() - (body_pos + 4);
-    body = req.substr(body_pos + 4, body_size);
-    log_to_file("Extracted body from request: " + std::to_string(body.size()) +
-                " bytes");
+  explicit ResumableUploads(const std::string &dir) : dir_(dir) {
+    make_dirs(dir_);
+    expire();
   }
 
-  // Parse headers
-  std::string content_type, boundary;
-  parse_content_type(req, content_type, boundary);
+  // Start an upload of `length` bytes; nullptr with errno set on failure
+  Session *create(uint64_t length, std::string_view metadata_header,
+                  std::map<std::string, std::string> metadata) {
+    expire();
 
-  // Handle different paths
-  std::string response;
+    unsigned char random[16];
+    if (RAND_bytes(random, sizeof(random)) != 1) {
+      errno = EIO;
+      return nullptr;
+    }
+    static const char hex[] = "0123456789abcdef";
+    std::string id;
+    for (unsigned char byte : random) {
+      id += hex[byte >> 4];
+      id += hex[byte & 15];
+    }
 
-  if (method == "GET") {
-    if (base_path == "/" || base_path == "/index") {
-      response = "HTTP/1.1 200 OK\r\n";
-      response += "Content-Type: text/html\r\n\r\n";
-      response += generate_main_page(db);
-    } else if (base_path == "/delete-image") {
-      response = handle_delete_image(db, params);
-    } else if (base_path == "/delete-video") {
-      response = handle_delete_video(db, params);
-    } else {
-      response = "HTTP/1.1 404 Not Found\r\n";
-      response += "Content-Type: text/plain\r\n\r\n";
-      response += "404 - Page not found";
+    std::string path = dir_ + "/" + id;
+    int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return nullptr;
     }
-  } else if (method == "POST") {
-    log_to_file("Handling POST request to: " + base_path);
-    log_to_file("Content-Type: " + content_type + ", Boundary: " + boundary);
+    Session &session = sessions_[id];
+    session.id = id;
+    session.path = path;
+    session.fd = fd;
+    session.length = length;
+    session.metadata_header = metadata_header;
+    session.metadata = std::move(metadata);
+    // Reserve the space up front so a full disk fails now, not at 90%
+    if ((fallocate(fd, 0, 0, length) != 0 && errno != EOPNOTSUPP) ||
+        !write_info(session)) {
+      int error = errno;
+      remove(session);
+      errno = error;
+      return nullptr;
+    }
+    return &session;
+  }
 
-    if (base_path == "/upload-image" && content_type == "multipart/form-data" &&
-        !boundary.empty()) {
-      // Parse form data and handle image upload
-      std::map<std::string, std::vector<char>> files;
+  // The session as last recorded by any process; nullptr if there is none
+  Session *find(std::string_view id) {
+    if (!valid_id(id)) {
+      return nullptr;
+    }
+    auto it = sessions_.find(std::string(id));
+    if (it == sessions_.end()) {
+      Session session;
+      session.id = id;
+      session.path = dir_ + "/" + session.id;
+      it = sessions_.emplace(session.id, std::move(session)).first;
+    }
+    Session &session = it->second;
+    if (session.fd < 0) {
+      session.fd = open(session.path.c_str(), O_WRONLY | O_CLOEXEC);
+    }
+    if (session.fd < 0 || !read_info(session)) {
+      forget(session); // finished or abandoned elsewhere
+      return nullptr;
+    }
+    return &session;
+  }
 
-      log_to_file("About to parse multipart form data, body size: " +
-                  std::to_string(body.size()));
+  // Record [start, end) as received once the chunk is on disk; false on
+  // an I/O error
+  bool record(Session &session, uint64_t start, uint64_t end) {
+    // Another process may have recorded chunks since find()
+    flock(session.fd, LOCK_EX);
+    bool ok = read_info(session);
+    session.add(start, end);
+    ok = ok && write_info(session);
+    flock(session.fd, LOCK_UN);
+    return ok;
+  }
 
-      std::map<std::string, std::string> form_data =
-          parse_multipart_form_data(body, boundary, files);
+  // Claim a complete session for finalizing, through an O_EXCL marker
+  // next to its info file so workers in other processes see it too; false
+  // if another finalize holds it. A claim left by a crash goes when the
+  // session expires.
+  bool claim(const Session &session) {
+    int fd = open(claim_path(session.id).c_str(),
+                  O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    close(fd);
+    return true;
+  }
 
-      log_to_file("After parsing, found " + std::to_string(files.size()) +
-                  " files");
+  // Give up a claim, e.g. so a failed finalize can be retried
+  void release(const std::string &id) { unlink(claim_path(id).c_str()); }
+
+  // Delete a session's files and forget it
+  void remove(Session &session) {
+    FileIo &io = FileIo::instance();
+    io.unlink_async(info_path(session.id));
+    io.unlink_async(claim_path(session.id));
+    io.unlink_async(session.path);
+    io.submit();
+    forget(session);
+  }
 
-      response = handle_image_upload(db, form_data, files);
-    } else if (base_path == "/upload-video" &&
-               content_type == "multipart/form-data" && !boundary.empty()) {
-      // Parse form data and handle video upload
-      std::map<std::string, std::vector<char>> files;
-      std::map<std::string, std::string> form_data =
-          parse_multipart_form_data(body, boundary, files);
-      response = handle_video_upload(db, form_data, files);
-    } else {
-      response = "HTTP/1.1 400 Bad Request\r\n";
-      response += "Content-Type: text/plain\r\n\r\n";
-      response += "400 - Bad Request";
-    }
-  } else {
-    response = "HTTP/1.1 405 Method Not Allowed\r\n";
-    response += "Content-Type: text/plain\r\n\r\n";
-    response += "405 - Method Not Allowed";
+private:
+  static bool valid_id(std::string_view id) {
+    return id.size() == 32 &&
+           id.find_first_not_of("0123456789abcdef") == std::string_view::npos;
   }
 
-  // Close database connection and send response
-  sqlite3_close(db);
-  send(client_socket, response.c_str(), response.length(), 0);
-}
+  std::string info_path(const std::string &id) const {
+    return dir_ + "/" + id + ".info";
+  }
 
-std::string read_full_http_request(int client_socket) {
-  std::string request_data;
-  char buffer[BUFFER_SIZE];
-  int bytes_read;
+  std::string claim_path(const std::string &id) const {
+    return dir_ + "/" + id + ".finalizing";
+  }
 
-  log_to_file("Started reading HTTP request");
+  void forget(Session &session) {
+    if (session.fd >= 0) {
+      FileIo::instance().close_async(session.fd);
+      FileIo::instance().submit();
+    }
+    sessions_.erase(session.id);
+  }
 
-  // Read headers first
-  while ((bytes_read = read(client_socket, buffer, sizeof(buffer))) > 0) {
-    request_data.insert(request_data.end(), buffer, buffer + bytes_read);
+  // "length N", "metadata HEADER", then one "range START END" per range
+  bool read_info(Session &session) {
+    std::ifstream in(info_path(session.id));
+    std::string line;
+    if (!in || !std::getline(in, line) || line.compare(0, 7, "length ") ||
+        (session.length = parse_unsigned(line.substr(7), 0)) == 0 ||
+        !std::getline(in, line) || line.compare(0, 9, "metadata ")) {
+      return false;
+    }
+    if (session.metadata_header != line.substr(9)) {
+      session.metadata_header = line.substr(9);
+      session.metadata.clear();
+      if (!parse_upload_metadata(session.metadata_header, session.metadata)) {
+        return false;
+      }
+    }
+    session.received.clear();
+    unsigned long long start, end;
+    while (std::getline(in, line)) {
+      if (sscanf(line.c_str(), "range %llu %llu", &start, &end) == 2 &&
+          start <= end && end <= session.length) {
+        session.add(start, end);
+      }
+    }
+    return true;
+  }
 
-    // Check if we have received complete headers
-    size_t header_end = request_data.find("\r\n\r\n");
-    if (header_end != std::string::npos) {
-      break;
+  bool write_info(const Session &session) {
+    std::string path = info_path(session.id);
+    std::string temporary = path + "." + std::to_string(getpid());
+    {
+      std::ofstream out(temporary, std::ios::trunc);
+      out << "length " << session.length << "\n"
+          << "metadata " << session.metadata_header << "\n";
+      for (const auto &range : session.received) {
+        out << "range " << range.first << " " << range.second << "\n";
+      }
+      if (!out.flush()) {
+        unlink(temporary.c_str());
+        return false;
+      }
+    }
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+      unlink(temporary.c_str());
+      return false;
     }
+    return true;
   }
 
-  if (bytes_read <= 0) {
-    log_to_file("Error reading request headers");
-    return request_data; // Error or connection closed
-  }
-
-  // Parse Content-Length
-  int content_length = 0;
-  size_t pos = request_data.find("Content-Length:");
-  if (pos != std::string::npos) {
-    std::string cl_str = request_data.substr(pos + 15);
-    pos = cl_str.find_first_of("\r\n");
-    if (pos != std::string::npos) {
-      cl_str = cl_str.substr(0, pos);
-    }
-    // Trim leading whitespace
-    cl_str.erase(0, cl_str.find_first_not_of(" \t"));
-    content_length = std::stoi(cl_str);
-    log_to_file("Content-Length detected: " + std::to_string(content_length) +
-                " bytes");
-  }
-
-  // Calculate how much body data we've already read
-  size_t header_end = request_data.find("\r\n\r\n");
-  size_t body_received = request_data.size() - (header_end + 4);
-  log_to_file("Already received " + std::to_string(body_received) +
-              " bytes of body data");
-
-  // Read the rest of the body
-  while (body_received < (size_t)content_length) {
-    bytes_read = read(client_socket, buffer, sizeof(buffer));
-    if (bytes_read > 0) {
-      request_data.append(buffer, bytes_read);
-      body_received += bytes_read;
-      log_to_file("Read " + std::to_string(bytes_read) +
-                  " more bytes, total body: " + std::to_string(body_received) +
-                  "/" + std::to_string(content_length));
-    } else if (bytes_read == 0) {
-      log_to_file("Connection closed before receiving complete body");
-      break; // Connection closed
-    } else {
-      log_to_file("Error reading request body: " + std::to_string(errno));
-      break; // Error
+  // Delete sessions idle past the expiry, and files that belong to no
+  // session once they are a minute old (a create or write still running
+  // in another process is younger than that)
+  void expire() {
+    time_t now = time(nullptr);
+    time_t cutoff = now - RESUMABLE_EXPIRY_SECONDS;
+    DIR *d = opendir(dir_.c_str());
+    if (!d) {
+      return;
+    }
+    std::vector<std::string> stale;
+    while (dirent *entry = readdir(d)) {
+      std::string name = entry->d_name;
+      if (name[0] == '.') {
+        continue;
+      }
+      std::string id = name.substr(0, name.find('.'));
+      struct stat file, info;
+      if (stat((dir_ + "/" + name).c_str(), &file) != 0) {
+        continue;
+      }
+      bool has_info = valid_id(id) && stat(info_path(id).c_str(), &info) == 0;
+      if (has_info ? info.st_mtime < cutoff : file.st_mtime < now - 60) {
+        stale.push_back(name);
+      }
+    }
+    closedir(d);
+    for (const std::string &name : stale) {
+      std::string id = name.substr(0, name.find('.'));
+      auto it = sessions_.find(id);
+      if (it != sessions_.end()) {
+        forget(it->second);
+      }
+      if (name == id) {
+        log_to_file("Resumable upload expired: ", id);
+      }
+      unlink((dir_ + "/" + name).c_str());
     }
   }
 
-  log_to_file("Finished reading HTTP request, total size: " +
-              std::to_string(request_data.size()) + " bytes");
-  return request_data;
+  std::string dir_;
+  std::map<std::string, Session> sessions_;
+};
+
+ResumableUploads &resumable_uploads() {
+  static ResumableUploads uploads(RESUMABLE_UPLOAD_DIR);
+  return uploads;
 }
 
-// Add these functions for better debugging
+std::string metadata_value(const std::map<std::string, std::string> &metadata,
+                           const std::string &key) {
+  auto it = metadata.find(key);
+  return it != metadata.end() ? it->second : "";
+}
 
-int main() {
-  // Create directory for temporary uploads
-  system(("mkdir -p " + std::string(TEMP_UPLOAD_DIR)).c_str());
+// tus protocol. Sessions are only touched on the loop thread; what blocks
+// (chunk writes, the storage upload) is awaited with the session's id
+// rather than its pointer, since another request may end it meanwhile.
+Task<void> handle_resumable_upload(const HttpRequest &request,
+                                   ResponseWriter &response) {
+  std::string_view method = request.method;
+  ResumableUploads &uploads = resumable_uploads();
+  response.add_header("Tus-Resumable", "1.0.0");
+
+  if (request.path == "/uploads") {
+    if (method == "OPTIONS") {
+      response.set_status(204);
+      response.add_header("Tus-Version", "1.0.0");
+      response.add_header("Tus-Extension", "creation,termination");
+      response.add_header("Tus-Max-Size", std::to_string(RESUMABLE_MAX_SIZE));
+      co_return;
+    }
+    if (method != "POST") {
+      response.text(405, "405 - Method Not Allowed");
+      co_return;
+    }
+
+    uint64_t length = parse_unsigned(request.header("Upload-Length"), 0);
+    std::map<std::string, std::string> metadata;
+    if (length == 0 ||
+        !parse_upload_metadata(request.header("Upload-Metadata"), metadata)) {
+      response.text(400, "400 - Bad Request");
+      co_return;
+    }
+    if (length > RESUMABLE_MAX_SIZE) {
+      response.text(413, "413 - Upload too large");
+      co_return;
+    }
+    // The filename ends up in an object path
+    std::string filename = metadata_value(metadata, "filename");
+    if (filename.find('/') != std::string::npos ||
+        !valid_object_path(filename)) {
+      response.text(400, "400 - Missing or invalid filename");
+      co_return;
+    }
+
+    ResumableUploads::Session *session =
+        uploads.create(length, request.header("Upload-Metadata"),
+                       std::move(metadata));
+    if (!session) {
+      log_to_file("Cannot create resumable upload: ", strerror(errno));
+      response.text(errno == ENOSPC ? 507 : 500, "Cannot create upload");
+      co_return;
+    }
+    log_to_file("Resumable upload ", session->id, " created for ", filename,
+                ", ", length, " bytes");
+    response.set_status(201);
+    response.add_header("Location", "/uploads/" + session->id);
+    response.add_header("Upload-Offset", "0");
+    co_return;
+  }
 
-  int server_fd, new_socket;
-  struct sockaddr_in address;
-  int opt = 1;
-  socklen_t addrlen = sizeof(address);
-  char buffer[BUFFER_SIZE] = {0};
+  // /uploads/<id> or /uploads/<id>/finalize
+  std::string_view id = request.path.substr(strlen("/uploads/"));
+  bool finalize = false;
+  size_t slash = id.find('/');
+  if (slash != std::string_view::npos) {
+    finalize = id.substr(slash) == "/finalize";
+    id = finalize ? id.substr(0, slash) : std::string_view();
+  }
+  ResumableUploads::Session *session = id.empty() ? nullptr : uploads.find(id);
+  if (!session) {
+    response.text(404, "404 - Upload not found");
+    co_return;
+  }
 
-  // Create socket
-  if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    perror("Socket creation failed");
-    exit(EXIT_FAILURE);
+  if (finalize && method == "POST") {
+    if (!session->complete()) {
+      response.add_header("Upload-Offset", std::to_string(session->offset()));
+      response.text(409, "409 - Upload incomplete");
+      co_return;
+    }
+    if (!uploads.claim(*session)) {
+      response.text(409, "409 - Upload already being finalized");
+      co_return;
+    }
+    const auto &metadata = session->metadata;
+    std::string session_id = session->id;
+    std::string path = session->path;
+    std::string filename = metadata_value(metadata, "filename");
+    std::string title = metadata_value(metadata, "title");
+    std::string storage_type = metadata_value(metadata, "storage_type");
+    if (title.empty()) {
+      title = filename;
+    }
+    if (storage_type.empty()) {
+      storage_type = "public";
+    }
+    int video_id = co_await store_video(
+        path, filename, title, storage_type,
+        (int)parse_unsigned(metadata_value(metadata, "content_id"), 0),
+        (int)parse_unsigned(metadata_value(metadata, "duration"), 0),
+        session->length);
+    if (!video_id) {
+      // The session stays, so finalize can be retried
+      uploads.release(session_id);
+      response.text(500, "500 - Storage upload failed");
+      co_return;
+    }
+    log_to_file("Resumable upload ", session_id, " stored as video ",
+                video_id);
+    if ((session = uploads.find(session_id))) {
+      uploads.remove(*session);
+    }
+    response.text(200, "Video " + std::to_string(video_id) + " stored");
+  } else if (finalize) {
+    response.text(405, "405 - Method Not Allowed");
+  } else if (method == "HEAD") {
+    response.add_header("Upload-Offset", std::to_string(session->offset()));
+    response.add_header("Upload-Length", std::to_string(session->length));
+    response.add_header("Cache-Control", "no-store");
+  } else if (method == "PATCH") {
+    if (request.header("Content-Type") != "application/offset+octet-stream") {
+      response.text(415, "415 - Unsupported Media Type");
+      co_return;
+    }
+    uint64_t offset = parse_unsigned(request.header("Upload-Offset"), SIZE_MAX);
+    if (offset > session->length ||
+        request.body.size() > session->length - offset) {
+      response.text(400, "400 - Chunk outside the upload");
+      co_return;
+    }
+    // Through a descriptor of its own, which a DELETE cannot close
+    std::string session_id = session->id;
+    int fd = fcntl(session->fd, F_DUPFD_CLOEXEC, 0);
+    bool written = false;
+    if (fd >= 0) {
+      written = co_await blocking_pool().run([&] {
+        bool ok = FileIo::instance().write_all(fd, request.body, offset);
+        close(fd);
+        return ok;
+      });
+    }
+    if (!(session = uploads.find(session_id))) {
+      response.text(404, "404 - Upload not found");
+      co_return;
+    }
+    if (!written ||
+        !uploads.record(*session, offset, offset + request.body.size())) {
+      response.text(500, "500 - Cannot write chunk");
+      co_return;
+    }
+    response.set_status(204);
+    response.add_header("Upload-Offset", std::to_string(session->offset()));
+  } else if (method == "DELETE") {
+    uploads.remove(*session);
+    response.set_status(204);
+  } else {
+    response.text(405, "405 - Method Not Allowed");
   }
+}
 
-  // Set socket options
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
-                 sizeof(opt))) {
-    perror("Setsockopt failed");
-    exit(EXIT_FAILURE);
+// Allocation statistics key: object and session paths share one route
+std::string_view route_name(std::string_view path) {
+  if (path.substr(0, 7) == "/media/") {
+    return "/media/*";
+  }
+  if (path.substr(0, 9) == "/uploads/") {
+    return "/uploads/*";
   }
+  return path;
+}
 
-  // Configure address
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = inet_addr("127.0.0.1"); // Only bind to localhost
-  address.sin_port = htons(MEDIA_PORT);
+// Only the upload endpoints take bodies past HTTP_MAX_FORM_BODY_SIZE
+size_t request_body_limit(std::string_view method, std::string_view target) {
+  std::string_view path = target.substr(0, target.find('?'));
+  if ((method == "POST" &&
+       (path == "/upload-image" || path == "/upload-video")) ||
+      (method == "PATCH" && path.substr(0, 9) == "/uploads/")) {
+    return HTTP_MAX_BODY_SIZE;
+  }
+  return HTTP_MAX_FORM_BODY_SIZE;
+}
 
-  // Bind socket
-  if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-    perror("Bind failed");
-    exit(EXIT_FAILURE);
+// Run `fn` with one of the pool's database connections; answers 500 if
+// the database cannot be opened
+template <typename F>
+Task<void> with_database(ResponseWriter &response, F fn) {
+  bool opened = co_await db_pool().run([&](sqlite3 *db) {
+    if (db) {
+      fn(db);
+    }
+    return db != nullptr;
+  });
+  if (!opened) {
+    response.text(500, "Failed to open database");
   }
+}
 
-  // Listen for connections
-  if (listen(server_fd, 3) < 0) {
-    perror("Listen failed");
-    exit(EXIT_FAILURE);
+// Main request handler. Runs on the event loop: SQLite work goes to
+// db_pool(), disk and storage work to blocking_pool().
+Task<void> handle_request(Connection &conn, const HttpRequest &request,
+                          std::pmr::memory_resource *arena) {
+  ResponseWriter response(conn);
+
+  // Media is served from the cache and needs no database; a miss fetches
+  // from storage, and writes that would block are queued, so the whole of
+  // it can run off the loop
+  if (request.method == "GET" && request.path.substr(0, 7) == "/media/") {
+    co_await blocking_pool().run([&] { serve_media(response, request); });
+    co_return;
+  }
+  // So are the analytics sketches, which live in memory
+  if (request.path.substr(0, 11) == "/analytics/") {
+    handle_analytics(request, response);
+    response.send();
+    co_return;
   }
 
-  printf("Media Manager Server started on localhost:%d\n", MEDIA_PORT);
+  std::string_view method = request.method;
+  std::string_view base_path = request.path;
+  std::string_view body = request.body;
+  log_to_file("Request body size in handle_request: ", body.size(), " bytes");
 
-  while (1) {
-    if ((new_socket =
-             accept(server_fd, (struct sockaddr *)&address, &addrlen)) < 0) {
-      perror("Accept failed");
-      exit(EXIT_FAILURE);
+  // Parse headers
+  std::string_view content_type, boundary;
+  parse_content_type(request.header("Content-Type"), content_type, boundary);
+
+  // Handle different paths
+  if (base_path == "/uploads" || base_path.substr(0, 9) == "/uploads/") {
+    co_await handle_resumable_upload(request, response);
+  } else if (base_path == "/sochee/counters") {
+    co_await with_database(response, [&](sqlite3 *db) {
+      handle_sochee_counters(db, request, response);
+    });
+  } else if (method == "GET") {
+    if (base_path == "/" || base_path == "/index") {
+      co_await with_database(response, [&](sqlite3 *db) {
+        generate_main_page(db, response.body(), arena);
+      });
+    } else if (base_path == "/delete-image") {
+      co_await with_database(response, [&](sqlite3 *db) {
+        handle_delete_image(db, request);
+        response.redirect("/");
+      });
+    } else if (base_path == "/delete-video") {
+      co_await with_database(response, [&](sqlite3 *db) {
+        handle_delete_video(db, request);
+        response.redirect("/");
+      });
+    } else if (base_path == "/admin/queries") {
+      size_t limit = parse_unsigned(request.param("n"), 20);
+      response.text(200,
+                    query_stats_report(QueryProfiler::instance().snapshot(),
+                                       limit ? limit : 20));
+    } else if (base_path == "/admin/allocations") {
+      response.text(200, AllocationProfiler::instance().report());
+    } else if (base_path == "/admin/cache") {
+      response.text(200, media_cache_report(media_cache().stats()));
+    } else if (base_path == "/admin/counters") {
+      response.text(200, counter_report(sochee_counters(),
+                                        sochee_counters().stats()));
+    } else if (base_path == "/admin/analytics") {
+      TrendingAnalytics &analytics = trending_analytics();
+      response.text(200, trending_report(analytics.stats(),
+                                         analytics.candidates()));
+    } else if (base_path == "/admin/gc") {
+      co_await with_database(response, [&](sqlite3 *db) {
+        response.text(200, storage_collector_report(
+                               db, storage_collector().stats()));
+      });
+    } else {
+      response.text(404, "404 - Page not found");
+    }
+  } else if (method == "POST") {
+    log_to_file("Handling POST request to: ", base_path);
+    log_to_file("Content-Type: ", content_type, ", Boundary: ", boundary);
+
+    if (base_path == "/upload-image" && content_type == "multipart/form-data" &&
+        !boundary.empty()) {
+      // Parse form data and handle image upload
+      std::map<std::string, std::vector<char>> files;
+
+      log_to_file("About to parse multipart form data, body size: ",
+                  body.size());
+
+      std::map<std::string, std::string> form_data =
+          parse_multipart_form_data(body, std::string(boundary), files);
+
+      log_to_file("After parsing, found ", files.size(), " files");
+
+      co_await handle_image_upload(form_data, files);
+      response.redirect("/");
+    } else if (base_path == "/upload-video" &&
+               content_type == "multipart/form-data" && !boundary.empty()) {
+      // Parse form data and handle video upload
+      std::map<std::string, std::vector<char>> files;
+      std::map<std::string, std::string> form_data =
+          parse_multipart_form_data(body, std::string(boundary), files);
+      co_await handle_video_upload(form_data, files);
+      response.redirect("/");
+    } else {
+      response.text(400, "400 - Bad Request");
     }
+  } else {
+    response.text(405, "405 - Method Not Allowed");
+  }
+
+  // Send response
+  response.send();
+}
 
-    memset(buffer, 0, BUFFER_SIZE);
-    std::string request_data;
-    std::string full_request = read_full_http_request(new_socket);
-    handle_request(new_socket, full_request.c_str(), full_request.size());
+int main() {
+  // With GRABBIEL_WORKERS this process only supervises; workers go on below
+  run_supervisor("Media Manager Server", MEDIA_PORT);
 
-    close(new_socket);
+  // Create directory for temporary uploads
+  if (!upload_spool().ready()) {
+    log_to_file("Cannot create upload directory " TEMP_UPLOAD_DIR);
+  }
+  log_to_file(FileIo::instance().uses_io_uring()
+                  ? "File I/O through io_uring"
+                  : "File I/O through plain syscalls");
+
+  // Set up what the collector thread shares before it can race to it
+  storage();
+  media_cache();
+  storage_collector().start();
+
+  // Replays journals left by a crash before any new delta is accepted
+  const char *journal_dir = getenv("GRABBIEL_COUNTER_JOURNAL_DIR");
+  std::string error;
+  if (!sochee_counters().start(resolve_db_path(DB_PATH),
+                               journal_dir && *journal_dir
+                                   ? journal_dir
+                                   : COUNTER_JOURNAL_DIR,
+                               error)) {
+    log_to_file("Counters disabled: ", error);
   }
 
-  close(server_fd);
-  return 0;
+  trending_analytics().start();
+
+  // Arenas are only needed while a request is handled; finished ones wait
+  // here for the next request instead of going back to the heap
+  static std::vector<std::unique_ptr<RequestArena>> idle_arenas;
+
+  int status = run_async_server(
+      "Media Manager Server", MEDIA_PORT, event_loop(),
+      [](Connection &conn) -> Task<void> {
+        RequestReader reader(BUFFER_SIZE);
+        reader.set_body_limit(request_body_limit);
+        HttpRequest request;
+
+        HttpParser::Status status =
+            co_await read_request(event_loop(), conn, reader, request);
+        if (status == HttpParser::Complete) {
+          std::unique_ptr<RequestArena> arena;
+          if (idle_arenas.empty()) {
+            arena.reset(new RequestArena());
+          } else {
+            arena = std::move(idle_arenas.back());
+            idle_arenas.pop_back();
+          }
+          HeapCounters heap;
+          {
+            TaskHeapCounters counting(heap);
+            co_await handle_request(conn, request, arena.get());
+          }
+          record_task_allocations(route_name(request.path), heap, *arena);
+          arena->reset();
+          idle_arenas.push_back(std::move(arena));
+        } else if (reader.parser().error_status()) {
+          log_to_file("Rejected request: ",
+                      reader.parser().error_status());
+          write_error(conn, reader.parser().error_status());
+        } else {
+          log_to_file("Connection closed before the request was complete");
+        }
+      });
+
+  // Stopped: commit the counter deltas rather than leave them to a replay,
+  // and add this generation's analytics to the stored buckets
+  sochee_counters().stop();
+  trending_analytics().flush();
+  exit_server(status);
 }
@@ -0,0 +1,14 @@
+-- Foreign key columns without an index make ON DELETE CASCADE and joins
+-- scan the whole child table (reported by tools/index_advisor)
+CREATE INDEX IF NOT EXISTS idx_image_variants_image ON image_variants(image_id);
+CREATE INDEX IF NOT EXISTS idx_video_variants_video ON video_variants(video_id);
+CREATE INDEX IF NOT EXISTS idx_reels_video ON reels(video_id);
+CREATE INDEX IF NOT EXISTS idx_content_tags_tag ON content_tags(tag_id);
+CREATE INDEX IF NOT EXISTS idx_articles_content ON articles(content_id);
+CREATE INDEX IF NOT EXISTS idx_content_blocks_site ON content_blocks(site_id);
+CREATE INDEX IF NOT EXISTS idx_content_files_content ON content_files(content_id);
+CREATE INDEX IF NOT EXISTS idx_sochee_comment_content ON sochee_comment(content_id);
+CREATE INDEX IF NOT EXISTS idx_sochee_comment_embedded_comment ON sochee_comment_embedded(comment_id);
+CREATE INDEX IF NOT EXISTS idx_sochee_hashtag_content ON sochee_hashtag(content_id);
+CREATE INDEX IF NOT EXISTS idx_sochee_link_image ON sochee_link(image_id);
+CREATE INDEX IF NOT EXISTS idx_sochee_order_sochee ON sochee_order(sochee_id);
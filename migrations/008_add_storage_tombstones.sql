@@ -0,0 +1,9 @@
+-- Storage objects whose media rows have been deleted. media_manager's
+-- collector deletes the objects in the background and drops a tombstone
+-- only once its object is gone.
+CREATE TABLE IF NOT EXISTS storage_tombstones (
+    gcs_path TEXT PRIMARY KEY,
+    created_at DATETIME DEFAULT CURRENT_TIMESTAMP,
+    attempts INTEGER NOT NULL DEFAULT 0,
+    last_attempt_at DATETIME
+);
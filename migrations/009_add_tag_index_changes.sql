@@ -0,0 +1,65 @@
+-- Change log for the in-memory tag index (common/tag_index.h). Each row
+-- names a (content, tag), (sochee, hashtag) or content block whose state
+-- may have changed; the index re-reads just those rows. Triggers rather
+-- than sqlite3_update_hook because the hook only sees writes made on its
+-- own connection, and tags are written by other processes.
+CREATE TABLE IF NOT EXISTS tag_index_changes (
+    id INTEGER PRIMARY KEY AUTOINCREMENT,
+    kind INTEGER NOT NULL, -- 1 content_tags, 2 sochee_hashtag, 3 content_blocks
+    content_id INTEGER NOT NULL,
+    tag_id INTEGER,
+    hashtag TEXT,
+    created_at DATETIME DEFAULT CURRENT_TIMESTAMP
+);
+
+CREATE TRIGGER IF NOT EXISTS tag_index_content_tags_insert
+AFTER INSERT ON content_tags BEGIN
+    INSERT INTO tag_index_changes (kind, content_id, tag_id)
+    VALUES (1, NEW.content_id, NEW.tag_id);
+END;
+
+CREATE TRIGGER IF NOT EXISTS tag_index_content_tags_delete
+AFTER DELETE ON content_tags BEGIN
+    INSERT INTO tag_index_changes (kind, content_id, tag_id)
+    VALUES (1, OLD.content_id, OLD.tag_id);
+END;
+
+CREATE TRIGGER IF NOT EXISTS tag_index_content_tags_update
+AFTER UPDATE ON content_tags BEGIN
+    INSERT INTO tag_index_changes (kind, content_id, tag_id)
+    VALUES (1, OLD.content_id, OLD.tag_id), (1, NEW.content_id, NEW.tag_id);
+END;
+
+CREATE TRIGGER IF NOT EXISTS tag_index_sochee_hashtag_insert
+AFTER INSERT ON sochee_hashtag BEGIN
+    INSERT INTO tag_index_changes (kind, content_id, hashtag)
+    VALUES (2, NEW.content_id, NEW.hashtag);
+END;
+
+CREATE TRIGGER IF NOT EXISTS tag_index_sochee_hashtag_delete
+AFTER DELETE ON sochee_hashtag BEGIN
+    INSERT INTO tag_index_changes (kind, content_id, hashtag)
+    VALUES (2, OLD.content_id, OLD.hashtag);
+END;
+
+CREATE TRIGGER IF NOT EXISTS tag_index_sochee_hashtag_update
+AFTER UPDATE ON sochee_hashtag BEGIN
+    INSERT INTO tag_index_changes (kind, content_id, hashtag)
+    VALUES (2, OLD.content_id, OLD.hashtag), (2, NEW.content_id, NEW.hashtag);
+END;
+
+CREATE TRIGGER IF NOT EXISTS tag_index_content_blocks_insert
+AFTER INSERT ON content_blocks BEGIN
+    INSERT INTO tag_index_changes (kind, content_id) VALUES (3, NEW.id);
+END;
+
+CREATE TRIGGER IF NOT EXISTS tag_index_content_blocks_delete
+AFTER DELETE ON content_blocks BEGIN
+    INSERT INTO tag_index_changes (kind, content_id) VALUES (3, OLD.id);
+END;
+
+CREATE TRIGGER IF NOT EXISTS tag_index_content_blocks_update
+AFTER UPDATE OF id, status, site_id ON content_blocks BEGIN
+    INSERT INTO tag_index_changes (kind, content_id)
+    VALUES (3, OLD.id), (3, NEW.id);
+END;
@@ -0,0 +1,8 @@
+-- Last journal segment each write-coalescing counter service
+-- (common/counters.h) has committed, written in the same transaction as
+-- its deltas so journals are replayed exactly once after a crash.
+CREATE TABLE IF NOT EXISTS counter_flushes (
+    name TEXT PRIMARY KEY,
+    segment INTEGER NOT NULL,
+    flushed_at DATETIME
+);
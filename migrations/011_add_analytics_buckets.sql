@@ -0,0 +1,17 @@
+-- Persisted state of media_manager's trending analytics (common/sketch.h):
+-- one row per time bucket of each stream ("hashtag/1h", "view/24h", ...)
+-- holding its Count-Min cells and heavy hitters, so windows survive a
+-- restart. Buckets that leave their window are deleted as they expire.
+CREATE TABLE IF NOT EXISTS analytics_buckets (
+    stream TEXT NOT NULL,
+    bucket INTEGER NOT NULL, -- unix time / bucket length
+    data BLOB NOT NULL,
+    PRIMARY KEY (stream, bucket)
+);
+
+-- How far each tailed change log has been counted, written in the same
+-- transaction as the buckets.
+CREATE TABLE IF NOT EXISTS analytics_cursors (
+    name TEXT PRIMARY KEY,
+    position INTEGER NOT NULL
+);
@@ -0,0 +1,8 @@
+-- Let db_admin's maintenance scheduler (common/maintenance.h) return free
+-- pages left by upload/delete churn to the filesystem a batch at a time
+-- with PRAGMA incremental_vacuum. Switching auto_vacuum on an existing
+-- database only takes effect through a full VACUUM, which rewrites the
+-- file: it needs free disk space about the size of the database and
+-- blocks writers while it runs, so apply this in a quiet period.
+PRAGMA auto_vacuum = INCREMENTAL;
+VACUUM;
@@ -0,0 +1,57 @@
+// Checks for common/http.h: how HttpParser frames a request body from its
+// headers, and the status it answers with when it refuses one.
+//
+// Usage: http_framing_test
+
+#include <cstdio>
+#include <string>
+
+#include "../common/http.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+  printf("%s  %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok) {
+    failures++;
+  }
+}
+
+// Status to answer `raw` with: 200 if it parses, else the parser's error
+static int answer(std::string raw) {
+  HttpParser parser;
+  HttpRequest request;
+  HttpParser::Status status = parser.parse(&raw[0], raw.size(), request);
+  if (status == HttpParser::Complete) {
+    return 200;
+  }
+  return status == HttpParser::Error ? parser.error_status() : 0;
+}
+
+int main() {
+  check(answer("POST /form HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello") ==
+            200,
+        "body framed by Content-Length");
+  check(answer("POST /form HTTP/1.1\r\nContent-Length: 5\r\n"
+               "Content-Length: 5\r\n\r\nhello") == 200,
+        "repeated equal Content-Length is accepted");
+  check(answer("POST /form HTTP/1.1\r\nContent-Length: 5\r\n"
+               "Content-Length: 3\r\n\r\nhello") == 400,
+        "conflicting Content-Length is 400");
+  check(answer("POST /form HTTP/1.1\r\nContent-Length: 0\r\n"
+               "content-length: 5\r\n\r\nhello") == 400,
+        "conflicting Content-Length in another case is 400");
+  check(answer("POST /form HTTP/1.1\r\nContent-Length: 5x\r\n\r\nhello") ==
+            400,
+        "malformed Content-Length is 400");
+  check(answer("POST /form HTTP/1.1\r\nContent-Length: " +
+               std::to_string(HTTP_MAX_FORM_BODY_SIZE + 1) + "\r\n\r\n") ==
+            413,
+        "body over the form limit is 413");
+  check(answer("POST /form HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n") ==
+            501,
+        "chunked body is 501");
+
+  printf("%s\n", failures ? "FAILED" : "passed");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,92 @@
+// Checks for common/query_console.h: what the /query console accepts, and
+// that it never leaves a transaction open on its connection.
+//
+// Usage: query_console_test
+
+#include <cstdio>
+#include <sqlite3.h>
+#include <string>
+#include <unistd.h>
+
+#include "../common/query_console.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+  printf("%s  %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok) {
+    failures++;
+  }
+}
+
+// prepare() refuses `sql`
+static bool rejected(QueryConsole &console, const char *sql) {
+  std::string error;
+  sqlite3_stmt *stmt = console.prepare(sql, error);
+  if (stmt) {
+    sqlite3_finalize(stmt);
+    return false;
+  }
+  return !error.empty();
+}
+
+// Runs `sql` to completion; false if it was refused or failed
+static bool runs(QueryConsole &console, const char *sql) {
+  std::string error;
+  sqlite3_stmt *stmt = console.prepare(sql, error);
+  if (!stmt) {
+    return false;
+  }
+  QueryResult result = console.run(stmt, QueryBudget(), -1,
+                                   [](sqlite3_stmt *) { return true; });
+  return result.outcome == QueryOutcome::Done;
+}
+
+int main() {
+  char path[] = "/tmp/query_console_test_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 2;
+  }
+  close(fd);
+
+  sqlite3 *db;
+  if (sqlite3_open(path, &db) != SQLITE_OK ||
+      sqlite3_exec(db,
+                   "CREATE TABLE t (id INTEGER PRIMARY KEY, name TEXT);"
+                   "INSERT INTO t (name) VALUES ('a'), ('b');",
+                   NULL, NULL, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Cannot create %s: %s\n", path, sqlite3_errmsg(db));
+    return 2;
+  }
+  sqlite3_close(db);
+
+  // Never destroyed, as in db_admin: its watchdog thread runs until exit
+  QueryConsole &console = *new QueryConsole();
+  std::string error;
+  if (!console.open(path, error)) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, error.c_str());
+    return 2;
+  }
+
+  check(runs(console, "SELECT * FROM t"), "SELECT runs");
+  check(runs(console, "PRAGMA table_info(t)"), "PRAGMA table_info runs");
+  check(rejected(console, "BEGIN"), "BEGIN is rejected");
+  check(rejected(console, "BEGIN IMMEDIATE"), "BEGIN IMMEDIATE is rejected");
+  check(rejected(console, "SAVEPOINT s"), "SAVEPOINT is rejected");
+  check(rejected(console, "RELEASE s"), "RELEASE is rejected");
+  check(rejected(console, "COMMIT"), "COMMIT is rejected");
+  check(rejected(console, "PRAGMA query_only = 0"),
+        "PRAGMA query_only = 0 is rejected");
+  check(rejected(console, "INSERT INTO t (name) VALUES ('c')"),
+        "INSERT is rejected");
+  check(rejected(console, "ATTACH 'other.db' AS other"),
+        "ATTACH is rejected");
+  check(!console.in_transaction(), "no transaction left open");
+  check(runs(console, "SELECT count(*) FROM t"), "SELECT still runs");
+
+  unlink(path);
+  printf("%s\n", failures ? "FAILED" : "passed");
+  return failures ? 1 : 0;
+}
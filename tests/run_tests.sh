@@ -0,0 +1,14 @@
+#!/bin/bash
+
+# Build and run the checks; exits nonzero if any fails
+cd "$(dirname "$0")"
+set -e
+
+g++ -std=c++17 -O2 -pthread -o query_console_test query_console_test.cpp -lsqlite3
+./query_console_test
+
+g++ -std=c++17 -O2 -pthread -o server_timeout_test server_timeout_test.cpp -lssl -lcrypto
+./server_timeout_test
+
+g++ -std=c++17 -O2 -o http_framing_test http_framing_test.cpp
+./http_framing_test
@@ -0,0 +1,98 @@
+// Checks for common/server.h: a client that connects and goes silent is
+// disconnected once the accepted socket's timeouts run out, while one
+// that sends its request in time is served.
+//
+// Usage: server_timeout_test
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+#include "../common/server.h"
+
+#define TEST_TIMEOUT_MS 200
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+  printf("%s  %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok) {
+    failures++;
+  }
+}
+
+// Connected client socket, or -1
+static int connect_to(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Accept the next connection as run_server does and read one request;
+// `ms` is how long that took
+static HttpParser::Status serve_one(int server_fd, long &ms) {
+  int fd = accept(server_fd, nullptr, nullptr);
+  set_connection_timeouts(fd, TEST_TIMEOUT_MS, TEST_TIMEOUT_MS);
+  Connection conn(fd, nullptr);
+  RequestReader reader;
+  HttpRequest request;
+  auto start = std::chrono::steady_clock::now();
+  HttpParser::Status status = reader.read(conn, request);
+  ms = (long)std::chrono::duration_cast<std::chrono::milliseconds>(
+           std::chrono::steady_clock::now() - start)
+           .count();
+  return status;
+}
+
+int main() {
+  signal(SIGPIPE, SIG_IGN);
+  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrlen = sizeof(addr);
+  if (server_fd < 0 ||
+      bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(server_fd, 4) != 0 ||
+      getsockname(server_fd, (struct sockaddr *)&addr, &addrlen) != 0) {
+    perror("Cannot listen");
+    return 2;
+  }
+  int port = ntohs(addr.sin_port);
+
+  // Connects and sends nothing
+  int idle = connect_to(port);
+  long ms = 0;
+  HttpParser::Status status = serve_one(server_fd, ms);
+  check(status != HttpParser::Complete, "idle client gets no request");
+  check(ms >= TEST_TIMEOUT_MS / 2 && ms < 10 * TEST_TIMEOUT_MS,
+        "idle client is dropped after the receive timeout");
+  char byte;
+  set_connection_timeouts(idle, 10 * TEST_TIMEOUT_MS, TEST_TIMEOUT_MS);
+  check(read(idle, &byte, 1) == 0, "idle client sees the connection close");
+
+  // Sends a whole request
+  int client = connect_to(port);
+  const char *get = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  check(write(client, get, strlen(get)) == (ssize_t)strlen(get),
+        "client sends its request");
+  status = serve_one(server_fd, ms);
+  check(status == HttpParser::Complete, "prompt client is served");
+
+  close(idle);
+  close(client);
+  close(server_fd);
+  printf("%s\n", failures ? "FAILED" : "passed");
+  return failures ? 1 : 0;
+}
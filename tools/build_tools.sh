@@ -0,0 +1,11 @@
+#!/bin/bash
+
+# Build the offline database tools. They are run by hand against
+# content.db (or a copy of it), so nothing is installed as a service.
+cd "$(dirname "$0")"
+
+g++ -std=c++17 -O2 -o index_advisor index_advisor.cpp -lsqlite3
+g++ -std=c++17 -O2 -pthread -o datagen datagen.cpp -lsqlite3
+g++ -std=c++17 -O2 -o snapshot_export snapshot_export.cpp -lsqlite3
+
+echo "Tools built in $(pwd)"
@@ -0,0 +1,929 @@
+// Synthetic content.db generator.
+//
+// Produces a database shaped like production: sites, content_blocks with
+// metadata, articles, tags, images and variants, videos with variants and
+// reels, and sochee posts with comments, hashtags, links and photo order.
+// Rows are generated in parallel in fixed-size chunks, each from its own
+// RNG stream derived from the seed, and written by a single thread in chunk
+// order through reused prepared statements, so the output is identical for
+// a given seed and scale regardless of --threads.
+//
+// Usage:
+//   datagen --out /tmp/content.db [--scale 1.0] [--skew 1.1] [--seed 42]
+//           [--threads N] [--schema ../schema/init_db.sql]
+//           [--migrations ../migrations] [--force]
+//
+// Scale 1.0 is 100k content blocks; tag, hashtag, site and comment
+// popularity follow Zipf distributions with exponent --skew.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sqlite3.h>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define BLOCKS_PER_SCALE 100000
+#define CHUNK_SIZE 5000
+
+struct Options {
+  std::string out;
+  std::string schema;
+  std::string migrations;
+  double scale = 1.0;
+  double skew = 1.1;
+  uint64_t seed = 42;
+  int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+  bool force = false;
+};
+
+// splitmix64: seeds independent per-chunk streams from one seed
+static uint64_t mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// xoshiro256** generator
+class Rng {
+public:
+  explicit Rng(uint64_t seed) {
+    for (auto &word : s_) {
+      seed = mix(seed);
+      word = seed;
+    }
+  }
+
+  uint64_t next() {
+    uint64_t result = rotl(s_[1] * 5, 7) * 9;
+    uint64_t t = s_[1] << 17;
+    s_[2] ^= s_[0];
+    s_[3] ^= s_[1];
+    s_[1] ^= s_[2];
+    s_[0] ^= s_[3];
+    s_[2] ^= t;
+    s_[3] = rotl(s_[3], 45);
+    return result;
+  }
+
+  // Uniform integer in [lo, hi]
+  int64_t range(int64_t lo, int64_t hi) {
+    return lo + (int64_t)(next() % (uint64_t)(hi - lo + 1));
+  }
+
+  double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+  bool chance(double p) { return uniform() < p; }
+
+private:
+  static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+  uint64_t s_[4];
+};
+
+// Zipf(n, s) sampler over ranks 0..n-1 by inverse CDF lookup
+class Zipf {
+public:
+  Zipf(size_t n, double s) : cdf_(n) {
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+      sum += 1.0 / std::pow((double)(i + 1), s);
+      cdf_[i] = sum;
+    }
+    for (auto &c : cdf_) {
+      c /= sum;
+    }
+  }
+
+  size_t sample(Rng &rng) const {
+    double u = rng.uniform();
+    return std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+  }
+
+  size_t size() const { return cdf_.size(); }
+
+private:
+  std::vector<double> cdf_;
+};
+
+static const char *WORDS[] = {
+    "river",  "signal", "paper",   "orbit",  "garden", "engine", "winter",
+    "copper", "lantern", "harbor", "meadow", "static", "canvas", "ember",
+    "glacier", "pixel", "quartz",  "saddle", "thunder", "velvet", "willow",
+    "atlas",  "beacon", "cobalt",  "delta",  "fable",  "gravel", "horizon",
+    "island", "jungle", "kernel",  "lumen",  "marble", "nectar", "oasis",
+    "prism",  "quiver", "ripple",  "summit", "tundra"};
+static const size_t WORD_COUNT = sizeof(WORDS) / sizeof(WORDS[0]);
+
+static const char *CONTENT_TYPES[] = {"article", "minisite", "gallery",
+                                      "interactive", "sochee"};
+static const char *STATUSES[] = {"published", "draft", "archived"};
+static const char *IMAGE_FORMATS[] = {"webp", "jpeg", "avif"};
+static const char *VIEWPORTS[] = {"small", "medium", "large"};
+static const int VIEWPORT_WIDTHS[] = {480, 1024, 1920};
+static const char *QUALITIES[] = {"low", "medium", "high"};
+static const char *VIDEO_QUALITIES[] = {"360p", "720p", "1080p"};
+static const char *LOCATIONS[] = {"", "Mexico City", "Lisbon", "Tokyo",
+                                  "Berlin", "Toronto", "Seoul"};
+
+static std::string words(Rng &rng, int count) {
+  std::string out;
+  for (int i = 0; i < count; i++) {
+    if (i) {
+      out += ' ';
+    }
+    out += WORDS[rng.next() % WORD_COUNT];
+  }
+  return out;
+}
+
+static std::string timestamp(int64_t unix_seconds) {
+  time_t t = (time_t)unix_seconds;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  char buf[32];
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+  return buf;
+}
+
+// In-memory rows. Ids that point at other generated rows are chunk-local
+// indexes; the writer adds the running id base for each table.
+struct BlockRow {
+  std::string title, slug, status, created_at;
+  int type_id, site_id;
+};
+struct MetaRow {
+  int block;
+  std::string key, value;
+};
+struct ArticleRow {
+  int block;
+  std::string body, summary, author, published_at;
+};
+struct TagRow {
+  int block, tag_id;
+};
+struct ImageRow {
+  int block;
+  std::string filename;
+  int size, width, height;
+  bool thumbnail;
+};
+struct ImageVariantRow {
+  int image, format, viewport, quality, size;
+};
+struct VideoRow {
+  int block;
+  std::string title;
+  int size, duration;
+  bool reel;
+};
+struct VideoVariantRow {
+  int video, quality, size;
+};
+struct ReelRow {
+  int video, sort_order;
+  std::string caption;
+};
+struct SocheeRow {
+  int block, comments, likes, hashtags;
+  bool single, has_link;
+  std::string caption, location;
+};
+struct CommentRow {
+  int block;
+  bool embedded;
+  std::string content;
+};
+struct EmbeddedRow {
+  int comment, x, y;
+};
+struct HashtagRow {
+  int block;
+  int hashtag;
+};
+struct LinkRow {
+  int block, image;
+  std::string url, name;
+};
+struct OrderRow {
+  int image, block, order;
+};
+
+struct Chunk {
+  int64_t first_block_id = 0;
+  std::vector<BlockRow> blocks;
+  std::vector<MetaRow> metadata;
+  std::vector<ArticleRow> articles;
+  std::vector<TagRow> tags;
+  std::vector<ImageRow> images;
+  std::vector<ImageVariantRow> image_variants;
+  std::vector<VideoRow> videos;
+  std::vector<VideoVariantRow> video_variants;
+  std::vector<ReelRow> reels;
+  std::vector<SocheeRow> sochee;
+  std::vector<CommentRow> comments;
+  std::vector<EmbeddedRow> embedded;
+  std::vector<HashtagRow> hashtags;
+  std::vector<LinkRow> links;
+  std::vector<OrderRow> orders;
+};
+
+struct Model {
+  int64_t blocks;
+  int sites;
+  int tags;
+  int hashtags;
+  Zipf site_zipf;
+  Zipf tag_zipf;
+  Zipf hashtag_zipf;
+  Zipf comment_zipf;
+
+  Model(const Options &opt)
+      : blocks((int64_t)(BLOCKS_PER_SCALE * opt.scale)),
+        sites(std::max(3, (int)(20 * std::sqrt(opt.scale)))),
+        tags(std::max(50, (int)(2000 * std::sqrt(opt.scale)))),
+        hashtags(std::max(100, (int)(10000 * std::sqrt(opt.scale)))),
+        site_zipf(sites, opt.skew), tag_zipf(tags, opt.skew),
+        hashtag_zipf(hashtags, opt.skew), comment_zipf(200, opt.skew) {}
+};
+
+static void add_images(Chunk &chunk, Rng &rng, int block, int count,
+                       bool first_is_thumbnail) {
+  for (int i = 0; i < count; i++) {
+    ImageRow img;
+    img.block = block;
+    img.filename = "img-" + std::to_string(chunk.first_block_id + block) +
+                   "-" + std::to_string(i) + ".jpg";
+    img.width = (int)rng.range(800, 4000);
+    img.height = img.width * 2 / 3;
+    img.size = (int)rng.range(80, 6000) * 1024;
+    img.thumbnail = first_is_thumbnail && i == 0;
+    int image = (int)chunk.images.size();
+    chunk.images.push_back(img);
+
+    for (int format = 0; format < 2; format++) {
+      for (int viewport = 0; viewport < 3; viewport++) {
+        chunk.image_variants.push_back(
+            {image, format, viewport, (int)rng.range(0, 2),
+             img.size / (4 - viewport) / (format + 2)});
+      }
+    }
+  }
+}
+
+static Chunk generate_chunk(const Options &opt, const Model &model,
+                            int64_t index) {
+  Chunk chunk;
+  Rng rng(mix(opt.seed ^ mix((uint64_t)index + 1)));
+  chunk.first_block_id = index * CHUNK_SIZE + 1;
+  int64_t count =
+      std::min<int64_t>(CHUNK_SIZE, model.blocks - index * CHUNK_SIZE);
+  const int64_t epoch = 1640995200; // 2022-01-01
+
+  for (int b = 0; b < count; b++) {
+    int64_t id = chunk.first_block_id + b;
+    double kind = rng.uniform();
+    int type_id = kind < 0.45   ? 1  // article
+                  : kind < 0.55 ? 2  // minisite
+                  : kind < 0.70 ? 3  // gallery
+                  : kind < 0.75 ? 4  // interactive
+                                : 5; // sochee
+    int64_t created = epoch + (int64_t)(rng.uniform() * 3 * 365 * 86400);
+
+    BlockRow block;
+    block.type_id = type_id;
+    block.site_id = (int)model.site_zipf.sample(rng) + 1;
+    block.title = words(rng, (int)rng.range(2, 8));
+    block.slug = "c" + std::to_string(id) + "-" + WORDS[rng.next() % WORD_COUNT];
+    double st = rng.uniform();
+    block.status = STATUSES[st < 0.75 ? 0 : st < 0.95 ? 1 : 2];
+    block.created_at = timestamp(created);
+    chunk.blocks.push_back(block);
+
+    chunk.metadata.push_back({b, "reading_time", std::to_string(rng.range(1, 30))});
+    if (rng.chance(0.5)) {
+      chunk.metadata.push_back({b, "seo_description", words(rng, 12)});
+    }
+
+    // Tags: popular tags are shared by many blocks
+    int tag_count = (int)rng.range(0, 7);
+    std::vector<int> chosen;
+    for (int t = 0; t < tag_count; t++) {
+      int tag = (int)model.tag_zipf.sample(rng) + 1;
+      if (std::find(chosen.begin(), chosen.end(), tag) == chosen.end()) {
+        chosen.push_back(tag);
+        chunk.tags.push_back({b, tag});
+      }
+    }
+
+    if (type_id == 1) {
+      ArticleRow article;
+      article.block = b;
+      article.summary = words(rng, 20);
+      article.body = "# " + block.title + "\n\n" + words(rng, (int)rng.range(80, 600));
+      article.author = WORDS[rng.next() % WORD_COUNT];
+      article.published_at = timestamp(created + rng.range(0, 86400 * 7));
+      chunk.articles.push_back(article);
+    }
+
+    if (type_id == 5) {
+      SocheeRow post;
+      post.block = b;
+      post.single = rng.chance(0.6);
+      post.caption = words(rng, (int)rng.range(3, 25));
+      post.location = LOCATIONS[rng.next() % 7];
+      post.has_link = rng.chance(0.1);
+
+      int photos = post.single ? 1 : (int)rng.range(2, 6);
+      int first_image = (int)chunk.images.size();
+      add_images(chunk, rng, b, photos, false);
+      for (int p = 0; p < photos; p++) {
+        chunk.orders.push_back({first_image + p, b, p});
+      }
+      if (post.has_link) {
+        chunk.links.push_back({b, first_image,
+                               "https://example.com/" + block.slug,
+                               words(rng, 2)});
+      }
+
+      post.comments = (int)model.comment_zipf.sample(rng);
+      for (int c = 0; c < post.comments; c++) {
+        bool embedded = rng.chance(0.1);
+        int comment = (int)chunk.comments.size();
+        chunk.comments.push_back({b, embedded, words(rng, (int)rng.range(1, 30))});
+        if (embedded) {
+          chunk.embedded.push_back(
+              {comment, (int)rng.range(0, 1080), (int)rng.range(0, 1350)});
+        }
+      }
+      post.likes = (int)(post.comments * rng.range(2, 40) + rng.range(0, 20));
+
+      post.hashtags = (int)rng.range(0, 6);
+      for (int h = 0; h < post.hashtags; h++) {
+        chunk.hashtags.push_back({b, (int)model.hashtag_zipf.sample(rng)});
+      }
+      chunk.sochee.push_back(post);
+      continue;
+    }
+
+    // Regular content: a thumbnail plus some inline images
+    int images = 1 + (int)(rng.chance(0.5) ? rng.range(1, 4) : 0);
+    add_images(chunk, rng, b, images, true);
+
+    if (type_id == 3 || rng.chance(0.05)) {
+      VideoRow video;
+      video.block = b;
+      video.title = words(rng, (int)rng.range(2, 6));
+      video.duration = (int)rng.range(10, 1800);
+      video.size = video.duration * (int)rng.range(100, 600) * 1024;
+      video.reel = video.duration < 90 && rng.chance(0.6);
+      int v = (int)chunk.videos.size();
+      chunk.videos.push_back(video);
+
+      for (int q = 0; q < 3; q++) {
+        chunk.video_variants.push_back({v, q, video.size / (3 - q)});
+      }
+      if (video.reel) {
+        chunk.reels.push_back({v, (int)rng.range(0, 100), words(rng, 6)});
+      }
+    }
+  }
+
+  return chunk;
+}
+
+// Prepared statements reused for every row of the run
+class Writer {
+public:
+  explicit Writer(sqlite3 *db) : db_(db) {
+    prepare(blocks_, "INSERT INTO content_blocks (id, title, url_slug, type_id, "
+                     "status, thumbnail_url, language, created_at, updated_at, "
+                     "site_id) VALUES (?, ?, ?, ?, ?, ?, 'en', ?, ?, ?)");
+    prepare(metadata_, "INSERT INTO content_metadata (content_id, key, value) "
+                       "VALUES (?, ?, ?)");
+    prepare(articles_, "INSERT INTO articles (content_id, body_markdown, "
+                       "summary, author, published_at, last_edited) "
+                       "VALUES (?, ?, ?, ?, ?, ?)");
+    prepare(tags_, "INSERT OR IGNORE INTO content_tags (content_id, tag_id) "
+                   "VALUES (?, ?)");
+    prepare(images_, "INSERT INTO images (id, original_url, filename, "
+                     "mime_type, size, width, height, created_at, content_id, "
+                     "image_type, processing_status) "
+                     "VALUES (?, ?, ?, 'image/jpeg', ?, ?, ?, ?, ?, ?, "
+                     "'complete')");
+    prepare(image_variants_,
+            "INSERT INTO image_variants (image_id, url, format, width, "
+            "height, quality, viewport_size, size, created_at) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)");
+    prepare(videos_, "INSERT INTO videos (id, title, gcs_path, mime_type, "
+                     "size_bytes, duration_seconds, created_at, content_id, "
+                     "processing_status, is_reel) "
+                     "VALUES (?, ?, ?, 'video/mp4', ?, ?, ?, ?, 'complete', ?)");
+    prepare(video_variants_,
+            "INSERT INTO video_variants (video_id, quality, format, gcs_path, "
+            "size_bytes) VALUES (?, ?, 'mp4', ?, ?)");
+    prepare(reels_, "INSERT INTO reels (video_id, caption, sort_order) "
+                    "VALUES (?, ?, ?)");
+    prepare(sochee_, "INSERT INTO sochee (id, single, comments, likes, "
+                     "caption, hashtag, location, has_link) "
+                     "VALUES (?, ?, ?, ?, ?, ?, ?, ?)");
+    prepare(comments_, "INSERT INTO sochee_comment (id, content_id, embedded, "
+                       "content) VALUES (?, ?, ?, ?)");
+    prepare(embedded_, "INSERT INTO sochee_comment_embedded (comment_id, "
+                       "x_coord, y_coord) VALUES (?, ?, ?)");
+    prepare(hashtags_, "INSERT INTO sochee_hashtag (content_id, hashtag) "
+                       "VALUES (?, ?)");
+    prepare(links_, "INSERT INTO sochee_link (id, image_id, url, name) "
+                    "VALUES (?, ?, ?, ?)");
+    prepare(orders_, "INSERT INTO sochee_order (id, sochee_id, photo_order) "
+                     "VALUES (?, ?, ?)");
+  }
+
+  ~Writer() {
+    for (sqlite3_stmt *stmt : all_) {
+      sqlite3_finalize(stmt);
+    }
+  }
+
+  bool ok() const { return ok_; }
+
+  void write(const Chunk &c) {
+    int64_t base = c.first_block_id;
+
+    for (size_t i = 0; i < c.blocks.size(); i++) {
+      const BlockRow &r = c.blocks[i];
+      int64_t id = base + (int64_t)i;
+      bind(blocks_, 1, id);
+      text(blocks_, 2, r.title);
+      text(blocks_, 3, r.slug);
+      bind(blocks_, 4, r.type_id);
+      text(blocks_, 5, r.status);
+      std::string thumb = "https://storage.googleapis.com/grabbiel-media-public/"
+                          "images/originals/img-" +
+                          std::to_string(id) + "-0.jpg";
+      text(blocks_, 6, thumb);
+      text(blocks_, 7, r.created_at);
+      text(blocks_, 8, r.created_at);
+      bind(blocks_, 9, r.site_id);
+      step(blocks_);
+    }
+    for (const auto &r : c.metadata) {
+      bind(metadata_, 1, base + r.block);
+      text(metadata_, 2, r.key);
+      text(metadata_, 3, r.value);
+      step(metadata_);
+    }
+    for (const auto &r : c.articles) {
+      bind(articles_, 1, base + r.block);
+      text(articles_, 2, r.body);
+      text(articles_, 3, r.summary);
+      text(articles_, 4, r.author);
+      text(articles_, 5, r.published_at);
+      text(articles_, 6, r.published_at);
+      step(articles_);
+    }
+    for (const auto &r : c.tags) {
+      bind(tags_, 1, base + r.block);
+      bind(tags_, 2, r.tag_id);
+      step(tags_);
+    }
+
+    for (size_t i = 0; i < c.images.size(); i++) {
+      const ImageRow &r = c.images[i];
+      std::string url =
+          "https://storage.googleapis.com/grabbiel-media-public/images/"
+          "originals/" +
+          r.filename;
+      bind(images_, 1, image_base_ + (int64_t)i);
+      text(images_, 2, url);
+      text(images_, 3, r.filename);
+      bind(images_, 4, r.size);
+      bind(images_, 5, r.width);
+      bind(images_, 6, r.height);
+      text(images_, 7, c.blocks[r.block].created_at);
+      bind(images_, 8, base + r.block);
+      text(images_, 9, r.thumbnail ? "thumbnail" : "content");
+      step(images_);
+    }
+    for (const auto &r : c.image_variants) {
+      const ImageRow &img = c.images[r.image];
+      int width = std::min(img.width, VIEWPORT_WIDTHS[r.viewport]);
+      std::string url =
+          "https://storage.googleapis.com/grabbiel-media-public/images/"
+          "variants/" +
+          img.filename + "-" + VIEWPORTS[r.viewport] + "." +
+          IMAGE_FORMATS[r.format];
+      bind(image_variants_, 1, image_base_ + r.image);
+      text(image_variants_, 2, url);
+      text(image_variants_, 3, IMAGE_FORMATS[r.format]);
+      bind(image_variants_, 4, width);
+      bind(image_variants_, 5, width * 2 / 3);
+      text(image_variants_, 6, QUALITIES[r.quality]);
+      text(image_variants_, 7, VIEWPORTS[r.viewport]);
+      bind(image_variants_, 8, r.size);
+      text(image_variants_, 9, c.blocks[img.block].created_at);
+      step(image_variants_);
+    }
+
+    for (size_t i = 0; i < c.videos.size(); i++) {
+      const VideoRow &r = c.videos[i];
+      int64_t id = video_base_ + (int64_t)i;
+      bind(videos_, 1, id);
+      text(videos_, 2, r.title);
+      text(videos_, 3, "gs://grabbiel-media-public/videos/originals/video-" +
+                           std::to_string(id) + ".mp4");
+      bind(videos_, 4, r.size);
+      bind(videos_, 5, r.duration);
+      text(videos_, 6, c.blocks[r.block].created_at);
+      bind(videos_, 7, base + r.block);
+      bind(videos_, 8, r.reel ? 1 : 0);
+      step(videos_);
+    }
+    for (const auto &r : c.video_variants) {
+      int64_t video = video_base_ + r.video;
+      bind(video_variants_, 1, video);
+      text(video_variants_, 2, VIDEO_QUALITIES[r.quality]);
+      text(video_variants_, 3,
+           "gs://grabbiel-media-public/videos/variants/video-" +
+               std::to_string(video) + "-" + VIDEO_QUALITIES[r.quality] +
+               ".mp4");
+      bind(video_variants_, 4, r.size);
+      step(video_variants_);
+    }
+    for (const auto &r : c.reels) {
+      bind(reels_, 1, video_base_ + r.video);
+      text(reels_, 2, r.caption);
+      bind(reels_, 3, r.sort_order);
+      step(reels_);
+    }
+
+    for (const auto &r : c.sochee) {
+      bind(sochee_, 1, base + r.block);
+      bind(sochee_, 2, r.single ? 1 : 0);
+      bind(sochee_, 3, r.comments);
+      bind(sochee_, 4, r.likes);
+      text(sochee_, 5, r.caption);
+      bind(sochee_, 6, r.hashtags);
+      text(sochee_, 7, r.location);
+      bind(sochee_, 8, r.has_link ? 1 : 0);
+      step(sochee_);
+    }
+    for (size_t i = 0; i < c.comments.size(); i++) {
+      const CommentRow &r = c.comments[i];
+      bind(comments_, 1, comment_base_ + (int64_t)i);
+      bind(comments_, 2, base + r.block);
+      bind(comments_, 3, r.embedded ? 1 : 0);
+      text(comments_, 4, r.content);
+      step(comments_);
+    }
+    for (const auto &r : c.embedded) {
+      bind(embedded_, 1, comment_base_ + r.comment);
+      bind(embedded_, 2, r.x);
+      bind(embedded_, 3, r.y);
+      step(embedded_);
+    }
+    for (const auto &r : c.hashtags) {
+      std::string tag = std::string("#") + WORDS[r.hashtag % WORD_COUNT] +
+                        std::to_string(r.hashtag);
+      bind(hashtags_, 1, base + r.block);
+      text(hashtags_, 2, tag);
+      step(hashtags_);
+    }
+    for (const auto &r : c.links) {
+      bind(links_, 1, base + r.block);
+      bind(links_, 2, image_base_ + r.image);
+      text(links_, 3, r.url);
+      text(links_, 4, r.name);
+      step(links_);
+    }
+    for (const auto &r : c.orders) {
+      bind(orders_, 1, image_base_ + r.image);
+      bind(orders_, 2, base + r.block);
+      bind(orders_, 3, r.order);
+      step(orders_);
+    }
+
+    image_base_ += (int64_t)c.images.size();
+    video_base_ += (int64_t)c.videos.size();
+    comment_base_ += (int64_t)c.comments.size();
+    rows_ += c.blocks.size() + c.metadata.size() + c.articles.size() +
+             c.tags.size() + c.images.size() + c.image_variants.size() +
+             c.videos.size() + c.video_variants.size() + c.reels.size() +
+             c.sochee.size() + c.comments.size() + c.embedded.size() +
+             c.hashtags.size() + c.links.size() + c.orders.size();
+  }
+
+  uint64_t rows() const { return rows_; }
+
+private:
+  void prepare(sqlite3_stmt *&stmt, const char *sql) {
+    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, NULL) != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare '%s': %s\n", sql, sqlite3_errmsg(db_));
+      ok_ = false;
+    }
+    all_.push_back(stmt);
+  }
+
+  void bind(sqlite3_stmt *stmt, int i, int64_t v) {
+    sqlite3_bind_int64(stmt, i, v);
+  }
+
+  void text(sqlite3_stmt *stmt, int i, const std::string &v) {
+    sqlite3_bind_text(stmt, i, v.c_str(), (int)v.size(), SQLITE_TRANSIENT);
+  }
+
+  void step(sqlite3_stmt *stmt) {
+    if (sqlite3_step(stmt) != SQLITE_DONE && errors_++ < 10) {
+      fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(db_));
+    }
+    sqlite3_reset(stmt);
+  }
+
+  sqlite3 *db_;
+  bool ok_ = true;
+  int errors_ = 0;
+  uint64_t rows_ = 0;
+  int64_t image_base_ = 1;
+  int64_t video_base_ = 1;
+  int64_t comment_base_ = 1;
+  std::vector<sqlite3_stmt *> all_;
+  sqlite3_stmt *blocks_, *metadata_, *articles_, *tags_, *images_,
+      *image_variants_, *videos_, *video_variants_, *reels_, *sochee_,
+      *comments_, *embedded_, *hashtags_, *links_, *orders_;
+};
+
+static std::string read_file(const std::string &path) {
+  std::ifstream in(path);
+  std::stringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+// Same order and bookkeeping as scripts/setup_db.sh + scripts/migrate_db.sh.
+// Migrations that are not valid SQLite are reported and skipped, which is
+// what the sqlite3 shell does with them in production.
+static bool apply_schema(sqlite3 *db, const Options &opt) {
+  std::string schema = read_file(opt.schema);
+  if (schema.empty()) {
+    fprintf(stderr, "Cannot read schema %s\n", opt.schema.c_str());
+    return false;
+  }
+  char *err = nullptr;
+  if (sqlite3_exec(db, schema.c_str(), NULL, NULL, &err) != SQLITE_OK) {
+    fprintf(stderr, "Schema failed: %s\n", err);
+    sqlite3_free(err);
+    return false;
+  }
+
+  std::vector<std::string> files;
+  if (DIR *dir = opendir(opt.migrations.c_str())) {
+    while (struct dirent *entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name.size() > 4 && name.substr(name.size() - 4) == ".sql") {
+        files.push_back(name);
+      }
+    }
+    closedir(dir);
+  }
+  std::sort(files.begin(), files.end());
+
+  for (const auto &name : files) {
+    std::string sql = read_file(opt.migrations + "/" + name);
+    if (sqlite3_exec(db, sql.c_str(), NULL, NULL, &err) != SQLITE_OK) {
+      fprintf(stderr, "Warning: migration %s: %s\n", name.c_str(), err);
+      sqlite3_free(err);
+    }
+    int version = atoi(name.c_str());
+    std::string description = name.substr(name.find('_') + 1);
+    description = description.substr(0, description.size() - 4);
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(db,
+                       "INSERT OR IGNORE INTO schema_versions (version, "
+                       "description) VALUES (?, ?)",
+                       -1, &stmt, NULL);
+    sqlite3_bind_int(stmt, 1, version);
+    sqlite3_bind_text(stmt, 2, description.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+  }
+  return true;
+}
+
+static void write_dimensions(sqlite3 *db, const Model &model) {
+  sqlite3_stmt *stmt;
+
+  sqlite3_prepare_v2(db, "INSERT INTO content_types (id, type) VALUES (?, ?)",
+                     -1, &stmt, NULL);
+  for (int i = 0; i < 5; i++) {
+    sqlite3_bind_int(stmt, 1, i + 1);
+    sqlite3_bind_text(stmt, 2, CONTENT_TYPES[i], -1, SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+
+  sqlite3_prepare_v2(db,
+                     "INSERT INTO sites (id, slug, title, description, created_at) "
+                     "VALUES (?, ?, ?, ?, '2022-01-01 00:00:00')",
+                     -1, &stmt, NULL);
+  for (int i = 1; i <= model.sites; i++) {
+    std::string slug = std::string(WORDS[i % WORD_COUNT]) + "-" +
+                       std::to_string(i);
+    sqlite3_bind_int(stmt, 1, i);
+    sqlite3_bind_text(stmt, 2, slug.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 3, slug.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 4, "Generated site", -1, SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+
+  sqlite3_prepare_v2(db, "INSERT INTO tags (id, name) VALUES (?, ?)", -1,
+                     &stmt, NULL);
+  for (int i = 1; i <= model.tags; i++) {
+    std::string name = std::string(WORDS[i % WORD_COUNT]) + "-" +
+                       std::to_string(i);
+    sqlite3_bind_int(stmt, 1, i);
+    sqlite3_bind_text(stmt, 2, name.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+}
+
+static std::string dirname_of(const char *path) {
+  std::string p = path;
+  size_t slash = p.rfind('/');
+  return slash == std::string::npos ? "." : p.substr(0, slash);
+}
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: datagen --out PATH [--scale F] [--skew S] [--seed N] "
+          "[--threads N]\n"
+          "               [--schema FILE] [--migrations DIR] [--force]\n");
+}
+
+int main(int argc, char **argv) {
+  Options opt;
+  std::string here = dirname_of(argv[0]);
+  opt.schema = here + "/../schema/init_db.sql";
+  opt.migrations = here + "/../migrations";
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--force") {
+      opt.force = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    const char *value = argv[++i];
+    if (arg == "--out") {
+      opt.out = value;
+    } else if (arg == "--scale") {
+      opt.scale = atof(value);
+    } else if (arg == "--skew") {
+      opt.skew = atof(value);
+    } else if (arg == "--seed") {
+      opt.seed = strtoull(value, nullptr, 10);
+    } else if (arg == "--threads") {
+      opt.threads = std::max(1, atoi(value));
+    } else if (arg == "--schema") {
+      opt.schema = value;
+    } else if (arg == "--migrations") {
+      opt.migrations = value;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  if (opt.out.empty() || opt.scale <= 0) {
+    usage();
+    return 1;
+  }
+  struct stat st;
+  if (stat(opt.out.c_str(), &st) == 0) {
+    if (!opt.force) {
+      fprintf(stderr, "%s exists, pass --force to replace it\n",
+              opt.out.c_str());
+      return 1;
+    }
+    unlink(opt.out.c_str());
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  sqlite3 *db;
+  if (sqlite3_open(opt.out.c_str(), &db) != SQLITE_OK) {
+    fprintf(stderr, "Failed to open %s: %s\n", opt.out.c_str(),
+            sqlite3_errmsg(db));
+    return 1;
+  }
+  sqlite3_exec(db,
+               "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF; "
+               "PRAGMA locking_mode=EXCLUSIVE; PRAGMA cache_size=-262144; "
+               "PRAGMA temp_store=MEMORY;",
+               NULL, NULL, NULL);
+
+  if (!apply_schema(db, opt)) {
+    sqlite3_close(db);
+    return 1;
+  }
+
+  Model model(opt);
+  write_dimensions(db, model);
+
+  Writer writer(db);
+  if (!writer.ok()) {
+    sqlite3_close(db);
+    return 1;
+  }
+
+  // Generators fill slots; the writer drains them strictly in order and
+  // generators stay at most a few chunks ahead to bound memory
+  int64_t chunks = (model.blocks + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  std::vector<std::unique_ptr<Chunk>> slots(chunks);
+  std::mutex mutex;
+  std::condition_variable ready, drained;
+  std::atomic<int64_t> next_chunk(0);
+  int64_t written = 0;
+  int64_t window = opt.threads * 2;
+
+  std::vector<std::thread> generators;
+  for (int t = 0; t < opt.threads; t++) {
+    generators.emplace_back([&]() {
+      while (true) {
+        int64_t index = next_chunk.fetch_add(1);
+        if (index >= chunks) {
+          return;
+        }
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          drained.wait(lock, [&]() { return index < written + window; });
+        }
+        std::unique_ptr<Chunk> chunk(
+            new Chunk(generate_chunk(opt, model, index)));
+        std::lock_guard<std::mutex> lock(mutex);
+        slots[index] = std::move(chunk);
+        ready.notify_all();
+      }
+    });
+  }
+
+  sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+  for (int64_t i = 0; i < chunks; i++) {
+    std::unique_ptr<Chunk> chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      ready.wait(lock, [&]() { return slots[i] != nullptr; });
+      chunk = std::move(slots[i]);
+    }
+    writer.write(*chunk);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      written = i + 1;
+    }
+    drained.notify_all();
+
+    // Commit in batches so a huge run does not hold one giant transaction
+    if ((i + 1) % 20 == 0) {
+      sqlite3_exec(db, "COMMIT; BEGIN", NULL, NULL, NULL);
+      fprintf(stderr, "\r%lld/%lld blocks", (long long)((i + 1) * CHUNK_SIZE),
+              (long long)model.blocks);
+    }
+  }
+  sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  for (auto &g : generators) {
+    g.join();
+  }
+
+  sqlite3_exec(db, "ANALYZE", NULL, NULL, NULL);
+  sqlite3_close(db);
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - started)
+                       .count();
+  fprintf(stderr, "\rGenerated %lld content blocks, %llu rows in %.1f s "
+                  "(%.0f rows/s) -> %s\n",
+          (long long)model.blocks, (unsigned long long)writer.rows(), seconds,
+          writer.rows() / seconds, opt.out.c_str());
+  return 0;
+}
@@ -0,0 +1,852 @@
+// Index advisor: replays a workload captured with GRABBIEL_SQL_WORKLOAD
+// against EXPLAIN QUERY PLAN on a scratch copy of content.db, proposes
+// covering/partial indexes (plus indexes for unindexed foreign keys) and
+// measures statement latency before and after creating them.
+//
+// Usage:
+//   index_advisor --workload /tmp/grabbiel-sql.log
+//                 [--db /var/lib/grabbiel-db/content.db]
+//                 [--scratch /tmp/index-advisor.db] [--runs 5] [--top 50]
+//                 [--emit-migration 007_add_indexes.sql]
+
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sqlite3.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../common/sql_trace.h"
+
+#define DEFAULT_DB_PATH "/var/lib/grabbiel-db/content.db"
+#define DEFAULT_SCRATCH_PATH "/tmp/index-advisor.db"
+
+struct WorkloadEntry {
+  std::string normalized;
+  std::string text;
+  std::string sample;
+  long long count = 0;
+  long long total_ns = 0;
+};
+
+struct IndexInfo {
+  std::string name;
+  std::string table;
+  std::vector<std::string> columns;
+  bool partial = false;
+};
+
+struct Proposal {
+  std::string table;
+  std::vector<std::string> columns;
+  std::string where; // partial index predicate, empty for a full index
+  std::string reason;
+
+  // Partial indexes on the same columns differ by predicate, so its hash
+  // is part of the name. FNV-1a keeps the name stable across builds for
+  // emitted migrations.
+  std::string name() const {
+    std::string n = "idx_" + table;
+    for (const auto &col : columns) {
+      n += "_" + col;
+    }
+    if (!where.empty()) {
+      uint32_t hash = 2166136261u;
+      for (char c : where) {
+        hash = (hash ^ (unsigned char)c) * 16777619u;
+      }
+      char suffix[16];
+      snprintf(suffix, sizeof(suffix), "_p%08x", hash);
+      n += suffix;
+    }
+    return n;
+  }
+
+  std::string sql() const {
+    std::string s = "CREATE INDEX IF NOT EXISTS " + name() + " ON " + table + "(";
+    for (size_t i = 0; i < columns.size(); i++) {
+      s += (i ? ", " : "") + columns[i];
+    }
+    s += ")";
+    if (!where.empty()) {
+      s += " WHERE " + where;
+    }
+    return s + ";";
+  }
+};
+
+struct Catalog {
+  std::map<std::string, std::vector<std::string>> columns;
+  std::map<std::string, std::string> rowid_alias;
+  std::vector<IndexInfo> indexes;
+};
+
+struct Token {
+  enum Kind { IDENT, STRING, NUMBER, PARAM, OP };
+  Kind kind;
+  std::string text;
+};
+
+static std::string lower(std::string s) {
+  for (char &c : s) {
+    c = (char)std::tolower((unsigned char)c);
+  }
+  return s;
+}
+
+// Minimal SQL tokenizer, good enough to find predicates and ORDER BY terms
+static std::vector<Token> tokenize(const std::string &sql) {
+  std::vector<Token> tokens;
+  size_t i = 0;
+
+  while (i < sql.size()) {
+    char c = sql[i];
+    if (std::isspace((unsigned char)c)) {
+      i++;
+    } else if (c == '\'') {
+      size_t j = i + 1;
+      while (j < sql.size()) {
+        if (sql[j] == '\'' && j + 1 < sql.size() && sql[j + 1] == '\'') {
+          j += 2;
+        } else if (sql[j] == '\'') {
+          break;
+        } else {
+          j++;
+        }
+      }
+      tokens.push_back({Token::STRING, sql.substr(i, j + 1 - i)});
+      i = j + 1;
+    } else if (c == '"' || c == '`' || c == '[') {
+      char close = c == '[' ? ']' : c;
+      size_t j = sql.find(close, i + 1);
+      if (j == std::string::npos) {
+        j = sql.size();
+      }
+      tokens.push_back({Token::IDENT, sql.substr(i + 1, j - i - 1)});
+      i = j + 1;
+    } else if (std::isalpha((unsigned char)c) || c == '_') {
+      size_t j = i;
+      while (j < sql.size() &&
+             (std::isalnum((unsigned char)sql[j]) || sql[j] == '_')) {
+        j++;
+      }
+      tokens.push_back({Token::IDENT, sql.substr(i, j - i)});
+      i = j;
+    } else if (std::isdigit((unsigned char)c)) {
+      size_t j = i;
+      while (j < sql.size() &&
+             (std::isalnum((unsigned char)sql[j]) || sql[j] == '.')) {
+        j++;
+      }
+      tokens.push_back({Token::NUMBER, sql.substr(i, j - i)});
+      i = j;
+    } else if (c == '?' || c == ':' || c == '@' || c == '$') {
+      size_t j = i + 1;
+      while (j < sql.size() &&
+             (std::isalnum((unsigned char)sql[j]) || sql[j] == '_')) {
+        j++;
+      }
+      tokens.push_back({Token::PARAM, sql.substr(i, j - i)});
+      i = j;
+    } else if ((c == '<' || c == '>' || c == '!' || c == '=') &&
+               i + 1 < sql.size() &&
+               (sql[i + 1] == '=' || sql[i + 1] == '>')) {
+      tokens.push_back({Token::OP, sql.substr(i, 2)});
+      i += 2;
+    } else {
+      tokens.push_back({Token::OP, std::string(1, c)});
+      i++;
+    }
+  }
+
+  return tokens;
+}
+
+static bool is_keyword(const std::string &word) {
+  static const std::set<std::string> keywords = {
+      "where", "join",  "left",  "inner",  "cross",  "outer", "natural",
+      "on",    "using", "order", "group",  "limit",  "having", "set",
+      "union", "as",    "and",   "or",     "not",    "select", "from",
+      "values", "offset", "returning", "window", "indexed"};
+  return keywords.count(lower(word)) > 0;
+}
+
+// What the advisor learned about one table from one statement
+struct TableUsage {
+  std::vector<std::string> equality;
+  std::vector<std::string> range;
+  std::vector<std::string> order_by;
+  std::vector<std::string> selected;
+  std::vector<std::pair<std::string, std::string>> constants;
+  bool select_star = false;
+};
+
+static void add_unique(std::vector<std::string> &v, const std::string &s) {
+  if (std::find(v.begin(), v.end(), s) == v.end()) {
+    v.push_back(s);
+  }
+}
+
+class StatementAnalyzer {
+public:
+  StatementAnalyzer(const Catalog &catalog, const std::string &sql)
+      : catalog_(catalog), tokens_(tokenize(sql)) {
+    collect_tables();
+    collect_usage();
+  }
+
+  const std::map<std::string, TableUsage> &usage() const { return usage_; }
+
+  // Table name for an EXPLAIN QUERY PLAN object (which may be an alias)
+  std::string resolve(const std::string &name) const {
+    auto it = aliases_.find(lower(name));
+    return it != aliases_.end() ? it->second : lower(name);
+  }
+
+private:
+  void collect_tables() {
+    for (size_t i = 0; i < tokens_.size(); i++) {
+      std::string word = lower(tokens_[i].text);
+      if (tokens_[i].kind != Token::IDENT ||
+          (word != "from" && word != "join" && word != "update" &&
+           word != "into")) {
+        continue;
+      }
+
+      size_t j = i + 1;
+      while (j < tokens_.size() && tokens_[j].kind == Token::IDENT &&
+             !is_keyword(tokens_[j].text)) {
+        std::string table = lower(tokens_[j].text);
+        if (!catalog_.columns.count(table)) {
+          break;
+        }
+        aliases_[table] = table;
+        j++;
+
+        if (j < tokens_.size() && lower(tokens_[j].text) == "as") {
+          j++;
+        }
+        if (j < tokens_.size() && tokens_[j].kind == Token::IDENT &&
+            !is_keyword(tokens_[j].text)) {
+          aliases_[lower(tokens_[j].text)] = table;
+          j++;
+        }
+
+        if (word == "from" && j < tokens_.size() && tokens_[j].text == ",") {
+          j++;
+          continue;
+        }
+        break;
+      }
+    }
+  }
+
+  // Resolve "col" or "alias.col" starting at token i; returns table/column
+  bool column_at(size_t i, std::string &table, std::string &column,
+                 size_t &next) const {
+    if (i >= tokens_.size() || tokens_[i].kind != Token::IDENT) {
+      return false;
+    }
+
+    if (i + 2 < tokens_.size() && tokens_[i + 1].text == "." &&
+        tokens_[i + 2].kind == Token::IDENT) {
+      auto it = aliases_.find(lower(tokens_[i].text));
+      if (it == aliases_.end()) {
+        return false;
+      }
+      table = it->second;
+      column = lower(tokens_[i + 2].text);
+      next = i + 3;
+      return has_column(table, column);
+    }
+
+    column = lower(tokens_[i].text);
+    next = i + 1;
+    std::set<std::string> seen;
+    for (const auto &alias : aliases_) {
+      if (seen.insert(alias.second).second && has_column(alias.second, column)) {
+        table = alias.second;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool has_column(const std::string &table, const std::string &column) const {
+    auto it = catalog_.columns.find(table);
+    if (it == catalog_.columns.end()) {
+      return false;
+    }
+    return std::find(it->second.begin(), it->second.end(), column) !=
+           it->second.end();
+  }
+
+  void collect_usage() {
+    bool in_select_list = false;
+    bool in_order_by = false;
+
+    for (size_t i = 0; i < tokens_.size(); i++) {
+      std::string word = lower(tokens_[i].text);
+
+      if (tokens_[i].kind == Token::IDENT && word == "select") {
+        in_select_list = true;
+        continue;
+      }
+      if (tokens_[i].kind == Token::IDENT && word == "from") {
+        in_select_list = false;
+        continue;
+      }
+      if (tokens_[i].kind == Token::IDENT && word == "order" &&
+          i + 1 < tokens_.size() && lower(tokens_[i + 1].text) == "by") {
+        in_order_by = true;
+        i++;
+        continue;
+      }
+      if (tokens_[i].kind == Token::IDENT &&
+          (word == "limit" || word == "where" || word == "group")) {
+        in_order_by = false;
+      }
+
+      if (in_select_list && tokens_[i].text == "*") {
+        for (const auto &alias : aliases_) {
+          usage_[alias.second].select_star = true;
+        }
+        continue;
+      }
+
+      std::string table, column;
+      size_t next;
+      if (!column_at(i, table, column, next)) {
+        continue;
+      }
+
+      TableUsage &use = usage_[table];
+      if (in_select_list) {
+        add_unique(use.selected, column);
+        i = next - 1;
+        continue;
+      }
+      if (in_order_by) {
+        add_unique(use.order_by, column);
+        i = next - 1;
+        continue;
+      }
+      if (next >= tokens_.size()) {
+        continue;
+      }
+
+      std::string op = lower(tokens_[next].text);
+      if (op == "=" || op == "==" || op == "in" || op == "is") {
+        const Token *value =
+            next + 1 < tokens_.size() ? &tokens_[next + 1] : nullptr;
+        if (op == "=" && value &&
+            (value->kind == Token::STRING || value->kind == Token::NUMBER)) {
+          use.constants.push_back({column, value->text});
+        } else {
+          add_unique(use.equality, column);
+        }
+
+        // Join predicate: the other side is a column too
+        std::string other_table, other_column;
+        size_t other_next;
+        if (op == "=" && column_at(next + 1, other_table, other_column,
+                                   other_next)) {
+          add_unique(use.equality, column);
+          add_unique(usage_[other_table].equality, other_column);
+        }
+      } else if (op == "<" || op == ">" || op == "<=" || op == ">=" ||
+                 op == "between" || op == "like" || op == "glob") {
+        add_unique(use.range, column);
+      }
+      i = next - 1;
+    }
+  }
+
+  const Catalog &catalog_;
+  std::vector<Token> tokens_;
+  std::map<std::string, std::string> aliases_;
+  std::map<std::string, TableUsage> usage_;
+};
+
+static Catalog load_catalog(sqlite3 *db) {
+  Catalog catalog;
+  sqlite3_stmt *stmt;
+
+  const char *sql = "SELECT name FROM sqlite_master WHERE type='table' AND "
+                    "name NOT LIKE 'sqlite_%' ORDER BY name";
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    return catalog;
+  }
+  std::vector<std::string> tables;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    tables.push_back((const char *)sqlite3_column_text(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+
+  for (const auto &table : tables) {
+    std::string key = lower(table);
+    std::string pragma = "PRAGMA table_info(\"" + table + "\")";
+    int pk_count = 0;
+    std::string pk_column, pk_type;
+    if (sqlite3_prepare_v2(db, pragma.c_str(), -1, &stmt, NULL) == SQLITE_OK) {
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+        std::string name = lower((const char *)sqlite3_column_text(stmt, 1));
+        const char *type = (const char *)sqlite3_column_text(stmt, 2);
+        catalog.columns[key].push_back(name);
+        if (sqlite3_column_int(stmt, 5) > 0) {
+          pk_count++;
+          pk_column = name;
+          pk_type = lower(type ? type : "");
+        }
+      }
+      sqlite3_finalize(stmt);
+    }
+    if (pk_count == 1 && pk_type == "integer") {
+      catalog.rowid_alias[key] = pk_column;
+    }
+
+    pragma = "PRAGMA index_list(\"" + table + "\")";
+    std::vector<IndexInfo> table_indexes;
+    if (sqlite3_prepare_v2(db, pragma.c_str(), -1, &stmt, NULL) == SQLITE_OK) {
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+        IndexInfo index;
+        index.name = (const char *)sqlite3_column_text(stmt, 1);
+        index.table = key;
+        index.partial = sqlite3_column_int(stmt, 4) != 0;
+        table_indexes.push_back(index);
+      }
+      sqlite3_finalize(stmt);
+    }
+
+    for (auto &index : table_indexes) {
+      pragma = "PRAGMA index_info(\"" + index.name + "\")";
+      if (sqlite3_prepare_v2(db, pragma.c_str(), -1, &stmt, NULL) ==
+          SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+          const char *col = (const char *)sqlite3_column_text(stmt, 2);
+          index.columns.push_back(lower(col ? col : ""));
+        }
+        sqlite3_finalize(stmt);
+      }
+      catalog.indexes.push_back(index);
+    }
+  }
+
+  return catalog;
+}
+
+// True when an existing full index (or the rowid) already leads with columns
+static bool already_indexed(const Catalog &catalog, const std::string &table,
+                            const std::vector<std::string> &columns) {
+  auto alias = catalog.rowid_alias.find(table);
+  if (alias != catalog.rowid_alias.end() && columns.size() == 1 &&
+      columns[0] == alias->second) {
+    return true;
+  }
+
+  for (const auto &index : catalog.indexes) {
+    if (index.table != table || index.partial ||
+        index.columns.size() < columns.size()) {
+      continue;
+    }
+    if (std::equal(columns.begin(), columns.end(), index.columns.begin())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static std::vector<Proposal> foreign_key_proposals(sqlite3 *db,
+                                                   const Catalog &catalog) {
+  std::vector<Proposal> proposals;
+
+  for (const auto &table : catalog.columns) {
+    std::string pragma = "PRAGMA foreign_key_list(\"" + table.first + "\")";
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, pragma.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+      continue;
+    }
+
+    std::map<int, Proposal> by_id;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      Proposal &p = by_id[sqlite3_column_int(stmt, 0)];
+      p.table = table.first;
+      p.columns.push_back(lower((const char *)sqlite3_column_text(stmt, 3)));
+      p.reason = std::string("foreign key to ") +
+                 (const char *)sqlite3_column_text(stmt, 2) +
+                 " (cascades and joins scan " + table.first + ")";
+    }
+    sqlite3_finalize(stmt);
+
+    for (auto &fk : by_id) {
+      if (!already_indexed(catalog, fk.second.table, fk.second.columns)) {
+        proposals.push_back(fk.second);
+      }
+    }
+  }
+
+  return proposals;
+}
+
+struct PlanInfo {
+  std::vector<std::string> details;
+  std::set<std::string> scanned; // tables read without an index
+  bool temp_sort = false;
+};
+
+static bool explain(sqlite3 *db, const std::string &sql,
+                    const StatementAnalyzer &analyzer, PlanInfo &plan) {
+  std::string eqp = "EXPLAIN QUERY PLAN " + sql;
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, eqp.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+    return false;
+  }
+
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    std::string detail = (const char *)sqlite3_column_text(stmt, 3);
+    plan.details.push_back(detail);
+
+    if (detail.rfind("SCAN ", 0) == 0 &&
+        detail.find("COVERING INDEX") == std::string::npos &&
+        detail.find("USING INDEX") == std::string::npos) {
+      std::string object = detail.substr(5);
+      object = object.substr(0, object.find(' '));
+      plan.scanned.insert(analyzer.resolve(object));
+    }
+    if (detail.find("USE TEMP B-TREE FOR ORDER BY") != std::string::npos) {
+      plan.temp_sort = true;
+    }
+  }
+
+  sqlite3_finalize(stmt);
+  return true;
+}
+
+static std::vector<Proposal> statement_proposals(const Catalog &catalog,
+                                                 const StatementAnalyzer &an,
+                                                 const PlanInfo &plan) {
+  std::vector<Proposal> proposals;
+
+  for (const auto &entry : an.usage()) {
+    const std::string &table = entry.first;
+    const TableUsage &use = entry.second;
+    bool scanned = plan.scanned.count(table) > 0;
+    if (!scanned && !(plan.temp_sort && !use.order_by.empty())) {
+      continue;
+    }
+
+    Proposal p;
+    p.table = table;
+
+    // Constant equality predicates from the statement text become partial
+    // index filters; everything bound at runtime becomes a key column
+    for (const auto &constant : use.constants) {
+      p.where += (p.where.empty() ? "" : " AND ") + constant.first + " = " +
+                 constant.second;
+    }
+    for (const auto &col : use.equality) {
+      add_unique(p.columns, col);
+    }
+    if (!use.range.empty()) {
+      add_unique(p.columns, use.range.front());
+    } else {
+      for (const auto &col : use.order_by) {
+        add_unique(p.columns, col);
+      }
+    }
+    if (p.columns.empty()) {
+      continue;
+    }
+
+    // Make it covering when the select list is small and explicit
+    if (!use.select_star && !use.selected.empty()) {
+      std::vector<std::string> covering = p.columns;
+      for (const auto &col : use.selected) {
+        add_unique(covering, col);
+      }
+      auto alias = catalog.rowid_alias.find(table);
+      if (alias != catalog.rowid_alias.end()) {
+        covering.erase(
+            std::remove(covering.begin(), covering.end(), alias->second),
+            covering.end());
+      }
+      if (covering.size() <= 5 && covering.size() > p.columns.size()) {
+        p.columns = covering;
+        p.reason = "covering ";
+      }
+    }
+
+    p.reason += scanned ? "index for full scan of " + table
+                        : "index to avoid temp b-tree sort on " + table;
+    if (!p.where.empty()) {
+      p.reason = "partial " + p.reason;
+    }
+
+    if (p.where.empty() && already_indexed(catalog, table, p.columns)) {
+      continue;
+    }
+    proposals.push_back(p);
+  }
+
+  return proposals;
+}
+
+// Median wall time of running a statement `runs` times; writes roll back
+static double time_statement(sqlite3 *db, const std::string &sql, int runs) {
+  std::vector<double> samples;
+
+  for (int r = 0; r < runs; r++) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+      return -1;
+    }
+    bool readonly = sqlite3_stmt_readonly(stmt);
+    if (!readonly) {
+      sqlite3_exec(db, "SAVEPOINT advisor", NULL, NULL, NULL);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+    }
+    auto end = std::chrono::steady_clock::now();
+    sqlite3_finalize(stmt);
+
+    if (!readonly) {
+      sqlite3_exec(db, "ROLLBACK TO advisor; RELEASE advisor", NULL, NULL,
+                   NULL);
+    }
+    samples.push_back(
+        std::chrono::duration<double, std::milli>(end - start).count());
+  }
+
+  std::sort(samples.begin(), samples.end());
+  return samples[samples.size() / 2];
+}
+
+static bool is_query(const std::string &normalized) {
+  return normalized.rfind("SELECT", 0) == 0 ||
+         normalized.rfind("WITH", 0) == 0 ||
+         normalized.rfind("UPDATE", 0) == 0 ||
+         normalized.rfind("DELETE", 0) == 0;
+}
+
+static std::vector<WorkloadEntry> load_workload(const std::string &path) {
+  std::map<std::string, WorkloadEntry> grouped;
+  std::ifstream in(path);
+  std::string line;
+
+  while (std::getline(in, line)) {
+    std::vector<std::string> fields;
+    std::istringstream iss(line);
+    std::string field;
+    while (std::getline(iss, field, '\t')) {
+      fields.push_back(field);
+    }
+    if (fields.size() < 5) {
+      continue;
+    }
+
+    WorkloadEntry &entry = grouped[fields[2]];
+    if (entry.count == 0) {
+      entry.normalized = fields[2];
+      entry.text = fields[3];
+      entry.sample = fields[4];
+    }
+    entry.count++;
+    entry.total_ns += std::atoll(fields[1].c_str());
+  }
+
+  std::vector<WorkloadEntry> entries;
+  for (auto &g : grouped) {
+    entries.push_back(g.second);
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const WorkloadEntry &a, const WorkloadEntry &b) {
+              return a.total_ns > b.total_ns;
+            });
+  return entries;
+}
+
+static bool copy_database(const std::string &from, const std::string &to) {
+  sqlite3 *src, *dst;
+  if (sqlite3_open_v2(from.c_str(), &src, SQLITE_OPEN_READONLY, NULL) !=
+      SQLITE_OK) {
+    sqlite3_close(src);
+    return false;
+  }
+  if (sqlite3_open(to.c_str(), &dst) != SQLITE_OK) {
+    sqlite3_close(src);
+    sqlite3_close(dst);
+    return false;
+  }
+
+  sqlite3_backup *backup = sqlite3_backup_init(dst, "main", src, "main");
+  bool ok = backup && sqlite3_backup_step(backup, -1) == SQLITE_DONE;
+  sqlite3_backup_finish(backup);
+  sqlite3_close(src);
+  sqlite3_close(dst);
+  return ok;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: index_advisor --workload FILE [--db PATH] [--scratch PATH]\n"
+          "                     [--runs N] [--top N] [--emit-migration FILE]\n");
+}
+
+int main(int argc, char **argv) {
+  std::string workload_path;
+  std::string db_path = DEFAULT_DB_PATH;
+  std::string scratch_path = DEFAULT_SCRATCH_PATH;
+  std::string migration_path;
+  int runs = 5;
+  size_t top = 50;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    if (arg == "--workload") {
+      workload_path = argv[++i];
+    } else if (arg == "--db") {
+      db_path = argv[++i];
+    } else if (arg == "--scratch") {
+      scratch_path = argv[++i];
+    } else if (arg == "--runs") {
+      runs = std::max(1, atoi(argv[++i]));
+    } else if (arg == "--top") {
+      top = (size_t)std::max(1, atoi(argv[++i]));
+    } else if (arg == "--emit-migration") {
+      migration_path = argv[++i];
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  if (workload_path.empty()) {
+    usage();
+    return 1;
+  }
+
+  std::vector<WorkloadEntry> workload = load_workload(workload_path);
+  workload.erase(std::remove_if(workload.begin(), workload.end(),
+                                [](const WorkloadEntry &e) {
+                                  return !is_query(e.normalized);
+                                }),
+                 workload.end());
+  if (workload.size() > top) {
+    workload.resize(top);
+  }
+  printf("Loaded %zu distinct statements from %s\n", workload.size(),
+         workload_path.c_str());
+
+  // Never touch the live database: everything runs on a scratch copy
+  if (!copy_database(db_path, scratch_path)) {
+    fprintf(stderr, "Failed to copy %s to %s\n", db_path.c_str(),
+            scratch_path.c_str());
+    return 1;
+  }
+
+  sqlite3 *db;
+  if (sqlite3_open(scratch_path.c_str(), &db) != SQLITE_OK) {
+    fprintf(stderr, "Failed to open scratch database: %s\n",
+            sqlite3_errmsg(db));
+    return 1;
+  }
+
+  // Planner statistics for both passes, so the speedup is the indexes'
+  // alone and not also what ANALYZE changed
+  sqlite3_exec(db, "ANALYZE", NULL, NULL, NULL);
+
+  Catalog catalog = load_catalog(db);
+  std::vector<Proposal> proposals = foreign_key_proposals(db, catalog);
+  std::vector<double> before(workload.size(), -1);
+
+  printf("\n== Plans before ==\n");
+  for (size_t i = 0; i < workload.size(); i++) {
+    StatementAnalyzer analyzer(catalog, workload[i].text);
+    PlanInfo plan;
+    if (!explain(db, workload[i].sample, analyzer, plan)) {
+      continue;
+    }
+
+    printf("\n[%zu] %s\n    calls=%lld total=%.3f ms\n", i,
+           workload[i].normalized.c_str(), workload[i].count,
+           workload[i].total_ns / 1e6);
+    for (const auto &detail : plan.details) {
+      printf("    %s\n", detail.c_str());
+    }
+
+    for (const auto &p : statement_proposals(catalog, analyzer, plan)) {
+      bool duplicate = false;
+      for (const auto &existing : proposals) {
+        duplicate |= existing.name() == p.name();
+      }
+      if (!duplicate) {
+        proposals.push_back(p);
+      }
+    }
+    before[i] = time_statement(db, workload[i].sample, runs);
+  }
+
+  printf("\n== Proposed indexes ==\n");
+  if (proposals.empty()) {
+    printf("No index proposals.\n");
+  }
+  for (const auto &p : proposals) {
+    printf("%s\n    -- %s\n", p.sql().c_str(), p.reason.c_str());
+    char *err = nullptr;
+    if (sqlite3_exec(db, p.sql().c_str(), NULL, NULL, &err) != SQLITE_OK) {
+      printf("    !! failed to create: %s\n", err ? err : "unknown error");
+      sqlite3_free(err);
+    }
+  }
+  // Statistics for the new indexes too
+  sqlite3_exec(db, "ANALYZE", NULL, NULL, NULL);
+
+  printf("\n== Latency (median of %d runs, ms) ==\n", runs);
+  printf("%-6s %12s %12s %9s  %s\n", "stmt", "before", "after", "speedup",
+         "plan after");
+  for (size_t i = 0; i < workload.size(); i++) {
+    if (before[i] < 0) {
+      continue;
+    }
+    StatementAnalyzer analyzer(catalog, workload[i].text);
+    PlanInfo plan;
+    explain(db, workload[i].sample, analyzer, plan);
+    double after = time_statement(db, workload[i].sample, runs);
+
+    std::string summary;
+    for (const auto &detail : plan.details) {
+      summary += (summary.empty() ? "" : "; ") + detail;
+    }
+    printf("[%-4zu] %12.3f %12.3f %8.2fx  %s\n", i, before[i], after,
+           after > 0 ? before[i] / after : 0.0, summary.c_str());
+  }
+
+  if (!migration_path.empty()) {
+    std::ofstream out(migration_path);
+    out << "-- Generated by tools/index_advisor from " << workload_path
+        << "\n";
+    for (const auto &p : proposals) {
+      out << "-- " << p.reason << "\n" << p.sql() << "\n";
+    }
+    printf("\nWrote %zu index statements to %s\n", proposals.size(),
+           migration_path.c_str());
+  }
+
+  sqlite3_close(db);
+  return 0;
+}
@@ -0,0 +1,430 @@
+// Snapshot exporter: compiles the published subset of content.db (content
+// blocks with their type, newest article, thumbnail, tags and metadata)
+// into the immutable file read by common/snapshot.h, indexed by a minimal
+// perfect hash on url_slug.
+//
+// The file is written next to the target and renamed over it, so readers
+// see either the old snapshot or the new one, never a partial file. Run it
+// after publishing (or from cron); servers pick the new file up with
+// SnapshotStore::reload().
+//
+// Usage:
+//   snapshot_export [--db /var/lib/grabbiel-db/content.db]
+//                   [--out /var/lib/grabbiel-db/content.snapshot]
+//                   [--verify]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/snapshot.h"
+
+#define DEFAULT_DB_PATH "/var/lib/grabbiel-db/content.db"
+#define DEFAULT_OUT_PATH "/var/lib/grabbiel-db/content.snapshot"
+#define SNAPSHOT_BUCKET_LOAD 4 // average slugs per hash bucket
+
+typedef std::chrono::steady_clock Clock;
+
+// Deduplicating string heap
+class StringHeap {
+public:
+  bool add(const char *text, SnapshotString &out) {
+    std::string value = text ? text : "";
+    auto it = index_.find(value);
+    if (it == index_.end()) {
+      if (data_.size() + value.size() > UINT32_MAX) {
+        return false;
+      }
+      it = index_.emplace(value, SnapshotString{(uint32_t)data_.size(),
+                                                (uint32_t)value.size()})
+               .first;
+      data_ += value;
+    }
+    out = it->second;
+    return true;
+  }
+
+  const std::string &data() const { return data_; }
+
+private:
+  std::string data_;
+  std::unordered_map<std::string, SnapshotString> index_;
+};
+
+struct Block {
+  SnapshotRecord record;
+  std::vector<SnapshotString> tags;
+  std::vector<SnapshotPair> meta;
+  bool has_article = false;
+  bool has_thumbnail = false;
+};
+
+static const char *column(sqlite3_stmt *stmt, int i) {
+  return (const char *)sqlite3_column_text(stmt, i);
+}
+
+// Run `sql` and call `row` for each result; false on an SQL error
+template <typename Row>
+static bool each_row(sqlite3 *db, const char *sql, Row row) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n  in: %s\n", sqlite3_errmsg(db), sql);
+    return false;
+  }
+  int rc;
+  bool ok = true;
+  while (ok && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    ok = row(stmt);
+  }
+  if (ok && rc != SQLITE_DONE) {
+    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    ok = false;
+  }
+  sqlite3_finalize(stmt);
+  return ok;
+}
+
+static bool load_blocks(sqlite3 *db, StringHeap &heap,
+                        std::vector<Block> &blocks) {
+  std::unordered_map<int64_t, size_t> by_id;
+  auto find = [&](sqlite3_stmt *stmt) -> Block * {
+    auto it = by_id.find(sqlite3_column_int64(stmt, 0));
+    return it == by_id.end() ? nullptr : &blocks[it->second];
+  };
+
+  // One read transaction, so every table is seen at the same point
+  sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+  bool ok =
+      each_row(db,
+               "SELECT cb.id, cb.url_slug, cb.title, ct.type, cb.language, "
+               "cb.created_at, cb.updated_at, cb.thumbnail_url "
+               "FROM content_blocks cb "
+               "LEFT JOIN content_types ct ON ct.id = cb.type_id "
+               "WHERE cb.status = 'published' ORDER BY cb.id",
+               [&](sqlite3_stmt *stmt) {
+                 Block block;
+                 memset(&block.record, 0, sizeof(block.record));
+                 SnapshotRecord &r = block.record;
+                 r.id = sqlite3_column_int64(stmt, 0);
+                 by_id[r.id] = blocks.size();
+                 bool ok = heap.add(column(stmt, 1), r.slug) &&
+                           heap.add(column(stmt, 2), r.title) &&
+                           heap.add(column(stmt, 3), r.type) &&
+                           heap.add(column(stmt, 4), r.language) &&
+                           heap.add(column(stmt, 5), r.created_at) &&
+                           heap.add(column(stmt, 6), r.updated_at) &&
+                           heap.add(column(stmt, 7), r.thumbnail_url) &&
+                           heap.add("", r.summary);
+                 r.author = r.published_at = r.body = r.summary;
+                 blocks.push_back(std::move(block));
+                 return ok;
+               }) &&
+      each_row(db,
+               "SELECT a.content_id, a.summary, a.author, a.published_at, "
+               "a.body_markdown FROM articles a "
+               "JOIN content_blocks cb ON cb.id = a.content_id "
+               "WHERE cb.status = 'published' "
+               "ORDER BY a.content_id, a.id DESC",
+               [&](sqlite3_stmt *stmt) {
+                 Block *block = find(stmt);
+                 if (!block || block->has_article) {
+                   return true;
+                 }
+                 block->has_article = true;
+                 SnapshotRecord &r = block->record;
+                 return heap.add(column(stmt, 1), r.summary) &&
+                        heap.add(column(stmt, 2), r.author) &&
+                        heap.add(column(stmt, 3), r.published_at) &&
+                        heap.add(column(stmt, 4), r.body);
+               }) &&
+      each_row(db,
+               "SELECT i.content_id, i.original_url, i.width, i.height "
+               "FROM images i "
+               "JOIN content_blocks cb ON cb.id = i.content_id "
+               "WHERE cb.status = 'published' "
+               "AND i.image_type = 'thumbnail' "
+               "AND i.processing_status = 'complete' "
+               "ORDER BY i.content_id, i.id DESC",
+               [&](sqlite3_stmt *stmt) {
+                 Block *block = find(stmt);
+                 if (!block || block->has_thumbnail) {
+                   return true;
+                 }
+                 block->has_thumbnail = true;
+                 block->record.thumbnail_width = sqlite3_column_int(stmt, 2);
+                 block->record.thumbnail_height = sqlite3_column_int(stmt, 3);
+                 return heap.add(column(stmt, 1), block->record.thumbnail_url);
+               }) &&
+      each_row(db,
+               "SELECT ct.content_id, t.name FROM content_tags ct "
+               "JOIN tags t ON t.id = ct.tag_id "
+               "JOIN content_blocks cb ON cb.id = ct.content_id "
+               "WHERE cb.status = 'published' ORDER BY ct.content_id, t.name",
+               [&](sqlite3_stmt *stmt) {
+                 Block *block = find(stmt);
+                 SnapshotString tag;
+                 if (!block) {
+                   return true;
+                 }
+                 bool ok = heap.add(column(stmt, 1), tag);
+                 block->tags.push_back(tag);
+                 return ok;
+               }) &&
+      each_row(db,
+               "SELECT m.content_id, m.key, m.value FROM content_metadata m "
+               "JOIN content_blocks cb ON cb.id = m.content_id "
+               "WHERE cb.status = 'published' ORDER BY m.content_id, m.key",
+               [&](sqlite3_stmt *stmt) {
+                 Block *block = find(stmt);
+                 SnapshotPair pair;
+                 if (!block) {
+                   return true;
+                 }
+                 bool ok = heap.add(column(stmt, 1), pair.key) &&
+                           heap.add(column(stmt, 2), pair.value);
+                 block->meta.push_back(pair);
+                 return ok;
+               });
+  sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  return ok;
+}
+
+// Hash and displace: buckets are placed largest first, each trying seeds
+// until all of its slugs land in free slots. With SNAPSHOT_BUCKET_LOAD
+// slugs per bucket on average this converges quickly even with every slot
+// used (a minimal perfect hash). Returns false if two slugs hash alike.
+static bool build_index(const std::vector<Block> &blocks,
+                        const StringHeap &heap, std::vector<uint32_t> &seeds,
+                        std::vector<uint32_t> &slot_of) {
+  uint32_t n = (uint32_t)blocks.size();
+  uint32_t bucket_count = std::max<uint32_t>(1, n / SNAPSHOT_BUCKET_LOAD);
+  seeds.assign(bucket_count, 0);
+  slot_of.assign(n, 0);
+
+  std::vector<uint64_t> hashes(n);
+  std::vector<std::vector<uint32_t>> buckets(bucket_count);
+  for (uint32_t i = 0; i < n; i++) {
+    const SnapshotString &slug = blocks[i].record.slug;
+    hashes[i] = snapshot_hash(
+        std::string_view(heap.data().data() + slug.offset, slug.length));
+    buckets[snapshot_bucket(hashes[i], bucket_count)].push_back(i);
+  }
+
+  // Keys with equal hashes can never be separated by a seed
+  std::vector<uint64_t> sorted = hashes;
+  std::sort(sorted.begin(), sorted.end());
+  if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+    return false;
+  }
+
+  std::vector<uint32_t> order(bucket_count);
+  for (uint32_t b = 0; b < bucket_count; b++) {
+    order[b] = b;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  std::vector<char> taken(n, 0);
+  std::vector<uint32_t> slots;
+  for (uint32_t b : order) {
+    const std::vector<uint32_t> &keys = buckets[b];
+    if (keys.empty()) {
+      break;
+    }
+    for (uint32_t seed = 0;; seed++) {
+      slots.clear();
+      bool fits = true;
+      for (uint32_t key : keys) {
+        uint32_t slot = snapshot_slot(hashes[key], seed, n);
+        if (taken[slot] ||
+            std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+          fits = false;
+          break;
+        }
+        slots.push_back(slot);
+      }
+      if (fits) {
+        seeds[b] = seed;
+        for (size_t k = 0; k < keys.size(); k++) {
+          taken[slots[k]] = 1;
+          slot_of[keys[k]] = slots[k];
+        }
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+static size_t align8(size_t offset) { return (offset + 7) & ~(size_t)7; }
+
+static bool write_snapshot(const std::string &path,
+                           const std::vector<Block> &blocks,
+                           const StringHeap &heap,
+                           const std::vector<uint32_t> &seeds,
+                           const std::vector<uint32_t> &slot_of) {
+  std::vector<SnapshotRecord> records(blocks.size());
+  std::vector<SnapshotString> tags;
+  std::vector<SnapshotPair> meta;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    SnapshotRecord r = blocks[i].record;
+    r.tags_begin = (uint32_t)tags.size();
+    r.tags_count = (uint32_t)blocks[i].tags.size();
+    r.meta_begin = (uint32_t)meta.size();
+    r.meta_count = (uint32_t)blocks[i].meta.size();
+    tags.insert(tags.end(), blocks[i].tags.begin(), blocks[i].tags.end());
+    meta.insert(meta.end(), blocks[i].meta.begin(), blocks[i].meta.end());
+    records[slot_of[i]] = r;
+  }
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+  header.version = SNAPSHOT_VERSION;
+  header.count = (uint32_t)records.size();
+  header.bucket_count = (uint32_t)seeds.size();
+  header.tag_count = (uint32_t)tags.size();
+  header.meta_count = (uint32_t)meta.size();
+  header.created_at = time(nullptr);
+  header.seeds_offset = sizeof(header);
+  header.records_offset =
+      align8(header.seeds_offset + seeds.size() * sizeof(uint32_t));
+  header.tags_offset = align8(header.records_offset +
+                              records.size() * sizeof(SnapshotRecord));
+  header.meta_offset =
+      align8(header.tags_offset + tags.size() * sizeof(SnapshotString));
+  header.heap_offset =
+      align8(header.meta_offset + meta.size() * sizeof(SnapshotPair));
+  header.heap_size = heap.data().size();
+  header.file_size = header.heap_offset + header.heap_size;
+
+  std::string tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) {
+    fprintf(stderr, "Cannot write %s: %s\n", tmp.c_str(), strerror(errno));
+    return false;
+  }
+  auto put = [&](uint64_t offset, const void *data, size_t length) {
+    static const char zeros[8] = {};
+    long pad = (long)offset - ftell(f);
+    return fwrite(zeros, 1, pad, f) == (size_t)pad &&
+           fwrite(data, 1, length, f) == length;
+  };
+  bool ok = put(0, &header, sizeof(header)) &&
+            put(header.seeds_offset, seeds.data(),
+                seeds.size() * sizeof(uint32_t)) &&
+            put(header.records_offset, records.data(),
+                records.size() * sizeof(SnapshotRecord)) &&
+            put(header.tags_offset, tags.data(),
+                tags.size() * sizeof(SnapshotString)) &&
+            put(header.meta_offset, meta.data(),
+                meta.size() * sizeof(SnapshotPair)) &&
+            put(header.heap_offset, heap.data().data(), heap.data().size());
+  ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "Cannot write %s: %s\n", path.c_str(), strerror(errno));
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Look every published slug up in the written file and compare
+static bool verify(const std::string &path, const std::vector<Block> &blocks,
+                   const StringHeap &heap) {
+  std::string error;
+  std::shared_ptr<const ContentSnapshot> snapshot =
+      ContentSnapshot::open(path, error);
+  if (!snapshot) {
+    fprintf(stderr, "Verify: %s\n", error.c_str());
+    return false;
+  }
+  for (const Block &block : blocks) {
+    const SnapshotString &slug = block.record.slug;
+    std::string_view key(heap.data().data() + slug.offset, slug.length);
+    const SnapshotRecord *r = snapshot->find(key);
+    if (!r || r->id != block.record.id || r->tags_count != block.tags.size() ||
+        r->meta_count != block.meta.size()) {
+      fprintf(stderr, "Verify: wrong record for %.*s\n", (int)key.size(),
+              key.data());
+      return false;
+    }
+  }
+  if (snapshot->find("no such slug, surely") != nullptr) {
+    fprintf(stderr, "Verify: found a slug that does not exist\n");
+    return false;
+  }
+  printf("Verified %zu lookups\n", blocks.size());
+  return true;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: snapshot_export [--db PATH] [--out PATH] "
+                  "[--verify]\n");
+}
+
+int main(int argc, char **argv) {
+  std::string db_path = DEFAULT_DB_PATH;
+  std::string out_path = DEFAULT_OUT_PATH;
+  bool check = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--verify") {
+      check = true;
+    } else if (arg == "--db" && i + 1 < argc) {
+      db_path = argv[++i];
+    } else if (arg == "--out" && i + 1 < argc) {
+      out_path = argv[++i];
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  sqlite3 *db;
+  if (sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READONLY, NULL) !=
+      SQLITE_OK) {
+    fprintf(stderr, "Failed to open %s: %s\n", db_path.c_str(),
+            sqlite3_errmsg(db));
+    return 1;
+  }
+
+  Clock::time_point start = Clock::now();
+  StringHeap heap;
+  std::vector<Block> blocks;
+  bool ok = load_blocks(db, heap, blocks);
+  sqlite3_close(db);
+  if (!ok) {
+    fprintf(stderr, "Export failed (or the string heap passed 4 GB)\n");
+    return 1;
+  }
+  double load_s = std::chrono::duration<double>(Clock::now() - start).count();
+
+  start = Clock::now();
+  std::vector<uint32_t> seeds, slot_of;
+  if (!build_index(blocks, heap, seeds, slot_of)) {
+    fprintf(stderr, "Two published slugs have the same hash\n");
+    return 1;
+  }
+  double index_s = std::chrono::duration<double>(Clock::now() - start).count();
+
+  if (!write_snapshot(out_path, blocks, heap, seeds, slot_of)) {
+    return 1;
+  }
+  printf("Wrote %s: %zu published blocks, %zu buckets, %.1f MB heap "
+         "(load %.2f s, index %.2f s)\n",
+         out_path.c_str(), blocks.size(), seeds.size(),
+         heap.data().size() / 1e6, load_s, index_s);
+
+  return check && !verify(out_path, blocks, heap) ? 1 : 0;
+}